@@ -0,0 +1,506 @@
+/*
+ * b0bench: micro benchmarks for the hot paths of boot0img and gen_part
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libboot0img.h"
+#include "nand-part-a20.h"
+#include "nand_mbr.h"
+
+#define KB		1024UL
+#define MB		(1024UL * 1024)
+
+#define MAX_REPS	1000
+#define MAX_ITERS	(1U << 24)
+#define NOISE_SIGMAS	3		/* see is_regression() */
+
+struct bench_ctx {
+	size_t size;
+	uint8_t *buf;
+	FILE *stream;
+	char path[64];
+	int pipe_fd;
+	pthread_t drain;
+	volatile uint32_t sink;		/* keeps results alive */
+};
+
+struct bench_case {
+	const char *name;
+	size_t size;			/* bytes processed per call */
+	int (*setup)(struct bench_ctx *ctx);
+	void (*run)(struct bench_ctx *ctx);
+	void (*teardown)(struct bench_ctx *ctx);
+};
+
+struct bench_result {
+	unsigned int iters;		/* calls per sample */
+	unsigned int reps;		/* samples */
+	double min_ns, median_ns, mean_ns, stddev_ns;	/* per call */
+};
+
+/* Synthetic, but reproducible input data. */
+static void fill_random(void *buf, size_t size)
+{
+	uint32_t *p = buf, x = 0x2545f491;
+	size_t i;
+
+	for (i = 0; i < size / 4; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		p[i] = x;
+	}
+}
+
+static int setup_buffer(struct bench_ctx *ctx)
+{
+	ctx->buf = malloc(ctx->size);
+	if (!ctx->buf)
+		return -ENOMEM;
+	fill_random(ctx->buf, ctx->size);
+
+	return 0;
+}
+
+static void teardown(struct bench_ctx *ctx)
+{
+	if (ctx->stream)
+		fclose(ctx->stream);
+	if (ctx->drain)
+		pthread_join(ctx->drain, NULL);
+	if (ctx->path[0])
+		unlink(ctx->path);
+	free(ctx->buf);
+}
+
+static void run_checksum(struct bench_ctx *ctx)
+{
+	ctx->sink += b0_calc_checksum(ctx->buf, ctx->size);
+}
+
+static int setup_file(struct bench_ctx *ctx)
+{
+	int fd, ret;
+
+	ret = setup_buffer(ctx);
+	if (ret)
+		return ret;
+
+	snprintf(ctx->path, sizeof(ctx->path), "%s/b0bench.XXXXXX",
+		 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	fd = mkstemp(ctx->path);
+	if (fd < 0) {
+		ctx->path[0] = 0;
+		return -errno;
+	}
+	ret = write(fd, ctx->buf, ctx->size) == (ssize_t)ctx->size ? 0 : -EIO;
+	close(fd);
+
+	return ret;
+}
+
+/* The file stays in the page cache, so this measures the copying only. */
+static void run_read_file(struct bench_ctx *ctx)
+{
+	char *buffer;
+	ssize_t size;
+
+	size = b0_read_file(ctx->path, &buffer);
+	if (size > 0) {
+		ctx->sink += buffer[size - 1];
+		free(buffer);
+	}
+}
+
+static int setup_tmpfile(struct bench_ctx *ctx)
+{
+	ctx->stream = tmpfile();
+
+	return ctx->stream ? 0 : -errno;
+}
+
+static void run_fill_zeroes(struct bench_ctx *ctx)
+{
+	rewind(ctx->stream);
+	ctx->sink += b0_fill_zeroes(ctx->stream, ctx->size);
+}
+
+static void run_pseek(struct bench_ctx *ctx)
+{
+	rewind(ctx->stream);
+	ctx->sink += b0_pseek(ctx->stream, ctx->size);
+}
+
+static void *drain_pipe(void *arg)
+{
+	struct bench_ctx *ctx = arg;
+	char buf[65536];
+
+	while (read(ctx->pipe_fd, buf, sizeof(buf)) > 0)
+		;
+	close(ctx->pipe_fd);
+
+	return NULL;
+}
+
+/* On a pipe pseek falls back to writing zeroes, like with stdout. */
+static int setup_pipe(struct bench_ctx *ctx)
+{
+	int fds[2];
+
+	if (pipe(fds))
+		return -errno;
+
+	ctx->pipe_fd = fds[0];
+	ctx->stream = fdopen(fds[1], "w");
+	if (!ctx->stream) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+	if (pthread_create(&ctx->drain, NULL, drain_pipe, ctx)) {
+		ctx->drain = 0;
+		return -EAGAIN;
+	}
+
+	return 0;
+}
+
+static void run_pseek_pipe(struct bench_ctx *ctx)
+{
+	ctx->sink += b0_pseek(ctx->stream, ctx->size);
+}
+
+static void run_splice_zeroes(struct bench_ctx *ctx)
+{
+	ctx->sink += b0_splice_zeroes(fileno(ctx->stream), ctx->size);
+}
+
+/* A Thumb2 MOVW instruction loading imm into r3, as found in boot0. */
+static void put_movw(uint16_t *insn, uint16_t imm)
+{
+	insn[0] = 0xf240 | ((imm >> 12) & 0xf) | (((imm >> 11) & 1) << 10);
+	insn[1] = (((imm >> 8) & 7) << 12) | (3 << 8) | (imm & 0xff);
+}
+
+static int setup_boot0(struct bench_ctx *ctx)
+{
+	int ret;
+
+	ret = setup_buffer(ctx);
+	if (ret)
+		return ret;
+
+	put_movw((uint16_t *)ctx->buf + 1000, UBOOT_OFFSET_KB * 2);
+	put_movw((uint16_t *)ctx->buf + 9000, UBOOT_OFFSET_KB * 2);
+
+	return 0;
+}
+
+/* Patching to the same value keeps the input the same for every call. */
+static void run_patch_boot0(struct bench_ctx *ctx)
+{
+	ctx->sink += b0_patch_boot0((uint16_t *)ctx->buf, UBOOT_OFFSET_KB * 2,
+				    UBOOT_OFFSET_KB * 2);
+}
+
+static void run_crc32(struct bench_ctx *ctx)
+{
+	ctx->sink += calc_crc32(ctx->buf, ctx->size);
+}
+
+static int setup_mbr(struct bench_ctx *ctx)
+{
+	int ret;
+
+	ret = setup_buffer(ctx);
+	if (ret)
+		return ret;
+
+	ctx->stream = fopen("/dev/null", "w");
+
+	return ctx->stream ? 0 : -errno;
+}
+
+static void run_write_mbr_copy(struct bench_ctx *ctx)
+{
+	ctx->sink += write_mbr_copy(ctx->stream, (MBR *)ctx->buf, 1);
+}
+
+/*
+ * The sizes are the ones the tools actually see (boot0, a firmware blob,
+ * the padding and gap in the stock layout), plus a larger one to stress
+ * the caches.
+ */
+static const struct bench_case cases[] = {
+	{ "checksum/32K", 32 * KB, setup_buffer, run_checksum, teardown },
+	{ "checksum/1M", MB, setup_buffer, run_checksum, teardown },
+	{ "checksum/64M", 64 * MB, setup_buffer, run_checksum, teardown },
+	{ "read_file/32K", 32 * KB, setup_file, run_read_file, teardown },
+	{ "read_file/1M", MB, setup_file, run_read_file, teardown },
+	{ "read_file/64M", 64 * MB, setup_file, run_read_file, teardown },
+	{ "fill_zeroes/16K", 16 * KB, setup_tmpfile, run_fill_zeroes,
+	  teardown },
+	{ "fill_zeroes/19M", (UBOOT_OFFSET_KB - BOOT0_END_KB) * KB,
+	  setup_tmpfile, run_fill_zeroes, teardown },
+	{ "pseek/19M", (UBOOT_OFFSET_KB - BOOT0_END_KB) * KB, setup_tmpfile,
+	  run_pseek, teardown },
+	{ "pseek_pipe/16K", 16 * KB, setup_pipe, run_pseek_pipe, teardown },
+	{ "pseek_pipe/19M", (UBOOT_OFFSET_KB - BOOT0_END_KB) * KB, setup_pipe,
+	  run_pseek_pipe, teardown },
+	{ "splice_zeroes/19M", (UBOOT_OFFSET_KB - BOOT0_END_KB) * KB,
+	  setup_pipe, run_splice_zeroes, teardown },
+	{ "patch_boot0/32K", BOOT0_SIZE, setup_boot0, run_patch_boot0,
+	  teardown },
+	{ "crc32/mbr", sizeof(MBR) - 4, setup_buffer, run_crc32, teardown },
+	{ "crc32/1M", MB, setup_buffer, run_crc32, teardown },
+	{ "write_mbr_copy", sizeof(MBR), setup_mbr, run_write_mbr_copy,
+	  teardown },
+};
+
+#define NR_CASES	(sizeof(cases) / sizeof(cases[0]))
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t time_iters(const struct bench_case *bc, struct bench_ctx *ctx,
+			   unsigned int iters)
+{
+	uint64_t start = now_ns();
+	unsigned int i;
+
+	for (i = 0; i < iters; i++)
+		bc->run(ctx);
+
+	return now_ns() - start;
+}
+
+/*
+ * Batch enough calls into one sample to make the timer resolution
+ * irrelevant, then take reps samples and look at their distribution.
+ */
+static int run_case(const struct bench_case *bc, unsigned int reps,
+		    uint64_t sample_ns, struct bench_result *res)
+{
+	struct bench_ctx ctx = { .size = bc->size };
+	double samples[MAX_REPS], sum = 0, var = 0;
+	unsigned int i, iters = 1;
+	uint64_t t;
+	int ret;
+
+	ret = bc->setup(&ctx);
+	if (ret) {
+		bc->teardown(&ctx);
+		return ret;
+	}
+
+	/* the first round also warms up the caches */
+	while ((t = time_iters(bc, &ctx, iters)) < sample_ns &&
+	       iters < MAX_ITERS)
+		iters *= 2;
+
+	for (i = 0; i < reps; i++) {
+		samples[i] = (double)time_iters(bc, &ctx, iters) / iters;
+		sum += samples[i];
+	}
+	bc->teardown(&ctx);
+
+	qsort(samples, reps, sizeof(samples[0]), cmp_double);
+	res->iters = iters;
+	res->reps = reps;
+	res->min_ns = samples[0];
+	res->median_ns = reps % 2 ? samples[reps / 2] :
+			 (samples[reps / 2 - 1] + samples[reps / 2]) / 2;
+	res->mean_ns = sum / reps;
+	for (i = 0; i < reps; i++)
+		var += (samples[i] - res->mean_ns) * (samples[i] - res->mean_ns);
+	res->stddev_ns = reps > 1 ? sqrt(var / (reps - 1)) : 0;
+
+	return 0;
+}
+
+/* Returns the minimum of the benchmark in the baseline, 0 if not found. */
+static double find_baseline(FILE *base, const char *name, double *stddev)
+{
+	char line[256], bname[64];
+	double min;
+
+	if (!base)
+		return 0;
+
+	rewind(base);
+	while (fgets(line, sizeof(line), base)) {
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%63s %*s %*s %*s %lf %*s %*s %lf", bname, &min,
+			   stddev) != 3)
+			continue;
+		if (!strcmp(bname, name))
+			return min;
+	}
+
+	return 0;
+}
+
+/*
+ * The minimum is the sample least disturbed by other load, but it still
+ * moves around between runs. A slowdown only counts if it is beyond the
+ * threshold and also beyond the noise seen in either run.
+ */
+static bool is_regression(const struct bench_result *res, double base,
+			  double base_stddev, double threshold)
+{
+	double noise = res->stddev_ns > base_stddev ? res->stddev_ns :
+						      base_stddev;
+
+	return (res->min_ns - base) / base * 100 > threshold &&
+	       res->min_ns - base > NOISE_SIGMAS * noise;
+}
+
+static void usage(const char *progname, FILE *stream)
+{
+	fprintf(stream, "b0bench: micro benchmarks for boot0img and gen_part\n"
+		"usage: %s [-h] [-l] [-f filter] [-r reps] [-s sample_ms]\n"
+		"       [-c baseline] [-t threshold]\n", progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-l|--list: list the benchmarks\n"
+		"\t-f|--filter: only run benchmarks containing this string\n"
+		"\t-r|--reps: number of samples per benchmark (default: 15)\n"
+		"\t-s|--sample-time: minimum length of a sample in ms (default: 2)\n"
+		"\t-c|--compare: compare against the output of an earlier run\n"
+		"\t-t|--threshold: slowdown in %% reported as regression (default: 10)\n");
+	fprintf(stream, "\nThe output is tab separated, one line per benchmark, "
+		"with times per call\nin nanoseconds. With -c the minimum gets "
+		"compared, a benchmark regressed if\nit got slower than the "
+		"threshold and by more than %d times the bigger\nstandard "
+		"deviation of the two runs. The exit code is 3 then.\n",
+		NOISE_SIGMAS);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option lopts[] = {
+		{ "help",	0, 0, 'h' },
+		{ "list",	0, 0, 'l' },
+		{ "filter",	1, 0, 'f' },
+		{ "reps",	1, 0, 'r' },
+		{ "sample-time",	1, 0, 's' },
+		{ "compare",	1, 0, 'c' },
+		{ "threshold",	1, 0, 't' },
+		{ NULL, 0, 0, 0 },
+	};
+	unsigned int reps = 15, sample_ms = 2, i;
+	double threshold = 10, base, base_stddev, change;
+	const char *filter = NULL;
+	struct bench_result res;
+	bool regression = false;
+	FILE *basef = NULL;
+	int ch, ret;
+
+	while ((ch = getopt_long(argc, argv, "hlf:r:s:c:t:", lopts,
+				 NULL)) != -1) {
+		switch(ch) {
+		case '?':
+			usage(argv[0], stderr);
+			return 1;
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+		case 'l':
+			for (i = 0; i < NR_CASES; i++)
+				printf("%s\n", cases[i].name);
+			return 0;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'r':
+			reps = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			sample_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			basef = fopen(optarg, "r");
+			if (!basef) {
+				perror(optarg);
+				return 2;
+			}
+			break;
+		case 't':
+			threshold = strtod(optarg, NULL);
+			break;
+		}
+	}
+
+	if (reps < 1 || reps > MAX_REPS) {
+		fprintf(stderr, "reps must be 1-%d\n", MAX_REPS);
+		return 1;
+	}
+
+	printf("# b0bench reps=%u sample_ms=%u\n", reps, sample_ms);
+	printf("#name\tbytes\titers\treps\tmin_ns\tmedian_ns\tmean_ns"
+	       "\tstddev_ns\tMiB/s%s\n", basef ? "\tbase_ns\tchange_%" : "");
+
+	for (i = 0; i < NR_CASES; i++) {
+		if (filter && !strstr(cases[i].name, filter))
+			continue;
+
+		ret = run_case(&cases[i], reps, sample_ms * 1000000ULL, &res);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", cases[i].name,
+				strerror(-ret));
+			continue;
+		}
+
+		printf("%s\t%zu\t%u\t%u\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f",
+		       cases[i].name, cases[i].size, res.iters, res.reps,
+		       res.min_ns, res.median_ns, res.mean_ns, res.stddev_ns,
+		       cases[i].size / res.median_ns * 1e9 / MB);
+
+		base = find_baseline(basef, cases[i].name, &base_stddev);
+		if (base > 0) {
+			bool slower = is_regression(&res, base, base_stddev,
+						    threshold);
+
+			change = (res.min_ns - base) / base * 100;
+			printf("\t%.1f\t%+.1f%s", base, change,
+			       slower ? "\tREGRESSION" : "");
+			if (slower)
+				regression = true;
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	if (basef)
+		fclose(basef);
+
+	return regression ? 3 : 0;
+}
@@ -0,0 +1,594 @@
+/*
+ * b0cache: content addressed on-disk cache of assembled boot0 images
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "b0cache.h"
+
+#define CACHE_MAGIC	"boot0img-cache 1"
+
+static const char * const component_names[B0_NR_COMPONENTS] = {
+	[B0_COMP_BOOT0] = "boot0",
+	[B0_COMP_UBOOT] = "uboot",
+	[B0_COMP_DRAM] = "dram",
+	[B0_COMP_SRAM] = "sram",
+};
+
+static char *cache_path(const struct b0_cache *cache, const char *name,
+			const char *suffix)
+{
+	char *path;
+
+	if (asprintf(&path, "%s/%s%s", cache->dir, name, suffix) < 0)
+		return NULL;
+
+	return path;
+}
+
+int b0_cache_open(struct b0_cache *cache, const char *dir, uint64_t max_size)
+{
+	char *files;
+
+	if (mkdir(dir, 0755) && errno != EEXIST)
+		return -errno;
+
+	cache->dir = strdup(dir);
+	cache->max_size = max_size;
+	if (!cache->dir)
+		return -ENOMEM;
+
+	files = cache_path(cache, "files", "");
+	if (!files || (mkdir(files, 0755) && errno != EEXIST)) {
+		free(files);
+		free(cache->dir);
+		return -errno;
+	}
+	free(files);
+
+	return 0;
+}
+
+void b0_cache_close(struct b0_cache *cache)
+{
+	free(cache->dir);
+	cache->dir = NULL;
+}
+
+/*
+ * The permissions a newly created file would get. umask() cannot be read
+ * without setting it, which races with the daemon's other threads.
+ */
+static mode_t file_mode(void)
+{
+	unsigned int mask = 022;
+	char line[64];
+	FILE *f;
+
+	f = fopen("/proc/self/status", "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f))
+			if (sscanf(line, "Umask: %o", &mask) == 1)
+				break;
+		fclose(f);
+	}
+
+	return 0666 & ~mask;
+}
+
+/* Atomically replace path with the given data, via a temporary file. */
+static int write_atomic(const struct b0_cache *cache, const char *path,
+			const void *data, size_t size)
+{
+	char *tmp;
+	int fd, ret = 0;
+
+	tmp = cache_path(cache, "tmp.XXXXXX", "");
+	if (!tmp)
+		return -ENOMEM;
+
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return -errno;
+	}
+	if (write(fd, data, size) != (ssize_t)size || fsync(fd))
+		ret = errno ? -errno : -EIO;
+	close(fd);
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+	free(tmp);
+
+	return ret;
+}
+
+/*
+ * Get the SHA-256 of an input file. The result is remembered together with
+ * the file's identity and timestamps, so an unchanged file is only hashed
+ * once.
+ */
+int b0_cache_hash_file(struct b0_cache *cache, const char *path,
+		       uint8_t digest[SHA256_DIGEST_SIZE])
+{
+	char real[PATH_MAX], name[B0_CACHE_KEY_LEN + 6];
+	char stamp[256], record[512], hex[B0_CACHE_KEY_LEN];
+	uint8_t path_hash[SHA256_DIGEST_SIZE];
+	char *rec_path, *buffer;
+	struct stat st;
+	ssize_t size;
+	FILE *f;
+	int i, ret;
+
+	if (!realpath(path, real) || stat(real, &st))
+		return -errno;
+
+	strcpy(name, "files/");
+	sha256(real, strlen(real), path_hash);
+	sha256_hex(path_hash, name + 6);
+	rec_path = cache_path(cache, name, "");
+	if (!rec_path)
+		return -ENOMEM;
+
+	snprintf(stamp, sizeof(stamp), "%ju %ju %jd %jd.%09ld %jd.%09ld",
+		 (uintmax_t)st.st_dev, (uintmax_t)st.st_ino,
+		 (intmax_t)st.st_size,
+		 (intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+		 (intmax_t)st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+
+	f = fopen(rec_path, "r");
+	if (f) {
+		size_t len = strlen(stamp);
+
+		if (fgets(record, sizeof(record), f) &&
+		    !strncmp(record, stamp, len) && record[len] == ' ' &&
+		    strlen(record + len + 1) >= 2 * SHA256_DIGEST_SIZE) {
+			for (i = 0; i < SHA256_DIGEST_SIZE; i++)
+				sscanf(record + len + 1 + i * 2, "%2hhx",
+				       &digest[i]);
+			fclose(f);
+			free(rec_path);
+			return 0;
+		}
+		fclose(f);
+	}
+
+	size = b0_read_file(real, &buffer);
+	if (size < 0) {
+		free(rec_path);
+		return size;
+	}
+	sha256(buffer, size, digest);
+	free(buffer);
+
+	sha256_hex(digest, hex);
+	snprintf(record, sizeof(record), "%s %s\n", stamp, hex);
+	ret = write_atomic(cache, rec_path, record, strlen(record));
+	free(rec_path);
+
+	return ret;
+}
+
+/*
+ * The cache key covers the hashes of all inputs and every option which
+ * influences the resulting image, so equal keys mean equal images.
+ */
+void b0_cache_key(const struct b0_options *opts,
+		  uint8_t hashes[B0_NR_COMPONENTS][SHA256_DIGEST_SIZE],
+		  const bool present[B0_NR_COMPONENTS], char *key)
+{
+	struct sha256_ctx ctx;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	char line[128], hex[B0_CACHE_KEY_LEN];
+	int i;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, CACHE_MAGIC "\n", strlen(CACHE_MAGIC) + 1);
+	for (i = 0; i < B0_NR_COMPONENTS; i++) {
+		if (present[i])
+			sha256_hex(hashes[i], hex);
+		else
+			strcpy(hex, "-");
+		snprintf(line, sizeof(line), "%s %s\n",
+			 component_names[i], hex);
+		sha256_update(&ctx, line, strlen(line));
+	}
+	snprintf(line, sizeof(line),
+		 "e=%d B=%d a=%d:%08x p=%ld P=%d D=%d t=%d:%08x T=%08x\n",
+		 opts->embedded_header, opts->patch_boot0,
+		 opts->arisc_entry, opts->arisc_entry ? opts->arisc_addr : 0,
+		 opts->part_size_mb, opts->part_size_mb != -1 && opts->efi_part,
+		 opts->device, opts->dram_type,
+		 opts->dram_type != B0_DRAM_BINARY ? opts->trampoline_addr : 0,
+		 opts->stamp_addr);
+	sha256_update(&ctx, line, strlen(line));
+	sha256_final(&ctx, digest);
+
+	sha256_hex(digest, key);
+}
+
+static void remove_entry(const struct b0_cache *cache, const char *key)
+{
+	char *path;
+
+	path = cache_path(cache, key, ".meta");
+	if (path)
+		unlink(path);
+	free(path);
+	path = cache_path(cache, key, ".img");
+	if (path)
+		unlink(path);
+	free(path);
+}
+
+/* Bump the LRU timestamp of an entry. */
+static void touch_entry(const struct b0_cache *cache, const char *key)
+{
+	char *path = cache_path(cache, key, ".img");
+
+	if (path)
+		utimensat(AT_FDCWD, path, NULL, 0);
+	free(path);
+}
+
+/*
+ * Load a cached image. Each segment's checksum gets verified, so a
+ * corrupted (or hardlinked and then modified) entry just becomes a miss.
+ * Returns -ENOENT on a cache miss.
+ */
+int b0_cache_lookup(struct b0_cache *cache, const char *key,
+		    struct b0_image *img)
+{
+	char *meta_path, *img_path;
+	char magic[32], type[8];
+	intmax_t offset, size, boot0_offset, fw_offset;
+	size_t fw_size;
+	struct stat st;
+	uint32_t sum;
+	int patched, fd, ret = -ENOENT;
+	FILE *f;
+
+	memset(img, 0, sizeof(*img));
+
+	meta_path = cache_path(cache, key, ".meta");
+	img_path = cache_path(cache, key, ".img");
+	if (!meta_path || !img_path) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	f = fopen(meta_path, "r");
+	if (!f)
+		goto out_free;
+	fd = open(img_path, O_RDONLY);
+	if (fd < 0) {
+		fclose(f);
+		goto out_free;
+	}
+
+	if (!fgets(magic, sizeof(magic), f) ||
+	    strncmp(magic, CACHE_MAGIC "\n", sizeof(CACHE_MAGIC)) ||
+	    fscanf(f, "size %jd checksum %"SCNx32" patched %d boot0 %jd fw %jd %zu\n",
+		   &size, &img->checksum, &patched, &boot0_offset,
+		   &fw_offset, &fw_size) != 6)
+		goto out_corrupt;
+	if (fstat(fd, &st) || st.st_size != size)
+		goto out_corrupt;
+	img->size = size;
+	img->patched_boot0 = patched;
+	img->boot0_offset = boot0_offset;
+	img->fw_offset = fw_offset;
+	img->fw_size = fw_size;
+
+	while (fscanf(f, "seg %jd %jd %7s %"SCNx32"\n",
+		      &offset, &size, type, &sum) == 4) {
+		struct b0_segment *seg;
+
+		if (img->nr_segs == B0_MAX_SEGMENTS)
+			goto out_corrupt;
+		seg = &img->seg[img->nr_segs++];
+		seg->offset = offset;
+		seg->size = size;
+		if (strcmp(type, "data"))
+			continue;
+
+		if (posix_memalign(&seg->data, B0_BUF_ALIGN,
+				   size ? size : 1)) {
+			ret = -ENOMEM;
+			goto out_close;
+		}
+		if (pread(fd, seg->data, size, offset) != size ||
+		    b0_calc_checksum(seg->data, size) != sum)
+			goto out_corrupt;
+	}
+
+	fclose(f);
+	close(fd);
+	touch_entry(cache, key);
+	free(meta_path);
+	free(img_path);
+	return 0;
+
+out_corrupt:
+	remove_entry(cache, key);
+	ret = -ENOENT;
+out_close:
+	b0_free_image(img);
+	fclose(f);
+	close(fd);
+out_free:
+	free(meta_path);
+	free(img_path);
+	return ret;
+}
+
+struct cache_entry {
+	char key[B0_CACHE_KEY_LEN];
+	struct timespec mtime;
+	uint64_t size;
+};
+
+static int cmp_entry_age(const void *a, const void *b)
+{
+	const struct cache_entry *ea = a, *eb = b;
+
+	if (ea->mtime.tv_sec != eb->mtime.tv_sec)
+		return ea->mtime.tv_sec < eb->mtime.tv_sec ? -1 : 1;
+	if (ea->mtime.tv_nsec != eb->mtime.tv_nsec)
+		return ea->mtime.tv_nsec < eb->mtime.tv_nsec ? -1 : 1;
+	return 0;
+}
+
+/* Remove the least recently used entries until we are below the limit. */
+static void cache_evict(struct b0_cache *cache)
+{
+	struct cache_entry *entries = NULL, *tmp;
+	int nr_entries = 0, i;
+	uint64_t total = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+	int dfd;
+
+	if (!cache->max_size)
+		return;
+
+	dir = opendir(cache->dir);
+	if (!dir)
+		return;
+	dfd = dirfd(dir);
+
+	while ((de = readdir(dir))) {
+		size_t len = strlen(de->d_name);
+
+		if (len != B0_CACHE_KEY_LEN - 1 + 4 ||
+		    strcmp(de->d_name + len - 4, ".img") ||
+		    fstatat(dfd, de->d_name, &st, 0))
+			continue;
+
+		tmp = realloc(entries, (nr_entries + 1) * sizeof(*entries));
+		if (!tmp)
+			break;
+		entries = tmp;
+		memcpy(entries[nr_entries].key, de->d_name,
+		       B0_CACHE_KEY_LEN - 1);
+		entries[nr_entries].key[B0_CACHE_KEY_LEN - 1] = 0;
+		entries[nr_entries].mtime = st.st_mtim;
+		entries[nr_entries].size = st.st_blocks * 512ULL;
+		total += entries[nr_entries].size;
+		nr_entries++;
+	}
+	closedir(dir);
+
+	qsort(entries, nr_entries, sizeof(*entries), cmp_entry_age);
+	for (i = 0; i < nr_entries && total > cache->max_size; i++) {
+		remove_entry(cache, entries[i].key);
+		total -= entries[i].size;
+	}
+
+	free(entries);
+}
+
+int b0_cache_store(struct b0_cache *cache, const char *key,
+		   const struct b0_image *img,
+		   uint8_t hashes[B0_NR_COMPONENTS][SHA256_DIGEST_SIZE],
+		   const bool present[B0_NR_COMPONENTS])
+{
+	char *meta_path, *img_path, *tmp, *meta = NULL;
+	char hex[B0_CACHE_KEY_LEN];
+	size_t meta_size;
+	FILE *f;
+	int i, fd, ret;
+
+	meta_path = cache_path(cache, key, ".meta");
+	img_path = cache_path(cache, key, ".img");
+	tmp = cache_path(cache, "tmp.XXXXXX", "");
+	if (!meta_path || !img_path || !tmp) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	/* the image itself, exactly as it would end up in a file */
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		ret = -errno;
+		goto out_free;
+	}
+	f = fdopen(fd, "wb");
+	if (!f) {
+		ret = -errno;
+		close(fd);
+		unlink(tmp);
+		goto out_free;
+	}
+	ret = b0_write_image(img, f, false);
+	/* mkstemp() makes it 0600, a hardlinked output would inherit that */
+	if (!ret && (fflush(f) || fchmod(fd, file_mode()) || fsync(fd)))
+		ret = -errno;
+	if (fclose(f) && !ret)
+		ret = -errno;
+	if (!ret && rename(tmp, img_path))
+		ret = -errno;
+	if (ret) {
+		unlink(tmp);
+		goto out_free;
+	}
+
+	f = open_memstream(&meta, &meta_size);
+	if (!f) {
+		ret = -errno;
+		goto out_free;
+	}
+	fprintf(f, CACHE_MAGIC "\n");
+	fprintf(f, "size %jd checksum %08"PRIx32" patched %d boot0 %jd fw %jd %zu\n",
+		(intmax_t)img->size, img->checksum, img->patched_boot0,
+		(intmax_t)img->boot0_offset, (intmax_t)img->fw_offset,
+		img->fw_size);
+	for (i = 0; i < img->nr_segs; i++) {
+		const struct b0_segment *seg = &img->seg[i];
+
+		fprintf(f, "seg %jd %zu %s %08"PRIx32"\n",
+			(intmax_t)seg->offset, seg->size,
+			seg->data ? "data" : "zero",
+			seg->data ? b0_calc_checksum(seg->data, seg->size) : 0);
+	}
+	for (i = 0; i < B0_NR_COMPONENTS; i++) {
+		if (!present[i])
+			continue;
+		sha256_hex(hashes[i], hex);
+		fprintf(f, "component %s %s\n", component_names[i], hex);
+	}
+	fclose(f);
+
+	ret = write_atomic(cache, meta_path, meta, meta_size);
+	if (ret)
+		remove_entry(cache, key);
+	else
+		cache_evict(cache);
+
+out_free:
+	free(meta);
+	free(meta_path);
+	free(img_path);
+	free(tmp);
+	return ret;
+}
+
+static int copy_fd(int in, int out)
+{
+	char buf[65536];
+	ssize_t ret;
+	loff_t len;
+
+	/* lets the kernel or the filesystem do the copy, if possible */
+	do {
+		len = copy_file_range(in, NULL, out, NULL, SSIZE_MAX, 0);
+	} while (len > 0);
+	if (len == 0)
+		return 0;
+	if (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+	    errno != EOPNOTSUPP)
+		return -errno;
+
+	while ((ret = read(in, buf, sizeof(buf))) > 0)
+		if (write(out, buf, ret) != ret)
+			return -errno;
+
+	return ret < 0 ? -errno : 0;
+}
+
+/*
+ * Put a cached image into place as the output file: as a hardlink when
+ * requested, otherwise as a reflink, falling back to a copy.
+ */
+int b0_cache_link(struct b0_cache *cache, const char *key, const char *path,
+		  enum b0_link_mode mode)
+{
+	struct stat st, src_st;
+	char *src;
+	int in, out, ret = 0;
+
+	src = cache_path(cache, key, ".img");
+	if (!src)
+		return -ENOMEM;
+
+	if (mode == B0_LINK_HARD) {
+		if (unlink(path) && errno != ENOENT) {
+			ret = -errno;
+			goto out_free;
+		}
+		if (!link(src, path))
+			goto out_free;
+	}
+
+	/*
+	 * An earlier --hardlink output is the cache entry itself, truncating
+	 * it would empty both. Replace the file instead.
+	 */
+	if (!lstat(path, &st) && S_ISREG(st.st_mode) && unlink(path)) {
+		ret = -errno;
+		goto out_free;
+	}
+
+	in = open(src, O_RDONLY);
+	if (in < 0) {
+		ret = -errno;
+		goto out_free;
+	}
+	out = open(path, O_WRONLY | O_CREAT, 0666);
+	if (out < 0) {
+		ret = -errno;
+		close(in);
+		goto out_free;
+	}
+	/* still the same file, through a symlink */
+	if (fstat(in, &src_st) || fstat(out, &st))
+		ret = -errno;
+	else if (src_st.st_dev == st.st_dev && src_st.st_ino == st.st_ino)
+		ret = -EEXIST;
+	else if (ftruncate(out, 0))
+		ret = -errno;
+	if (ret) {
+		close(in);
+		close(out);
+		goto out_free;
+	}
+
+	if (ioctl(out, FICLONE, in))
+		ret = copy_fd(in, out);
+
+	close(in);
+	if (close(out) && !ret)
+		ret = -errno;
+
+out_free:
+	free(src);
+	return ret;
+}
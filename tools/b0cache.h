@@ -0,0 +1,72 @@
+/*
+ * b0cache: content addressed on-disk cache of assembled boot0 images
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __B0CACHE_H__
+#define __B0CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libboot0img.h"
+#include "sha256.h"
+
+#define B0_CACHE_KEY_LEN	(2 * SHA256_DIGEST_SIZE + 1)
+
+/*
+ * Each cache entry consists of <key>.img, holding the image as it would be
+ * written to a file, and <key>.meta, describing its segments together with
+ * their checksums and the hashes of the input components. The modification
+ * time of the .img file serves as the LRU timestamp.
+ * The hashes of the input files are remembered in files/, indexed by the
+ * file name, so that a cache hit does not need to read any input.
+ */
+struct b0_cache {
+	char *dir;
+	uint64_t max_size;		/* in bytes, 0 for unlimited */
+};
+
+enum b0_component_idx {
+	B0_COMP_BOOT0,
+	B0_COMP_UBOOT,
+	B0_COMP_DRAM,
+	B0_COMP_SRAM,
+	B0_NR_COMPONENTS
+};
+
+enum b0_link_mode {
+	B0_LINK_COPY,			/* reflink if possible, else copy */
+	B0_LINK_HARD,			/* hardlink, shares the cache inode */
+};
+
+int b0_cache_open(struct b0_cache *cache, const char *dir, uint64_t max_size);
+void b0_cache_close(struct b0_cache *cache);
+
+int b0_cache_hash_file(struct b0_cache *cache, const char *path,
+		       uint8_t digest[SHA256_DIGEST_SIZE]);
+void b0_cache_key(const struct b0_options *opts,
+		  uint8_t hashes[B0_NR_COMPONENTS][SHA256_DIGEST_SIZE],
+		  const bool present[B0_NR_COMPONENTS], char *key);
+
+int b0_cache_lookup(struct b0_cache *cache, const char *key,
+		    struct b0_image *img);
+int b0_cache_store(struct b0_cache *cache, const char *key,
+		   const struct b0_image *img,
+		   uint8_t hashes[B0_NR_COMPONENTS][SHA256_DIGEST_SIZE],
+		   const bool present[B0_NR_COMPONENTS]);
+int b0_cache_link(struct b0_cache *cache, const char *key, const char *path,
+		  enum b0_link_mode mode);
+
+#endif
@@ -0,0 +1,701 @@
+/*
+ * b0compress: write assembled boot0 images as compressed streams
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <lzma.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "b0compress.h"
+
+#define XZ_CHECK		LZMA_CHECK_CRC64
+
+struct xz_block {
+	off_t offset;
+	size_t size;
+	uint8_t *out;			/* compressed, including padding */
+	size_t out_size;
+	lzma_vli unpadded_size;
+	bool zero;			/* uses the shared zero block */
+	bool done;
+};
+
+struct xz_job {
+	const struct b0_image *img;
+	size_t block_size;
+	lzma_options_lzma lzma;
+	lzma_filter filters[2];
+	struct xz_block *blocks;
+	int nr_blocks;
+	struct xz_block zero_block;	/* for full sized zero blocks */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int next;			/* next block to compress */
+	int written;			/* blocks written out so far */
+	int window;			/* maximum blocks held in memory */
+	int err;
+};
+
+void b0_compress_init_options(struct b0_compress_options *opts)
+{
+	opts->type = B0_COMPRESS_NONE;
+	opts->level = -1;
+	opts->threads = 0;
+	opts->block_size = B0_XZ_BLOCK_SIZE;
+}
+
+/* Parse "xz", "zstd" or "xz:9" style arguments. */
+int b0_parse_compression(const char *arg, struct b0_compress_options *opts)
+{
+	const char *colon = strchr(arg, ':');
+	size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+
+	if (len == 2 && !strncmp(arg, "xz", len))
+		opts->type = B0_COMPRESS_XZ;
+#ifdef HAVE_ZSTD
+	else if (len == 4 && !strncmp(arg, "zstd", len))
+		opts->type = B0_COMPRESS_ZSTD;
+#endif
+	else
+		return -EINVAL;
+
+	opts->level = colon ? atoi(colon + 1) : -1;
+
+	return 0;
+}
+
+static int lzma_errno(lzma_ret ret)
+{
+	switch (ret) {
+	case LZMA_OK:
+	case LZMA_STREAM_END:
+		return 0;
+	case LZMA_MEM_ERROR:
+		return -ENOMEM;
+	case LZMA_OPTIONS_ERROR:
+	case LZMA_UNSUPPORTED_CHECK:
+		return -EINVAL;
+	default:
+		return -EIO;
+	}
+}
+
+/* Does [start, end) hold anything but zeroes? */
+static bool has_data(const struct b0_image *img, off_t start, off_t end)
+{
+	const struct b0_segment *seg;
+	int i;
+
+	for (i = 0; i < img->nr_segs; i++) {
+		seg = &img->seg[i];
+		if (seg->data && seg->size && seg->offset < end &&
+		    seg->offset + (off_t)seg->size > start)
+			return true;
+	}
+
+	return false;
+}
+
+/* Gather [start, start + size) of the image into a flat buffer. */
+static void fill_block(const struct b0_image *img, uint8_t *buf, off_t start,
+		       size_t size)
+{
+	const struct b0_segment *seg;
+	off_t s, e, end = start + size;
+	int i;
+
+	memset(buf, 0, size);
+	for (i = 0; i < img->nr_segs; i++) {
+		seg = &img->seg[i];
+		if (!seg->data)
+			continue;
+		s = seg->offset > start ? seg->offset : start;
+		e = seg->offset + (off_t)seg->size;
+		if (e > end)
+			e = end;
+		if (e > s)
+			memcpy(buf + (s - start),
+			       (uint8_t *)seg->data + (s - seg->offset), e - s);
+	}
+}
+
+static int xz_encode_block(struct xz_job *job, const uint8_t *in,
+			   struct xz_block *blk)
+{
+	lzma_block block = {
+		.version = 0,
+		.check = XZ_CHECK,
+		.filters = job->filters,
+	};
+	size_t bound = lzma_block_buffer_bound(blk->size);
+	lzma_ret ret;
+
+	blk->out = malloc(bound);
+	if (!blk->out)
+		return -ENOMEM;
+
+	blk->out_size = 0;
+	ret = lzma_block_buffer_encode(&block, NULL, in, blk->size, blk->out,
+				       &blk->out_size, bound);
+	if (ret != LZMA_OK) {
+		free(blk->out);
+		blk->out = NULL;
+		return lzma_errno(ret);
+	}
+	blk->unpadded_size = lzma_block_unpadded_size(&block);
+
+	return 0;
+}
+
+/*
+ * Compress blocks in any order, but stay within a window of the writer,
+ * so that only a few compressed blocks are held in memory at any time.
+ */
+static void *xz_worker(void *arg)
+{
+	struct xz_job *job = arg;
+	struct xz_block *blk;
+	uint8_t *buf;
+	int ret;
+
+	buf = malloc(job->block_size);
+
+	pthread_mutex_lock(&job->lock);
+	if (!buf)
+		job->err = -ENOMEM;
+	while (!job->err) {
+		while (job->next < job->nr_blocks &&
+		       job->blocks[job->next].done)
+			job->next++;
+		if (job->next >= job->nr_blocks)
+			break;
+		if (job->next >= job->written + job->window) {
+			pthread_cond_wait(&job->cond, &job->lock);
+			continue;
+		}
+		blk = &job->blocks[job->next++];
+		pthread_mutex_unlock(&job->lock);
+
+		fill_block(job->img, buf, blk->offset, blk->size);
+		/* zeroes might be in the data as well */
+		if (blk->size == job->zero_block.size && !buf[0] &&
+		    !memcmp(buf, buf + 1, blk->size - 1)) {
+			blk->zero = true;
+			ret = 0;
+		} else {
+			ret = xz_encode_block(job, buf, blk);
+		}
+
+		pthread_mutex_lock(&job->lock);
+		if (ret && !job->err)
+			job->err = ret;
+		blk->done = true;
+		pthread_cond_broadcast(&job->cond);
+	}
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+
+	free(buf);
+
+	return NULL;
+}
+
+static int write_out(FILE *stream, const void *buf, size_t len)
+{
+	if (len && fwrite(buf, len, 1, stream) != 1)
+		return -errno;
+
+	return 0;
+}
+
+static int xz_write_index(struct xz_job *job, FILE *stream)
+{
+	uint8_t header[LZMA_STREAM_HEADER_SIZE];
+	lzma_stream_flags flags = {
+		.version = 0,
+		.check = XZ_CHECK,
+	};
+	const struct xz_block *blk;
+	lzma_index *index;
+	uint8_t *buf = NULL;
+	size_t size, pos = 0;
+	lzma_ret lret;
+	int i, ret;
+
+	index = lzma_index_init(NULL);
+	if (!index)
+		return -ENOMEM;
+
+	for (i = 0; i < job->nr_blocks; i++) {
+		blk = &job->blocks[i];
+		if (blk->zero && blk->size == job->zero_block.size)
+			blk = &job->zero_block;
+		lret = lzma_index_append(index, NULL, blk->unpadded_size,
+					 blk->size);
+		if (lret != LZMA_OK) {
+			ret = lzma_errno(lret);
+			goto out_free;
+		}
+	}
+
+	size = lzma_index_size(index);
+	buf = malloc(size);
+	ret = -ENOMEM;
+	if (!buf)
+		goto out_free;
+	lret = lzma_index_buffer_encode(index, buf, &pos, size);
+	ret = lzma_errno(lret);
+	if (ret)
+		goto out_free;
+	ret = write_out(stream, buf, pos);
+	if (ret)
+		goto out_free;
+
+	flags.backward_size = size;
+	ret = lzma_errno(lzma_stream_footer_encode(&flags, header));
+	if (!ret)
+		ret = write_out(stream, header, LZMA_STREAM_HEADER_SIZE);
+
+out_free:
+	free(buf);
+	lzma_index_end(index, NULL);
+
+	return ret;
+}
+
+static unsigned int nr_threads(const struct b0_compress_options *opts)
+{
+	long cpus;
+
+	if (opts->threads)
+		return opts->threads;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return cpus > 0 ? cpus : 1;
+}
+
+static int write_xz(const struct b0_image *img, FILE *stream,
+		    const struct b0_compress_options *opts)
+{
+	uint8_t header[LZMA_STREAM_HEADER_SIZE];
+	lzma_stream_flags flags = {
+		.version = 0,
+		.check = XZ_CHECK,
+	};
+	unsigned int i, threads = nr_threads(opts);
+	struct xz_job job = {
+		.img = img,
+		.block_size = opts->block_size ? opts->block_size :
+						 B0_XZ_BLOCK_SIZE,
+		.window = 2 * threads,
+	};
+	pthread_t *tids;
+	struct xz_block *blk;
+	uint8_t *buf;
+	off_t pos;
+	int ret;
+
+	if (lzma_lzma_preset(&job.lzma, opts->level < 0 ? LZMA_PRESET_DEFAULT :
+							   opts->level))
+		return -EINVAL;
+	/* a larger dictionary than the block does not help */
+	if (job.lzma.dict_size > job.block_size)
+		job.lzma.dict_size = job.block_size < LZMA_DICT_SIZE_MIN ?
+				     LZMA_DICT_SIZE_MIN : job.block_size;
+	job.filters[0].id = LZMA_FILTER_LZMA2;
+	job.filters[0].options = &job.lzma;
+	job.filters[1].id = LZMA_VLI_UNKNOWN;
+
+	job.nr_blocks = (img->size + job.block_size - 1) / job.block_size;
+	job.blocks = calloc(job.nr_blocks, sizeof(*job.blocks));
+	tids = calloc(threads, sizeof(*tids));
+	buf = malloc(job.block_size);
+	ret = -ENOMEM;
+	if (!job.blocks || !tids || !buf)
+		goto out_free;
+
+	job.zero_block.size = job.block_size;
+	if (img->size >= (off_t)job.block_size) {
+		memset(buf, 0, job.block_size);
+		ret = xz_encode_block(&job, buf, &job.zero_block);
+		if (ret)
+			goto out_free;
+	}
+
+	for (pos = 0, i = 0; pos < img->size; pos += job.block_size, i++) {
+		blk = &job.blocks[i];
+		blk->offset = pos;
+		blk->size = img->size - pos < (off_t)job.block_size ?
+			    img->size - pos : job.block_size;
+		if (blk->size == job.zero_block.size &&
+		    !has_data(img, pos, pos + blk->size)) {
+			blk->zero = true;
+			blk->done = true;
+		}
+	}
+
+	ret = lzma_errno(lzma_stream_header_encode(&flags, header));
+	if (!ret)
+		ret = write_out(stream, header, LZMA_STREAM_HEADER_SIZE);
+	if (ret)
+		goto out_free;
+
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&tids[i], NULL, xz_worker, &job))
+			break;
+	threads = i;
+	if (!threads)
+		job.err = -EAGAIN;
+
+	/* write out the blocks in order, as they become ready */
+	for (i = 0; i < (unsigned int)job.nr_blocks; i++) {
+		blk = &job.blocks[i];
+
+		pthread_mutex_lock(&job.lock);
+		while (!blk->done && !job.err)
+			pthread_cond_wait(&job.cond, &job.lock);
+		ret = job.err;
+		pthread_mutex_unlock(&job.lock);
+		if (ret)
+			break;
+
+		if (blk->zero && blk->size == job.zero_block.size)
+			ret = write_out(stream, job.zero_block.out,
+					job.zero_block.out_size);
+		else
+			ret = write_out(stream, blk->out, blk->out_size);
+		free(blk->out);
+		blk->out = NULL;
+
+		pthread_mutex_lock(&job.lock);
+		if (ret)
+			job.err = ret;
+		job.written++;
+		pthread_cond_broadcast(&job.cond);
+		pthread_mutex_unlock(&job.lock);
+		if (ret)
+			break;
+	}
+
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	pthread_cond_destroy(&job.cond);
+	pthread_mutex_destroy(&job.lock);
+
+	if (!ret)
+		ret = xz_write_index(&job, stream);
+
+out_free:
+	for (i = 0; job.blocks && i < (unsigned int)job.nr_blocks; i++)
+		free(job.blocks[i].out);
+	free(job.blocks);
+	free(job.zero_block.out);
+	free(tids);
+	free(buf);
+
+	return ret;
+}
+
+#ifdef HAVE_ZSTD
+static const uint8_t zero_buf[64 * 1024];
+
+static int zstd_feed(ZSTD_CCtx *cctx, FILE *stream, void *out, size_t out_size,
+		     const void *buf, size_t len, ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer in = { buf, len, 0 };
+	ZSTD_outBuffer ob;
+	size_t remaining;
+	int ret;
+
+	do {
+		ob.dst = out;
+		ob.size = out_size;
+		ob.pos = 0;
+		remaining = ZSTD_compressStream2(cctx, &ob, &in, mode);
+		if (ZSTD_isError(remaining))
+			return -EIO;
+		ret = write_out(stream, out, ob.pos);
+		if (ret)
+			return ret;
+	} while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+
+	return 0;
+}
+
+/* zstd does its own threading, zero runs are fed from a static buffer */
+static int write_zstd(const struct b0_image *img, FILE *stream,
+		      const struct b0_compress_options *opts)
+{
+	size_t out_size = ZSTD_CStreamOutSize(), len;
+	const struct b0_segment *seg;
+	ZSTD_CCtx *cctx;
+	off_t pos = 0, zeroes;
+	void *out;
+	int i, ret = -ENOMEM;
+
+	cctx = ZSTD_createCCtx();
+	out = malloc(out_size);
+	if (!cctx || !out)
+		goto out_free;
+
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+			       opts->level < 0 ? ZSTD_CLEVEL_DEFAULT :
+						 opts->level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, nr_threads(opts));
+	ZSTD_CCtx_setPledgedSrcSize(cctx, img->size);
+
+	ret = 0;
+	for (i = 0; i < img->nr_segs && !ret; i++) {
+		seg = &img->seg[i];
+
+		zeroes = seg->offset - pos;
+		if (!seg->data)
+			zeroes += seg->size;
+		while (zeroes > 0 && !ret) {
+			len = zeroes > (off_t)sizeof(zero_buf) ?
+			      sizeof(zero_buf) : (size_t)zeroes;
+			ret = zstd_feed(cctx, stream, out, out_size, zero_buf,
+					len, ZSTD_e_continue);
+			zeroes -= len;
+		}
+		if (seg->data && !ret)
+			ret = zstd_feed(cctx, stream, out, out_size, seg->data,
+					seg->size, ZSTD_e_continue);
+		pos = seg->offset + seg->size;
+	}
+	if (!ret)
+		ret = zstd_feed(cctx, stream, out, out_size, NULL, 0,
+				ZSTD_e_end);
+
+out_free:
+	ZSTD_freeCCtx(cctx);
+	free(out);
+
+	return ret;
+}
+#endif
+
+/* Parse the index of all streams in the file, seeking as liblzma asks. */
+static int xz_read_index(struct b0_xz_reader *rd)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	uint8_t buf[BUFSIZ];
+	struct stat st;
+	lzma_ret lret;
+	ssize_t len;
+	int ret = 0;
+
+	if (fstat(rd->fd, &st))
+		return -errno;
+
+	lret = lzma_file_info_decoder(&strm, &rd->index, UINT64_MAX,
+				      st.st_size);
+	if (lret != LZMA_OK)
+		return lzma_errno(lret);
+
+	for (;;) {
+		if (!strm.avail_in) {
+			len = read(rd->fd, buf, sizeof(buf));
+			if (len < 0) {
+				ret = -errno;
+				break;
+			}
+			strm.next_in = buf;
+			strm.avail_in = len;
+			rd->bytes_read += len;
+		}
+
+		lret = lzma_code(&strm, LZMA_RUN);
+		if (lret == LZMA_SEEK_NEEDED) {
+			if (lseek(rd->fd, strm.seek_pos, SEEK_SET) < 0) {
+				ret = -errno;
+				break;
+			}
+			strm.avail_in = 0;
+			continue;
+		}
+		if (lret != LZMA_OK) {
+			ret = lret == LZMA_STREAM_END ? 0 : lzma_errno(lret);
+			break;
+		}
+	}
+
+	lzma_end(&strm);
+
+	return ret;
+}
+
+int b0_xz_open(struct b0_xz_reader *rd, const char *path)
+{
+	int ret;
+
+	memset(rd, 0, sizeof(*rd));
+	rd->fd = open(path, O_RDONLY);
+	if (rd->fd < 0)
+		return -errno;
+
+	ret = xz_read_index(rd);
+	if (ret) {
+		b0_xz_close(rd);
+		return ret;
+	}
+
+	rd->size = lzma_index_uncompressed_size(rd->index);
+	rd->nr_blocks = lzma_index_block_count(rd->index);
+
+	return 0;
+}
+
+void b0_xz_close(struct b0_xz_reader *rd)
+{
+	if (rd->index)
+		lzma_index_end(rd->index, NULL);
+	free(rd->block);
+	close(rd->fd);
+	rd->index = NULL;
+	rd->block = NULL;
+}
+
+static int xz_decode_block(struct b0_xz_reader *rd,
+			   const lzma_index_iter *iter)
+{
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	lzma_block block = {
+		.version = 0,
+		.check = iter->stream.flags->check,
+		.filters = filters,
+	};
+	size_t in_size = iter->block.total_size, in_pos, out_pos = 0;
+	uint8_t *in, *out = NULL;
+	ssize_t len;
+	int i, ret;
+
+	in = malloc(in_size);
+	if (!in)
+		return -ENOMEM;
+
+	len = pread(rd->fd, in, in_size, iter->block.compressed_file_offset);
+	if (len != (ssize_t)in_size) {
+		ret = len < 0 ? -errno : -EIO;
+		goto out_free;
+	}
+	rd->bytes_read += len;
+
+	filters[0].id = LZMA_VLI_UNKNOWN;
+	block.header_size = lzma_block_header_size_decode(in[0]);
+	ret = lzma_errno(lzma_block_header_decode(&block, NULL, in));
+	if (ret)
+		goto out_free;
+	ret = lzma_errno(lzma_block_compressed_size(&block,
+					iter->block.unpadded_size));
+	if (ret)
+		goto out_filters;
+
+	out = malloc(iter->block.uncompressed_size);
+	ret = -ENOMEM;
+	if (!out)
+		goto out_filters;
+
+	in_pos = block.header_size;
+	ret = lzma_errno(lzma_block_buffer_decode(&block, NULL, in, &in_pos,
+						  in_size, out, &out_pos,
+						  iter->block.uncompressed_size));
+	if (ret)
+		goto out_filters;
+
+	free(rd->block);
+	rd->block = out;
+	rd->block_offset = iter->block.uncompressed_file_offset;
+	rd->block_size = out_pos;
+	rd->blocks_decoded++;
+	out = NULL;
+
+out_filters:
+	for (i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+		free(filters[i].options);
+out_free:
+	free(out);
+	free(in);
+
+	return ret;
+}
+
+ssize_t b0_xz_pread(struct b0_xz_reader *rd, void *buf, size_t len,
+		    uint64_t offset)
+{
+	lzma_index_iter iter;
+	size_t done = 0, chunk;
+	int ret;
+
+	while (done < len && offset < rd->size) {
+		if (!rd->block || offset < rd->block_offset ||
+		    offset >= rd->block_offset + rd->block_size) {
+			lzma_index_iter_init(&iter, rd->index);
+			if (lzma_index_iter_locate(&iter, offset))
+				break;
+			ret = xz_decode_block(rd, &iter);
+			if (ret)
+				return ret;
+		}
+
+		chunk = rd->block_offset + rd->block_size - offset;
+		if (chunk > len - done)
+			chunk = len - done;
+		memcpy((uint8_t *)buf + done,
+		       rd->block + (offset - rd->block_offset), chunk);
+		done += chunk;
+		offset += chunk;
+	}
+
+	return done;
+}
+
+int b0_write_compressed(const struct b0_image *img, FILE *stream,
+			const struct b0_compress_options *opts)
+{
+	int ret;
+
+	switch (opts->type) {
+	case B0_COMPRESS_XZ:
+		ret = write_xz(img, stream, opts);
+		break;
+#ifdef HAVE_ZSTD
+	case B0_COMPRESS_ZSTD:
+		ret = write_zstd(img, stream, opts);
+		break;
+#endif
+	default:
+		return -EINVAL;
+	}
+
+	if (!ret && fflush(stream))
+		ret = -errno;
+
+	return ret;
+}
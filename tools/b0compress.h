@@ -0,0 +1,73 @@
+/*
+ * b0compress: write assembled boot0 images as compressed streams
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __B0COMPRESS_H__
+#define __B0COMPRESS_H__
+
+#include <stdio.h>
+
+#include "libboot0img.h"
+
+enum b0_compression {
+	B0_COMPRESS_NONE,
+	B0_COMPRESS_XZ,
+	B0_COMPRESS_ZSTD,		/* only with HAVE_ZSTD */
+};
+
+#define B0_XZ_BLOCK_SIZE	(1024 * 1024)
+
+struct b0_compress_options {
+	enum b0_compression type;
+	int level;			/* -1 for the default */
+	unsigned int threads;		/* 0 for one per CPU */
+	size_t block_size;		/* xz: uncompressed size per block */
+};
+
+/*
+ * xz output consists of independently compressed blocks of block_size
+ * bytes, listed in the stream index, so a reader can decompress any part
+ * of the image without starting at the beginning. Blocks consisting of
+ * zeroes only are compressed once and then repeated.
+ */
+void b0_compress_init_options(struct b0_compress_options *opts);
+int b0_parse_compression(const char *arg, struct b0_compress_options *opts);
+int b0_write_compressed(const struct b0_image *img, FILE *stream,
+			const struct b0_compress_options *opts);
+
+/*
+ * Random access to .xz files: the index gets read from the end of the
+ * file, a read then decompresses just the blocks covering the requested
+ * range. Files compressed as a single block still work, but need to be
+ * decompressed as a whole.
+ */
+struct b0_xz_reader {
+	int fd;
+	struct lzma_index_s *index;
+	uint64_t size;			/* uncompressed */
+	uint8_t *block;			/* the last block decompressed */
+	uint64_t block_offset;
+	size_t block_size;
+	unsigned int nr_blocks;
+	unsigned int blocks_decoded;
+	uint64_t bytes_read;		/* compressed, including the index */
+};
+
+int b0_xz_open(struct b0_xz_reader *rd, const char *path);
+ssize_t b0_xz_pread(struct b0_xz_reader *rd, void *buf, size_t len,
+		    uint64_t offset);
+void b0_xz_close(struct b0_xz_reader *rd);
+
+#endif
@@ -0,0 +1,947 @@
+/*
+ * b0delta: binary deltas between firmware images, applied in place
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <lzma.h>
+
+#include "libboot0img.h"
+#include "b0dev.h"
+#include "sha256.h"
+
+#define PATCH_MAGIC	"B0DELTA1"
+#define MATCH_BLOCK	32		/* shortest match worth a copy */
+#define MAX_CANDIDATES	16
+#define GOOD_MATCH	4096		/* stop looking for a longer one */
+#define MAX_FUZZ_LOSS	64		/* approximate matches give up then */
+#define MAX_OPS_SIZE	(1U << 30)
+
+enum {
+	OP_COPY = 'C',			/* offset and length in the old image */
+	OP_DATA = 'D',			/* length, followed by the new bytes */
+	OP_ADD = 'A',			/* like copy, followed by differences */
+};
+
+/*
+ * The patch file: this header, followed by the xz compressed list of
+ * operations building the new image. All numbers are little endian.
+ */
+struct patch_header {
+	char magic[8];
+	uint64_t old_size;
+	uint64_t new_size;
+	uint8_t old_sha[SHA256_DIGEST_SIZE];
+	uint8_t new_sha[SHA256_DIGEST_SIZE];
+	uint64_t ops_size;		/* uncompressed */
+};
+
+struct ops_buf {
+	uint8_t *data;
+	size_t size, alloc;
+	unsigned int nr_copy, nr_data, nr_add;
+	uint64_t copied, literal, added;
+};
+
+struct image_parts {
+	off_t boot0, fw;		/* -1 if not found */
+	size_t boot0_size, fw_size;
+	off_t base;			/* disk offset of the image start */
+};
+
+static void usage(const char *progname, FILE *stream)
+{
+	fprintf(stream, "b0delta: binary deltas between firmware images\n"
+		"usage: %s diff <old.img> <new.img> <patch>\n"
+		"       %s apply [-s offset] [-b old.img] <patch> <target>\n"
+		"       %s verify <image>\n", progname, progname, progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-q|--quiet: only report errors\n"
+		"\t-s|--offset: position of the image on the target (default: "
+		"8K on a block\n\t            device for images starting with "
+		"boot0, 0 otherwise)\n"
+		"\t-b|--base: old image file, instead of reading it from the "
+		"target\n"
+		"\t-n|--dry-run: check everything, but don't write\n\n");
+	fprintf(stream, "apply replaces the old image on the target (a device "
+		"or a file) with the new\none, writing only the blocks which "
+		"differ. Both images are verified with\ntheir SHA256 and the "
+		"boot0 and firmware checksums.\n");
+}
+
+static int read_full(int fd, void *buf, size_t len, off_t offset)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = pread(fd, buf, len, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -ENODATA;
+		buf = (uint8_t *)buf + ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+/* Page aligned, as the device writer wants it. */
+static int read_image(const char *path, uint8_t **bufp, size_t *sizep)
+{
+	struct stat st;
+	void *buf;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out_close;
+	}
+	if (posix_memalign(&buf, B0_BUF_ALIGN, st.st_size ? st.st_size : 1)) {
+		ret = -ENOMEM;
+		goto out_close;
+	}
+	ret = read_full(fd, buf, st.st_size, 0);
+	if (ret) {
+		free(buf);
+		goto out_close;
+	}
+	*bufp = buf;
+	*sizep = st.st_size;
+
+out_close:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Find boot0 and the firmware blob, like b0xz info: the image either
+ * starts with boot0 (at disk offset 8K), covers the whole disk or is just
+ * the firmware blob.
+ */
+static void find_parts(const uint8_t *buf, size_t size,
+		       struct image_parts *parts)
+{
+	const uint32_t *hdr;
+	off_t offsets[3];
+	unsigned int i;
+
+	parts->boot0 = parts->fw = -1;
+	parts->base = 0;
+	if (size >= 32 && !memcmp(buf + 4, BOOT0_MAGIC, 8)) {
+		parts->boot0 = 0;
+		parts->base = BOOT0_OFFSET;
+	} else if (size >= BOOT0_OFFSET + 32 &&
+		   !memcmp(buf + BOOT0_OFFSET + 4, BOOT0_MAGIC, 8)) {
+		parts->boot0 = BOOT0_OFFSET;
+	}
+	if (parts->boot0 >= 0) {
+		hdr = (const uint32_t *)(buf + parts->boot0);
+		parts->boot0_size = le32toh(hdr[BOOT0_LENGTH]);
+	}
+
+	offsets[0] = 0;
+	offsets[1] = BOOT0_END_KB * 1024 - parts->base;
+	offsets[2] = UBOOT_OFFSET_KB * 1024 - parts->base;
+	for (i = 0; i < 3; i++) {
+		if (offsets[i] + HEADER_SIZE > (off_t)size)
+			continue;
+		hdr = (const uint32_t *)(buf + offsets[i]);
+		if (memcmp(&hdr[HEADER_MAGIC], FW_MAGIC, strlen(FW_MAGIC)))
+			continue;
+		parts->fw = offsets[i];
+		parts->fw_size = le32toh(hdr[HEADER_PRIMSIZE]);
+		break;
+	}
+}
+
+static int check_part(const uint8_t *buf, size_t size, const char *name,
+		      off_t offset, size_t part_size, bool verbose)
+{
+	uint32_t checksum, old_checksum;
+
+	if (offset + part_size > size || part_size < 16) {
+		fprintf(stderr, "%s at %jd: %zu Bytes, truncated\n", name,
+			(intmax_t)offset, part_size);
+		return 1;
+	}
+
+	checksum = b0_image_checksum(buf + offset, part_size, &old_checksum);
+	if (verbose || checksum != old_checksum)
+		fprintf(stderr, "%-8s at %8jd: %zu Bytes, checksum 0x%08x, %s\n",
+			name, (intmax_t)offset, part_size, old_checksum,
+			checksum == old_checksum ? "OK" : "MISMATCH");
+
+	return checksum != old_checksum;
+}
+
+/* Returns the number of checksum mismatches, -ENOENT without headers. */
+static int verify_image(const uint8_t *buf, size_t size,
+			const struct image_parts *parts, bool verbose)
+{
+	int bad = 0;
+
+	if (parts->boot0 < 0 && parts->fw < 0)
+		return -ENOENT;
+	if (parts->boot0 >= 0)
+		bad += check_part(buf, size, "boot0", parts->boot0,
+				  parts->boot0_size, verbose);
+	if (parts->fw >= 0)
+		bad += check_part(buf, size, "firmware", parts->fw,
+				  parts->fw_size, verbose);
+
+	return bad;
+}
+
+static int ops_put(struct ops_buf *ops, const void *data, size_t len)
+{
+	uint8_t *p;
+
+	if (ops->size + len > ops->alloc) {
+		ops->alloc = (ops->size + len) * 2;
+		p = realloc(ops->data, ops->alloc);
+		if (!p)
+			return -ENOMEM;
+		ops->data = p;
+	}
+	memcpy(ops->data + ops->size, data, len);
+	ops->size += len;
+
+	return 0;
+}
+
+static int emit_op(struct ops_buf *ops, uint8_t type, uint64_t a, uint64_t b)
+{
+	uint64_t args[2] = { htole64(a), htole64(b) };
+	int ret;
+
+	ret = ops_put(ops, &type, 1);
+	if (!ret)
+		ret = ops_put(ops, args, type == OP_DATA ? 8 : 16);
+
+	return ret;
+}
+
+static int emit_data(struct ops_buf *ops, const uint8_t *data, size_t len)
+{
+	int ret;
+
+	if (!len)
+		return 0;
+	ret = emit_op(ops, OP_DATA, len, 0);
+	if (!ret)
+		ret = ops_put(ops, data, len);
+	ops->nr_data++;
+	ops->literal += len;
+
+	return ret;
+}
+
+static int emit_copy(struct ops_buf *ops, uint64_t src, uint64_t len)
+{
+	ops->nr_copy++;
+	ops->copied += len;
+
+	return emit_op(ops, OP_COPY, src, len);
+}
+
+/* The differences are mostly zeroes, which compress to almost nothing. */
+static int emit_add(struct ops_buf *ops, const uint8_t *old, uint64_t src,
+		    const uint8_t *new, uint64_t len)
+{
+	uint8_t diff[256];
+	size_t i, j, n;
+	int ret;
+
+	if (!len)
+		return 0;
+	ret = emit_op(ops, OP_ADD, src, len);
+	for (i = 0; !ret && i < len; i += n) {
+		n = len - i < sizeof(diff) ? len - i : sizeof(diff);
+		for (j = 0; j < n; j++)
+			diff[j] = new[i + j] - old[src + i + j];
+		ret = ops_put(ops, diff, n);
+	}
+	ops->nr_add++;
+	ops->added += len;
+
+	return ret;
+}
+
+/*
+ * Moved code keeps most bytes, but branch targets and addresses change.
+ * Behind an exact match, find the length which maximises the matching
+ * bytes minus the differing ones, like bsdiff does.
+ */
+static size_t fuzzy_len(const uint8_t *old, size_t old_len,
+			const uint8_t *new, size_t new_len)
+{
+	size_t i, max = old_len < new_len ? old_len : new_len, best = 0;
+	long score = 0, best_score = 0;
+
+	for (i = 0; i < max; i++) {
+		score += old[i] == new[i] ? 1 : -1;
+		if (score > best_score) {
+			best_score = score;
+			best = i + 1;
+		} else if (score < best_score - MAX_FUZZ_LOSS) {
+			break;
+		}
+	}
+
+	return best;
+}
+
+/* The rolling checksum from rsync, over MATCH_BLOCK bytes. */
+static uint32_t weak_sum(const uint8_t *p, uint32_t *a, uint32_t *b)
+{
+	int i;
+
+	*a = *b = 0;
+	for (i = 0; i < MATCH_BLOCK; i++) {
+		*a += p[i];
+		*b += (MATCH_BLOCK - i) * p[i];
+	}
+
+	return (*a & 0xffff) | (*b << 16);
+}
+
+static uint32_t bucket(uint32_t sum, uint32_t mask)
+{
+	return (sum * 0x9e3779b1U) >> 7 & mask;
+}
+
+static size_t match_len(const uint8_t *a, size_t a_len, const uint8_t *b,
+			size_t b_len)
+{
+	size_t n = 0, max = a_len < b_len ? a_len : b_len;
+
+	while (n < max && a[n] == b[n])
+		n++;
+
+	return n;
+}
+
+/*
+ * Build the operations turning old into new: the old image gets indexed
+ * in blocks, then a rolling checksum over the new image finds those
+ * blocks at any offset, and matches get extended in both directions.
+ * Code moved around between releases thus becomes copies.
+ */
+static int diff_images(const uint8_t *old, size_t old_size,
+		       const uint8_t *new, size_t new_size,
+		       struct ops_buf *ops)
+{
+	uint32_t *heads, *next, mask, sum = 0, a, b, nr_blocks, i;
+	size_t pos = 0, lit = 0, len, best_len, prev_end = SIZE_MAX;
+	size_t src, best_src = 0;
+	unsigned int tries;
+	int ret = 0;
+
+	nr_blocks = old_size / MATCH_BLOCK;
+	for (mask = 1; mask < nr_blocks; mask <<= 1)
+		;
+	heads = malloc(mask * sizeof(*heads));
+	next = malloc((nr_blocks + 1) * sizeof(*next));
+	if (!heads || !next) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	mask--;
+	memset(heads, 0xff, (mask + 1) * sizeof(*heads));
+	/* inserted backwards, so chains start with the lowest offset */
+	for (i = nr_blocks; i-- > 0; ) {
+		sum = bucket(weak_sum(old + i * MATCH_BLOCK, &a, &b), mask);
+		next[i] = heads[sum];
+		heads[sum] = i;
+	}
+
+	if (new_size >= MATCH_BLOCK)
+		sum = weak_sum(new, &a, &b);
+	while (nr_blocks && pos + MATCH_BLOCK <= new_size) {
+		best_len = 0;
+		/* continuing the previous copy is the cheapest */
+		if (prev_end != SIZE_MAX && pos == lit)
+			best_len = match_len(old + prev_end, old_size - prev_end,
+					     new + pos, new_size - pos);
+		if (best_len)
+			best_src = prev_end;
+
+		tries = 0;
+		for (i = heads[bucket(sum, mask)];
+		     i != UINT32_MAX && tries < MAX_CANDIDATES &&
+		     best_len < GOOD_MATCH; i = next[i], tries++) {
+			src = (size_t)i * MATCH_BLOCK;
+			len = match_len(old + src, old_size - src, new + pos,
+					new_size - pos);
+			if (len > best_len) {
+				best_len = len;
+				best_src = src;
+			}
+		}
+
+		if (best_len >= MATCH_BLOCK) {
+			/* grow the match backwards into the pending data */
+			while (pos > lit && best_src > 0 &&
+			       new[pos - 1] == old[best_src - 1]) {
+				pos--;
+				best_src--;
+				best_len++;
+			}
+			ret = emit_data(ops, new + lit, pos - lit);
+			if (!ret)
+				ret = emit_copy(ops, best_src, best_len);
+			pos += best_len;
+			best_src += best_len;
+			len = fuzzy_len(old + best_src, old_size - best_src,
+					new + pos, new_size - pos);
+			if (!ret)
+				ret = emit_add(ops, old, best_src, new + pos, len);
+			if (ret)
+				goto out_free;
+			pos += len;
+			lit = pos;
+			prev_end = best_src + len;
+			if (pos + MATCH_BLOCK <= new_size)
+				sum = weak_sum(new + pos, &a, &b);
+			continue;
+		}
+
+		if (pos + MATCH_BLOCK >= new_size)
+			break;
+		a += new[pos + MATCH_BLOCK] - new[pos];
+		b += a - MATCH_BLOCK * new[pos];
+		sum = (a & 0xffff) | (b << 16);
+		pos++;
+	}
+	ret = emit_data(ops, new + lit, new_size - lit);
+
+out_free:
+	free(heads);
+	free(next);
+	return ret;
+}
+
+/* Build the new image from the operations, checking every one of them. */
+static int apply_ops(const uint8_t *ops, size_t ops_size, const uint8_t *old,
+		     size_t old_size, uint8_t *new, size_t new_size)
+{
+	size_t pos = 0, i = 0, j;
+	uint64_t args[2], src, len;
+	uint8_t type;
+
+	while (i < ops_size) {
+		type = ops[i++];
+		if (type == OP_COPY) {
+			if (i + 16 > ops_size)
+				return -EINVAL;
+			memcpy(args, ops + i, 16);
+			i += 16;
+			src = le64toh(args[0]);
+			len = le64toh(args[1]);
+			if (src > old_size || len > old_size - src ||
+			    len > new_size - pos)
+				return -EINVAL;
+			memcpy(new + pos, old + src, len);
+		} else if (type == OP_ADD) {
+			if (i + 16 > ops_size)
+				return -EINVAL;
+			memcpy(args, ops + i, 16);
+			i += 16;
+			src = le64toh(args[0]);
+			len = le64toh(args[1]);
+			if (src > old_size || len > old_size - src ||
+			    len > new_size - pos || len > ops_size - i)
+				return -EINVAL;
+			for (j = 0; j < len; j++)
+				new[pos + j] = old[src + j] + ops[i + j];
+			i += len;
+		} else if (type == OP_DATA) {
+			if (i + 8 > ops_size)
+				return -EINVAL;
+			memcpy(args, ops + i, 8);
+			i += 8;
+			len = le64toh(args[0]);
+			if (len > ops_size - i || len > new_size - pos)
+				return -EINVAL;
+			memcpy(new + pos, ops + i, len);
+			i += len;
+		} else {
+			return -EINVAL;
+		}
+		pos += len;
+	}
+
+	return pos == new_size ? 0 : -EINVAL;
+}
+
+static int cmd_diff(const char *old_fname, const char *new_fname,
+		    const char *patch_fname, bool quiet)
+{
+	struct ops_buf ops = {};
+	struct patch_header hdr;
+	struct image_parts parts;
+	uint8_t *old = NULL, *new = NULL, *check = NULL, *xz = NULL;
+	size_t old_size, new_size, xz_size, xz_pos = 0;
+	FILE *patch;
+	int ret;
+
+	ret = read_image(old_fname, &old, &old_size);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", old_fname, strerror(-ret));
+		return 2;
+	}
+	ret = read_image(new_fname, &new, &new_size);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", new_fname, strerror(-ret));
+		ret = 2;
+		goto out_free;
+	}
+
+	find_parts(new, new_size, &parts);
+	if (verify_image(new, new_size, &parts, false) > 0)
+		fprintf(stderr, "warning: %s has checksum errors\n", new_fname);
+
+	ret = diff_images(old, old_size, new, new_size, &ops);
+	if (ret)
+		goto out_err;
+
+	/* make sure the patch actually works, before anyone relies on it */
+	check = malloc(new_size ? new_size : 1);
+	if (!check) {
+		ret = -ENOMEM;
+		goto out_err;
+	}
+	ret = apply_ops(ops.data, ops.size, old, old_size, check, new_size);
+	if (!ret && memcmp(check, new, new_size))
+		ret = -EINVAL;
+	if (ret) {
+		fprintf(stderr, "internal error: the patch does not work\n");
+		ret = 3;
+		goto out_free;
+	}
+
+	xz_size = lzma_stream_buffer_bound(ops.size);
+	xz = malloc(xz_size);
+	if (!xz) {
+		ret = -ENOMEM;
+		goto out_err;
+	}
+	if (lzma_easy_buffer_encode(9 | LZMA_PRESET_EXTREME, LZMA_CHECK_CRC64,
+				    NULL, ops.data, ops.size, xz, &xz_pos,
+				    xz_size) != LZMA_OK) {
+		ret = -EIO;
+		goto out_err;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, PATCH_MAGIC, sizeof(hdr.magic));
+	hdr.old_size = htole64(old_size);
+	hdr.new_size = htole64(new_size);
+	sha256(old, old_size, hdr.old_sha);
+	sha256(new, new_size, hdr.new_sha);
+	hdr.ops_size = htole64(ops.size);
+
+	patch = fopen(patch_fname, "wb");
+	if (!patch) {
+		ret = -errno;
+		fprintf(stderr, "%s: %s\n", patch_fname, strerror(-ret));
+		ret = 2;
+		goto out_free;
+	}
+	if (fwrite(&hdr, sizeof(hdr), 1, patch) != 1 ||
+	    fwrite(xz, xz_pos, 1, patch) != 1)
+		ret = -errno;
+	if (fclose(patch) && !ret)
+		ret = -errno;
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", patch_fname, strerror(-ret));
+		ret = 2;
+		goto out_free;
+	}
+
+	if (!quiet)
+		fprintf(stderr, "%u copies (%ju Bytes), %u approximate copies "
+			"(%ju Bytes), %u inserts (%ju Bytes), patch: %zu Bytes\n",
+			ops.nr_copy, (uintmax_t)ops.copied, ops.nr_add,
+			(uintmax_t)ops.added, ops.nr_data,
+			(uintmax_t)ops.literal, sizeof(hdr) + xz_pos);
+	goto out_free;
+
+out_err:
+	fprintf(stderr, "cannot create patch: %s\n", strerror(-ret));
+	ret = 3;
+out_free:
+	free(ops.data);
+	free(xz);
+	free(check);
+	free(new);
+	free(old);
+
+	return ret;
+}
+
+static int read_patch(const char *fname, struct patch_header *hdr,
+		      uint8_t **opsp)
+{
+	uint64_t memlimit = UINT64_MAX;
+	size_t size, in_pos = 0, out_pos = 0;
+	uint8_t *buf, *ops;
+	int ret;
+
+	ret = read_image(fname, &buf, &size);
+	if (ret)
+		return ret;
+	if (size < sizeof(*hdr) || memcmp(buf, PATCH_MAGIC, 8)) {
+		ret = -EINVAL;
+		goto out_free;
+	}
+	memcpy(hdr, buf, sizeof(*hdr));
+	hdr->old_size = le64toh(hdr->old_size);
+	hdr->new_size = le64toh(hdr->new_size);
+	hdr->ops_size = le64toh(hdr->ops_size);
+	if (hdr->ops_size > MAX_OPS_SIZE) {
+		ret = -EFBIG;
+		goto out_free;
+	}
+
+	ops = malloc(hdr->ops_size ? hdr->ops_size : 1);
+	if (!ops) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	if (lzma_stream_buffer_decode(&memlimit, 0, NULL, buf + sizeof(*hdr),
+				      &in_pos, size - sizeof(*hdr), ops,
+				      &out_pos, hdr->ops_size) != LZMA_OK ||
+	    out_pos != hdr->ops_size) {
+		free(ops);
+		ret = -EINVAL;
+		goto out_free;
+	}
+	*opsp = ops;
+
+out_free:
+	free(buf);
+	return ret;
+}
+
+static bool sha_matches(const uint8_t *buf, size_t size,
+			const uint8_t expected[SHA256_DIGEST_SIZE])
+{
+	uint8_t digest[SHA256_DIGEST_SIZE];
+
+	sha256(buf, size, digest);
+
+	return !memcmp(digest, expected, SHA256_DIGEST_SIZE);
+}
+
+/* Read the image back from the target, bypassing the page cache. */
+static int read_back(const char *target, off_t offset, uint8_t *buf,
+		     size_t size)
+{
+	int fd, ret;
+
+	fd = open(target, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	posix_fadvise(fd, offset, size, POSIX_FADV_DONTNEED);
+	ret = read_full(fd, buf, size, offset);
+	close(fd);
+
+	return ret;
+}
+
+/*
+ * Look for the old image on the target: a device normally has it at the
+ * boot0 offset, a file at the beginning. Returns the offset it was found.
+ */
+static off_t find_old_image(const char *target, const struct stat *st,
+			    off_t offset, uint8_t *old,
+			    const struct patch_header *hdr)
+{
+	off_t offsets[2] = { 0, BOOT0_OFFSET };
+	int i, ret = -ENOENT;
+
+	if (offset >= 0)
+		offsets[0] = offsets[1] = offset;
+	else if (S_ISBLK(st->st_mode))
+		offsets[0] = BOOT0_OFFSET, offsets[1] = 0;
+
+	for (i = 0; i < 2; i++) {
+		ret = read_back(target, offsets[i], old, hdr->old_size);
+		if (ret == -ENODATA)
+			continue;
+		if (ret)
+			return ret;
+		if (sha_matches(old, hdr->old_size, hdr->old_sha))
+			return offsets[i];
+		ret = -ENOENT;
+	}
+
+	return -ENOENT;
+}
+
+static int cmd_apply(const char *patch_fname, const char *target,
+		     const char *base_fname, off_t offset, bool dry_run,
+		     bool quiet)
+{
+	struct b0_dev_options dev_opts;
+	struct b0_dev_stats stats;
+	struct patch_header hdr;
+	struct image_parts parts;
+	struct b0_image img;
+	struct stat st;
+	uint8_t *ops = NULL, *old = NULL, *new = NULL;
+	size_t old_size;
+	off_t end;
+	void *buf;
+	int fd, ret, bad;
+
+	ret = read_patch(patch_fname, &hdr, &ops);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", patch_fname,
+			ret == -EINVAL ? "not a valid patch" : strerror(-ret));
+		return 2;
+	}
+
+	if (posix_memalign(&buf, B0_BUF_ALIGN,
+			   hdr.new_size ? hdr.new_size : 1)) {
+		ret = 2;
+		goto out_free;
+	}
+	new = buf;
+
+	if (stat(target, &st)) {
+		perror(target);
+		ret = 2;
+		goto out_free;
+	}
+	if (base_fname) {
+		ret = read_image(base_fname, &old, &old_size);
+		if (!ret && old_size != hdr.old_size)
+			ret = -EINVAL;
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", base_fname, ret == -EINVAL ?
+				"size does not match the patch" :
+				strerror(-ret));
+			ret = 2;
+			goto out_free;
+		}
+	} else {
+		old = malloc(hdr.old_size ? hdr.old_size : 1);
+		if (!old) {
+			ret = 2;
+			goto out_free;
+		}
+	}
+
+	if (base_fname) {
+		if (!sha_matches(old, hdr.old_size, hdr.old_sha)) {
+			fprintf(stderr, "%s: does not match the patch\n",
+				base_fname);
+			ret = 3;
+			goto out_free;
+		}
+		find_parts(old, hdr.old_size, &parts);
+		if (offset < 0)
+			offset = S_ISBLK(st.st_mode) ? parts.base : 0;
+	} else {
+		ret = find_old_image(target, &st, offset, old, &hdr);
+		if (ret < 0) {
+			fprintf(stderr, "%s: %s\n", target, ret == -ENOENT ?
+				"the old image is not there" : strerror(-ret));
+			ret = 3;
+			goto out_free;
+		}
+		offset = ret;
+	}
+
+	ret = apply_ops(ops, hdr.ops_size, old, hdr.old_size, new,
+			hdr.new_size);
+	if (ret || !sha_matches(new, hdr.new_size, hdr.new_sha)) {
+		fprintf(stderr, "%s: corrupted patch\n", patch_fname);
+		ret = 3;
+		goto out_free;
+	}
+
+	find_parts(new, hdr.new_size, &parts);
+	bad = verify_image(new, hdr.new_size, &parts, !quiet);
+	if (bad > 0) {
+		fprintf(stderr, "new image has checksum errors, not writing it\n");
+		ret = 3;
+		goto out_free;
+	}
+	if (dry_run) {
+		ret = 0;
+		goto out_free;
+	}
+
+	/* the blocks holding the headers go last, after everything else */
+	memset(&img, 0, sizeof(img));
+	img.seg[0].offset = offset;
+	img.seg[0].size = hdr.new_size;
+	img.seg[0].data = new;
+	img.nr_segs = 1;
+	img.size = offset + hdr.new_size;
+	img.boot0_offset = parts.boot0 >= 0 ? offset + parts.boot0 : -1;
+	img.fw_offset = offset + (parts.fw >= 0 ? parts.fw : 0);
+
+	b0_dev_init_options(&dev_opts);
+	dev_opts.delta = true;
+	fd = b0_open_device(target);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", target, strerror(-fd));
+		ret = 2;
+		goto out_free;
+	}
+	ret = b0_write_device(&img, fd, &dev_opts, &stats);
+	/*
+	 * Whole blocks got written, a file ending within the image (or
+	 * holding just the old one) needs to end with the new one.
+	 */
+	end = offset + hdr.new_size;
+	if (!ret && S_ISREG(st.st_mode) &&
+	    ftruncate(fd, st.st_size < end ||
+			  st.st_size == offset + (off_t)hdr.old_size ?
+			  end : st.st_size))
+		ret = -errno;
+	if (close(fd) && !ret)
+		ret = -errno;
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", target, strerror(-ret));
+		ret = 2;
+		goto out_free;
+	}
+	if (!quiet)
+		fprintf(stderr, "%s: wrote %ju Bytes, %ju Bytes unchanged\n",
+			target, (uintmax_t)stats.bytes,
+			(uintmax_t)stats.skipped);
+
+	/* check what actually ended up on the target */
+	memset(new, 0, hdr.new_size);
+	ret = read_back(target, offset, new, hdr.new_size);
+	if (ret || !sha_matches(new, hdr.new_size, hdr.new_sha) ||
+	    verify_image(new, hdr.new_size, &parts, false) > 0) {
+		fprintf(stderr, "%s: verification failed after writing\n",
+			target);
+		ret = 4;
+		goto out_free;
+	}
+	if (!quiet)
+		fprintf(stderr, "%s: verified\n", target);
+	ret = 0;
+
+out_free:
+	free(ops);
+	free(old);
+	free(new);
+
+	return ret;
+}
+
+static int cmd_verify(const char *fname)
+{
+	struct image_parts parts;
+	uint8_t *buf;
+	size_t size;
+	int ret;
+
+	ret = read_image(fname, &buf, &size);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", fname, strerror(-ret));
+		return 2;
+	}
+	find_parts(buf, size, &parts);
+	ret = verify_image(buf, size, &parts, true);
+	free(buf);
+	if (ret == -ENOENT)
+		fprintf(stderr, "%s: no boot0 or firmware header found\n",
+			fname);
+
+	return ret ? 3 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option lopts[] = {
+		{ "help",	0, 0, 'h' },
+		{ "quiet",	0, 0, 'q' },
+		{ "offset",	1, 0, 's' },
+		{ "base",	1, 0, 'b' },
+		{ "dry-run",	0, 0, 'n' },
+		{ NULL, 0, 0, 0 },
+	};
+	const char *cmd, *base_fname = NULL;
+	bool quiet = false, dry_run = false;
+	off_t offset = -1;
+	int ch;
+
+	while ((ch = getopt_long(argc, argv, "hqs:b:n", lopts, NULL)) != -1) {
+		switch(ch) {
+		case '?':
+			usage(argv[0], stderr);
+			return 1;
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+		case 'q':
+			quiet = true;
+			break;
+		case 's':
+			offset = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			base_fname = optarg;
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		}
+	}
+
+	if (optind == argc) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+	cmd = argv[optind++];
+
+	if (!strcmp(cmd, "diff") && argc - optind == 3)
+		return cmd_diff(argv[optind], argv[optind + 1],
+				argv[optind + 2], quiet);
+	if (!strcmp(cmd, "apply") && argc - optind == 2)
+		return cmd_apply(argv[optind], argv[optind + 1], base_fname,
+				 offset, dry_run, quiet);
+	if (!strcmp(cmd, "verify") && argc - optind == 1)
+		return cmd_verify(argv[optind]);
+
+	usage(argv[0], stderr);
+	return 1;
+}
@@ -0,0 +1,936 @@
+/*
+ * b0dev: write assembled boot0 images to block devices
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+
+#include "b0dev.h"
+
+#define DELTA_BLOCK_SIZE	4096
+
+enum zero_method {
+	ZERO_WRITE,			/* explicit zeroes */
+	ZERO_OUT,			/* BLKZEROOUT, offloaded to the device */
+	ZERO_DISCARD,			/* BLKDISCARD, read back */
+	ZERO_PUNCH,			/* a hole in a regular file */
+};
+
+static const char *zero_names[] = {
+	[ZERO_OUT]	= "BLKZEROOUT",
+	[ZERO_DISCARD]	= "BLKDISCARD",
+	[ZERO_PUNCH]	= "hole punching",
+};
+
+struct dev_range {
+	off_t offset;
+	off_t len;
+};
+
+struct dev_req {
+	off_t offset;
+	struct iovec iov;
+	uint64_t submit_ns;
+};
+
+struct dev_write {
+	int fd;
+	struct dev_req *reqs;
+	int nr_reqs;
+	int nr_held;			/* at the end of reqs, written last */
+	void **bounces;
+	int nr_bounces;
+	void *zeroes;
+	enum zero_method zero;
+	size_t zero_gran;
+	struct dev_range zero_ranges[B0_MAX_SEGMENTS];
+	int nr_zero_ranges;
+	struct b0_dev_stats *stats;
+	uint64_t lat_sum_ns;
+};
+
+struct uring {
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_size, cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+void b0_dev_init_options(struct b0_dev_options *opts)
+{
+	opts->backend = B0_DEV_AUTO;
+	opts->queue_depth = B0_DEV_QUEUE_DEPTH;
+	opts->chunk_size = B0_DEV_CHUNK_SIZE;
+	opts->delta = false;
+	opts->discard = false;
+}
+
+int b0_open_device(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDWR | O_DIRECT);
+	/* some file systems don't do O_DIRECT */
+	if (fd < 0 && errno == EINVAL)
+		fd = open(path, O_RDWR);
+
+	return fd < 0 ? -errno : fd;
+}
+
+static void account_write(struct dev_write *dw, uint64_t start, size_t bytes)
+{
+	struct b0_dev_stats *stats = dw->stats;
+	uint64_t lat = now_ns() - start;
+
+	if (!stats->nr_writes || lat < stats->lat_min_ns)
+		stats->lat_min_ns = lat;
+	if (lat > stats->lat_max_ns)
+		stats->lat_max_ns = lat;
+	dw->lat_sum_ns += lat;
+	stats->nr_writes++;
+	stats->bytes += bytes;
+}
+
+/* O_DIRECT needs offsets, lengths and buffers aligned to the block size */
+static size_t get_block_size(int fd, bool direct)
+{
+	struct stat st;
+	int bs;
+
+	if (!direct)
+		return 1;
+
+	if (!fstat(fd, &st) && S_ISBLK(st.st_mode) &&
+	    !ioctl(fd, BLKSSZGET, &bs) && bs > 0)
+		return bs;
+
+	return B0_BUF_ALIGN;
+}
+
+static ssize_t read_full(int fd, void *buf, size_t len, off_t offset)
+{
+	size_t pos = 0;
+	ssize_t ret;
+
+	while (pos < len) {
+		ret = pread(fd, buf + pos, len - pos, offset + pos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			break;
+		pos += ret;
+	}
+
+	return pos;
+}
+
+/*
+ * Prepare a buffer for a block aligned range which is not fully covered by
+ * a single segment: read the current content back, then put all parts of
+ * the image falling into that range on top.
+ */
+static void *bounce_chunk(const struct b0_image *img, int fd, off_t start,
+			  size_t len, int *err)
+{
+	const struct b0_segment *seg;
+	off_t s, e, covered = 0;
+	ssize_t ret;
+	void *buf;
+	int i;
+
+	if (posix_memalign(&buf, B0_BUF_ALIGN, ALIGN(len, B0_BUF_ALIGN))) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < img->nr_segs; i++) {
+		seg = &img->seg[i];
+		s = seg->offset > start ? seg->offset : start;
+		e = seg->offset + (off_t)seg->size;
+		if (e > start + (off_t)len)
+			e = start + len;
+		if (e > s)
+			covered += e - s;
+	}
+
+	if (covered < (off_t)len) {
+		ret = read_full(fd, buf, len, start);
+		if (ret < 0) {
+			*err = ret;
+			free(buf);
+			return NULL;
+		}
+		/* beyond the end of a file */
+		memset(buf + ret, 0, len - ret);
+	}
+
+	for (i = 0; i < img->nr_segs; i++) {
+		seg = &img->seg[i];
+		s = seg->offset > start ? seg->offset : start;
+		e = seg->offset + (off_t)seg->size;
+		if (e > start + (off_t)len)
+			e = start + len;
+		if (e <= s)
+			continue;
+		if (seg->data)
+			memcpy(buf + (s - start), seg->data + (s - seg->offset),
+			       e - s);
+		else
+			memset(buf + (s - start), 0, e - s);
+	}
+
+	return buf;
+}
+
+/* A queue attribute of a block device, or of the disk a partition is on. */
+static uint64_t queue_attr(dev_t dev, const char *name)
+{
+	char path[96], buf[32];
+	ssize_t len;
+	int fd, i;
+
+	for (i = 0; i < 2; i++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%squeue/%s",
+			 major(dev), minor(dev), i ? "../" : "", name);
+		fd = open(path, O_RDONLY);
+		if (fd < 0)
+			continue;
+		len = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (len <= 0)
+			return 0;
+		buf[len] = 0;
+		return strtoull(buf, NULL, 10);
+	}
+
+	return 0;
+}
+
+/*
+ * How the target can zero a range without us writing it, and the
+ * granularity it does that in. Erase blocks are only freed as a whole, so
+ * for block devices that is the discard granularity.
+ */
+static enum zero_method get_zero_method(int fd, size_t bs, size_t *gran)
+{
+	struct stat st;
+	uint64_t g;
+
+	*gran = bs < 512 ? 512 : bs;
+	if (fstat(fd, &st))
+		return ZERO_WRITE;
+
+	if (S_ISREG(st.st_mode)) {
+		if ((size_t)st.st_blksize > *gran)
+			*gran = ALIGN((size_t)st.st_blksize, *gran);
+		return ZERO_PUNCH;
+	}
+	if (!S_ISBLK(st.st_mode))
+		return ZERO_WRITE;
+
+	g = queue_attr(st.st_rdev, "discard_granularity");
+	if (g > *gran)
+		*gran = ALIGN(g, *gran);
+	if (queue_attr(st.st_rdev, "write_zeroes_max_bytes"))
+		return ZERO_OUT;
+	if (queue_attr(st.st_rdev, "discard_max_bytes"))
+		return ZERO_DISCARD;
+
+	return ZERO_WRITE;
+}
+
+/* Which segment holds all of [start, end), if any? */
+static const struct b0_segment *covering_segment(const struct b0_image *img,
+						 off_t start, off_t end)
+{
+	int i;
+
+	for (i = 0; i < img->nr_segs; i++)
+		if (img->seg[i].offset <= start &&
+		    img->seg[i].offset + (off_t)img->seg[i].size >= end)
+			return &img->seg[i];
+
+	return NULL;
+}
+
+/* Add [s, e) rounded out to blocks, merging it with the previous extent. */
+static void add_extent(off_t *ext_start, off_t *ext_end, int *nr, off_t s,
+		       off_t e, size_t bs)
+{
+	if (e <= s)
+		return;
+
+	s = s / bs * bs;
+	e = ALIGN(e, (off_t)bs);
+	if (*nr && s <= ext_end[*nr - 1]) {
+		if (e > ext_end[*nr - 1])
+			ext_end[*nr - 1] = e;
+		return;
+	}
+	ext_start[*nr] = s;
+	ext_end[(*nr)++] = e;
+}
+
+/*
+ * Split the image into block aligned write requests of at most chunk bytes.
+ * Segments sharing a block get merged into one extent, so no block is ever
+ * written twice. Padding the device can zero by itself becomes a zero
+ * range instead, leaving just its unaligned fringes to be written.
+ */
+static int build_requests(struct dev_write *dw, const struct b0_image *img,
+			  size_t bs, size_t chunk)
+{
+	off_t ext_start[2 * B0_MAX_SEGMENTS], ext_end[2 * B0_MAX_SEGMENTS];
+	const struct b0_segment *seg;
+	struct dev_range *range;
+	struct dev_req *req;
+	int i, nr_ext = 0, nr = 0, ret = 0;
+	off_t s, e, c, ce, zs, ze;
+
+	for (i = 0; i < img->nr_segs; i++) {
+		seg = &img->seg[i];
+		s = seg->offset;
+		e = seg->offset + (off_t)seg->size;
+		if (seg->data || dw->zero == ZERO_WRITE) {
+			add_extent(ext_start, ext_end, &nr_ext, s, e, bs);
+			continue;
+		}
+
+		zs = ALIGN(s, (off_t)dw->zero_gran);
+		ze = e / (off_t)dw->zero_gran * (off_t)dw->zero_gran;
+		if (ze > zs) {
+			range = &dw->zero_ranges[dw->nr_zero_ranges++];
+			range->offset = zs;
+			range->len = ze - zs;
+			add_extent(ext_start, ext_end, &nr_ext, s, zs, bs);
+			add_extent(ext_start, ext_end, &nr_ext, ze, e, bs);
+			continue;
+		}
+		add_extent(ext_start, ext_end, &nr_ext, s, e, bs);
+	}
+
+	for (i = 0; i < nr_ext; i++)
+		nr += (ext_end[i] - ext_start[i] + chunk - 1) / chunk;
+
+	dw->reqs = calloc(nr, sizeof(*dw->reqs));
+	dw->bounces = calloc(nr, sizeof(*dw->bounces));
+	if (!dw->reqs || !dw->bounces)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_ext; i++) {
+		for (c = ext_start[i]; c < ext_end[i]; c += chunk) {
+			ce = c + chunk < ext_end[i] ? c + chunk : ext_end[i];
+			req = &dw->reqs[dw->nr_reqs++];
+			req->offset = c;
+			req->iov.iov_len = ce - c;
+
+			seg = covering_segment(img, c, ce);
+			if (seg && !seg->data) {
+				req->iov.iov_base = dw->zeroes;
+			} else if (seg && (c - seg->offset) % bs == 0) {
+				req->iov.iov_base = seg->data + (c - seg->offset);
+			} else {
+				req->iov.iov_base = bounce_chunk(img, dw->fd, c,
+								 ce - c, &ret);
+				if (!req->iov.iov_base)
+					return ret;
+				dw->bounces[dw->nr_bounces++] =
+					req->iov.iov_base;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The headers of boot0 and the firmware hold the checksums, writing them
+ * after everything else means an interrupted update fails to verify.
+ */
+static bool is_header_block(const struct b0_image *img, off_t start, off_t end)
+{
+	if (img->boot0_offset >= 0 && start < img->boot0_offset + HEADER_SIZE &&
+	    end > img->boot0_offset)
+		return true;
+
+	return start < img->fw_offset + HEADER_SIZE && end > img->fw_offset;
+}
+
+/*
+ * Compare the requests against what is on the device already, and replace
+ * them with requests covering just the blocks that differ. Blocks holding
+ * a header are moved to the end of the list.
+ */
+static int delta_requests(struct dev_write *dw, const struct b0_image *img,
+			  size_t chunk)
+{
+	struct dev_req *reqs, *held, *req;
+	int i, nr = 0, nr_held = 0, nr_max = 0, ret = 0;
+	off_t p, e, end, run_start = -1;
+	bool run_held = false, differs, hdr;
+	ssize_t len;
+	void *buf;
+
+	for (i = 0; i < dw->nr_reqs; i++)
+		nr_max += dw->reqs[i].iov.iov_len / DELTA_BLOCK_SIZE + 2;
+
+	if (posix_memalign(&buf, B0_BUF_ALIGN, ALIGN(chunk, B0_BUF_ALIGN)))
+		return -ENOMEM;
+	reqs = calloc(nr_max, sizeof(*reqs));
+	held = calloc(nr_max, sizeof(*held));
+	if (!reqs || !held) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	for (i = 0; i < dw->nr_reqs; i++) {
+		req = &dw->reqs[i];
+		end = req->offset + req->iov.iov_len;
+
+		len = read_full(dw->fd, buf, req->iov.iov_len, req->offset);
+		if (len < 0) {
+			ret = len;
+			goto out_free;
+		}
+
+		for (p = req->offset; p < end; p = e) {
+			e = (p / DELTA_BLOCK_SIZE + 1) * DELTA_BLOCK_SIZE;
+			if (e > end)
+				e = end;
+			differs = p - req->offset + (e - p) > len ||
+				  memcmp(buf + (p - req->offset),
+					 req->iov.iov_base + (p - req->offset),
+					 e - p);
+			hdr = is_header_block(img, p, e);
+
+			if (run_start >= 0 && (!differs || hdr != run_held)) {
+				/* close the current run */
+				struct dev_req *r = run_held ? &held[nr_held++] :
+							       &reqs[nr++];
+
+				r->offset = run_start;
+				r->iov.iov_base = req->iov.iov_base +
+						  (run_start - req->offset);
+				r->iov.iov_len = p - run_start;
+				run_start = -1;
+			}
+			if (!differs) {
+				dw->stats->skipped += e - p;
+				continue;
+			}
+			if (run_start < 0) {
+				run_start = p;
+				run_held = hdr;
+			}
+		}
+
+		if (run_start >= 0) {
+			struct dev_req *r = run_held ? &held[nr_held++] :
+						       &reqs[nr++];
+
+			r->offset = run_start;
+			r->iov.iov_base = req->iov.iov_base +
+					  (run_start - req->offset);
+			r->iov.iov_len = end - run_start;
+			run_start = -1;
+		}
+	}
+
+	memcpy(reqs + nr, held, nr_held * sizeof(*held));
+	free(dw->reqs);
+	dw->reqs = reqs;
+	dw->nr_reqs = nr + nr_held;
+	dw->nr_held = nr_held;
+	reqs = NULL;
+
+out_free:
+	free(reqs);
+	free(held);
+	free(buf);
+
+	return ret;
+}
+
+/* Does [offset, offset + len) read back as zeroes? 1 if so, 0 if not. */
+static int range_is_zero(struct dev_write *dw, off_t offset, off_t len,
+			 void *buf, size_t chunk)
+{
+	ssize_t n;
+
+	while (len) {
+		n = read_full(dw->fd, buf, len < (off_t)chunk ? len : chunk,
+			      offset);
+		if (n < 0)
+			return n;
+		/* beyond the end of a file */
+		if (!n)
+			return 1;
+		if (memcmp(buf, dw->zeroes, n))
+			return 0;
+		offset += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static int write_zeroes(struct dev_write *dw, off_t offset, off_t len,
+			size_t chunk)
+{
+	uint64_t start;
+	ssize_t ret;
+
+	while (len) {
+		start = now_ns();
+		ret = pwrite(dw->fd, dw->zeroes, len < (off_t)chunk ? len : chunk,
+			     offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret < 0 ? -errno : -EIO;
+		account_write(dw, start, ret);
+		offset += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Let the device zero a range, returns 1 if it would not. Discarded blocks
+ * read back as whatever the card's erased state is, so those get checked.
+ */
+static int zero_range(struct dev_write *dw, const struct dev_range *range,
+		      void *buf, size_t chunk)
+{
+	uint64_t r[2] = { range->offset, range->len };
+	off_t end = range->offset + range->len;
+	struct stat st;
+	int ret;
+
+	switch (dw->zero) {
+	case ZERO_PUNCH:
+		/* the padding may be beyond the end of the file */
+		if (fstat(dw->fd, &st))
+			return -errno;
+		if (st.st_size < end && ftruncate(dw->fd, end))
+			return -errno;
+		if (!fallocate(dw->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			       range->offset, range->len))
+			return 0;
+		break;
+	case ZERO_OUT:
+		if (!ioctl(dw->fd, BLKZEROOUT, r))
+			return 0;
+		break;
+	case ZERO_DISCARD:
+		if (ioctl(dw->fd, BLKDISCARD, r))
+			break;
+		ret = range_is_zero(dw, range->offset, range->len, buf, chunk);
+		if (ret)
+			return ret < 0 ? ret : 0;
+		break;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+/*
+ * Zero the aligned parts of the padding. Whatever the device refuses to
+ * zero gets written after all, so real I/O errors show up there. In delta
+ * mode ranges which are zero already are left alone.
+ */
+static int zero_ranges(struct dev_write *dw, size_t chunk, bool delta)
+{
+	const struct dev_range *range;
+	int i, ret = 0;
+	void *buf;
+
+	if (posix_memalign(&buf, B0_BUF_ALIGN, ALIGN(chunk, B0_BUF_ALIGN)))
+		return -ENOMEM;
+
+	for (i = 0; i < dw->nr_zero_ranges; i++) {
+		range = &dw->zero_ranges[i];
+		if (delta) {
+			ret = range_is_zero(dw, range->offset, range->len,
+					    buf, chunk);
+			if (ret < 0)
+				break;
+			if (ret) {
+				dw->stats->skipped += range->len;
+				ret = 0;
+				continue;
+			}
+		}
+
+		ret = zero_range(dw, range, buf, chunk);
+		if (ret > 0)
+			ret = write_zeroes(dw, range->offset, range->len,
+					   chunk);
+		else if (!ret)
+			dw->stats->zeroed += range->len;
+		if (ret)
+			break;
+	}
+
+	free(buf);
+	return ret;
+}
+
+static int write_pwritev(struct dev_write *dw, struct dev_req *reqs, int nr,
+			 unsigned int qd)
+{
+	struct iovec *iov, *iovp;
+	int i = 0, n, cnt, ret = 0;
+	uint64_t start;
+	size_t total;
+	ssize_t done;
+	off_t offset;
+
+	if (qd > IOV_MAX)
+		qd = IOV_MAX;
+	iov = malloc(qd * sizeof(*iov));
+	if (!iov)
+		return -ENOMEM;
+
+	/* the queue depth limits the number of chunks per call */
+	while (i < nr && !ret) {
+		total = reqs[i].iov.iov_len;
+		iov[0] = reqs[i].iov;
+		for (n = 1; i + n < nr && n < (int)qd; n++) {
+			if (reqs[i + n].offset != reqs[i].offset + (off_t)total)
+				break;
+			iov[n] = reqs[i + n].iov;
+			total += iov[n].iov_len;
+		}
+
+		offset = reqs[i].offset;
+		iovp = iov;
+		cnt = n;
+		while (total) {
+			start = now_ns();
+			done = pwritev(dw->fd, iovp, cnt, offset);
+			if (done < 0 && errno == EINTR)
+				continue;
+			if (done <= 0) {
+				ret = done ? -errno : -EIO;
+				break;
+			}
+			account_write(dw, start, done);
+
+			offset += done;
+			total -= done;
+			while (cnt && (size_t)done >= iovp->iov_len) {
+				done -= iovp->iov_len;
+				iovp++;
+				cnt--;
+			}
+			if (cnt) {
+				iovp->iov_base += done;
+				iovp->iov_len -= done;
+			}
+		}
+		i += n;
+	}
+
+	free(iov);
+
+	return ret;
+}
+
+static void uring_exit(struct uring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_size);
+	if (ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_size);
+	close(ring->fd);
+}
+
+static int uring_setup(struct uring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	void *ptr;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return -errno;
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_size = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_size > ring->sq_size)
+			ring->sq_size = ring->cq_size;
+		ring->cq_size = ring->sq_size;
+	}
+
+	ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto out_err;
+	ring->sq_ring = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto out_err;
+		ring->cq_ring = ptr;
+	}
+
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto out_err;
+	ring->sqes = ptr;
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+
+	return 0;
+
+out_err:
+	ring->fd = -errno;
+	uring_exit(ring);
+
+	return ring->fd;
+}
+
+/*
+ * Keep up to qd writes in flight. Short writes get resubmitted for the
+ * remainder, the first error stops new submissions.
+ */
+static int write_uring(struct dev_write *dw, struct uring *ring,
+		       struct dev_req *reqs, int nr, unsigned int qd)
+{
+	struct timespec reap_wait = { 0, 1000000 };
+	unsigned int inflight = 0, to_submit, head, tail, idx;
+	int next = 0, nr_requeue = 0, ret = 0;
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct dev_req *req;
+	int *requeue;
+
+	requeue = malloc(qd * sizeof(*requeue));
+	if (!requeue)
+		return -ENOMEM;
+
+	while (inflight || (!ret && (next < nr || nr_requeue))) {
+		to_submit = 0;
+		while (!ret && inflight < qd &&
+		       (nr_requeue || next < nr)) {
+			idx = nr_requeue ? requeue[--nr_requeue] : next++;
+			req = &reqs[idx];
+
+			tail = *ring->sq_tail;
+			sqe = &ring->sqes[tail & *ring->sq_mask];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_WRITEV;
+			sqe->fd = dw->fd;
+			sqe->addr = (uintptr_t)&req->iov;
+			sqe->len = 1;
+			sqe->off = req->offset;
+			sqe->user_data = idx;
+			ring->sq_array[tail & *ring->sq_mask] =
+				tail & *ring->sq_mask;
+			__atomic_store_n(ring->sq_tail, tail + 1,
+					 __ATOMIC_RELEASE);
+
+			req->submit_ns = now_ns();
+			to_submit++;
+			inflight++;
+		}
+
+		if (syscall(__NR_io_uring_enter, ring->fd, to_submit, 1,
+			    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+		    errno != EINTR) {
+			/*
+			 * Stop submitting, but the writes the kernel took
+			 * still reference reqs[] and the image, so they have
+			 * to be reaped before returning. Entries it did not
+			 * take are withdrawn, they are not in flight.
+			 */
+			if (!ret)
+				ret = -errno;
+			else if (inflight)
+				nanosleep(&reap_wait, NULL);
+			head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+			tail = *ring->sq_tail;
+			inflight -= tail - head;
+			__atomic_store_n(ring->sq_tail, head, __ATOMIC_RELEASE);
+		}
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			req = &reqs[cqe->user_data];
+			inflight--;
+
+			if (cqe->res <= 0) {
+				if (!ret)
+					ret = cqe->res ? cqe->res : -EIO;
+				continue;
+			}
+			account_write(dw, req->submit_ns, cqe->res);
+
+			if ((size_t)cqe->res < req->iov.iov_len) {
+				req->offset += cqe->res;
+				req->iov.iov_base += cqe->res;
+				req->iov.iov_len -= cqe->res;
+				requeue[nr_requeue++] = cqe->user_data;
+			}
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	free(requeue);
+
+	return ret;
+}
+
+/* Write a batch of requests and flush them to the device. */
+static int write_round(struct dev_write *dw, struct uring *ring,
+		       struct dev_req *reqs, int nr, unsigned int qd)
+{
+	uint64_t start;
+	int ret;
+
+	if (ring)
+		ret = write_uring(dw, ring, reqs, nr, qd);
+	else
+		ret = write_pwritev(dw, reqs, nr, qd);
+	if (ret)
+		return ret;
+
+	start = now_ns();
+	if (fsync(dw->fd))
+		ret = -errno;
+	dw->stats->flush_ns += now_ns() - start;
+
+	return ret;
+}
+
+int b0_write_device(const struct b0_image *img, int fd,
+		    const struct b0_dev_options *opts,
+		    struct b0_dev_stats *stats)
+{
+	struct dev_write dw = { .fd = fd, .stats = stats };
+	unsigned int qd = opts->queue_depth ? opts->queue_depth :
+					      B0_DEV_QUEUE_DEPTH;
+	uint64_t start = now_ns();
+	struct uring ring;
+	bool uring = false;
+	size_t bs, chunk;
+	int i, nr, flags, ret;
+
+	memset(stats, 0, sizeof(*stats));
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return -errno;
+	stats->direct = flags & O_DIRECT;
+	bs = get_block_size(fd, stats->direct);
+	chunk = ALIGN(opts->chunk_size ? opts->chunk_size : B0_DEV_CHUNK_SIZE,
+		      bs);
+
+	if (posix_memalign(&dw.zeroes, B0_BUF_ALIGN, ALIGN(chunk, B0_BUF_ALIGN)))
+		return -ENOMEM;
+	memset(dw.zeroes, 0, ALIGN(chunk, B0_BUF_ALIGN));
+
+	if (opts->discard) {
+		dw.zero = get_zero_method(fd, bs, &dw.zero_gran);
+		stats->zero_method = zero_names[dw.zero];
+	}
+
+	ret = build_requests(&dw, img, bs, chunk);
+	if (!ret && opts->delta)
+		ret = delta_requests(&dw, img, chunk);
+	if (!ret && dw.nr_zero_ranges)
+		ret = zero_ranges(&dw, chunk, opts->delta);
+	if (ret)
+		goto out_free;
+
+	if (opts->backend != B0_DEV_PWRITEV) {
+		ret = uring_setup(&ring, qd);
+		if (ret && opts->backend == B0_DEV_URING)
+			goto out_free;
+		uring = !ret;
+	}
+	stats->backend = uring ? "io_uring" : "pwritev";
+
+	/* the held back headers go last, in a second round */
+	nr = dw.nr_reqs - dw.nr_held;
+	ret = write_round(&dw, uring ? &ring : NULL, dw.reqs, nr, qd);
+	if (!ret && dw.nr_held)
+		ret = write_round(&dw, uring ? &ring : NULL, dw.reqs + nr,
+				  dw.nr_held, qd);
+	if (uring)
+		uring_exit(&ring);
+
+out_free:
+	if (stats->nr_writes)
+		stats->lat_avg_ns = dw.lat_sum_ns / stats->nr_writes;
+	stats->total_ns = now_ns() - start;
+
+	for (i = 0; i < dw.nr_bounces; i++)
+		free(dw.bounces[i]);
+	free(dw.bounces);
+	free(dw.reqs);
+	free(dw.zeroes);
+
+	return ret;
+}
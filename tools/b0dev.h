@@ -0,0 +1,76 @@
+/*
+ * b0dev: write assembled boot0 images to block devices
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __B0DEV_H__
+#define __B0DEV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libboot0img.h"
+
+enum b0_dev_backend {
+	B0_DEV_AUTO,			/* io_uring, pwritev if unavailable */
+	B0_DEV_URING,
+	B0_DEV_PWRITEV,
+};
+
+#define B0_DEV_QUEUE_DEPTH	8
+#define B0_DEV_CHUNK_SIZE	(128 * 1024)
+
+struct b0_dev_options {
+	enum b0_dev_backend backend;
+	unsigned int queue_depth;	/* writes in flight */
+	size_t chunk_size;		/* maximum size of a single write */
+	bool delta;			/* skip blocks already on the device */
+	bool discard;			/* let the device zero the padding */
+};
+
+struct b0_dev_stats {
+	const char *backend;		/* the one actually used */
+	bool direct;			/* bypassing the page cache */
+	uint64_t bytes;			/* including partial blocks */
+	uint64_t skipped;		/* unchanged, with delta */
+	const char *zero_method;	/* with discard, NULL if unsupported */
+	uint64_t zeroed;		/* by the device or a punched hole */
+	unsigned int nr_writes;
+	uint64_t lat_min_ns;		/* per write request */
+	uint64_t lat_avg_ns;
+	uint64_t lat_max_ns;
+	uint64_t flush_ns;
+	uint64_t total_ns;		/* including the flush */
+};
+
+/*
+ * The device gets opened with O_DIRECT if possible, and written to from
+ * page aligned buffers. Partial blocks at the edges of the image segments
+ * are read back from the device first, so everything outside the segments
+ * stays untouched. The data is flushed to the device once, at the end.
+ * In delta mode only the blocks differing from the device content are
+ * written, and the blocks holding the boot0 and firmware headers go last,
+ * after a flush, so an interrupted update fails the checksum check.
+ * With discard, the parts of the padding aligned to the discard granularity
+ * are zeroed by the device (BLKZEROOUT, or BLKDISCARD if that reads back
+ * as zeroes), or become a hole in a regular file. Just the unaligned fringes
+ * get written.
+ */
+void b0_dev_init_options(struct b0_dev_options *opts);
+int b0_open_device(const char *path);
+int b0_write_device(const struct b0_image *img, int fd,
+		    const struct b0_dev_options *opts,
+		    struct b0_dev_stats *stats);
+
+#endif
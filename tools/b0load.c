@@ -0,0 +1,512 @@
+/*
+ * b0load: time the reads boot0 does from a boot medium, for each layout
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE			/* O_DIRECT */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "libboot0img.h"
+
+#define SECTOR_SIZE	512
+#define MAX_LAYOUTS	8
+#define MAX_SIZES	16
+#define MAX_RUNS	100
+#define MAX_FW_LENGTH	(16 * 1024 * 1024)
+#define DEFAULT_LENGTH	(1024 * 1024)
+
+enum load_phase {
+	PHASE_BOOT0,			/* the boot ROM loading boot0 */
+	PHASE_HEADER,			/* boot0 looking at the firmware header */
+	PHASE_FW,			/* ... and loading HEADER_LENGTH bytes */
+	NR_PHASES
+};
+
+struct layout {
+	char name[16];
+	off_t fw_offset;		/* on the disk */
+	bool usable;			/* within the target */
+};
+
+struct target {
+	int fd;
+	bool block_dev;
+	bool direct;			/* O_DIRECT, otherwise fadvise */
+	off_t disk_offset;		/* disk position of the first byte */
+	off_t size;
+};
+
+static const size_t default_sizes[] = {
+	512, 4096, 16384, 65536, 262144,
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t median(uint64_t *samples, int n)
+{
+	qsort(samples, n, sizeof(samples[0]), cmp_u64);
+
+	return n % 2 ? samples[n / 2] :
+		(samples[n / 2 - 1] + samples[n / 2]) / 2;
+}
+
+/* Parse a size with an optional K or M suffix, 0 on errors. */
+static size_t parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoul(str, &end, 0);
+
+	switch (*end) {
+	case 'k': case 'K':
+		size *= 1024;
+		end++;
+		break;
+	case 'm': case 'M':
+		size *= 1024 * 1024;
+		end++;
+		break;
+	}
+
+	return *end ? 0 : size;
+}
+
+static void format_size(char *buf, size_t len, off_t size)
+{
+	if (size && !(size % (1024 * 1024)))
+		snprintf(buf, len, "%jdM", (intmax_t)size / (1024 * 1024));
+	else if (size && !(size % 1024))
+		snprintf(buf, len, "%jdK", (intmax_t)size / 1024);
+	else
+		snprintf(buf, len, "%jd", (intmax_t)size);
+}
+
+static int open_target(const char *path, struct target *t, off_t start)
+{
+	struct stat st;
+	void *buf;
+	int fd;
+
+	t->fd = open(path, O_RDONLY | O_DIRECT);
+	if (t->fd < 0 && errno == EINVAL)
+		t->fd = open(path, O_RDONLY);
+	if (t->fd < 0)
+		return -errno;
+
+	if (fstat(t->fd, &st))
+		return -errno;
+	t->block_dev = S_ISBLK(st.st_mode);
+	t->size = st.st_size;
+	if (t->block_dev && ioctl(t->fd, BLKGETSIZE64, &t->size))
+		return -errno;
+
+	/* some file systems accept O_DIRECT, but only for whole blocks */
+	t->direct = fcntl(t->fd, F_GETFL) & O_DIRECT;
+	if (posix_memalign(&buf, B0_BUF_ALIGN, SECTOR_SIZE))
+		return -ENOMEM;
+	if (t->direct && pread(t->fd, buf, SECTOR_SIZE, SECTOR_SIZE) < 0) {
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			free(buf);
+			return -errno;
+		}
+		close(t->fd);
+		t->fd = fd;
+		t->direct = false;
+	}
+
+	/* full disk images have boot0 at 8K, firmware images at the start */
+	t->disk_offset = start;
+	if (start >= 0) {
+		free(buf);
+		return 0;
+	}
+	t->disk_offset = 0;
+	if (pread(t->fd, buf, SECTOR_SIZE, BOOT0_OFFSET) == SECTOR_SIZE &&
+	    !memcmp((char *)buf + 4, BOOT0_MAGIC, MAGIC_SIZE)) {
+		free(buf);
+		return 0;
+	}
+	if (pread(t->fd, buf, SECTOR_SIZE, 0) == SECTOR_SIZE &&
+	    !memcmp((char *)buf + 4, BOOT0_MAGIC, MAGIC_SIZE))
+		t->disk_offset = BOOT0_OFFSET;
+	free(buf);
+
+	return 0;
+}
+
+/* Get the firmware length from the first layout with a header in place. */
+static size_t find_fw_length(const struct target *t, struct layout *layouts,
+			     int nr_layouts, int *found)
+{
+	uint32_t header[SECTOR_SIZE / 4] __attribute__((aligned(B0_BUF_ALIGN)));
+	uint32_t length;
+	int i;
+
+	for (i = 0; i < nr_layouts; i++) {
+		if (pread(t->fd, header, sizeof(header),
+			  layouts[i].fw_offset - t->disk_offset) !=
+		    sizeof(header))
+			continue;
+		if (strncmp((char *)&header[HEADER_MAGIC], FW_MAGIC,
+			    MAGIC_SIZE))
+			continue;
+		length = le32toh(header[HEADER_LENGTH]);
+		if (length < HEADER_SIZE || length > MAX_FW_LENGTH)
+			continue;
+		*found = i;
+		return length;
+	}
+
+	return 0;
+}
+
+/* Drop whatever the kernel might have cached of the target. */
+static void drop_cache(const struct target *t)
+{
+	if (t->direct)
+		return;
+	if (t->block_dev)
+		ioctl(t->fd, BLKFLSBUF, 0);	/* needs CAP_SYS_ADMIN */
+	posix_fadvise(t->fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static int read_range(const struct target *t, void *buf, size_t request,
+		      off_t disk_offset, size_t length)
+{
+	off_t pos = disk_offset - t->disk_offset;
+	size_t len;
+	ssize_t ret;
+
+	for (; length; length -= len, pos += len) {
+		len = length < request ? length : request;
+		ret = pread(t->fd, buf, len, pos);
+		if (ret < 0)
+			return -errno;
+		if ((size_t)ret != len)
+			return -ENXIO;
+	}
+
+	return 0;
+}
+
+/*
+ * Replay what happens at boot: the boot ROM loads 32KB of boot0 from 8K,
+ * boot0 reads the firmware header to learn the length, then loads that
+ * many bytes from the start of the header.
+ */
+static int replay_boot(const struct target *t, void *buf, size_t request,
+		       const struct layout *layout, size_t fw_length,
+		       uint64_t *ns)
+{
+	uint64_t start;
+	int ret;
+
+	drop_cache(t);
+
+	start = now_ns();
+	ret = read_range(t, buf, request, BOOT0_OFFSET, BOOT0_SIZE);
+	if (ret)
+		return ret;
+	ns[PHASE_BOOT0] = now_ns() - start;
+
+	start = now_ns();
+	ret = read_range(t, buf, request, layout->fw_offset,
+			 (HEADER_SIZE + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1));
+	if (ret)
+		return ret;
+	ns[PHASE_HEADER] = now_ns() - start;
+
+	start = now_ns();
+	ret = read_range(t, buf, request, layout->fw_offset, fw_length);
+	if (ret)
+		return ret;
+	ns[PHASE_FW] = now_ns() - start;
+
+	return 0;
+}
+
+static void usage(const char *progname, FILE *stream)
+{
+	fprintf(stream, "b0load: time boot0's reads from a boot medium\n"
+		"usage: %s [-h] [-r size,...] [-o offset,...] [-l length] "
+		"[-n runs] [-s start] <device|image>\n", progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-r|--requests: read request sizes to try "
+		"(default: 512,4K,16K,64K,256K)\n"
+		"\t-o|--offsets: firmware positions on the disk to try "
+		"(default: %dK,%dK)\n"
+		"\t-l|--length: firmware length (default: from the header, "
+		"or 1M)\n"
+		"\t-n|--runs: runs per combination, the median is reported "
+		"(default: 5)\n"
+		"\t-s|--start: disk position of the target's first byte "
+		"(default: 8K for\n\t            images starting with boot0, "
+		"0 otherwise)\n\n", UBOOT_OFFSET_KB, BOOT0_END_KB);
+	fprintf(stream, "Each run starts with a cold cache: the target is "
+		"read with O_DIRECT, or its\npage cache gets dropped before. "
+		"Images starting with boot0 are taken to be\nat 8K on the "
+		"disk. Running it against a card's block device gives the "
+		"numbers\nthat matter, the boot ROM and boot0 are somewhat "
+		"slower than Linux though.\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option lopts[] = {
+		{ "help",	0, 0, 'h' },
+		{ "requests",	1, 0, 'r' },
+		{ "offsets",	1, 0, 'o' },
+		{ "length",	1, 0, 'l' },
+		{ "runs",	1, 0, 'n' },
+		{ "start",	1, 0, 's' },
+		{ NULL, 0, 0, 0 },
+	};
+	struct layout layouts[MAX_LAYOUTS] = {
+		{ "stock", UBOOT_OFFSET_KB * 1024ULL },
+		{ "patched", BOOT0_END_KB * 1024ULL },
+	};
+	size_t sizes[MAX_SIZES], fw_length = 0, max_size = 0;
+	int nr_layouts = 2, nr_sizes = 0, runs = 5, found = -1;
+	uint64_t *samples, ns[NR_PHASES], med[NR_PHASES], total;
+	uint64_t best_ns[MAX_LAYOUTS] = { 0 };
+	size_t best_size[MAX_LAYOUTS] = { 0 };
+	char *tok, *saveptr, sbuf[16], obuf[16];
+	const char *length_src = "command line";
+	off_t start = -1;
+	int ch, ret, l, s, r, p, fastest = -1;
+	struct target t;
+	void *buf;
+
+	while ((ch = getopt_long(argc, argv, "hr:o:l:n:s:", lopts, NULL)) != -1) {
+		switch(ch) {
+		case '?':
+			usage(argv[0], stderr);
+			return 1;
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+		case 'r':
+			for (tok = strtok_r(optarg, ",", &saveptr); tok;
+			     tok = strtok_r(NULL, ",", &saveptr)) {
+				if (nr_sizes == MAX_SIZES)
+					break;
+				sizes[nr_sizes] = parse_size(tok);
+				if (!sizes[nr_sizes] ||
+				    sizes[nr_sizes] % SECTOR_SIZE) {
+					fprintf(stderr, "request size %s is "
+						"not a multiple of %d\n", tok,
+						SECTOR_SIZE);
+					return 1;
+				}
+				nr_sizes++;
+			}
+			break;
+		case 'o':
+			nr_layouts = 0;
+			for (tok = strtok_r(optarg, ",", &saveptr); tok;
+			     tok = strtok_r(NULL, ",", &saveptr)) {
+				if (nr_layouts == MAX_LAYOUTS)
+					break;
+				layouts[nr_layouts].fw_offset = parse_size(tok);
+				if (layouts[nr_layouts].fw_offset %
+				    SECTOR_SIZE ||
+				    layouts[nr_layouts].fw_offset <
+				    BOOT0_OFFSET + BOOT0_SIZE) {
+					fprintf(stderr, "firmware offset %s "
+						"is not a sector after "
+						"boot0\n", tok);
+					return 1;
+				}
+				if (layouts[nr_layouts].fw_offset ==
+				    UBOOT_OFFSET_KB * 1024LL)
+					strcpy(layouts[nr_layouts].name,
+					       "stock");
+				else if (layouts[nr_layouts].fw_offset ==
+					 BOOT0_END_KB * 1024LL)
+					strcpy(layouts[nr_layouts].name,
+					       "patched");
+				else
+					format_size(layouts[nr_layouts].name,
+						    sizeof(layouts[0].name),
+						    layouts[nr_layouts].fw_offset);
+				nr_layouts++;
+			}
+			break;
+		case 'l':
+			fw_length = parse_size(optarg);
+			fw_length = (fw_length + SECTOR_SIZE - 1) &
+				    ~(SECTOR_SIZE - 1);
+			break;
+		case 's':
+			start = parse_size(optarg);
+			if (start % SECTOR_SIZE) {
+				fprintf(stderr, "start %s is not a multiple "
+					"of %d\n", optarg, SECTOR_SIZE);
+				return 1;
+			}
+			break;
+		case 'n':
+			runs = strtol(optarg, NULL, 0);
+			if (runs < 1 || runs > MAX_RUNS) {
+				fprintf(stderr, "runs must be 1-%d\n",
+					MAX_RUNS);
+				return 1;
+			}
+			break;
+		}
+	}
+
+	if (optind >= argc || !nr_layouts) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+
+	if (!nr_sizes) {
+		nr_sizes = sizeof(default_sizes) / sizeof(default_sizes[0]);
+		memcpy(sizes, default_sizes, sizeof(default_sizes));
+	}
+	for (s = 0; s < nr_sizes; s++)
+		if (sizes[s] > max_size)
+			max_size = sizes[s];
+
+	ret = open_target(argv[optind], &t, start);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 2;
+	}
+
+	if (!fw_length) {
+		fw_length = find_fw_length(&t, layouts, nr_layouts, &found);
+		length_src = "header";
+		if (!fw_length) {
+			fw_length = DEFAULT_LENGTH;
+			length_src = "default, no firmware header found";
+		}
+	}
+
+	for (l = 0; l < nr_layouts; l++) {
+		layouts[l].usable = layouts[l].fw_offset - t.disk_offset +
+				    (off_t)fw_length <= t.size;
+		if (!layouts[l].usable)
+			fprintf(stderr, "%s: the target ends before the "
+				"firmware at %jdK\n", layouts[l].name,
+				(intmax_t)layouts[l].fw_offset / 1024);
+	}
+
+	samples = calloc((size_t)nr_layouts * nr_sizes * NR_PHASES * runs,
+			 sizeof(*samples));
+	if (!samples || posix_memalign(&buf, B0_BUF_ALIGN, max_size)) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+#define SAMPLE(l, s, p, r) \
+	samples[(((l) * nr_sizes + (s)) * NR_PHASES + (p)) * runs + (r)]
+
+	/* interleave everything, so drift affects all combinations alike */
+	for (r = 0; r < runs; r++) {
+		for (s = 0; s < nr_sizes; s++) {
+			for (l = 0; l < nr_layouts; l++) {
+				if (!layouts[l].usable)
+					continue;
+				ret = replay_boot(&t, buf, sizes[s],
+						  &layouts[l], fw_length, ns);
+				if (ret) {
+					fprintf(stderr, "%s: reading the %s "
+						"layout: %s\n", argv[optind],
+						layouts[l].name,
+						strerror(-ret));
+					layouts[l].usable = false;
+					continue;
+				}
+				for (p = 0; p < NR_PHASES; p++)
+					SAMPLE(l, s, p, r) = ns[p];
+			}
+		}
+	}
+	close(t.fd);
+
+	printf("firmware length: %zu Bytes (%s%s%s)\n", fw_length, length_src,
+	       found >= 0 ? " of the " : "", found >= 0 ? layouts[found].name :
+	       "");
+	printf("cold cache: %s, %d runs, median times\n", t.direct ?
+	       "O_DIRECT" : t.block_dev ? "buffers flushed" : "fadvise",
+	       runs);
+	printf("%-10s %8s %8s %11s %12s %10s %11s %8s\n", "layout", "offset",
+	       "request", "boot0 [ms]", "header [ms]", "fw [ms]",
+	       "total [ms]", "MB/s");
+
+	for (l = 0; l < nr_layouts; l++) {
+		if (!layouts[l].usable)
+			continue;
+		format_size(obuf, sizeof(obuf), layouts[l].fw_offset);
+		for (s = 0; s < nr_sizes; s++) {
+			total = 0;
+			for (p = 0; p < NR_PHASES; p++) {
+				med[p] = median(&SAMPLE(l, s, p, 0), runs);
+				total += med[p];
+			}
+			if (!best_ns[l] || total < best_ns[l]) {
+				best_ns[l] = total;
+				best_size[l] = sizes[s];
+			}
+			format_size(sbuf, sizeof(sbuf), sizes[s]);
+			printf("%-10s %8s %8s %11.3f %12.3f %10.3f %11.3f "
+			       "%8.1f\n", layouts[l].name, obuf, sbuf,
+			       med[PHASE_BOOT0] / 1e6, med[PHASE_HEADER] / 1e6,
+			       med[PHASE_FW] / 1e6, total / 1e6,
+			       (BOOT0_SIZE + fw_length) * 1e3 / total);
+		}
+		if (fastest < 0 || best_ns[l] < best_ns[fastest])
+			fastest = l;
+	}
+	free(samples);
+	free(buf);
+
+	if (fastest < 0)
+		return 3;
+
+	printf("\n");
+	for (l = 0; l < nr_layouts; l++) {
+		if (!layouts[l].usable)
+			continue;
+		format_size(sbuf, sizeof(sbuf), best_size[l]);
+		printf("%-10s %.3f ms with %s requests", layouts[l].name,
+		       best_ns[l] / 1e6, sbuf);
+		if (l == fastest)
+			printf(" (fastest)\n");
+		else
+			printf(", %.1f%% slower\n", (best_ns[l] -
+			       best_ns[fastest]) * 100.0 / best_ns[fastest]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,1232 @@
+/*
+ * b0pack: chunk deduplicated archive of firmware images
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE			/* nftw's FTW_PHYS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <ftw.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <lzma.h>
+
+#include "libboot0img.h"
+#include "b0compress.h"
+#include "sha256.h"
+
+#define PACK_MAGIC	"B0PACK01"
+#define MAX_THREADS	64
+#define DEF_AVG_CHUNK	(8 * 1024)
+#define DEF_FRAME_SIZE	(1024 * 1024)
+#define XZ_MAGIC	"\xfd" "7zXZ"
+
+/*
+ * The archive: this header, the compressed frames, then the index: the
+ * frame table, the chunk table, the file table, the chunk references of
+ * all files and their names. The new chunks of each file are compressed
+ * together in frames of about frame_size (raw LZMA2, chunks on their own
+ * compress too poorly), and every frame can be decompressed independently.
+ * All numbers are little endian.
+ */
+struct pack_header {
+	char magic[8];
+	uint32_t nr_files;
+	uint32_t nr_frames;
+	uint32_t nr_chunks;
+	uint32_t nr_refs;
+	uint32_t names_size;
+	uint32_t avg_chunk;		/* as used for the chunking */
+	uint32_t frame_size;
+	uint32_t dict_size;		/* LZMA2, for the decoder */
+	uint64_t index_offset;
+};
+
+struct pack_frame {
+	uint64_t offset;		/* of the compressed data */
+	uint32_t csize;			/* == size: stored uncompressed */
+	uint32_t size;
+};
+
+struct pack_chunk {
+	uint32_t frame;
+	uint32_t offset;		/* in the decompressed frame */
+	uint32_t size;
+	uint32_t reserved;
+	uint8_t sha[SHA256_DIGEST_SIZE];
+};
+
+#define PACK_XZ		(1U << 0)	/* the input was xz compressed */
+
+struct pack_file {
+	uint64_t size;
+	uint32_t first_ref;
+	uint32_t nr_refs;
+	uint32_t flags;
+	uint32_t name;			/* offset into the names */
+};
+
+struct pack {
+	struct pack_header hdr;
+	struct pack_frame *frames;
+	struct pack_chunk *chunks;
+	struct pack_file *files;
+	uint32_t *refs;
+	char *names;
+	uint32_t max_frames, max_chunks, max_files, max_refs, max_names;
+	/* while creating: digest -> chunk index + 1, open addressing */
+	uint32_t *hash;
+	uint32_t hash_size;
+	int fd;
+};
+
+struct pack_options {
+	unsigned int avg_chunk;
+	unsigned int frame_size;
+	int level;
+	int threads;
+	bool verbose;
+	bool verify;
+	size_t block_size;		/* for export */
+};
+
+static uint64_t gear[256];
+
+/* A fixed table, so the same data always gets cut in the same places. */
+static void init_gear(void)
+{
+	uint64_t x = 0x62306d6b70616b30ULL, z;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		/* splitmix64 */
+		z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+/*
+ * Content defined chunking with a gear hash (FastCDC): a cut is made where
+ * the top bits of the rolling hash are zero. Below the average size more
+ * bits have to match, above it fewer, which keeps the sizes close to the
+ * average. Over runs of zeroes the hash settles on a constant, so the padding
+ * in the images turns into the same few chunks over and over.
+ */
+static size_t next_cut(const uint8_t *buf, size_t len, unsigned int avg)
+{
+	size_t min = avg / 4, max = avg * 8, normal = avg, i;
+	uint64_t mask_s, mask_l, h = 0;
+	int bits = 0;
+
+	while ((1U << (bits + 1)) <= avg)
+		bits++;
+	mask_s = ((1ULL << (bits + 1)) - 1) << (64 - bits - 1);
+	mask_l = ((1ULL << (bits - 1)) - 1) << (64 - bits + 1);
+
+	if (len <= min)
+		return len;
+	if (len < max)
+		max = len;
+	if (normal > max)
+		normal = max;
+
+	for (i = min; i < normal; i++) {
+		h = (h << 1) + gear[buf[i]];
+		if (!(h & mask_s))
+			return i + 1;
+	}
+	for (; i < max; i++) {
+		h = (h << 1) + gear[buf[i]];
+		if (!(h & mask_l))
+			return i + 1;
+	}
+
+	return max;
+}
+
+/* Run fn(ctx, i) for i in [0, nr) on a number of threads. */
+struct parallel {
+	void (*fn)(void *ctx, size_t i);
+	void *ctx;
+	size_t nr;
+	size_t next;
+};
+
+static void *parallel_thread(void *arg)
+{
+	struct parallel *par = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(&par->next, 1, __ATOMIC_RELAXED)) <
+	       par->nr)
+		par->fn(par->ctx, i);
+
+	return NULL;
+}
+
+static void run_parallel(void (*fn)(void *, size_t), void *ctx, size_t nr,
+			 int nr_threads)
+{
+	struct parallel par = { fn, ctx, nr, 0 };
+	pthread_t threads[MAX_THREADS];
+	int i, started = 0;
+
+	if (nr_threads > (int)nr)
+		nr_threads = nr;
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, parallel_thread, &par))
+			break;
+		started++;
+	}
+	/* the calling thread does its share as well */
+	parallel_thread(&par);
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void lzma2_filters(lzma_filter *filters, lzma_options_lzma *lzopts,
+			  int level, uint32_t dict_size)
+{
+	lzma_lzma_preset(lzopts, level < 0 ? LZMA_PRESET_DEFAULT : level);
+	/* no frame is bigger, and it keeps the encoders small */
+	lzopts->dict_size = dict_size;
+	filters[0].id = LZMA_FILTER_LZMA2;
+	filters[0].options = lzopts;
+	filters[1].id = LZMA_VLI_UNKNOWN;
+}
+
+static int grow(void *array, uint32_t *max, uint32_t need, size_t size)
+{
+	uint32_t n = *max ? *max : 64;
+	void *p;
+
+	if (need <= *max)
+		return 0;
+	while (n < need)
+		n *= 2;
+	p = realloc(*(void **)array, (size_t)n * size);
+	if (!p)
+		return -ENOMEM;
+	*(void **)array = p;
+	*max = n;
+
+	return 0;
+}
+
+/* Index of the chunk with this digest, -1 if there is none. */
+static int64_t find_chunk(struct pack *pk, const uint8_t *sha, uint32_t *slot)
+{
+	uint32_t mask = pk->hash_size - 1, i, idx;
+
+	memcpy(&i, sha, sizeof(i));
+	for (i &= mask; (idx = pk->hash[i]); i = (i + 1) & mask)
+		if (!memcmp(pk->chunks[idx - 1].sha, sha, SHA256_DIGEST_SIZE))
+			return idx - 1;
+	*slot = i;
+
+	return -1;
+}
+
+static int hash_grow(struct pack *pk)
+{
+	uint32_t *old = pk->hash, old_size = pk->hash_size, i, slot;
+
+	pk->hash_size = old_size ? old_size * 2 : 1024;
+	pk->hash = calloc(pk->hash_size, sizeof(*pk->hash));
+	if (!pk->hash)
+		return -ENOMEM;
+	for (i = 0; i < old_size; i++) {
+		if (!old[i])
+			continue;
+		find_chunk(pk, pk->chunks[old[i] - 1].sha, &slot);
+		pk->hash[slot] = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+/* The chunks and frames of one input, while it gets added. */
+struct new_chunk {
+	const uint8_t *data;
+	uint32_t size;
+	uint8_t sha[SHA256_DIGEST_SIZE];
+};
+
+struct new_frame {
+	const uint8_t *data;
+	size_t size;
+	uint8_t *cdata;
+	size_t csize;
+	int err;
+};
+
+struct add_job {
+	struct new_chunk *nc;
+	struct new_frame *nf;
+	int level;
+	uint32_t dict_size;
+};
+
+static void hash_chunk(void *ctx, size_t i)
+{
+	struct add_job *job = ctx;
+
+	sha256(job->nc[i].data, job->nc[i].size, job->nc[i].sha);
+}
+
+static void compress_frame(void *ctx, size_t i)
+{
+	struct add_job *job = ctx;
+	struct new_frame *nf = &job->nf[i];
+	lzma_filter filters[2];
+	lzma_options_lzma lzopts;
+	size_t pos = 0;
+
+	lzma2_filters(filters, &lzopts, job->level, job->dict_size);
+	nf->cdata = malloc(nf->size);
+	if (!nf->cdata) {
+		nf->err = -ENOMEM;
+		return;
+	}
+	/* out of space just means it does not compress */
+	if (lzma_raw_buffer_encode(filters, NULL, nf->data, nf->size,
+				   nf->cdata, &pos, nf->size - 1) == LZMA_OK)
+		nf->csize = pos;
+	else
+		nf->csize = nf->size;
+}
+
+/* Read an input, decompressing it if it is an .xz file. */
+static ssize_t load_input(const char *path, uint8_t **buf, uint32_t *flags)
+{
+	struct b0_xz_reader rd;
+	char magic[6] = "";
+	ssize_t ret;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -errno;
+	ret = fread(magic, 1, sizeof(magic), f);
+	fclose(f);
+
+	*flags = 0;
+	if (ret < (ssize_t)sizeof(magic) || memcmp(magic, XZ_MAGIC, 6))
+		return b0_read_file(path, (char **)buf);
+
+	ret = b0_xz_open(&rd, path);
+	if (ret)
+		return ret;
+	*buf = malloc(rd.size ? rd.size : 1);
+	if (!*buf) {
+		b0_xz_close(&rd);
+		return -ENOMEM;
+	}
+	ret = b0_xz_pread(&rd, *buf, rd.size, 0);
+	if (ret >= 0 && (uint64_t)ret < rd.size)
+		ret = -ENODATA;
+	b0_xz_close(&rd);
+	if (ret < 0) {
+		free(*buf);
+		return ret;
+	}
+	*flags = PACK_XZ;
+
+	return ret;
+}
+
+/*
+ * Cut an input into chunks and hash them in parallel. The new ones get
+ * moved to the front of the buffer, in order, which never overwrites a
+ * chunk still to be moved. That part gets split into frames, compressed
+ * in parallel and appended to the archive.
+ */
+static int add_file(struct pack *pk, FILE *out, const char *name,
+		    const struct pack_options *opts)
+{
+	struct add_job job = { .level = opts->level,
+			       .dict_size = pk->hdr.dict_size };
+	struct new_chunk *nc = NULL;
+	struct new_frame *nf = NULL;
+	struct pack_frame *frame = NULL;
+	struct pack_file *pf;
+	struct pack_chunk *pc;
+	size_t nr = 0, max = 0, nr_frames = 0, pos, len, i, name_len;
+	uint32_t flags, slot, first_frame = pk->hdr.nr_frames;
+	uint64_t fresh = 0;
+	int64_t idx;
+	uint8_t *buf;
+	ssize_t size;
+	int ret = 0;
+
+	size = load_input(name, &buf, &flags);
+	if (size < 0)
+		return size;
+
+	for (pos = 0; pos < (size_t)size; pos += len) {
+		if (nr == max) {
+			max = max ? max * 2 : 256;
+			job.nc = realloc(nc, max * sizeof(*nc));
+			if (!job.nc) {
+				ret = -ENOMEM;
+				goto out_free;
+			}
+			nc = job.nc;
+		}
+		len = next_cut(buf + pos, size - pos, opts->avg_chunk);
+		nc[nr].data = buf + pos;
+		nc[nr++].size = len;
+	}
+	job.nc = nc;
+	run_parallel(hash_chunk, &job, nr, opts->threads);
+
+	name_len = strlen(name) + 1;
+	if (grow(&pk->files, &pk->max_files, pk->hdr.nr_files + 1,
+		 sizeof(*pk->files)) ||
+	    grow(&pk->refs, &pk->max_refs, pk->hdr.nr_refs + nr,
+		 sizeof(*pk->refs)) ||
+	    grow(&pk->chunks, &pk->max_chunks, pk->hdr.nr_chunks + nr,
+		 sizeof(*pk->chunks)) ||
+	    grow(&pk->frames, &pk->max_frames, pk->hdr.nr_frames + nr,
+		 sizeof(*pk->frames)) ||
+	    grow(&pk->names, &pk->max_names, pk->hdr.names_size + name_len,
+		 1)) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	nf = calloc(nr + 1, sizeof(*nf));
+	if (!nf) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	pf = &pk->files[pk->hdr.nr_files++];
+	pf->size = size;
+	pf->first_ref = pk->hdr.nr_refs;
+	pf->nr_refs = nr;
+	pf->flags = flags;
+	pf->name = pk->hdr.names_size;
+	memcpy(pk->names + pk->hdr.names_size, name, name_len);
+	pk->hdr.names_size += name_len;
+
+	for (i = 0; i < nr; i++) {
+		if ((pk->hdr.nr_chunks + 1) * 2 > pk->hash_size &&
+		    hash_grow(pk)) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		idx = find_chunk(pk, nc[i].sha, &slot);
+		if (idx < 0) {
+			if (!frame || frame->size >= opts->frame_size) {
+				frame = &pk->frames[pk->hdr.nr_frames++];
+				memset(frame, 0, sizeof(*frame));
+				nf[nr_frames++].data = buf + fresh;
+			}
+			idx = pk->hdr.nr_chunks++;
+			pc = &pk->chunks[idx];
+			memset(pc, 0, sizeof(*pc));
+			pc->frame = pk->hdr.nr_frames - 1;
+			pc->offset = frame->size;
+			pc->size = nc[i].size;
+			memcpy(pc->sha, nc[i].sha, SHA256_DIGEST_SIZE);
+			pk->hash[slot] = idx + 1;
+
+			memmove(buf + fresh, nc[i].data, nc[i].size);
+			fresh += nc[i].size;
+			frame->size += nc[i].size;
+			nf[nr_frames - 1].size += nc[i].size;
+		}
+		pk->refs[pk->hdr.nr_refs++] = idx;
+	}
+
+	job.nf = nf;
+	run_parallel(compress_frame, &job, nr_frames, opts->threads);
+
+	for (i = 0; i < nr_frames; i++) {
+		if (nf[i].err) {
+			ret = nf[i].err;
+			break;
+		}
+		frame = &pk->frames[first_frame + i];
+		frame->offset = ftello(out);
+		frame->csize = nf[i].csize;
+		if (fwrite(nf[i].csize < nf[i].size ? nf[i].cdata : nf[i].data,
+			   nf[i].csize, 1, out) != 1) {
+			ret = -errno;
+			break;
+		}
+	}
+
+	if (!ret && opts->verbose)
+		fprintf(stderr, "%s: %zd Bytes, %zu chunks, %ju Bytes new\n",
+			name, size, nr, (uintmax_t)fresh);
+
+out_free:
+	for (i = 0; nf && i < nr_frames; i++)
+		free(nf[i].cdata);
+	free(nf);
+	free(nc);
+	free(buf);
+
+	return ret;
+}
+
+static void frame_to_le(struct pack_frame *frame)
+{
+	frame->offset = htole64(frame->offset);
+	frame->csize = htole32(frame->csize);
+	frame->size = htole32(frame->size);
+}
+
+static void frame_from_le(struct pack_frame *frame)
+{
+	frame->offset = le64toh(frame->offset);
+	frame->csize = le32toh(frame->csize);
+	frame->size = le32toh(frame->size);
+}
+
+static void chunk_to_le(struct pack_chunk *pc)
+{
+	pc->frame = htole32(pc->frame);
+	pc->offset = htole32(pc->offset);
+	pc->size = htole32(pc->size);
+}
+
+static void chunk_from_le(struct pack_chunk *pc)
+{
+	pc->frame = le32toh(pc->frame);
+	pc->offset = le32toh(pc->offset);
+	pc->size = le32toh(pc->size);
+}
+
+static void file_to_le(struct pack_file *pf)
+{
+	pf->size = htole64(pf->size);
+	pf->first_ref = htole32(pf->first_ref);
+	pf->nr_refs = htole32(pf->nr_refs);
+	pf->flags = htole32(pf->flags);
+	pf->name = htole32(pf->name);
+}
+
+static void file_from_le(struct pack_file *pf)
+{
+	pf->size = le64toh(pf->size);
+	pf->first_ref = le32toh(pf->first_ref);
+	pf->nr_refs = le32toh(pf->nr_refs);
+	pf->flags = le32toh(pf->flags);
+	pf->name = le32toh(pf->name);
+}
+
+static void header_to_le(struct pack_header *hdr)
+{
+	hdr->nr_files = htole32(hdr->nr_files);
+	hdr->nr_frames = htole32(hdr->nr_frames);
+	hdr->nr_chunks = htole32(hdr->nr_chunks);
+	hdr->nr_refs = htole32(hdr->nr_refs);
+	hdr->names_size = htole32(hdr->names_size);
+	hdr->avg_chunk = htole32(hdr->avg_chunk);
+	hdr->frame_size = htole32(hdr->frame_size);
+	hdr->dict_size = htole32(hdr->dict_size);
+	hdr->index_offset = htole64(hdr->index_offset);
+}
+
+static void header_from_le(struct pack_header *hdr)
+{
+	hdr->nr_files = le32toh(hdr->nr_files);
+	hdr->nr_frames = le32toh(hdr->nr_frames);
+	hdr->nr_chunks = le32toh(hdr->nr_chunks);
+	hdr->nr_refs = le32toh(hdr->nr_refs);
+	hdr->names_size = le32toh(hdr->names_size);
+	hdr->avg_chunk = le32toh(hdr->avg_chunk);
+	hdr->frame_size = le32toh(hdr->frame_size);
+	hdr->dict_size = le32toh(hdr->dict_size);
+	hdr->index_offset = le64toh(hdr->index_offset);
+}
+
+static int write_index(struct pack *pk, FILE *out, off_t *total)
+{
+	struct pack_header hdr = pk->hdr;
+	uint32_t i;
+
+	for (i = 0; i < pk->hdr.nr_frames; i++)
+		frame_to_le(&pk->frames[i]);
+	for (i = 0; i < pk->hdr.nr_chunks; i++)
+		chunk_to_le(&pk->chunks[i]);
+	for (i = 0; i < pk->hdr.nr_files; i++)
+		file_to_le(&pk->files[i]);
+	for (i = 0; i < pk->hdr.nr_refs; i++)
+		pk->refs[i] = htole32(pk->refs[i]);
+
+	hdr.index_offset = ftello(out);
+	if ((pk->hdr.nr_frames &&
+	     fwrite(pk->frames, sizeof(*pk->frames), pk->hdr.nr_frames, out) !=
+	     pk->hdr.nr_frames) ||
+	    (pk->hdr.nr_chunks &&
+	     fwrite(pk->chunks, sizeof(*pk->chunks), pk->hdr.nr_chunks, out) !=
+	     pk->hdr.nr_chunks) ||
+	    (pk->hdr.nr_files &&
+	     fwrite(pk->files, sizeof(*pk->files), pk->hdr.nr_files, out) !=
+	     pk->hdr.nr_files) ||
+	    (pk->hdr.nr_refs &&
+	     fwrite(pk->refs, sizeof(*pk->refs), pk->hdr.nr_refs, out) !=
+	     pk->hdr.nr_refs) ||
+	    (pk->hdr.names_size &&
+	     fwrite(pk->names, pk->hdr.names_size, 1, out) != 1))
+		return -errno;
+	*total = ftello(out);
+
+	/* the header goes in last, an interrupted run leaves no magic */
+	header_to_le(&hdr);
+	memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+	if (fseeko(out, 0, SEEK_SET) ||
+	    fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		return -errno;
+
+	return 0;
+}
+
+static struct {
+	char **paths;
+	size_t nr, max;
+} inputs;
+
+static int add_input(const char *path, const struct stat *st, int type,
+		     struct FTW *ftw)
+{
+	char **p;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	if (inputs.nr == inputs.max) {
+		p = realloc(inputs.paths, (inputs.max + 64) * sizeof(*p));
+		if (!p)
+			return -ENOMEM;
+		inputs.paths = p;
+		inputs.max += 64;
+	}
+	inputs.paths[inputs.nr] = strdup(path);
+	if (!inputs.paths[inputs.nr])
+		return -ENOMEM;
+	inputs.nr++;
+
+	return 0;
+}
+
+static int cmp_path(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int create_pack(const char *fname, char **args, int nr_args,
+		       const struct pack_options *opts)
+{
+	struct pack_header hdr = { };
+	struct pack pk = { };
+	uint64_t raw = 0, unique = 0;
+	size_t i;
+	FILE *out;
+	off_t total = 0;
+	int ret = 0;
+
+	for (i = 0; i < (size_t)nr_args; i++) {
+		if (nftw(args[i], add_input, 64, FTW_PHYS)) {
+			fprintf(stderr, "%s: %s\n", args[i], strerror(errno));
+			return -ENOENT;
+		}
+	}
+	/* neighbours share the most, keep similar names together */
+	qsort(inputs.paths, inputs.nr, sizeof(*inputs.paths), cmp_path);
+
+	pk.hdr.avg_chunk = opts->avg_chunk;
+	pk.hdr.frame_size = opts->frame_size;
+	/* a frame may overshoot by one chunk */
+	pk.hdr.dict_size = opts->frame_size + opts->avg_chunk * 8;
+	if (pk.hdr.dict_size < LZMA_DICT_SIZE_MIN)
+		pk.hdr.dict_size = LZMA_DICT_SIZE_MIN;
+
+	out = fopen(fname, "wb");
+	if (!out)
+		return -errno;
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		ret = -errno;
+
+	for (i = 0; !ret && i < inputs.nr; i++) {
+		ret = add_file(&pk, out, inputs.paths[i], opts);
+		if (ret)
+			fprintf(stderr, "%s: %s\n", inputs.paths[i],
+				strerror(-ret));
+	}
+	for (i = 0; i < pk.hdr.nr_files; i++)
+		raw += pk.files[i].size;
+	for (i = 0; i < pk.hdr.nr_chunks; i++)
+		unique += pk.chunks[i].size;
+
+	if (!ret)
+		ret = write_index(&pk, out, &total);
+	if (fclose(out) && !ret)
+		ret = -errno;
+	if (ret)
+		unlink(fname);
+	else
+		fprintf(stderr, "%u files, %ju Bytes, %u chunks, %ju Bytes unique, archive: %jd Bytes\n",
+			pk.hdr.nr_files, (uintmax_t)raw, pk.hdr.nr_chunks,
+			(uintmax_t)unique, (intmax_t)total);
+
+	free(pk.frames);
+	free(pk.chunks);
+	free(pk.files);
+	free(pk.refs);
+	free(pk.names);
+	free(pk.hash);
+
+	return ret;
+}
+
+static ssize_t pread_full(int fd, void *buf, size_t len, off_t offset)
+{
+	size_t pos = 0;
+	ssize_t ret;
+
+	while (pos < len) {
+		ret = pread(fd, (char *)buf + pos, len - pos, offset + pos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return ret < 0 ? -errno : -ENODATA;
+		pos += ret;
+	}
+
+	return pos;
+}
+
+static void close_pack(struct pack *pk)
+{
+	free(pk->frames);
+	free(pk->chunks);
+	free(pk->files);
+	free(pk->refs);
+	free(pk->names);
+	close(pk->fd);
+}
+
+static int open_pack(struct pack *pk, const char *fname)
+{
+	struct pack_header *hdr = &pk->hdr;
+	uint64_t pos;
+	uint32_t i;
+	ssize_t ret;
+
+	memset(pk, 0, sizeof(*pk));
+	pk->fd = open(fname, O_RDONLY);
+	if (pk->fd < 0)
+		return -errno;
+
+	ret = pread_full(pk->fd, hdr, sizeof(*hdr), 0);
+	if (ret < 0 || memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic))) {
+		close(pk->fd);
+		return -EINVAL;
+	}
+	header_from_le(hdr);
+
+	pk->frames = calloc(hdr->nr_frames + 1, sizeof(*pk->frames));
+	pk->chunks = calloc(hdr->nr_chunks + 1, sizeof(*pk->chunks));
+	pk->files = calloc(hdr->nr_files + 1, sizeof(*pk->files));
+	pk->refs = calloc(hdr->nr_refs + 1, sizeof(*pk->refs));
+	pk->names = calloc(hdr->names_size + 1, 1);
+	if (!pk->frames || !pk->chunks || !pk->files || !pk->refs || !pk->names) {
+		close_pack(pk);
+		return -ENOMEM;
+	}
+
+	pos = hdr->index_offset;
+	ret = pread_full(pk->fd, pk->frames,
+			 hdr->nr_frames * sizeof(*pk->frames), pos);
+	pos += hdr->nr_frames * sizeof(*pk->frames);
+	if (ret >= 0)
+		ret = pread_full(pk->fd, pk->chunks,
+				 hdr->nr_chunks * sizeof(*pk->chunks), pos);
+	pos += hdr->nr_chunks * sizeof(*pk->chunks);
+	if (ret >= 0)
+		ret = pread_full(pk->fd, pk->files,
+				 hdr->nr_files * sizeof(*pk->files), pos);
+	pos += hdr->nr_files * sizeof(*pk->files);
+	if (ret >= 0)
+		ret = pread_full(pk->fd, pk->refs,
+				 hdr->nr_refs * sizeof(*pk->refs), pos);
+	pos += hdr->nr_refs * sizeof(*pk->refs);
+	if (ret >= 0)
+		ret = pread_full(pk->fd, pk->names, hdr->names_size, pos);
+	if (ret < 0) {
+		close_pack(pk);
+		return ret;
+	}
+
+	for (i = 0; i < hdr->nr_frames; i++) {
+		frame_from_le(&pk->frames[i]);
+		if (pk->frames[i].csize > pk->frames[i].size)
+			ret = -EINVAL;
+	}
+	for (i = 0; i < hdr->nr_chunks; i++) {
+		chunk_from_le(&pk->chunks[i]);
+		if (pk->chunks[i].frame >= hdr->nr_frames ||
+		    (uint64_t)pk->chunks[i].offset + pk->chunks[i].size >
+		    pk->frames[pk->chunks[i].frame].size)
+			ret = -EINVAL;
+	}
+	for (i = 0; i < hdr->nr_refs; i++) {
+		pk->refs[i] = le32toh(pk->refs[i]);
+		if (pk->refs[i] >= hdr->nr_chunks)
+			ret = -EINVAL;
+	}
+	for (i = 0; i < hdr->nr_files; i++) {
+		file_from_le(&pk->files[i]);
+		if ((uint64_t)pk->files[i].first_ref + pk->files[i].nr_refs >
+		    hdr->nr_refs || pk->files[i].name >= hdr->names_size)
+			ret = -EINVAL;
+	}
+	if (ret < 0) {
+		close_pack(pk);
+		return ret;
+	}
+
+	return 0;
+}
+
+/* By its full name, or just the file name if that is unique. */
+static struct pack_file *find_file(struct pack *pk, const char *name)
+{
+	struct pack_file *found = NULL;
+	const char *base;
+	uint32_t i;
+	int nr = 0;
+
+	for (i = 0; i < pk->hdr.nr_files; i++)
+		if (!strcmp(pk->names + pk->files[i].name, name))
+			return &pk->files[i];
+
+	for (i = 0; i < pk->hdr.nr_files; i++) {
+		base = strrchr(pk->names + pk->files[i].name, '/');
+		if (base && !strcmp(base + 1, name)) {
+			found = &pk->files[i];
+			nr++;
+		}
+	}
+
+	return nr == 1 ? found : NULL;
+}
+
+static int list_pack(struct pack *pk, const char *fname)
+{
+	uint64_t raw = 0, unique = 0, compressed = 0;
+	const struct pack_file *pf;
+	struct stat st;
+	uint32_t i;
+
+	printf("%12s %7s %s\n", "size", "chunks", "name");
+	for (i = 0; i < pk->hdr.nr_files; i++) {
+		pf = &pk->files[i];
+		printf("%12ju %7u %s%s\n", (uintmax_t)pf->size, pf->nr_refs,
+		       pk->names + pf->name, pf->flags & PACK_XZ ? " (xz)" : "");
+		raw += pf->size;
+	}
+	for (i = 0; i < pk->hdr.nr_frames; i++) {
+		unique += pk->frames[i].size;
+		compressed += pk->frames[i].csize;
+	}
+
+	printf("%u files, %ju Bytes, %u chunks of %u Bytes on average, %u frames\n",
+	       pk->hdr.nr_files, (uintmax_t)raw, pk->hdr.nr_chunks,
+	       pk->hdr.avg_chunk, pk->hdr.nr_frames);
+	printf("unique: %ju Bytes, compressed: %ju Bytes", (uintmax_t)unique,
+	       (uintmax_t)compressed);
+	if (!stat(fname, &st))
+		printf(", archive: %jd Bytes", (intmax_t)st.st_size);
+	printf("\n");
+
+	return 0;
+}
+
+struct extract_job {
+	struct pack *pk;
+	const struct pack_file *pf;
+	uint8_t *out;
+	uint64_t *offsets;		/* of each reference */
+	uint32_t *needed;		/* the frames referenced */
+	uint8_t **frames;		/* decompressed, by frame index */
+	uint8_t *checked;		/* by chunk index, with verify */
+	int err;
+};
+
+static void extract_frame(void *ctx, size_t i)
+{
+	struct extract_job *job = ctx;
+	uint32_t idx = job->needed[i];
+	const struct pack_frame *frame = &job->pk->frames[idx];
+	lzma_filter filters[2];
+	lzma_options_lzma lzopts;
+	size_t in_pos = 0, out_pos = 0;
+	uint8_t *buf, *cbuf;
+	ssize_t ret;
+
+	buf = malloc(frame->size ? frame->size : 1);
+	if (!buf) {
+		job->err = -ENOMEM;
+		return;
+	}
+	job->frames[idx] = buf;
+
+	if (frame->csize == frame->size) {
+		ret = pread_full(job->pk->fd, buf, frame->size, frame->offset);
+	} else {
+		cbuf = malloc(frame->csize);
+		if (!cbuf) {
+			job->err = -ENOMEM;
+			return;
+		}
+		ret = pread_full(job->pk->fd, cbuf, frame->csize,
+				 frame->offset);
+		lzma2_filters(filters, &lzopts, -1, job->pk->hdr.dict_size);
+		if (ret >= 0 &&
+		    (lzma_raw_buffer_decode(filters, NULL, cbuf, &in_pos,
+					    frame->csize, buf, &out_pos,
+					    frame->size) != LZMA_OK ||
+		     out_pos != frame->size))
+			ret = -EIO;
+		free(cbuf);
+	}
+	if (ret < 0)
+		job->err = ret;
+}
+
+static void extract_chunk(void *ctx, size_t i)
+{
+	struct extract_job *job = ctx;
+	uint32_t idx = job->pk->refs[job->pf->first_ref + i];
+	const struct pack_chunk *pc = &job->pk->chunks[idx];
+	uint8_t sha[SHA256_DIGEST_SIZE], *src;
+
+	src = job->frames[pc->frame] + pc->offset;
+	/* the padding is the same chunk many times, check it once */
+	if (job->checked &&
+	    !__atomic_exchange_n(&job->checked[idx], 1, __ATOMIC_RELAXED)) {
+		sha256(src, pc->size, sha);
+		if (memcmp(sha, pc->sha, SHA256_DIGEST_SIZE))
+			job->err = -EIO;
+	}
+	memcpy(job->out + job->offsets[i], src, pc->size);
+}
+
+/*
+ * Rebuild a file from its chunks: decompress the frames holding them in
+ * parallel, then copy (and check) the chunks in parallel.
+ */
+static int reconstruct(struct pack *pk, const struct pack_file *pf,
+		       const struct pack_options *opts, uint8_t **buf)
+{
+	struct extract_job job = { .pk = pk, .pf = pf };
+	uint64_t pos = 0, start = now_ns(), ns;
+	uint32_t i, nr_needed = 0, frame;
+
+	/* page aligned, so it can become an image segment */
+	if (posix_memalign((void **)&job.out, B0_BUF_ALIGN,
+			   pf->size ? pf->size : 1))
+		return -ENOMEM;
+	job.offsets = calloc(pf->nr_refs + 1, sizeof(*job.offsets));
+	job.needed = calloc(pk->hdr.nr_frames + 1, sizeof(*job.needed));
+	job.frames = calloc(pk->hdr.nr_frames + 1, sizeof(*job.frames));
+	if (opts->verify)
+		job.checked = calloc(pk->hdr.nr_chunks + 1, 1);
+	if (!job.offsets || !job.needed || !job.frames ||
+	    (opts->verify && !job.checked)) {
+		job.err = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < pf->nr_refs; i++) {
+		job.offsets[i] = pos;
+		pos += pk->chunks[pk->refs[pf->first_ref + i]].size;
+		frame = pk->chunks[pk->refs[pf->first_ref + i]].frame;
+		/* mark it, the buffers get allocated by the threads */
+		if (!job.frames[frame]) {
+			job.frames[frame] = job.out;
+			job.needed[nr_needed++] = frame;
+		}
+	}
+	for (i = 0; i < nr_needed; i++)
+		job.frames[job.needed[i]] = NULL;
+	if (pos != pf->size) {
+		job.err = -EINVAL;
+		goto out;
+	}
+
+	run_parallel(extract_frame, &job, nr_needed, opts->threads);
+	if (!job.err)
+		run_parallel(extract_chunk, &job, pf->nr_refs, opts->threads);
+
+	ns = now_ns() - start;
+	if (opts->verbose && !job.err)
+		fprintf(stderr, "%s: %ju Bytes from %u chunks in %u frames, %.1f ms (%.1f MB/s)\n",
+			pk->names + pf->name, (uintmax_t)pf->size, pf->nr_refs,
+			nr_needed, ns / 1e6, ns ? pf->size * 1e3 / ns : 0);
+
+out:
+	for (i = 0; job.frames && i < nr_needed; i++)
+		free(job.frames[job.needed[i]]);
+	free(job.checked);
+	free(job.frames);
+	free(job.needed);
+	free(job.offsets);
+	if (job.err) {
+		free(job.out);
+		return job.err;
+	}
+	*buf = job.out;
+
+	return 0;
+}
+
+static int extract_file(struct pack *pk, const struct pack_file *pf,
+			const char *out_fname, const struct pack_options *opts)
+{
+	FILE *out = stdout;
+	uint8_t *buf;
+	int ret;
+
+	ret = reconstruct(pk, pf, opts, &buf);
+	if (ret)
+		return ret;
+
+	if (out_fname) {
+		out = fopen(out_fname, "wb");
+		if (!out) {
+			free(buf);
+			return -errno;
+		}
+	}
+	if (pf->size && fwrite(buf, pf->size, 1, out) != 1)
+		ret = -errno;
+	if (out_fname && fclose(out) && !ret)
+		ret = -errno;
+	else if (!out_fname && fflush(out) && !ret)
+		ret = -errno;
+	free(buf);
+
+	return ret;
+}
+
+/* A standard .xz file, in blocks, so b0xz can access it randomly. */
+static int export_file(struct pack *pk, const struct pack_file *pf,
+		       const char *out_fname, const struct pack_options *opts)
+{
+	struct b0_compress_options copts;
+	struct b0_image img;
+	uint8_t *buf;
+	FILE *out;
+	int ret;
+
+	ret = reconstruct(pk, pf, opts, &buf);
+	if (ret)
+		return ret;
+
+	memset(&img, 0, sizeof(img));
+	img.seg[0].data = buf;
+	img.seg[0].size = pf->size;
+	img.nr_segs = 1;
+	img.size = pf->size;
+	img.boot0_offset = -1;
+
+	b0_compress_init_options(&copts);
+	copts.type = B0_COMPRESS_XZ;
+	copts.level = opts->level;
+	copts.threads = opts->threads;
+	copts.block_size = opts->block_size;
+
+	out = fopen(out_fname, "wb");
+	if (!out) {
+		free(buf);
+		return -errno;
+	}
+	ret = b0_write_compressed(&img, out, &copts);
+	if (fclose(out) && !ret)
+		ret = -errno;
+	if (ret)
+		unlink(out_fname);
+	free(buf);
+
+	return ret;
+}
+
+static void usage(const char *progname, FILE *stream)
+{
+	fprintf(stream, "b0pack: chunk deduplicated archive of firmware images\n"
+		"usage: %s [-v] [-j threads] [-c chunk_kb] [-f frame_kb] [-l level] create <archive> <file|dir>...\n"
+		"       %s list <archive>\n"
+		"       %s [-v] [-j threads] [-n] extract <archive> <name> [output]\n"
+		"       %s [-v] [-j threads] [-l level] [-b block_kb] export <archive> <name> <output.xz>\n",
+		progname, progname, progname, progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-v|--verbose: report each file and the reconstruction speed\n"
+		"\t-j|--jobs: number of threads (default: one per CPU)\n"
+		"\t-c|--chunk-size: average chunk size in KB (default: 8)\n"
+		"\t-f|--frame-size: new chunks compressed together, in KB (default: 1024)\n"
+		"\t-l|--level: xz/LZMA2 compression level (default: 6)\n"
+		"\t-n|--no-verify: skip checking the chunk checksums\n"
+		"\t-b|--block-size: export: xz block size in KB (default: 1024)\n\n");
+	fprintf(stream, ".xz inputs are stored decompressed, so they share chunks with the\n"
+		"others. extract writes to stdout without an output file.\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option lopts[] = {
+		{ "help",	0, 0, 'h' },
+		{ "verbose",	0, 0, 'v' },
+		{ "jobs",	1, 0, 'j' },
+		{ "chunk-size",	1, 0, 'c' },
+		{ "frame-size",	1, 0, 'f' },
+		{ "level",	1, 0, 'l' },
+		{ "no-verify",	0, 0, 'n' },
+		{ "block-size",	1, 0, 'b' },
+		{ NULL, 0, 0, 0 },
+	};
+	struct pack_options opts = {
+		.avg_chunk = DEF_AVG_CHUNK,
+		.frame_size = DEF_FRAME_SIZE,
+		.level = -1,
+		.threads = sysconf(_SC_NPROCESSORS_ONLN),
+		.verify = true,
+		.block_size = B0_XZ_BLOCK_SIZE,
+	};
+	const struct pack_file *pf;
+	const char *cmd, *archive;
+	struct pack pk;
+	int ch, ret;
+
+	while ((ch = getopt_long(argc, argv, "hvj:c:f:l:nb:", lopts, NULL)) != -1) {
+		switch(ch) {
+		case '?':
+			usage(argv[0], stderr);
+			return 1;
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+		case 'v':
+			opts.verbose = true;
+			break;
+		case 'j':
+			opts.threads = atoi(optarg);
+			break;
+		case 'c':
+			opts.avg_chunk = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'f':
+			opts.frame_size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		case 'l':
+			opts.level = atoi(optarg);
+			break;
+		case 'n':
+			opts.verify = false;
+			break;
+		case 'b':
+			opts.block_size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		}
+	}
+
+	if (argc - optind < 2 || opts.level > 9 || !opts.block_size ||
+	    opts.avg_chunk < 1024 || opts.avg_chunk > 1024 * 1024 ||
+	    (opts.avg_chunk & (opts.avg_chunk - 1)) ||
+	    opts.frame_size < opts.avg_chunk ||
+	    opts.frame_size > 256 * 1024 * 1024) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+	if (opts.threads < 1)
+		opts.threads = 1;
+	if (opts.threads > MAX_THREADS)
+		opts.threads = MAX_THREADS;
+	cmd = argv[optind++];
+	archive = argv[optind++];
+
+	if (!strcmp(cmd, "create")) {
+		if (optind >= argc) {
+			usage(argv[0], stderr);
+			return 1;
+		}
+		init_gear();
+		ret = create_pack(archive, argv + optind, argc - optind, &opts);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", archive, strerror(-ret));
+			return 3;
+		}
+		return 0;
+	}
+
+	if (strcmp(cmd, "list") && strcmp(cmd, "extract") &&
+	    strcmp(cmd, "export")) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+
+	ret = open_pack(&pk, archive);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", archive, ret == -EINVAL ?
+			"not a b0pack archive" : strerror(-ret));
+		return 2;
+	}
+
+	if (!strcmp(cmd, "list")) {
+		ret = list_pack(&pk, archive);
+		close_pack(&pk);
+		return ret ? 3 : 0;
+	}
+
+	if (optind >= argc || (!strcmp(cmd, "export") && optind + 1 >= argc)) {
+		usage(argv[0], stderr);
+		close_pack(&pk);
+		return 1;
+	}
+	pf = find_file(&pk, argv[optind]);
+	if (!pf) {
+		fprintf(stderr, "%s: no such file in %s\n", argv[optind],
+			archive);
+		close_pack(&pk);
+		return 2;
+	}
+
+	if (!strcmp(cmd, "extract"))
+		ret = extract_file(&pk, pf, argv[optind + 1], &opts);
+	else
+		ret = export_file(&pk, pf, argv[optind + 1], &opts);
+	close_pack(&pk);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 3;
+	}
+
+	return 0;
+}
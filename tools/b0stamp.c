@@ -0,0 +1,265 @@
+/*
+ * b0stamp: decode the boot stage timestamps recorded by boot0img trampolines
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include "libboot0img.h"
+
+#define DEFAULT_FREQ	24000000	/* the 24MHz oscillator on all SoCs */
+#define MAX_DUMP	(16 * 1024 * 1024)
+
+static const char *default_labels[B0_MAX_STAMPS] = {
+	"boot0", "atf", "u-boot",
+};
+
+static void usage(const char *progname, FILE *stream)
+{
+	fprintf(stream, "b0stamp: decode boot stage timestamps from a memory dump\n"
+		"usage: %s [-h] [-a dump_addr] [-t table_addr] [-f freq] "
+		"[-l label,...] [dump]\n", progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-a|--address: address the binary dump starts at (default: 0)\n"
+		"\t-t|--table: address of the stamp table (default: dump start)\n"
+		"\t-f|--freq: counter frequency in Hz, overriding the table\n"
+		"\t-l|--labels: names of the stages ending at each stamp\n"
+		"\t             (default: boot0,atf,u-boot)\n\n");
+	fprintf(stream, "The dump is read from stdin if omitted. It is either "
+		"binary, or the output of\nU-Boot's md command, which carries "
+		"the addresses itself.\n");
+}
+
+/*
+ * Parse a line of U-Boot's md output ("49ff0000: 53543042 00000001 ...").
+ * Returns the number of bytes stored, 0 if the line is something else.
+ */
+static size_t parse_md_line(const char *line, uint64_t *addr, uint8_t *bytes)
+{
+	const char *p;
+	char *end;
+	uint64_t val;
+	size_t n = 0, len, i;
+
+	*addr = strtoull(line, &end, 16);
+	if (end == line || *end != ':')
+		return 0;
+
+	for (p = end + 1; n < 16; p = end) {
+		while (*p == ' ')
+			p++;
+		val = strtoull(p, &end, 16);
+		len = end - p;
+		/* word sizes of md.b, md.w, md.l and md.q */
+		if ((len != 2 && len != 4 && len != 8 && len != 16) ||
+		    (*end && !isspace((unsigned char)*end)))
+			break;
+		for (i = 0; i < len / 2; i++)
+			bytes[n++] = val >> (i * 8);
+	}
+
+	return n;
+}
+
+/* Turn md output into a binary dump, returning the start address. */
+static ssize_t parse_md(FILE *f, uint8_t *buf, size_t size, uint64_t *start)
+{
+	char line[256];
+	uint8_t bytes[16];
+	uint64_t addr;
+	size_t n, end = 0;
+	bool first = true;
+
+	while (fgets(line, sizeof(line), f)) {
+		n = parse_md_line(line, &addr, bytes);
+		if (!n)
+			continue;
+		if (first) {
+			*start = addr;
+			first = false;
+		}
+		if (addr < *start || addr - *start + n > size)
+			return -ERANGE;
+		memcpy(buf + addr - *start, bytes, n);
+		if (addr - *start + n > end)
+			end = addr - *start + n;
+	}
+
+	return first ? -ENOENT : (ssize_t)end;
+}
+
+/*
+ * Read the whole dump, converting md output into binary. Returns its size,
+ * the start address is only changed for md output.
+ */
+static ssize_t read_dump(FILE *f, uint8_t **bufp, uint64_t *start)
+{
+	uint8_t *raw, *bin;
+	size_t len;
+	ssize_t ret;
+	FILE *mem;
+
+	raw = malloc(MAX_DUMP + 1);
+	if (!raw)
+		return -ENOMEM;
+	len = fread(raw, 1, MAX_DUMP, f);
+	if (ferror(f)) {
+		free(raw);
+		return -EIO;
+	}
+	raw[len] = 0;
+
+	/* binary dumps have zeroes in them, at least in the stamp table */
+	if (memchr(raw, 0, len)) {
+		*bufp = raw;
+		return len;
+	}
+
+	bin = calloc(1, MAX_DUMP);
+	mem = bin ? fmemopen(raw, len, "r") : NULL;
+	if (!mem) {
+		free(bin);
+		free(raw);
+		return -ENOMEM;
+	}
+	ret = parse_md(mem, bin, MAX_DUMP, start);
+	fclose(mem);
+	free(raw);
+	if (ret < 0)
+		free(bin);
+	else
+		*bufp = bin;
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option lopts[] = {
+		{ "help",	0, 0, 'h' },
+		{ "address",	1, 0, 'a' },
+		{ "table",	1, 0, 't' },
+		{ "freq",	1, 0, 'f' },
+		{ "labels",	1, 0, 'l' },
+		{ NULL, 0, 0, 0 },
+	};
+	const char *labels[B0_MAX_STAMPS], *freq_src = "table";
+	uint64_t start = 0, table_addr = UINT64_MAX, prev = 0;
+	struct b0_stamp_table tbl;
+	unsigned long freq = 0;
+	char *label_arg = NULL, *tok, *saveptr;
+	uint8_t *buf = NULL;
+	ssize_t len;
+	FILE *f = stdin;
+	int ch, ret, i;
+
+	memcpy(labels, default_labels, sizeof(labels));
+
+	while ((ch = getopt_long(argc, argv, "ha:t:f:l:", lopts, NULL)) != -1) {
+		switch(ch) {
+		case '?':
+			usage(argv[0], stderr);
+			return 1;
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+		case 'a':
+			start = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			table_addr = strtoull(optarg, NULL, 0);
+			break;
+		case 'f':
+			freq = strtoul(optarg, NULL, 0);
+			freq_src = "command line";
+			break;
+		case 'l':
+			label_arg = optarg;
+			break;
+		}
+	}
+
+	i = 0;
+	for (tok = label_arg ? strtok_r(label_arg, ",", &saveptr) : NULL;
+	     tok && i < B0_MAX_STAMPS; tok = strtok_r(NULL, ",", &saveptr))
+		labels[i++] = tok;
+
+	if (optind < argc && strcmp(argv[optind], "-")) {
+		f = fopen(argv[optind], "rb");
+		if (!f) {
+			perror(argv[optind]);
+			return 2;
+		}
+	}
+
+	len = read_dump(f, &buf, &start);
+	if (f != stdin)
+		fclose(f);
+	if (len == -ENOENT) {
+		fprintf(stderr, "neither a binary dump nor md output\n");
+		return 2;
+	}
+	if (len < 0) {
+		fprintf(stderr, "cannot read dump: %s\n", strerror(-len));
+		return 2;
+	}
+
+	if (table_addr == UINT64_MAX)
+		table_addr = start;
+	if (table_addr < start || table_addr - start >= (uint64_t)len) {
+		free(buf);
+		fprintf(stderr, "table at 0x%jx is not in the dump (0x%jx-0x%jx)\n",
+			(uintmax_t)table_addr, (uintmax_t)start,
+			(uintmax_t)(start + len));
+		return 2;
+	}
+
+	ret = b0_decode_stamps(buf + (table_addr - start),
+			       len - (table_addr - start), &tbl);
+	free(buf);
+	if (ret <= 0) {
+		fprintf(stderr, "no stamp table at 0x%jx\n",
+			(uintmax_t)table_addr);
+		return 3;
+	}
+
+	/* CNTFRQ is only set up by firmware, it might not be yet */
+	if (!freq) {
+		freq = tbl.freq;
+		if (freq < 1000000 || freq > 1000000000) {
+			freq = DEFAULT_FREQ;
+			freq_src = "default";
+		}
+	}
+
+	printf("counter frequency: %lu Hz (%s)\n", freq, freq_src);
+	printf("%-3s %-10s %16s %12s %12s\n", "#", "stage", "counter",
+	       "end [ms]", "took [ms]");
+	for (i = 0; i < ret; i++) {
+		printf("%-3d %-10s %16ju %12.3f %12.3f\n", i,
+		       labels[i] ? labels[i] : "-", (uintmax_t)tbl.stamp[i],
+		       tbl.stamp[i] * 1000.0 / freq,
+		       (int64_t)(tbl.stamp[i] - prev) * 1000.0 / freq);
+		prev = tbl.stamp[i];
+	}
+
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * b0stats: per-phase timing and I/O statistics for boot0img
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "libboot0img.h"
+#include "b0stats.h"
+
+static const char *phase_names[B0_NR_PHASES] = {
+	[B0_PHASE_READ]		= "read",
+	[B0_PHASE_CACHE]	= "cache",
+	[B0_PHASE_PATCH]	= "patch",
+	[B0_PHASE_CHECKSUM]	= "checksum",
+	[B0_PHASE_PARTITION]	= "partition",
+	[B0_PHASE_WRITE]	= "write",
+	[B0_PHASE_ZEROFILL]	= "zero-fill",
+	[B0_PHASE_TRUNCATE]	= "truncate",
+};
+
+/* Take a snapshot of /proc/self/io, returning the bytes read, 0 on error. */
+static size_t read_io(struct b0_io_counters *io)
+{
+	static const struct {
+		const char *name;
+		size_t offset;
+	} fields[] = {
+		{ "rchar:", offsetof(struct b0_io_counters, rchar) },
+		{ "wchar:", offsetof(struct b0_io_counters, wchar) },
+		{ "syscr:", offsetof(struct b0_io_counters, syscr) },
+		{ "syscw:", offsetof(struct b0_io_counters, syscw) },
+		{ "read_bytes:", offsetof(struct b0_io_counters, read_bytes) },
+		{ "write_bytes:", offsetof(struct b0_io_counters, write_bytes) },
+	};
+	char buf[512], *p;
+	ssize_t len;
+	unsigned int i;
+	int fd;
+
+	fd = open("/proc/self/io", O_RDONLY);
+	if (fd < 0)
+		return 0;
+	/* a single read, so the snapshot costs exactly one syscall */
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 0;
+	buf[len] = 0;
+
+	for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		p = strstr(buf, fields[i].name);
+		if (!p)
+			return 0;
+		*(uint64_t *)((char *)io + fields[i].offset) =
+			strtoull(p + strlen(fields[i].name), NULL, 10);
+	}
+
+	return len;
+}
+
+void b0_stats_init(struct b0_stats *st)
+{
+	struct b0_io_counters io;
+
+	memset(st, 0, sizeof(*st));
+	st->have_io = read_io(&io) > 0;
+	st->start_ns = now_ns();
+}
+
+void b0_stats_begin(const struct b0_stats *st, struct b0_stats_mark *mark)
+{
+	if (!st)
+		return;
+
+	mark->io_len = st->have_io ? read_io(&mark->io) : 0;
+	mark->ns = now_ns();
+}
+
+static uint64_t delta(uint64_t end, uint64_t start, uint64_t overhead)
+{
+	return end - start > overhead ? end - start - overhead : 0;
+}
+
+void b0_stats_end(struct b0_stats *st, enum b0_phase phase,
+		  const struct b0_stats_mark *mark, uint64_t bytes)
+{
+	struct b0_phase_stats *ps;
+	struct b0_io_counters io;
+
+	if (!st)
+		return;
+
+	ps = &st->phase[phase];
+	ps->ns += now_ns() - mark->ns;
+	ps->bytes += bytes;
+	ps->count++;
+
+	if (!mark->io_len || !read_io(&io))
+		return;
+
+	/* the read of the first snapshot shows up in the second one */
+	ps->io.rchar += delta(io.rchar, mark->io.rchar, mark->io_len);
+	ps->io.wchar += io.wchar - mark->io.wchar;
+	ps->io.syscr += delta(io.syscr, mark->io.syscr, 1);
+	ps->io.syscw += io.syscw - mark->io.syscw;
+	ps->io.read_bytes += io.read_bytes - mark->io.read_bytes;
+	ps->io.write_bytes += io.write_bytes - mark->io.write_bytes;
+}
+
+static double mb_per_s(uint64_t bytes, uint64_t ns)
+{
+	return ns ? bytes * 1e3 / ns : 0;
+}
+
+void b0_stats_print(const struct b0_stats *st, FILE *stream, bool json)
+{
+	const struct b0_phase_stats *ps;
+	uint64_t total_ns = now_ns() - st->start_ns;
+	bool first = true;
+	int i;
+
+	if (json)
+		fprintf(stream, "{\"total_ns\": %ju, \"io_counters\": %s, "
+			"\"phases\": [", (uintmax_t)total_ns,
+			st->have_io ? "true" : "false");
+	else
+		fprintf(stream, "%-10s %5s %10s %12s %10s %6s %6s %12s %12s "
+			"%12s %12s\n", "phase", "calls", "time [ms]", "bytes",
+			"MB/s", "syscr", "syscw", "rchar", "wchar",
+			"storage rd", "storage wr");
+
+	for (i = 0; i < B0_NR_PHASES; i++) {
+		ps = &st->phase[i];
+		if (!ps->count)
+			continue;
+
+		if (json) {
+			fprintf(stream, "%s\n  {\"phase\": \"%s\", "
+				"\"calls\": %u, \"time_ns\": %ju, "
+				"\"bytes\": %ju, \"mb_per_s\": %.1f, "
+				"\"syscr\": %ju, \"syscw\": %ju, "
+				"\"rchar\": %ju, \"wchar\": %ju, "
+				"\"read_bytes\": %ju, \"write_bytes\": %ju}",
+				first ? "" : ",", phase_names[i], ps->count,
+				(uintmax_t)ps->ns, (uintmax_t)ps->bytes,
+				mb_per_s(ps->bytes, ps->ns),
+				(uintmax_t)ps->io.syscr,
+				(uintmax_t)ps->io.syscw,
+				(uintmax_t)ps->io.rchar,
+				(uintmax_t)ps->io.wchar,
+				(uintmax_t)ps->io.read_bytes,
+				(uintmax_t)ps->io.write_bytes);
+			first = false;
+			continue;
+		}
+
+		fprintf(stream, "%-10s %5u %10.3f %12ju %10.1f", phase_names[i],
+			ps->count, ps->ns / 1e6, (uintmax_t)ps->bytes,
+			mb_per_s(ps->bytes, ps->ns));
+		if (st->have_io)
+			fprintf(stream, " %6ju %6ju %12ju %12ju %12ju %12ju\n",
+				(uintmax_t)ps->io.syscr,
+				(uintmax_t)ps->io.syscw,
+				(uintmax_t)ps->io.rchar,
+				(uintmax_t)ps->io.wchar,
+				(uintmax_t)ps->io.read_bytes,
+				(uintmax_t)ps->io.write_bytes);
+		else
+			fprintf(stream, " %6s %6s %12s %12s %12s %12s\n",
+				"-", "-", "-", "-", "-", "-");
+	}
+
+	if (json)
+		fprintf(stream, "\n]}\n");
+	else
+		fprintf(stream, "%-10s %5s %10.3f\n", "total", "",
+			total_ns / 1e6);
+}
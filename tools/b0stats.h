@@ -0,0 +1,75 @@
+/*
+ * b0stats: per-phase timing and I/O statistics for boot0img
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __B0STATS_H__
+#define __B0STATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+enum b0_phase {
+	B0_PHASE_READ,			/* loading the input files */
+	B0_PHASE_CACHE,			/* hashing inputs, cache lookup */
+	B0_PHASE_PATCH,			/* copying and patching boot0 */
+	B0_PHASE_CHECKSUM,		/* firmware blob checksum */
+	B0_PHASE_PARTITION,		/* partition table */
+	B0_PHASE_WRITE,			/* image data, including flushing */
+	B0_PHASE_ZEROFILL,		/* gaps and padding */
+	B0_PHASE_TRUNCATE,
+	B0_NR_PHASES
+};
+
+/* The counters from /proc/self/io. */
+struct b0_io_counters {
+	uint64_t rchar, wchar;		/* through read and write calls */
+	uint64_t syscr, syscw;		/* number of read and write calls */
+	uint64_t read_bytes;		/* actually fetched from storage */
+	uint64_t write_bytes;		/* sent to storage */
+};
+
+struct b0_phase_stats {
+	unsigned int count;
+	uint64_t ns;
+	uint64_t bytes;			/* processed in this phase */
+	struct b0_io_counters io;
+};
+
+struct b0_stats {
+	struct b0_phase_stats phase[B0_NR_PHASES];
+	uint64_t start_ns;
+	bool have_io;			/* /proc/self/io is readable */
+};
+
+struct b0_stats_mark {
+	uint64_t ns;
+	struct b0_io_counters io;
+	size_t io_len;			/* bytes read for the snapshot */
+};
+
+/*
+ * The I/O counters are process wide, so they are only meaningful with
+ * one image being built at a time. All functions accept a NULL stats
+ * pointer and do nothing then, so callers can be instrumented
+ * unconditionally.
+ */
+void b0_stats_init(struct b0_stats *st);
+void b0_stats_begin(const struct b0_stats *st, struct b0_stats_mark *mark);
+void b0_stats_end(struct b0_stats *st, enum b0_phase phase,
+		  const struct b0_stats_mark *mark, uint64_t bytes);
+void b0_stats_print(const struct b0_stats *st, FILE *stream, bool json);
+
+#endif
@@ -0,0 +1,193 @@
+/*
+ * b0test: host side checks for the trampoline encoder and the stamp decoder
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include "libboot0img.h"
+
+#define TARGET		0x4a000000
+#define STAMP_ADDR	0x00047f00
+
+static int testnr, failed;
+
+static void check(bool ok, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void check(bool ok, const char *fmt, ...)
+{
+	va_list args;
+
+	printf("%sok %d ", ok ? "" : "not ", ++testnr);
+	va_start(args, fmt);
+	vprintf(fmt, args);
+	va_end(args);
+	printf("\n");
+	if (!ok)
+		failed++;
+}
+
+/*
+ * Returns the index of the word a PC relative literal load at buf[i] reads,
+ * or -1 if buf[i] is no such load.
+ */
+static int a64_literal(const uint32_t *buf, int i)
+{
+	uint32_t insn = le32toh(buf[i]);
+	int32_t imm19;
+
+	/* LDR (literal), 32 and 64 bit */
+	if ((insn & 0xbf000000) != 0x18000000)
+		return -1;
+	imm19 = (int32_t)(insn << 8) >> 13;
+
+	return i + imm19;
+}
+
+static int a32_literal(const uint32_t *buf, int i)
+{
+	uint32_t insn = le32toh(buf[i]);
+	int offset;
+
+	/* LDR Rt, [pc, #+/-imm12] */
+	if ((insn & 0x0f7f0000) != 0x051f0000)
+		return -1;
+	offset = insn & 0xfff;
+	if (!(insn & (1U << 23)))
+		offset = -offset;
+
+	return (i * 4 + 8 + offset) / 4;
+}
+
+/* The instruction loading a literal pool word, or -1. */
+static int find_load(const uint32_t *buf, int n, bool a64, int word)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if ((a64 ? a64_literal(buf, i) : a32_literal(buf, i)) == word)
+			return i;
+
+	return -1;
+}
+
+static void test_trampoline(enum b0_dram_type type, const char *name)
+{
+	bool a64 = type == B0_DRAM_TRAMPOLINE64;
+	uint32_t buf[B0_TRAMPOLINE_WORDS + 1];
+	int n, target, table, magic;
+
+	memset(buf, 0xff, sizeof(buf));
+	n = b0_write_trampoline(buf, type, TARGET, 0);
+	target = 2;
+	check(n == (a64 ? 4 : 3), "%s: plain trampoline is %d words", name, n);
+	check(le32toh(buf[target]) == TARGET &&
+	      find_load(buf, n, a64, target) == 0,
+	      "%s: plain trampoline loads the target", name);
+	if (a64)
+		check(!buf[3], "%s: target has no high word", name);
+
+	memset(buf, 0xff, sizeof(buf));
+	n = b0_write_trampoline(buf, type, TARGET, STAMP_ADDR);
+	check(n > 3 && n <= B0_TRAMPOLINE_WORDS,
+	      "%s: stamp trampoline is %d words", name, n);
+	check(le32toh(buf[B0_TRAMPOLINE_WORDS]) == 0xffffffff,
+	      "%s: nothing written past B0_TRAMPOLINE_WORDS", name);
+
+	/* the literal pool is the last three words, ordered per variant */
+	target = a64 ? n - 1 : n - 3;
+	table = a64 ? n - 3 : n - 2;
+	magic = a64 ? n - 2 : n - 1;
+	check(le32toh(buf[target]) == TARGET &&
+	      le32toh(buf[table]) == STAMP_ADDR &&
+	      le32toh(buf[magic]) == B0_STAMP_MAGIC,
+	      "%s: literal pool words", name);
+	check(find_load(buf, n, a64, table) >= 0 &&
+	      find_load(buf, n, a64, magic) >= 0 &&
+	      find_load(buf, n, a64, target) >= 0,
+	      "%s: literal loads point at the pool", name);
+	check(find_load(buf, n, a64, target) == n - 5,
+	      "%s: target loaded right before the branch", name);
+}
+
+static void put_table(uint32_t *words, uint32_t magic, uint32_t count,
+		      const uint64_t *stamps, unsigned int nr)
+{
+	unsigned int i;
+
+	words[0] = htole32(magic);
+	words[1] = htole32(count);
+	words[2] = htole32(24000000);
+	words[3] = 0;
+	for (i = 0; i < nr; i++) {
+		words[4 + i * 2] = htole32(stamps[i]);
+		words[5 + i * 2] = htole32(stamps[i] >> 32);
+	}
+}
+
+static void test_stamps(void)
+{
+	static const uint64_t stamps[] = {
+		0x12345678, 0x1234567890ULL, 0xfedcba9876543210ULL,
+	};
+	uint32_t words[4 + 2 * (B0_MAX_STAMPS + 1)];
+	struct b0_stamp_table tbl;
+	unsigned int i;
+	bool same;
+	int ret;
+
+	put_table(words, B0_STAMP_MAGIC, 3, stamps, 3);
+	ret = b0_decode_stamps(words, 16 + 3 * 8, &tbl);
+	same = ret == 3 && tbl.magic == B0_STAMP_MAGIC && tbl.count == 3 &&
+	       tbl.freq == 24000000;
+	for (i = 0; same && i < 3; i++)
+		same = tbl.stamp[i] == stamps[i];
+	check(same, "stamps: round trip of %d stamps", ret);
+
+	ret = b0_decode_stamps(words, 16 + 2 * 8, &tbl);
+	check(ret == -ENOENT, "stamps: table cut short");
+	ret = b0_decode_stamps(words, 12, &tbl);
+	check(ret == -ENOENT, "stamps: no room for the header");
+
+	put_table(words, B0_STAMP_MAGIC ^ 1, 3, stamps, 3);
+	ret = b0_decode_stamps(words, sizeof(words), &tbl);
+	check(ret == -ENOENT, "stamps: bad magic");
+
+	put_table(words, B0_STAMP_MAGIC, B0_MAX_STAMPS + 1, stamps, 3);
+	ret = b0_decode_stamps(words, sizeof(words), &tbl);
+	check(ret == -ENOENT, "stamps: count beyond B0_MAX_STAMPS");
+
+	put_table(words, B0_STAMP_MAGIC, 0, stamps, 0);
+	ret = b0_decode_stamps(words, 16, &tbl);
+	check(ret == 0, "stamps: empty table");
+}
+
+int main(void)
+{
+	printf("TAP version 13\n");
+	test_trampoline(B0_DRAM_TRAMPOLINE64, "aarch64");
+	test_trampoline(B0_DRAM_TRAMPOLINE32, "aarch32");
+	test_stamps();
+	printf("1..%d\n", testnr);
+
+	return failed ? 1 : 0;
+}
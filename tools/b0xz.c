@@ -0,0 +1,319 @@
+/*
+ * b0xz: random access to xz compressed firmware images
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <endian.h>
+#include <lzma.h>
+
+#include "libboot0img.h"
+#include "b0compress.h"
+
+static void usage(const char *progname, FILE *stream)
+{
+	fprintf(stream, "b0xz: random access to xz compressed firmware images\n"
+		"usage: %s [-v] list <image.xz>\n"
+		"       %s [-v] cat [-s offset] [-l length] <image.xz>\n"
+		"       %s [-v] info <image.xz>\n"
+		"       %s [-v] convert [-b block_size] <image.xz> <output.xz>\n",
+		progname, progname, progname, progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-v|--verbose: report how much got decompressed\n"
+		"\t-s|--offset: start of the range to extract\n"
+		"\t-l|--length: length of the range, default: until the end\n"
+		"\t-b|--block-size: uncompressed block size in KB (default: 1024)\n");
+}
+
+static void report(const struct b0_xz_reader *rd, bool verbose)
+{
+	if (!verbose)
+		return;
+
+	fprintf(stderr, "decompressed %u of %u blocks, read %ju Bytes\n",
+		rd->blocks_decoded, rd->nr_blocks, (uintmax_t)rd->bytes_read);
+}
+
+static int list_blocks(struct b0_xz_reader *rd)
+{
+	lzma_index_iter iter;
+
+	printf("%6s %12s %12s %12s %12s\n", "block", "offset", "size",
+	       "xz offset", "xz size");
+	lzma_index_iter_init(&iter, rd->index);
+	while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+		printf("%6ju %12ju %12ju %12ju %12ju\n",
+		       (uintmax_t)iter.block.number_in_file,
+		       (uintmax_t)iter.block.uncompressed_file_offset,
+		       (uintmax_t)iter.block.uncompressed_size,
+		       (uintmax_t)iter.block.compressed_file_offset,
+		       (uintmax_t)iter.block.total_size);
+
+	return 0;
+}
+
+static int cat_range(struct b0_xz_reader *rd, uint64_t offset,
+		     uint64_t length)
+{
+	uint8_t buf[65536];
+	size_t chunk;
+	ssize_t ret;
+
+	while (length) {
+		chunk = length < sizeof(buf) ? length : sizeof(buf);
+		ret = b0_xz_pread(rd, buf, chunk, offset);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		if (fwrite(buf, ret, 1, stdout) != 1)
+			return -errno;
+		offset += ret;
+		length -= ret;
+	}
+
+	return 0;
+}
+
+/* Read a header at offset and check for the magic, 0 if it's not there. */
+static int read_header(struct b0_xz_reader *rd, uint64_t offset,
+		       uint32_t *header, size_t size, const char *magic)
+{
+	ssize_t ret;
+
+	ret = b0_xz_pread(rd, header, size, offset);
+	if (ret < 0)
+		return ret;
+	if ((size_t)ret < size)
+		return 0;
+
+	return !memcmp(&header[HEADER_MAGIC], magic, strlen(magic));
+}
+
+static int check_part(struct b0_xz_reader *rd, const char *name,
+		      uint64_t offset, size_t size)
+{
+	uint32_t checksum, old_checksum;
+	void *buf;
+	ssize_t ret;
+
+	buf = malloc(size);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = b0_xz_pread(rd, buf, size, offset);
+	if (ret >= 0 && (size_t)ret < size)
+		ret = -ENODATA;
+	if (ret < 0) {
+		free(buf);
+		return ret;
+	}
+
+	checksum = b0_image_checksum(buf, size, &old_checksum);
+	printf("%-8s at %8ju: %zu Bytes, checksum 0x%08x, %s\n", name,
+	       (uintmax_t)offset, size, old_checksum,
+	       checksum == old_checksum ? "OK" : "MISMATCH");
+	free(buf);
+
+	return 0;
+}
+
+/*
+ * Find boot0 and the firmware blob in an image, which is either a full disk
+ * image, starts at the boot0 offset (like the images shipped here) or is a
+ * firmware blob only.
+ */
+static int show_info(struct b0_xz_reader *rd)
+{
+	uint32_t header[HEADER_SIZE / 4];
+	static const uint64_t fw_offsets[] = {
+		BOOT0_END_KB * 1024, UBOOT_OFFSET_KB * 1024,
+	};
+	uint64_t base = 0, offset;
+	bool found = false;
+	unsigned int i;
+	int ret;
+
+	printf("%ju Bytes in %u blocks\n", (uintmax_t)rd->size, rd->nr_blocks);
+
+	ret = read_header(rd, 0, header, 32, BOOT0_MAGIC);
+	if (ret > 0) {
+		base = BOOT0_OFFSET;
+	} else if (!ret) {
+		ret = read_header(rd, BOOT0_OFFSET, header, 32, BOOT0_MAGIC);
+		if (ret > 0)
+			base = 0;
+	}
+	if (ret < 0)
+		return ret;
+	if (ret > 0) {
+		ret = check_part(rd, "boot0", BOOT0_OFFSET - base,
+				 le32toh(header[BOOT0_LENGTH]));
+		if (ret)
+			return ret;
+		found = true;
+	} else {
+		base = BOOT0_OFFSET;
+	}
+
+	for (i = 0; i <= sizeof(fw_offsets) / sizeof(fw_offsets[0]); i++) {
+		/* a firmware blob on its own starts right at the beginning */
+		offset = i ? fw_offsets[i - 1] - base : 0;
+		ret = read_header(rd, offset, header, HEADER_SIZE, FW_MAGIC);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			continue;
+
+		ret = check_part(rd, "firmware", offset,
+				 le32toh(header[HEADER_PRIMSIZE]));
+		if (ret)
+			return ret;
+		found = true;
+		break;
+	}
+
+	if (!found)
+		printf("no boot0 or firmware header found\n");
+
+	return 0;
+}
+
+/* Recompress an image into blocks, to make it randomly accessible. */
+static int convert(struct b0_xz_reader *rd, const char *out_fname,
+		   size_t block_size)
+{
+	struct b0_compress_options copts;
+	struct b0_image img;
+	FILE *outf;
+	void *buf;
+	ssize_t ret;
+
+	buf = malloc(rd->size);
+	if (!buf)
+		return -ENOMEM;
+	ret = b0_xz_pread(rd, buf, rd->size, 0);
+	if (ret >= 0 && (uint64_t)ret < rd->size)
+		ret = -ENODATA;
+	if (ret < 0)
+		goto out_free;
+
+	memset(&img, 0, sizeof(img));
+	img.seg[0].data = buf;
+	img.seg[0].size = rd->size;
+	img.nr_segs = 1;
+	img.size = rd->size;
+	img.boot0_offset = -1;
+
+	b0_compress_init_options(&copts);
+	copts.type = B0_COMPRESS_XZ;
+	copts.block_size = block_size;
+
+	outf = fopen(out_fname, "wb");
+	if (!outf) {
+		ret = -errno;
+		goto out_free;
+	}
+	ret = b0_write_compressed(&img, outf, &copts);
+	if (fclose(outf) && !ret)
+		ret = -errno;
+
+out_free:
+	free(buf);
+
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option lopts[] = {
+		{ "help",	0, 0, 'h' },
+		{ "verbose",	0, 0, 'v' },
+		{ "offset",	1, 0, 's' },
+		{ "length",	1, 0, 'l' },
+		{ "block-size",	1, 0, 'b' },
+		{ NULL, 0, 0, 0 },
+	};
+	uint64_t offset = 0, length = UINT64_MAX;
+	size_t block_size = B0_XZ_BLOCK_SIZE;
+	struct b0_xz_reader rd;
+	const char *cmd;
+	bool verbose = false;
+	int ch, ret;
+
+	while ((ch = getopt_long(argc, argv, "hvs:l:b:", lopts, NULL)) != -1) {
+		switch(ch) {
+		case '?':
+			usage(argv[0], stderr);
+			return 1;
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+		case 'v':
+			verbose = true;
+			break;
+		case 's':
+			offset = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			length = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			block_size = strtoul(optarg, NULL, 0) * 1024;
+			break;
+		}
+	}
+
+	if (argc - optind < 2) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+	cmd = argv[optind++];
+
+	ret = b0_xz_open(&rd, argv[optind]);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 2;
+	}
+
+	if (!strcmp(cmd, "list")) {
+		ret = list_blocks(&rd);
+	} else if (!strcmp(cmd, "cat")) {
+		ret = cat_range(&rd, offset, length);
+	} else if (!strcmp(cmd, "info")) {
+		ret = show_info(&rd);
+	} else if (!strcmp(cmd, "convert") && optind + 1 < argc) {
+		ret = convert(&rd, argv[optind + 1], block_size);
+	} else {
+		usage(argv[0], stderr);
+		b0_xz_close(&rd);
+		return 1;
+	}
+
+	report(&rd, verbose);
+	b0_xz_close(&rd);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", argv[optind], strerror(-ret));
+		return 3;
+	}
+
+	return 0;
+}
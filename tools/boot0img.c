@@ -23,365 +23,515 @@
 #include <getopt.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#include "libboot0img.h"
+#include "b0cache.h"
+#include "b0dev.h"
+#include "b0compress.h"
+#include "b0stats.h"
 
-enum header_offsets {				/* in words of 4 bytes */
-	HEADER_JUMP_INS	= 0,
-	HEADER_MAGIC	= 1,
-	HEADER_CHECKSUM	= 3,
-	HEADER_ALIGN	= 4,
-	HEADER_LENGTH	= 5,
-	HEADER_PRIMSIZE	= 6,
-	HEADER_LOADADDR = 11,
-	HEADER_SECS	= 0x500 / 4,
-};
+static void usage(const char *progname, FILE *stream)
+{
+	fprintf(stream, "boot0img: assemble an Allwinner boot image for boot0\n"
+		"usage: %s [-h] [-e] [-o output.img] [-b boot0.img]\n"
+		"       [-u u-boot-dtb.bin] -d bl31.bin -s scp.bin [-a addr]\n",
+			progname);
+	fprintf(stream, "       %s [-c file]\n", progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-q|--quiet: be less verbose\n"
+		"\t-o|--output: output file name, stdout if omitted\n"
+		"\t-D|--device: output device file, -o gets ignored, can be repeated\n"
+		"\t-b|--boot0: boot0 image to embed into the image\n"
+		"\t-B|--boot0-patch: patch boot0 image and embed into image\n"
+		"\t-c|--checksum: calculate checksum of file\n"
+		"\t-u|--uboot: U-Boot image file (without SPL)\n"
+		"\t-s|--sram: image file to write into SRAM\n"
+		"\t-d|--dram: image file to write into DRAM\n"
+		"\t-a|--arisc_entry: reset vector address for arisc\n"
+		"\t-e|--embedded_header: use header from U-Boot binary\n"
+		"\t-p|--partition: add a partition table with an <n> MB FAT partition\n"
+		"\t-P|--EFI-partition: as above, but as an EFI partition\n"
+		"\t-C|--cache: cache assembled images in this directory\n"
+		"\t--cache-size: limit the cache to <n> MB (default: 256)\n"
+		"\t--hardlink: hardlink output files to the cache entry\n"
+		"\t--io: device writer: auto, uring, pwritev or stdio\n"
+		"\t--queue-depth: number of device writes in flight (default: 8)\n"
+		"\t--delta: only write blocks differing from the device content\n"
+		"\t--discard: let the device zero the padding instead of writing it\n"
+		"\t-z|--compress: compress the output: xz[:level]"
+#ifdef HAVE_ZSTD
+		" or zstd[:level]"
+#endif
+		"\n"
+		"\t--threads: number of compression threads (default: one per CPU)\n"
+		"\t--stats[=json]: report time, I/O and throughput per phase\n"
+		"\t-w|--watch: keep watching the input files, updating the output\n\n");
+	fprintf(stream, "Giving a boot0 image name will create an image which "
+		"can be written directly\nto an SD card. Otherwise just the "
+		"blob with the secondary firmware parts will\nbe assembled.\n");
+	fprintf(stream, "\nInstead of an actual binary for the DRAM, you can "
+		"write ARM or AArch64\ntrampoline code into that location. It "
+		"will jump to the specified address.\n");
+	fprintf(stream, "\t--dram trampoline64:<addr>\n");
+	fprintf(stream, "\t--dram trampoline32:<addr>\n");
+	fprintf(stream, "With -T|--timestamp <addr> the trampoline first "
+		"records the counter into a\ntable at <addr>, for b0stamp "
+		"to decode.\n");
+	fprintf(stream, "\nSpecifying an arisc entry address will populate the "
+		"arisc reset exception vector\nwith an OpenRISC instruction to "
+		"jump to that specified address.\n");
+	fprintf(stream, "The given SRAM binary will thus be written behind the "
+		"exception vector area.\n");
+	fprintf(stream, "\t--arisc_entry 0x44008\n");
+}
+
+static int checksum_file(const char *filename, bool verbose)
+{
+	ssize_t size;
+	char *buffer;
+	uint32_t checksum, old_checksum;
 
-#define MAGIC_SIZE	((HEADER_CHECKSUM - HEADER_MAGIC) * 4)
-#define HEADER_SIZE	0x600
+	size = b0_read_file(filename, &buffer);
+	if (size < 0)
+		return size;
 
-#define CHECKSUM_SEED	0x5F0A6C39
+	checksum = b0_image_checksum(buffer, size, &old_checksum);
 
-#define BOOT0_OFFSET	8192
-#define BOOT0_SIZE	32768
-#define BOOT0_END_KB	((BOOT0_OFFSET + BOOT0_SIZE) / 1024)
-#define BOOT0_ALIGN	0x4000
-#define UBOOT_LOAD_ADDR	0x4a000000
-#define UBOOT_OFFSET_KB	19096
+	if (verbose) {
+		fprintf(stdout, "%s: %zd Bytes\n", filename, size);
+		fprintf(stdout, "nominal checksum: 0x%08x\n",
+			checksum - CHECKSUM_SEED + old_checksum);
+	}
+	fprintf(stdout, "0x%08x\n", checksum);
+	if (verbose) {
+		fprintf(stdout, "00000000  %02x %02x %02x %02x\n",
+			checksum & 0xff, (checksum >> 8) & 0xff,
+			(checksum >> 16) & 0xff, checksum >> 24);
+		fprintf(stdout, "old checksum: 0x%08x, %smatching\n",
+			old_checksum, old_checksum == checksum ? "" : "NOT ");
+	}
 
-#define ALIGN(x, a) ((((x) + (a) - 1) / (a)) * (a))
+	free(buffer);
+	return old_checksum != checksum;
+}
 
-static uint32_t calc_checksum(void *buffer, size_t length)
+/* Read a component file into memory, reporting its size unless quiet. */
+static int load_component(const char *name, const char *filename,
+			  struct b0_component *comp, bool quiet,
+			  struct b0_stats *stats)
 {
-	uint32_t *buf = buffer;
-	uint32_t sum = 0;
-	size_t i;
+	struct b0_stats_mark mark;
+	char *buffer;
+	ssize_t size;
 
-	for (i = 0; i < length / 4; i++)
-		sum += buf[i];
+	if (!quiet)
+		fprintf(stderr, "%s: %s: ", name, filename);
+
+	b0_stats_begin(stats, &mark);
+	size = b0_read_file(filename, &buffer);
+	b0_stats_end(stats, B0_PHASE_READ, &mark, size > 0 ? size : 0);
+	if (size < 0) {
+		errno = -size;
+		perror(quiet ? filename : "");
+		return size;
+	}
 
-	return sum;
-}
+	if (!quiet)
+		fprintf(stderr, "%zd Bytes\n", size);
 
-#define CHUNK_SIZE 262144
+	comp->data = buffer;
+	comp->size = size;
 
-static ssize_t read_file(const char *filename, char **buffer_addr)
-{
-	FILE *fp;
-	char* buffer;
-	size_t len, ret;
+	return 0;
+}
 
-	fp = fopen(filename, "rb");
-	if (fp == NULL)
-		return -errno;
+/*
+ * Hash all input files and try to find a matching image in the cache.
+ * Returns 0 on a hit, -ENOENT on a miss, the hashes are kept for storing
+ * the image after assembling it.
+ */
+static int cache_lookup(struct b0_cache *cache, const char **fnames,
+			const struct b0_options *opts,
+			uint8_t hashes[B0_NR_COMPONENTS][SHA256_DIGEST_SIZE],
+			bool present[B0_NR_COMPONENTS], char *key,
+			struct b0_image *img)
+{
+	int i, ret;
 
-	buffer = malloc(CHUNK_SIZE);
-	for (len = 0; !feof(fp); len += ret) {
-		ret = fread(buffer + len, 1, CHUNK_SIZE, fp);
-		if (ferror(fp)) {
-			fclose(fp);
-			free(buffer);
-			return -errno;
-		}
+	for (i = 0; i < B0_NR_COMPONENTS; i++) {
+		present[i] = fnames[i] != NULL;
+		if (!present[i])
+			continue;
 
-		if (!feof(fp))
-			buffer = realloc(buffer, len + 2 * CHUNK_SIZE);
+		ret = b0_cache_hash_file(cache, fnames[i], hashes[i]);
+		if (ret)
+			return ret;
 	}
+	b0_cache_key(opts, hashes, present, key);
 
-	*buffer_addr = realloc(buffer, len);
-
-	fclose(fp);
-	return len;
+	return b0_cache_lookup(cache, key, img);
 }
 
-#define ZBUFSIZE 1024
-static int fill_zeroes(FILE *stream, off_t size)
+#define MAX_DEVICES	64
+
+struct device_job {
+	const char *fname;
+	const struct b0_image *img;
+	const struct b0_dev_options *dev_opts;	/* NULL for stdio */
+	pthread_t thread;
+	int err;
+	struct b0_dev_stats stats;
+};
+
+/* The traditional buffered writer, kept for comparison. */
+static int write_device_stdio(struct device_job *job)
 {
-	static const char zeroes[ZBUFSIZE] = {};
-	int chunk, ret;
+	uint64_t start = now_ns();
+	FILE *outf;
+	int i, ret;
 
-	while (size) {
-		chunk = (size > ZBUFSIZE ? ZBUFSIZE : size);
+	outf = fopen(job->fname, "r+b");
+	if (!outf)
+		return -errno;
 
-		ret = fwrite(zeroes, 1, chunk, stream);
-		if (!ret)
-			return -errno;
+	ret = b0_write_image(job->img, outf, true);
+	/* the data is only on the card after the sync */
+	if (!ret && (fflush(outf) || fsync(fileno(outf))))
+		ret = -errno;
+	if (fclose(outf) && !ret)
+		ret = -errno;
 
-		size -= ret;
-	}
+	job->stats.backend = "stdio";
+	job->stats.total_ns = now_ns() - start;
+	for (i = 0; i < job->img->nr_segs; i++)
+		job->stats.bytes += job->img->seg[i].size;
 
-	return 0;
+	return ret;
 }
 
-static int pseek(FILE *stream, long offset)
+static void *write_device(void *arg)
 {
-	int ret;
+	struct device_job *job = arg;
+	int fd;
 
-	ret = fseek(stream, offset, SEEK_CUR);
-	if (!ret)
-		return ret;
+	if (!job->dev_opts) {
+		job->err = write_device_stdio(job);
+		return NULL;
+	}
 
-	if (ret < 0 && errno != ESPIPE)
-		return -errno;
+	fd = b0_open_device(job->fname);
+	if (fd < 0) {
+		job->err = fd;
+		return NULL;
+	}
+
+	job->err = b0_write_device(job->img, fd, job->dev_opts, &job->stats);
+	if (close(fd) && !job->err)
+		job->err = -errno;
 
-	return fill_zeroes(stream, offset);
+	return NULL;
 }
 
-#define SEC_PER_TRACK	63
-#define TRACKS_PER_CYL	255
-static void chs_encode(int lba, uint8_t *chs)
+static void report_device(const struct device_job *job)
 {
-	int c, h, s;
-
-	s = (lba % SEC_PER_TRACK) + 1;
-	h = ((lba / SEC_PER_TRACK) % TRACKS_PER_CYL) & 0xff;
-	c = lba / (SEC_PER_TRACK * TRACKS_PER_CYL) & 0x3ff;
-
-	chs[0] = h;
-	chs[1] = s | (c >> 8);
-	chs[2] = c & 0xff;
+	const struct b0_dev_stats *st = &job->stats;
+	double secs = st->total_ns / 1e9;
+
+	fprintf(stderr, "%s: %ju Bytes in %.2f s (%.2f MB/s), %s%s\n",
+		job->fname, (uintmax_t)st->bytes, secs,
+		secs > 0 ? st->bytes / secs / 1e6 : 0, st->backend,
+		st->direct ? ", O_DIRECT" : "");
+	if (job->dev_opts && job->dev_opts->delta)
+		fprintf(stderr, "%s: %ju Bytes unchanged, skipped\n",
+			job->fname, (uintmax_t)st->skipped);
+	if (job->dev_opts && job->dev_opts->discard && st->zero_method)
+		fprintf(stderr, "%s: %ju Bytes of padding zeroed by %s\n",
+			job->fname, (uintmax_t)st->zeroed, st->zero_method);
+	else if (job->dev_opts && job->dev_opts->discard)
+		fprintf(stderr, "%s: cannot discard, padding written\n",
+			job->fname);
+	if (!st->nr_writes)
+		return;
+	fprintf(stderr, "%s: %u writes, latency min/avg/max: "
+		"%.1f/%.1f/%.1f us, flush: %.1f ms\n", job->fname,
+		st->nr_writes, st->lat_min_ns / 1e3, st->lat_avg_ns / 1e3,
+		st->lat_max_ns / 1e3, st->flush_ns / 1e6);
 }
 
-static void create_part_table(FILE *stream, off_t fat_size, bool efi,
-			      bool patch)
+static uint64_t device_bytes(const struct device_job *jobs, int nr_devices)
 {
-	union {
-		uint8_t b[16];
-		uint32_t l[16];
-	} fatp, fwp, zero = {};
+	uint64_t bytes = 0;
 	int i;
 
-	fat_size /= 512;
-	for (i = 0; i < 27; i++)
-		fwrite(zero.b, 16, 1, stream);
-	fwrite(zero.b, 14, 1, stream);
-
-	fatp.b[0] = 0x80;
-	fatp.l[2] = htole32((patch ? 1 : 20) * 2048);
-	fatp.l[3] = htole32(fat_size);
-	chs_encode(fatp.l[2], &fatp.b[1]);
-	fatp.b[4] = efi ? 0xef : 0x06;
-	chs_encode(fatp.l[2] + fatp.l[3] - 1, &fatp.b[5]);
-	fwrite(fatp.b, 16, 1, stream);
-
-	if (patch) {
-		fwrite(zero.b, 16, 1, stream);
-	} else {
-		fwp.b[0] = 0;
-		fwp.l[2] = htole32(1);
-		fwp.l[3] = htole32(20 * 2048 - 1);
-		chs_encode(fwp.l[2], &fwp.b[1]);
-		fwp.b[4] = 0xda;
-		chs_encode(fwp.l[2] + fwp.l[3] - 1, &fwp.b[5]);
-		fwrite(fwp.b, 16, 1, stream);
-	}
-
-	fwrite(zero.b, 16, 1, stream);
-	fwrite(zero.b, 16, 1, stream);
+	for (i = 0; i < nr_devices; i++)
+		bytes += jobs[i].stats.bytes;
 
-	zero.b[0] = 0x55;
-	zero.b[1] = 0xaa;
-	fwrite(zero.b, 2, 1, stream);
+	return bytes;
 }
 
 /*
- * Scan the boot0 binary for a Thumb2 instruction which loads a wide
- * immediate into a register (MOVW <Rd>, #<imm16>), which is encoded as:
- * "1111.0i10.0100.imm4|0imm3.Rd.imm8", where the imm16 is constructed as:
- * "imm4:i:imm3:imm8". Match for an instruction which loads the "orig" value
- * into any register and replace it with a load with the "new" value.
- * Returns the number of patched instructions.
+ * Write the image to all devices at the same time, one thread each, so a
+ * slow card does not hold up the others. Returns the number of failures.
  */
-static int patch_boot0(uint16_t *boot0, uint16_t orig, uint16_t new)
+static int write_devices(struct device_job *jobs, int nr_devices,
+			 const struct b0_image *img,
+			 const struct b0_dev_options *dev_opts, bool quiet)
 {
-	int i;
-	uint16_t first = 0, imm;
-	int patched = 0;
-
-	for (i = 0; i < 16384; i++) {
-		if ((boot0[i] & 0xfbf0) == 0xf240) {
-			first = boot0[i];
-			continue;
-		}
-		if (!first)
-			continue;
-		if (boot0[i] & 0x8000) {
-			first = 0;
-			continue;
-		}
-		imm = (first & 0xf) << 12;
-		imm |= (first & 0x0400) << 1;
-		imm |= (boot0[i] & 0x7000) >> 4;
-		imm |= boot0[i] & 0x00ff;
-
-		if (imm == orig) {
-			first &= 0xfbf0;
-			first |= (new & 0xf000) >> 12;
-			first |= (new & 0x0800) >> 1;
-			boot0[i - 1] = first;
-			boot0[i] &= 0x8f00;
-			boot0[i] |= (new & 0x0700) << 4;
-			boot0[i] |= new & 0x00ff;
-
-			patched++;
+	int i, ret, failed = 0;
+
+	for (i = 0; i < nr_devices; i++) {
+		jobs[i].img = img;
+		jobs[i].dev_opts = dev_opts;
+		ret = pthread_create(&jobs[i].thread, NULL, write_device,
+				     &jobs[i]);
+		if (ret) {
+			jobs[i].err = -ret;
+			jobs[i].thread = 0;
 		}
+	}
+
+	for (i = 0; i < nr_devices; i++) {
+		if (jobs[i].thread)
+			pthread_join(jobs[i].thread, NULL);
 
-		first = 0;
+		if (jobs[i].err) {
+			fprintf(stderr, "%s: %s\n", jobs[i].fname,
+				strerror(-jobs[i].err));
+			failed++;
+		} else if (!quiet) {
+			report_device(&jobs[i]);
+		}
 	}
 
-	return patched;
+	return failed;
 }
 
-static void usage(const char *progname, FILE *stream)
+#define WATCH_SETTLE_MS	200
+
+struct watch_input {
+	const char *name;		/* as reported */
+	const char *fname;
+	struct b0_component *comp;
+	int region;			/* B0_REGION_*, -1 for boot0 */
+	int wd;
+};
+
+struct watch_output {
+	const char *fname;		/* NULL when writing to devices */
+	struct device_job *devices;
+	int nr_devices;
+	const struct b0_dev_options *dev_opts;	/* always delta */
+	bool quiet;
+};
+
+static const char *base_name(const char *path)
 {
-	fprintf(stream, "boot0img: assemble an Allwinner boot image for boot0\n"
-		"usage: %s [-h] [-e] [-o output.img] [-b boot0.img]\n"
-		"       [-u u-boot-dtb.bin] -d bl31.bin -s scp.bin [-a addr]\n",
-			progname);
-	fprintf(stream, "       %s [-c file]\n", progname);
-	fprintf(stream, "\t-h|--help: this help output\n"
-		"\t-q|--quiet: be less verbose\n"
-		"\t-o|--output: output file name, stdout if omitted\n"
-		"\t-D|--device: output device file, -o gets ignored\n"
-		"\t-b|--boot0: boot0 image to embed into the image\n"
-		"\t-B|--boot0-patch: patch boot0 image and embed into image\n"
-		"\t-c|--checksum: calculate checksum of file\n"
-		"\t-u|--uboot: U-Boot image file (without SPL)\n"
-		"\t-s|--sram: image file to write into SRAM\n"
-		"\t-d|--dram: image file to write into DRAM\n"
-		"\t-a|--arisc_entry: reset vector address for arisc\n"
-		"\t-e|--embedded_header: use header from U-Boot binary\n"
-		"\t-p|--partition: add a partition table with an <n> MB FAT partition\n"
-		"\t-P|--EFI-partition: as above, but as an EFI partition\n\n");
-	fprintf(stream, "Giving a boot0 image name will create an image which "
-		"can be written directly\nto an SD card. Otherwise just the "
-		"blob with the secondary firmware parts will\nbe assembled.\n");
-	fprintf(stream, "\nInstead of an actual binary for the DRAM, you can "
-		"write ARM or AArch64\ntrampoline code into that location. It "
-		"will jump to the specified address.\n");
-	fprintf(stream, "\t--dram trampoline64:<addr>\n");
-	fprintf(stream, "\t--dram trampoline32:<addr>\n");
-	fprintf(stream, "\nSpecifying an arisc entry address will populate the "
-		"arisc reset exception vector\nwith an OpenRISC instruction to "
-		"jump to that specified address.\n");
-	fprintf(stream, "The given SRAM binary will thus be written behind the "
-		"exception vector area.\n");
-	fprintf(stream, "\t--arisc_entry 0x44008\n");
+	const char *slash = strrchr(path, '/');
+
+	return slash ? slash + 1 : path;
 }
 
-/* Do a realloc(), but clear the new part if the new allocation is bigger. */
-static void *realloc_zero(void *ptr, ssize_t *sizeptr, ssize_t newsize)
+/* Watch the directories, build systems often replace files by renaming. */
+static int watch_setup(struct watch_input *in, int nr)
 {
-	void *ret;
-
-	ret = realloc(ptr, newsize);
+	char dir[PATH_MAX];
+	const char *slash;
+	int fd, i;
 
-	if (newsize > *sizeptr)
-		memset((char*)ret + *sizeptr, 0, newsize - *sizeptr);
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0)
+		return -errno;
 
-	*sizeptr = newsize;
+	for (i = 0; i < nr; i++) {
+		slash = strrchr(in[i].fname, '/');
+		if (!slash)
+			strcpy(dir, ".");
+		else
+			snprintf(dir, sizeof(dir), "%.*s",
+				 slash == in[i].fname ? 1 :
+				 (int)(slash - in[i].fname), in[i].fname);
+		in[i].wd = inotify_add_watch(fd, dir,
+					     IN_CLOSE_WRITE | IN_MOVED_TO);
+		if (in[i].wd < 0) {
+			perror(dir);
+			close(fd);
+			return -errno;
+		}
+	}
 
-	return ret;
+	return fd;
 }
 
-static int checksum_file(const char *filename, bool verbose)
+/*
+ * Wait for input files to change, and then for things to settle, as builds
+ * tend to write their output in several steps. Returns a mask of the
+ * changed inputs.
+ */
+static int watch_wait(int fd, const struct watch_input *in, int nr)
 {
-	ssize_t size;
-	char *buffer;
-	uint32_t checksum, old_checksum;
-
-	size = read_file(filename, &buffer);
-	if (size < 0)
-		return size;
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int i, ret, timeout = -1, changed = 0;
+	ssize_t len;
+	char *p;
+
+	for (;;) {
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -errno;
+		if (!ret)
+			return changed;
 
-	checksum = calc_checksum(buffer, 12);
-	old_checksum = calc_checksum(buffer + 12, 4);
-	checksum += calc_checksum(buffer + 16, size - 16);
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0)
+			return -errno;
 
-	if (verbose) {
-		fprintf(stdout, "%s: %zd Bytes\n", filename, size);
-		fprintf(stdout, "nominal checksum: 0x%08x\n",
-			checksum + old_checksum);
+		for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW)
+				changed |= (1 << nr) - 1;
+			for (i = 0; i < nr; i++)
+				if (ev->wd == in[i].wd && ev->len &&
+				    !strcmp(ev->name, base_name(in[i].fname)))
+					changed |= 1 << i;
+		}
+		if (changed)
+			timeout = WATCH_SETTLE_MS;
 	}
-	checksum += CHECKSUM_SEED;
-	fprintf(stdout, "0x%08x\n", checksum);
-	if (verbose) {
-		fprintf(stdout, "00000000  %02x %02x %02x %02x\n",
-			checksum & 0xff, (checksum >> 8) & 0xff,
-			(checksum >> 16) & 0xff, checksum >> 24);
-		fprintf(stdout, "old checksum: 0x%08x, %smatching\n",
-			old_checksum, old_checksum == checksum ? "" : "NOT ");
+}
+
+/* Write (part of) the image in place, to the output file or all devices. */
+static int write_update(const struct b0_image *img, off_t file_size,
+			const struct watch_output *out, uint64_t *bytes)
+{
+	struct b0_dev_stats st;
+	int fd, ret;
+
+	if (!out->fname) {
+		ret = write_devices(out->devices, out->nr_devices, img,
+				    out->dev_opts, out->quiet) ? -EIO : 0;
+		*bytes = device_bytes(out->devices, out->nr_devices);
+		return ret;
 	}
 
-	return old_checksum != checksum;
+	fd = b0_open_device(out->fname);
+	if (fd < 0)
+		return fd;
+	ret = b0_write_device(img, fd, out->dev_opts, &st);
+	*bytes = st.bytes;
+	/* the firmware blob might have grown or shrunk */
+	if (!ret && ftruncate(fd, file_size))
+		ret = -errno;
+	if (close(fd) && !ret)
+		ret = -errno;
+
+	return ret;
 }
 
-static int copy_boot0(FILE *outf, const char *boot0fname, bool patch)
+/*
+ * Rebuild the image whenever an input file changes. Only the changed parts
+ * of the firmware blob get replaced and written, with the checksum updated
+ * from the sums of the parts. A new boot0 means reassembling everything.
+ */
+static int watch_inputs(struct watch_input *in, int nr,
+			struct b0_options *opts, struct b0_image *img,
+			const struct watch_output *out)
 {
-	char *buffer;
-	ssize_t size;
-	int nr_patches;
-	uint32_t checksum = 0;
-
-	while (true) {			/* loop to potentially undo patching */
-		size = read_file(boot0fname, &buffer);
-		if (size < 0)
-			return size;
-
-		if (size > BOOT0_SIZE) {
-			fprintf(stderr,
-				"boot0 is bigger than 32K (%zd Bytes)\n", size);
-			return -1;
+	struct b0_component comp;
+	struct b0_image dirty, full;
+	unsigned int regions;
+	uint64_t start, bytes;
+	bool reassemble;
+	int fd, changed, i, ret;
+
+	fd = watch_setup(in, nr);
+	if (fd < 0)
+		return fd;
+	if (!out->quiet)
+		fprintf(stderr, "watching %d input files\n", nr);
+
+	for (;;) {
+		changed = watch_wait(fd, in, nr);
+		if (changed < 0) {
+			ret = changed;
+			break;
 		}
 
-		if (patch) {
-			nr_patches = patch_boot0((void *)buffer,
-						 BOOT0_END_KB * 2,
-						 BOOT0_END_KB * 2);
-			if (nr_patches == 2)		/* already patched */
-				break;
-
-			nr_patches = patch_boot0((void *)buffer,
-						 UBOOT_OFFSET_KB * 2,
-						 BOOT0_END_KB * 2);
-			if (nr_patches != 2) {		/* something's wrong */
-				patch = false;
-				continue;		/* reload file */
+		start = now_ns();
+		regions = 0;
+		reassemble = false;
+		for (i = 0; i < nr; i++) {
+			if (!(changed & (1 << i)))
+				continue;
+			/* keep the old one while it is being rewritten */
+			if (load_component(in[i].name, in[i].fname, &comp,
+					   out->quiet, NULL))
+				continue;
+			free((void *)in[i].comp->data);
+			*in[i].comp = comp;
+			if (in[i].region < 0)
+				reassemble = true;
+			else
+				regions |= 1U << in[i].region;
+		}
+		if (!regions && !reassemble)
+			continue;
+
+		ret = reassemble ? -EAGAIN :
+			b0_update_image(img, opts, regions, &dirty);
+		if (ret == -EAGAIN) {
+			ret = b0_assemble(opts, &full);
+			if (!ret) {
+				b0_free_image(img);
+				*img = full;
+				dirty = full;
 			}
-			checksum = 1;
-		} else {
-			nr_patches = patch_boot0((void *)buffer,
-						 UBOOT_OFFSET_KB * 2,
-						 UBOOT_OFFSET_KB * 2);
-			if (nr_patches == 2)		/* all fine */
-				break;
-
-			nr_patches = patch_boot0((void *)buffer,
-						 BOOT0_END_KB * 2,
-						 BOOT0_END_KB * 2);
-			if (nr_patches != 2)		/* unknown boot0 */
-				break;			/* proceed unaltered */
-
-			/* patched boot0, revert to old U-Boot position */
-			nr_patches = patch_boot0((void *)buffer,
-						 BOOT0_END_KB * 2,
-						 UBOOT_OFFSET_KB * 2);
-			checksum = 1;
-			patch = false;
 		}
-		break;
-	}
-	if (checksum) {
-		checksum = calc_checksum(buffer, 12);
-		checksum += CHECKSUM_SEED;
-		checksum += calc_checksum(buffer + 16, size - 16);
-		((uint32_t *)buffer)[3] = htole32(checksum);
-	}
+		if (ret) {
+			fprintf(stderr, "cannot update image: %s\n",
+				strerror(-ret));
+			continue;
+		}
 
-	fwrite(buffer, size, 1, outf);
+		ret = write_update(&dirty, img->size, out, &bytes);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", out->fname ? out->fname :
+				"writing devices", strerror(-ret));
+			continue;
+		}
+		if (!out->quiet)
+			fprintf(stderr, "image updated in %.1f ms: %ju Bytes "
+				"written, checksum 0x%08x\n",
+				(now_ns() - start) / 1e6, (uintmax_t)bytes,
+				img->checksum);
+	}
 
-	free(buffer);
-	return (int)patch;
+	close(fd);
+	return ret;
 }
 
+enum {
+	OPT_CACHE_SIZE = 0x100,
+	OPT_HARDLINK,
+	OPT_IO,
+	OPT_QUEUE_DEPTH,
+	OPT_DELTA,
+	OPT_DISCARD,
+	OPT_THREADS,
+	OPT_STATS,
+};
+
 int main(int argc, char **argv)
 {
 	static const struct option lopts[] = {
@@ -399,21 +549,54 @@ int main(int argc, char **argv)
 		{ "partition",	1, 0, 'p' },
 		{ "efi-partition",	1, 0, 'P' },
 		{ "device",	1, 0, 'D' },
+		{ "cache",	1, 0, 'C' },
+		{ "cache-size",	1, 0, OPT_CACHE_SIZE },
+		{ "hardlink",	0, 0, OPT_HARDLINK },
+		{ "io",		1, 0, OPT_IO },
+		{ "queue-depth",	1, 0, OPT_QUEUE_DEPTH },
+		{ "delta",	0, 0, OPT_DELTA },
+		{ "discard",	0, 0, OPT_DISCARD },
+		{ "compress",	1, 0, 'z' },
+		{ "threads",	1, 0, OPT_THREADS },
+		{ "timestamp",	1, 0, 'T' },
+		{ "stats",	2, 0, OPT_STATS },
+		{ "watch",	0, 0, 'w' },
 		{ NULL, 0, 0, 0 },
 	};
-	uint32_t *header;
-	uint32_t checksum = 0;
-	off_t offset, part_size = -1;
+	struct b0_options opts;
+	struct b0_image img;
+	struct b0_cache cache;
+	const char *fnames[B0_NR_COMPONENTS];
+	uint8_t hashes[B0_NR_COMPONENTS][SHA256_DIGEST_SIZE];
+	bool present[B0_NR_COMPONENTS];
+	char key[B0_CACHE_KEY_LEN];
+	const char *cache_dir = NULL;
+	uint64_t cache_size_mb = 256;
+	enum b0_link_mode link_mode = B0_LINK_COPY;
+	bool cached = false;
 	const char *uboot_fname = NULL, *boot0_fname = NULL, *dram_fname = NULL;
 	const char *sram_fname = NULL, *chksum_fname = NULL, *out_fname = NULL;
 	const char *arisc_addr = NULL, *device_fname = NULL;
-	char *uboot_buf = NULL;
-	uint32_t *dram_buf = NULL, *sram_buf = NULL;
-	ssize_t uboot_size, sram_size, dram_size;
+	struct device_job devices[MAX_DEVICES] = {};
+	int nr_devices = 0;
+	struct b0_dev_options dev_opts;
+	bool use_stdio = false;
+	struct b0_compress_options copts;
+	struct b0_stats stats;
+	struct b0_stats_mark mark;
+	bool stats_json = false;
+	struct watch_input inputs[B0_NR_COMPONENTS];
+	struct watch_output watch_out = { };
+	struct b0_dev_options watch_opts;
+	bool watch = false, spliced = false;
+	int nr_inputs = 0;
 	FILE *outf;
-	int ch;
-	bool quiet = false, embedded_header = false, patched_boot0 = false;
-	bool efi_part = false;
+	int ch, ret;
+	bool quiet = false;
+
+	b0_init_options(&opts);
+	b0_dev_init_options(&dev_opts);
+	b0_compress_init_options(&copts);
 
 	if (argc <= 1) {
 		/* with no arguments at all: default to showing usage help */
@@ -421,7 +604,7 @@ int main(int argc, char **argv)
 		return 0;
 	}
 
-	while ((ch = getopt_long(argc, argv, "heqo:u:c:b:B:s:d:a:p:P:D:",
+	while ((ch = getopt_long(argc, argv, "heqwo:u:c:b:B:s:d:a:p:P:D:C:z:T:",
 				 lopts, NULL)) != -1) {
 		switch(ch) {
 		case '?':
@@ -434,7 +617,7 @@ int main(int argc, char **argv)
 			out_fname = optarg;
 			break;
 		case 'B':
-			patched_boot0 = true;
+			opts.patch_boot0 = true;
 			/* fall through */
 		case 'b':
 			boot0_fname = optarg;
@@ -455,24 +638,93 @@ int main(int argc, char **argv)
 			quiet = true;
 			break;
 		case 'e':
-			embedded_header = true;
+			opts.embedded_header = true;
+			break;
+		case 'w':
+			watch = true;
 			break;
 		case 'a':
 			arisc_addr = optarg;
 			break;
+		case 'T':
+			opts.stamp_addr = strtoul(optarg, NULL, 0);
+			break;
 		case 'P':
-			efi_part = true;
+			opts.efi_part = true;
 			/* fall through */
 		case 'p':
-			part_size = atoi(optarg);
+			opts.part_size_mb = atoi(optarg);
 			break;
 		case 'D':
+			if (nr_devices == MAX_DEVICES) {
+				fprintf(stderr, "too many devices\n");
+				return 1;
+			}
+			devices[nr_devices++].fname = optarg;
 			device_fname = optarg;
 			break;
+		case 'C':
+			cache_dir = optarg;
+			break;
+		case OPT_CACHE_SIZE:
+			cache_size_mb = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_HARDLINK:
+			link_mode = B0_LINK_HARD;
+			break;
+		case OPT_IO:
+			if (!strcmp(optarg, "auto")) {
+				dev_opts.backend = B0_DEV_AUTO;
+			} else if (!strcmp(optarg, "uring")) {
+				dev_opts.backend = B0_DEV_URING;
+			} else if (!strcmp(optarg, "pwritev")) {
+				dev_opts.backend = B0_DEV_PWRITEV;
+			} else if (!strcmp(optarg, "stdio")) {
+				use_stdio = true;
+			} else {
+				fprintf(stderr, "unknown I/O backend %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case OPT_QUEUE_DEPTH:
+			dev_opts.queue_depth = strtoul(optarg, NULL, 0);
+			if (dev_opts.queue_depth < 1 ||
+			    dev_opts.queue_depth > 1024) {
+				fprintf(stderr, "queue depth must be 1-1024\n");
+				return 1;
+			}
+			break;
+		case OPT_DELTA:
+			dev_opts.delta = true;
+			break;
+		case OPT_DISCARD:
+			dev_opts.discard = true;
+			break;
+		case 'z':
+			if (b0_parse_compression(optarg, &copts)) {
+				fprintf(stderr, "unsupported compression %s\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case OPT_THREADS:
+			copts.threads = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_STATS:
+			if (optarg && strcmp(optarg, "json")) {
+				fprintf(stderr, "unknown stats format %s\n",
+					optarg);
+				return 1;
+			}
+			b0_stats_init(&stats);
+			opts.stats = &stats;
+			stats_json = optarg != NULL;
+			break;
 		}
 	}
 
-	if (embedded_header && !uboot_fname) {
+	if (opts.embedded_header && !uboot_fname) {
 		fprintf(stderr, "must provide U-Boot file (-u) with embedded header (-e)\n");
 		usage(argv[0], stderr);
 		return 2;
@@ -481,236 +733,243 @@ int main(int argc, char **argv)
 	if (chksum_fname)
 		return checksum_file(chksum_fname, !quiet);
 
+	if (dev_opts.delta && (use_stdio || !device_fname)) {
+		fprintf(stderr, "--delta needs a device (-D) and cannot be used with --io stdio\n");
+		return 1;
+	}
+
+	if (dev_opts.discard && (use_stdio || !device_fname)) {
+		fprintf(stderr, "--discard needs a device (-D) and cannot be used with --io stdio\n");
+		return 1;
+	}
+
+	if (copts.type != B0_COMPRESS_NONE && device_fname) {
+		fprintf(stderr, "cannot write compressed output to a device\n");
+		return 1;
+	}
+
+	if (watch && ((!out_fname && !device_fname) ||
+		      copts.type != B0_COMPRESS_NONE)) {
+		fprintf(stderr, "--watch needs an uncompressed output file (-o) or device (-D)\n");
+		return 1;
+	}
+
+	/* the updates rely on b0dev writing the header blocks last */
+	if (watch && use_stdio && device_fname) {
+		fprintf(stderr, "--watch cannot be used with --io stdio\n");
+		return 1;
+	}
+
 	if (!sram_fname) {
 		fprintf(stderr, "boot0 requires an \"SCP\" binary.\n");
 		usage(argv[0], stderr);
 		return 2;
 	}
 
-	if (uboot_fname) {
-		if (!quiet)
-			fprintf(stderr, "U-Boot: %s: ", uboot_fname);
+	if (dram_fname && (!strncmp(dram_fname, "trampoline64:", 13) ||
+			   !strncmp(dram_fname, "trampoline32:", 13))) {
+		bool aarch64 = dram_fname[10] == '6';
 
-		uboot_size = read_file(uboot_fname, &uboot_buf);
-		if (uboot_size < 0) {
-			perror(quiet ? uboot_fname : "");
-			return 3;
-		}
-
-		if (!quiet)
-			fprintf(stderr, "%zd Bytes\n", uboot_size);
+		opts.dram_type = aarch64 ? B0_DRAM_TRAMPOLINE64 :
+					   B0_DRAM_TRAMPOLINE32;
+		opts.trampoline_addr = strtoul(dram_fname + 13, NULL, 0);
+	}
 
-		uboot_buf = realloc_zero(uboot_buf, &uboot_size,
-					 ALIGN(uboot_size, 512));
+	if (opts.stamp_addr &&
+	    (opts.dram_type == B0_DRAM_BINARY || opts.stamp_addr % 8)) {
+		fprintf(stderr, "--timestamp needs a DRAM trampoline and an 8 byte aligned address\n");
+		return 2;
+	}
 
-		/* Use the buffer within uboot_buf for holding the header */
-		if (embedded_header) {
-			header = (uint32_t *)uboot_buf;
-			checksum += calc_checksum(uboot_buf + HEADER_SIZE,
-						  uboot_size - HEADER_SIZE);
-			offset = uboot_size;
-		} else {
-			header = calloc(HEADER_SIZE, 1);
-			checksum += calc_checksum(uboot_buf, uboot_size);
-			offset = uboot_size + HEADER_SIZE;
-		}
-	} else {
-		offset = HEADER_SIZE;
-		header = calloc(HEADER_SIZE, 1);
+	if (arisc_addr) {
+		opts.arisc_entry = true;
+		opts.arisc_addr = strtoul(arisc_addr, NULL, 0);
 	}
 
-	/* Assuming an embedded header already has a branch instruction. */
-	if (!embedded_header) {
-		uint32_t br_ins;
-		bool jump32 = false;
+	opts.device = device_fname != NULL;
 
-		br_ins = jump32 ? 0xea000000 : 0x14000000;
-		br_ins |= (jump32 ? HEADER_SIZE - 8 : HEADER_SIZE) / 4;
-		header[HEADER_JUMP_INS] = htole32(br_ins);
+	if (cache_dir) {
+		ret = b0_cache_open(&cache, cache_dir, cache_size_mb << 20);
+		if (ret) {
+			fprintf(stderr, "%s: %s, not using cache\n",
+				cache_dir, strerror(-ret));
+			cache_dir = NULL;
+		}
 	}
 
-	if (dram_fname) {
-		if (!quiet)
-			fprintf(stderr, "DRAM  : %s", dram_fname);
-
-		if (!strncmp(dram_fname, "trampoline64:", 13) ||
-		    !strncmp(dram_fname, "trampoline32:", 13)) {
-			bool aarch64 = dram_fname[10] == '6';
-			uint32_t address;
-			char *endptr;
-
-			address = strtoul(dram_fname + 13, &endptr, 0);
-
-			dram_buf = calloc(512, 1);
-			dram_size = 512;
-			if (aarch64) {
-					/* ldr	x16, 0x8 */
-				dram_buf[0] = htole32(0x58000050);
-					/* br	x16 */
-				dram_buf[1] = htole32(0xd61f0200);
-				dram_buf[2] = htole32(address);
-					/* high word is always 0 */
-				dram_buf[3] = 0;
-			} else {
-					/* ldr	r12, [pc, #-0] */
-				dram_buf[0] = htole32(0xe51fc000);
-					/* bx	r12 */
-				dram_buf[1] = htole32(0xe12fff1c);
-				dram_buf[2] = htole32(address);
-			}
-			if (!quiet)
-				fprintf(stderr, "\n");
+	if (cache_dir) {
+		fnames[B0_COMP_BOOT0] = boot0_fname;
+		fnames[B0_COMP_UBOOT] = uboot_fname;
+		fnames[B0_COMP_DRAM] = opts.dram_type == B0_DRAM_BINARY ?
+				       dram_fname : NULL;
+		fnames[B0_COMP_SRAM] = sram_fname;
+
+		b0_stats_begin(opts.stats, &mark);
+		ret = cache_lookup(&cache, fnames, &opts, hashes, present,
+				   key, &img);
+		b0_stats_end(opts.stats, B0_PHASE_CACHE, &mark, 0);
+		img.stats = opts.stats;
+		if (ret && ret != -ENOENT) {
+			fprintf(stderr, "cache lookup failed: %s\n",
+				strerror(-ret));
+			memset(present, 0, sizeof(present));
 		} else {
-			dram_size = read_file(dram_fname, (char**)&dram_buf);
-			if (dram_size < 0) {
-				perror(quiet ? dram_fname : "");
-				return 3;
-			}
-
+			cached = !ret;
 			if (!quiet)
-				fprintf(stderr, "%zd Bytes\n", dram_size);
+				fprintf(stderr, "cache %s: %s\n",
+					cached ? "hit" : "miss", key);
+			if (cached && !watch)
+				goto write_output;
+			/* watching needs the components themselves */
+			if (cached)
+				b0_free_image(&img);
 		}
-
-		dram_buf = realloc_zero(dram_buf, &dram_size,
-					ALIGN(dram_size, 512));
-		checksum += calc_checksum(dram_buf, dram_size);
-
-		header[HEADER_SECS + 0] = htole32(offset);
-		header[HEADER_SECS + 1] = htole32(dram_size);
-
-		offset += dram_size;
 	}
 
-	if (!quiet)
-		fprintf(stderr, "SRAM  : %s: ", sram_fname);
-
-	sram_size = read_file(sram_fname, (char **)&sram_buf);
-	if (sram_size < 0) {
-		perror(quiet ? sram_fname : "");
+	if (uboot_fname &&
+	    load_component("U-Boot", uboot_fname, &opts.uboot, quiet,
+			   opts.stats))
 		return 3;
-	}
-
-	if (!quiet)
-		fprintf(stderr, "%zd Bytes\n", sram_size);
-
-	if (arisc_addr)
-		sram_size += 0x4000;
 
-	sram_buf = realloc_zero(sram_buf, &sram_size,
-				ALIGN(sram_size, 512));
-
-	/*
-	 * Move the loaded code to the SRAM part behind the OpenRISC
-	 * exception vector part, which is in fact only sparsely
-	 * implemented on the Allwinner SoCs.
-	 * Add an OpenRISC jump instruction into the arisc entry point.
-	 */
-	if (arisc_addr) {
-		uint32_t address;
-		char *endptr;
-
-		address = strtoul(arisc_addr, &endptr, 0);
-		memmove(sram_buf + 0x1000, sram_buf, sram_size - 0x4000);
-		memset(sram_buf, 0, 0x4000);
-			/* OpenRISC: l.j <offset> */
-		sram_buf[64] = htole32((address - 0x40100) / 4);
-			/* OpenRISC: l.nop (delay slot) */
-		sram_buf[65] = htole32(0x15000000);
+	if (dram_fname) {
+		if (opts.dram_type != B0_DRAM_BINARY) {
+			if (!quiet)
+				fprintf(stderr, "DRAM  : %s\n", dram_fname);
+		} else if (load_component("DRAM  ", dram_fname, &opts.dram,
+					  quiet, opts.stats)) {
+			return 3;
+		}
 	}
-	checksum += calc_checksum(sram_buf, sram_size);
 
-	header[HEADER_SECS + 8] = htole32(offset);
-	header[HEADER_SECS + 9] = htole32(sram_size);
+	if (load_component("SRAM  ", sram_fname, &opts.sram, quiet,
+			   opts.stats))
+		return 3;
 
-	offset += sram_size;
+	if (boot0_fname &&
+	    load_component("boot0 ", boot0_fname, &opts.boot0, true,
+			   opts.stats))
+		return 3;
 
-	/* fill the static part of the header */
-	strncpy((char*)&header[HEADER_MAGIC], "uboot", MAGIC_SIZE);
-	header[HEADER_CHECKSUM] = CHECKSUM_SEED;
-	header[HEADER_ALIGN] = htole32(BOOT0_ALIGN);
-	header[HEADER_LOADADDR] = htole32(UBOOT_LOAD_ADDR);
-	header[HEADER_PRIMSIZE] = htole32(offset);
+	ret = b0_assemble(&opts, &img);
+	if (ret == -EFBIG) {
+		fprintf(stderr, "boot0 is bigger than 32K (%zd Bytes)\n",
+			opts.boot0.size);
+		return 3;
+	}
+	if (ret) {
+		fprintf(stderr, "cannot assemble image: %s\n", strerror(-ret));
+		return 3;
+	}
 
-	offset = ALIGN(offset, BOOT0_ALIGN);
-	header[HEADER_LENGTH] = htole32(offset);
-	offset -= le32toh(header[HEADER_PRIMSIZE]);
+	if (cache_dir && present[B0_COMP_SRAM] && !cached) {
+		b0_stats_begin(opts.stats, &mark);
+		ret = b0_cache_store(&cache, key, &img, hashes, present);
+		b0_stats_end(opts.stats, B0_PHASE_CACHE, &mark, 0);
+		if (ret) {
+			fprintf(stderr, "cannot store image in cache: %s\n",
+				strerror(-ret));
+		} else {
+			cached = true;
+		}
+	}
 
-	checksum += calc_checksum(header, HEADER_SIZE);
-	header[HEADER_CHECKSUM] = htole32(checksum);
+write_output:
+	/* a regular output file can share the data with the cache entry */
+	if (cached && out_fname && !device_fname && !watch &&
+	    copts.type == B0_COMPRESS_NONE) {
+		b0_stats_begin(opts.stats, &mark);
+		ret = b0_cache_link(&cache, key, out_fname, link_mode);
+		b0_stats_end(opts.stats, B0_PHASE_CACHE, &mark, 0);
+		if (!ret)
+			goto out_free;
+		fprintf(stderr, "%s: %s, writing it instead\n",
+			out_fname, strerror(-ret));
+	}
 
 	if (device_fname) {
-		outf = fopen(device_fname, "r+b");
-		if (!outf) {
-			perror(device_fname);
-			return 2;
-		}
-		out_fname = NULL;
-	} else {
-		if (out_fname)
-			outf = fopen(out_fname, "wb");
-		else
-			outf = stdout;
+		/* the device writers do their own zero-filling */
+		b0_stats_begin(opts.stats, &mark);
+		ret = write_devices(devices, nr_devices, &img,
+				    use_stdio ? NULL : &dev_opts, quiet) ? 2 : 0;
+		b0_stats_end(opts.stats, B0_PHASE_WRITE, &mark,
+			     device_bytes(devices, nr_devices));
+		if (watch && !ret)
+			goto watch;
+		goto out_free;
 	}
 
+	if (out_fname)
+		outf = fopen(out_fname, "wb");
+	else
+		outf = stdout;
+
 	if (outf == NULL) {
 		perror(out_fname);
 		return 5;
 	}
 
-	if (part_size != -1)
-		create_part_table(outf, part_size * 1024 * 1024, efi_part,
-				  patched_boot0);
-	else if (device_fname)
-		pseek(outf, 512);
-
-	if (boot0_fname) {
-		int ret;
-
-		if (device_fname || part_size != -1)
-			pseek(outf, BOOT0_OFFSET - 512);
-
-		ret = copy_boot0(outf, boot0_fname, patched_boot0);
-		if (ret < 0)
-			perror(boot0_fname);
-		else
-			patched_boot0 = ret;
-
-		if (!patched_boot0)
-			pseek(outf, (UBOOT_OFFSET_KB - BOOT0_END_KB) * 1024);
+	if (copts.type != B0_COMPRESS_NONE) {
+		b0_stats_begin(opts.stats, &mark);
+		ret = b0_write_compressed(&img, outf, &copts);
+		b0_stats_end(opts.stats, B0_PHASE_WRITE, &mark, img.size);
 	} else {
-		if (device_fname || part_size != -1)
-			pseek(outf, UBOOT_OFFSET_KB * 1024 - 512);
+		/* a pipe on stdout gets the image pages, without copies */
+		ret = outf == stdout ? b0_splice_image(&img, STDOUT_FILENO) :
+				       -EINVAL;
+		spliced = ret != -EINVAL && ret != -ENOSYS;
+		if (!spliced)
+			ret = b0_write_image(&img, outf, false);
 	}
 
-	if (!embedded_header)
-		fwrite(header, HEADER_SIZE, 1, outf);
-
-	if (uboot_fname)
-		fwrite(uboot_buf, uboot_size, 1, outf);
-	if (dram_fname)
-		fwrite(dram_buf, dram_size, 1, outf);
-	fwrite(sram_buf, sram_size, 1, outf);
-
-	if (device_fname) {
-		fill_zeroes(outf, offset);
-	} else {
-		long fpos;
-
-		pseek(outf, offset);
-
-		fpos = ftell(outf);
-		if (fpos >= 0 && ftruncate(fileno(outf), fpos))
-			perror("error truncating output file");
+	b0_stats_begin(opts.stats, &mark);
+	/* a full disk may only show up when the buffer gets flushed */
+	if (fclose(outf) && !ret)
+		ret = -errno;
+	b0_stats_end(opts.stats, B0_PHASE_WRITE, &mark, 0);
+	if (ret) {
+		errno = -ret;
+		perror("error writing output file");
+		ret = 2;
+		goto out_free;
 	}
+	if (watch)
+		goto watch;
+	goto out_free;
+
+watch:
+	/* updates go out as deltas, with the header blocks written last */
+	watch_opts = dev_opts;
+	watch_opts.delta = true;
+	watch_out.fname = device_fname ? NULL : out_fname;
+	watch_out.devices = devices;
+	watch_out.nr_devices = nr_devices;
+	watch_out.dev_opts = &watch_opts;
+	watch_out.quiet = quiet;
+	if (uboot_fname)
+		inputs[nr_inputs++] = (struct watch_input){ "U-Boot",
+			uboot_fname, &opts.uboot, B0_REGION_UBOOT };
+	if (opts.dram.data)
+		inputs[nr_inputs++] = (struct watch_input){ "DRAM  ",
+			dram_fname, &opts.dram, B0_REGION_DRAM };
+	inputs[nr_inputs++] = (struct watch_input){ "SRAM  ", sram_fname,
+		&opts.sram, B0_REGION_SRAM };
+	if (boot0_fname)
+		inputs[nr_inputs++] = (struct watch_input){ "boot0 ",
+			boot0_fname, &opts.boot0, -1 };
+	ret = watch_inputs(inputs, nr_inputs, &opts, &img, &watch_out) ? 4 : 0;
+
+out_free:
+	if (opts.stats)
+		b0_stats_print(opts.stats, stderr, stats_json);
+	if (cache_dir)
+		b0_cache_close(&cache);
+	/* freeing could scribble over pages the pipe still references */
+	if (!spliced)
+		b0_free_image(&img);
+	free((void *)opts.uboot.data);
+	free((void *)opts.sram.data);
+	free((void *)opts.dram.data);
+	free((void *)opts.boot0.data);
 
-	fclose(outf);
-
-	free(uboot_buf);
-	free(sram_buf);
-	free(dram_buf);
-
-	if (!embedded_header)
-		free(header);
-
-	return 0;
+	return ret;
 }
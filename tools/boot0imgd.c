@@ -0,0 +1,686 @@
+/*
+ * boot0imgd: serve boot0img image assembly requests over a Unix socket
+ *
+ * Copyright 2016 Andre Przywara <osp@andrep.de>
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libboot0img.h"
+
+#define MAX_REQUEST	4096
+#define MAX_ARGS	64
+
+/*
+ * A component file kept in memory. Entries are immutable once loaded:
+ * when the file changes on disk, a new entry replaces the old one in the
+ * list, and the old one gets freed when its last user drops it.
+ */
+struct resident {
+	struct resident *next;
+	char *path;
+	char *data;
+	size_t size;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	int refcount;
+};
+
+static struct resident *residents;
+static pthread_mutex_t residents_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void put_resident(struct resident *res)
+{
+	bool last;
+
+	pthread_mutex_lock(&residents_lock);
+	last = --res->refcount == 0;
+	pthread_mutex_unlock(&residents_lock);
+
+	if (last) {
+		free(res->path);
+		free(res->data);
+		free(res);
+	}
+}
+
+static bool resident_matches(const struct resident *res, const struct stat *st)
+{
+	return res->dev == st->st_dev && res->ino == st->st_ino &&
+	       res->size == (size_t)st->st_size &&
+	       res->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       res->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * Look up a component file, (re-)loading it if it is not resident yet or
+ * has changed on disk. The caller must put_resident() the result.
+ */
+static int get_resident(const char *path, struct resident **resp)
+{
+	struct resident *res, **prev;
+	struct stat st;
+	ssize_t size;
+
+	if (stat(path, &st))
+		return -errno;
+
+	pthread_mutex_lock(&residents_lock);
+	for (res = residents; res; res = res->next) {
+		if (strcmp(res->path, path))
+			continue;
+		if (resident_matches(res, &st)) {
+			res->refcount++;
+			pthread_mutex_unlock(&residents_lock);
+			*resp = res;
+			return 0;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&residents_lock);
+
+	res = calloc(1, sizeof(*res));
+	if (!res)
+		return -ENOMEM;
+	size = b0_read_file(path, &res->data);
+	if (size < 0) {
+		free(res);
+		return size;
+	}
+	res->path = strdup(path);
+	res->size = size;
+	res->dev = st.st_dev;
+	res->ino = st.st_ino;
+	res->mtime = st.st_mtim;
+	res->refcount = 2;		/* the list and the caller */
+
+	/* replace a stale entry, racing loaders just both get replaced */
+	pthread_mutex_lock(&residents_lock);
+	for (prev = &residents; *prev; prev = &(*prev)->next) {
+		if (!strcmp((*prev)->path, path)) {
+			struct resident *old = *prev;
+
+			*prev = old->next;
+			if (--old->refcount == 0) {
+				free(old->path);
+				free(old->data);
+				free(old);
+			}
+			break;
+		}
+	}
+	res->next = residents;
+	residents = res;
+	pthread_mutex_unlock(&residents_lock);
+
+	*resp = res;
+	return 0;
+}
+
+struct request {
+	struct b0_options opts;
+	struct resident *res[4];	/* boot0, U-Boot, DRAM, SRAM */
+	const char *out_fname;
+	const char *device_fname;
+};
+
+enum { RES_BOOT0, RES_UBOOT, RES_DRAM, RES_SRAM };
+
+static int use_resident(struct request *req, int idx, const char *path,
+			struct b0_component *comp)
+{
+	int ret;
+
+	if (req->res[idx])
+		put_resident(req->res[idx]);
+	req->res[idx] = NULL;
+
+	ret = get_resident(path, &req->res[idx]);
+	if (ret)
+		return ret;
+
+	comp->data = req->res[idx]->data;
+	comp->size = req->res[idx]->size;
+
+	return 0;
+}
+
+struct request_opt {
+	char short_opt;
+	const char *long_opt;
+	bool has_arg;
+	bool path;		/* the argument is a file name */
+};
+
+static const struct request_opt request_opts[] = {
+	{ 'u', "uboot", true, true },
+	{ 's', "sram", true, true },
+	{ 'd', "dram", true, true },
+	{ 'o', "output", true, true },
+	{ 'b', "boot0", true, true },
+	{ 'B', "boot0-patch", true, true },
+	{ 'e', "embedded_header", false, false },
+	{ 'a', "arisc_entry", true, false },
+	{ 'p', "partition", true, false },
+	{ 'P', "efi-partition", true, false },
+	{ 'D', "device", true, true },
+	{ 'T', "timestamp", true, false },
+	{ 0 }
+};
+
+static const struct request_opt *find_request_opt(const char *tok)
+{
+	const struct request_opt *opt;
+
+	if (tok[0] != '-')
+		return NULL;
+	for (opt = request_opts; opt->short_opt; opt++) {
+		if (tok[1] == opt->short_opt && !tok[2])
+			return opt;
+		if (tok[1] == '-' && !strcmp(tok + 2, opt->long_opt))
+			return opt;
+	}
+
+	return NULL;
+}
+
+/* The DRAM "file" can also be a trampoline to generate. */
+static bool is_trampoline(const struct request_opt *opt, const char *arg)
+{
+	return opt->short_opt == 'd' &&
+	       (!strncmp(arg, "trampoline64:", 13) ||
+		!strncmp(arg, "trampoline32:", 13));
+}
+
+/*
+ * Parse a request line, which uses the same options as boot0img. We can't
+ * use getopt() here, since that is not thread safe.
+ */
+static int parse_request(char *line, struct request *req, const char **errmsg)
+{
+	char *argv[MAX_ARGS], *saveptr, *tok, *arg;
+	const struct request_opt *opt;
+	int argc = 0, i, ret;
+
+	b0_init_options(&req->opts);
+
+	for (tok = strtok_r(line, " \t\r\n", &saveptr); tok;
+	     tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		if (argc == MAX_ARGS) {
+			*errmsg = "too many arguments";
+			return -E2BIG;
+		}
+		argv[argc++] = tok;
+	}
+
+	for (i = 0; i < argc; i++) {
+		opt = find_request_opt(argv[i]);
+		if (!opt) {
+			*errmsg = "unknown option";
+			return -EINVAL;
+		}
+		arg = NULL;
+		if (opt->has_arg) {
+			if (++i == argc) {
+				*errmsg = "missing argument";
+				return -EINVAL;
+			}
+			arg = argv[i];
+		}
+		/* our working directory has nothing to do with the client's */
+		if (opt->path && arg[0] != '/' && !is_trampoline(opt, arg)) {
+			*errmsg = "file names must be absolute";
+			return -EINVAL;
+		}
+
+		ret = 0;
+		switch (opt->short_opt) {
+		case 'u':
+			ret = use_resident(req, RES_UBOOT, arg,
+					   &req->opts.uboot);
+			break;
+		case 's':
+			ret = use_resident(req, RES_SRAM, arg,
+					   &req->opts.sram);
+			break;
+		case 'd':
+			if (is_trampoline(opt, arg)) {
+				req->opts.dram_type = arg[10] == '6' ?
+					B0_DRAM_TRAMPOLINE64 :
+					B0_DRAM_TRAMPOLINE32;
+				req->opts.trampoline_addr =
+					strtoul(arg + 13, NULL, 0);
+			} else {
+				ret = use_resident(req, RES_DRAM, arg,
+						   &req->opts.dram);
+			}
+			break;
+		case 'o':
+			req->out_fname = arg;
+			break;
+		case 'B':
+			req->opts.patch_boot0 = true;
+			/* fall through */
+		case 'b':
+			ret = use_resident(req, RES_BOOT0, arg,
+					   &req->opts.boot0);
+			break;
+		case 'e':
+			req->opts.embedded_header = true;
+			break;
+		case 'a':
+			req->opts.arisc_entry = true;
+			req->opts.arisc_addr = strtoul(arg, NULL, 0);
+			break;
+		case 'P':
+			req->opts.efi_part = true;
+			/* fall through */
+		case 'p':
+			req->opts.part_size_mb = atoi(arg);
+			break;
+		case 'D':
+			req->device_fname = arg;
+			break;
+		case 'T':
+			req->opts.stamp_addr = strtoul(arg, NULL, 0);
+			break;
+		}
+		if (ret) {
+			*errmsg = arg;
+			return ret;
+		}
+	}
+
+	if (!req->opts.sram.data) {
+		*errmsg = "boot0 requires an \"SCP\" binary";
+		return -EINVAL;
+	}
+	if (req->opts.embedded_header && !req->opts.uboot.data) {
+		*errmsg = "must provide U-Boot file (-u) with embedded header (-e)";
+		return -EINVAL;
+	}
+	req->opts.device = req->device_fname != NULL;
+
+	return 0;
+}
+
+static int write_target(const struct request *req, const struct b0_image *img)
+{
+	FILE *outf;
+	int ret;
+
+	if (req->device_fname)
+		outf = fopen(req->device_fname, "r+b");
+	else
+		outf = fopen(req->out_fname, "wb");
+	if (!outf)
+		return -errno;
+
+	ret = b0_write_image(img, outf, req->device_fname != NULL);
+	/* "OK" promises the image is in place, not just in the page cache */
+	if (!ret && (fflush(outf) || fsync(fileno(outf))))
+		ret = -errno;
+	if (fclose(outf) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+/*
+ * Handle one connection: read a single request line, answer with either
+ * "OK <size>\n" followed by the image, "OK <size> <target>\n" when the
+ * image was written to a file or device, or "ERR <message>\n".
+ */
+static void *serve_client(void *arg)
+{
+	int fd = (intptr_t)arg;
+	char line[MAX_REQUEST];
+	struct request req = {};
+	struct b0_image img;
+	const char *errmsg = NULL;
+	size_t len = 0;
+	ssize_t ret;
+	FILE *stream;
+	int i;
+
+	while (len < sizeof(line) - 1) {
+		ret = read(fd, line + len, sizeof(line) - 1 - len);
+		if (ret <= 0)
+			break;
+		len += ret;
+		if (memchr(line + len - ret, '\n', ret))
+			break;
+	}
+	line[len] = 0;
+
+	stream = fdopen(fd, "wb");
+	if (!stream) {
+		close(fd);
+		goto out_put;
+	}
+
+	ret = parse_request(line, &req, &errmsg);
+	if (!ret) {
+		ret = b0_assemble(&req.opts, &img);
+		errmsg = "cannot assemble image";
+	}
+	if (ret) {
+		fprintf(stream, "ERR %s: %s\n", errmsg, strerror(-ret));
+		goto out_close;
+	}
+
+	if (req.out_fname || req.device_fname) {
+		ret = write_target(&req, &img);
+		if (ret)
+			fprintf(stream, "ERR %s: %s\n", req.device_fname ?
+				req.device_fname : req.out_fname,
+				strerror(-ret));
+		else
+			fprintf(stream, "OK %jd %s\n", (intmax_t)img.size,
+				req.device_fname ? req.device_fname :
+						   req.out_fname);
+	} else {
+		fprintf(stream, "OK %jd\n", (intmax_t)img.size);
+		b0_write_image(&img, stream, false);
+	}
+	b0_free_image(&img);
+
+out_close:
+	fclose(stream);
+out_put:
+	for (i = 0; i < 4; i++)
+		if (req.res[i])
+			put_resident(req.res[i]);
+
+	return NULL;
+}
+
+/*
+ * A socket file left behind by a daemon which died refuses connections,
+ * one of a running daemon does not. Anything else is not ours to remove.
+ */
+static bool stale_socket(const struct sockaddr_un *addr)
+{
+	struct stat st;
+	bool stale;
+	int fd;
+
+	if (lstat(addr->sun_path, &st) || !S_ISSOCK(st.st_mode))
+		return false;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	stale = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) &&
+		errno == ECONNREFUSED;
+	close(fd);
+
+	return stale;
+}
+
+static int open_socket(const char *path, bool listening)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (listening) {
+		if (stale_socket(&addr))
+			unlink(path);
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+		    listen(fd, SOMAXCONN)) {
+			close(fd);
+			return -1;
+		}
+	} else if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int serve(const char *sock_path)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int sfd, cfd;
+
+	sfd = open_socket(sock_path, true);
+	if (sfd < 0) {
+		perror(sock_path);
+		return 2;
+	}
+
+	/* clients hanging up early must not kill the daemon */
+	signal(SIGPIPE, SIG_IGN);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	while (true) {
+		cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC);
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+		if (pthread_create(&thread, &attr, serve_client,
+				   (void *)(intptr_t)cfd)) {
+			close(cfd);
+		}
+	}
+
+	close(sfd);
+	return 3;
+}
+
+/*
+ * The server runs in a different directory, so resolve file names on our
+ * side. An output file may not exist yet, then only its directory has to.
+ */
+static char *absolute_path(const char *path)
+{
+	char *dir, *base, *rdir, *ret = NULL;
+
+	ret = realpath(path, NULL);
+	if (ret || errno != ENOENT)
+		return ret;
+
+	dir = strdup(path);
+	base = strdup(path);
+	if (!dir || !base)
+		goto out;
+	rdir = realpath(dirname(dir), NULL);
+	if (rdir && asprintf(&ret, "%s/%s", strcmp(rdir, "/") ? rdir : "",
+			     basename(base)) < 0)
+		ret = NULL;
+	free(rdir);
+out:
+	free(dir);
+	free(base);
+	return ret;
+}
+
+/*
+ * Send the remaining arguments as one request, and copy the image (or the
+ * status line, if written to a target) to stdout.
+ */
+static int client(const char *sock_path, int argc, char **argv)
+{
+	char request[MAX_REQUEST] = "", buf[65536];
+	const struct request_opt *opt = NULL;
+	char *arg, *path;
+	size_t len = 0;
+	ssize_t ret;
+	char *nl;
+	int fd, i;
+
+	for (i = 0; i < argc; i++) {
+		arg = argv[i];
+		path = NULL;
+		if (opt && opt->path && !is_trampoline(opt, arg)) {
+			path = absolute_path(arg);
+			if (!path) {
+				perror(arg);
+				return 1;
+			}
+			arg = path;
+		}
+		opt = opt ? NULL : find_request_opt(arg);
+		if (opt && !opt->has_arg)
+			opt = NULL;
+
+		if (len + strlen(arg) + 2 > sizeof(request)) {
+			fprintf(stderr, "request too long\n");
+			free(path);
+			return 1;
+		}
+		len += sprintf(request + len, "%s%s", i ? " " : "", arg);
+		free(path);
+	}
+	request[len++] = '\n';
+
+	fd = open_socket(sock_path, false);
+	if (fd < 0) {
+		perror(sock_path);
+		return 2;
+	}
+	if (write(fd, request, len) != (ssize_t)len) {
+		perror("sending request");
+		return 2;
+	}
+
+	/* read the status line */
+	len = 0;
+	while (len < sizeof(buf) - 1 &&
+	       (ret = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+		len += ret;
+		buf[len] = 0;
+		if (strchr(buf, '\n'))
+			break;
+	}
+	buf[len] = 0;
+	nl = strchr(buf, '\n');
+	if (!nl || strncmp(buf, "OK ", 3)) {
+		fprintf(stderr, "%s%s", buf, nl ? "" : "\n");
+		return 3;
+	}
+	*nl = 0;
+	if (strchr(buf + 3, ' ')) {		/* written by the server */
+		fprintf(stderr, "%s\n", buf);
+		return 0;
+	}
+
+	len -= nl + 1 - buf;
+	if (len && fwrite(nl + 1, len, 1, stdout) != 1)
+		return 4;
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		if (fwrite(buf, ret, 1, stdout) != 1)
+			return 4;
+
+	close(fd);
+	return ret < 0 ? 4 : 0;
+}
+
+static void usage(const char *progname, FILE *stream)
+{
+	fprintf(stream, "boot0imgd: assemble boot0 images on request\n"
+		"usage: %s [-h] -S socket [file ...]\n"
+		"       %s -C socket -- <boot0img options>\n", progname, progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-S|--serve: listen for requests on this Unix socket\n"
+		"\t-C|--client: send a request to a server on this socket\n\n");
+	fprintf(stream, "The server keeps all component files in memory "
+		"(preloading the ones given),\nand only re-reads them when "
+		"they change on disk.\nA request is one line of boot0img "
+		"options, the image is sent back unless\n-o or -D is given, "
+		"in which case the server writes it directly.\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option lopts[] = {
+		{ "help",	0, 0, 'h' },
+		{ "serve",	1, 0, 'S' },
+		{ "client",	1, 0, 'C' },
+		{ NULL, 0, 0, 0 },
+	};
+	const char *serve_path = NULL, *client_path = NULL;
+	struct resident *res;
+	int ch, ret;
+
+	while ((ch = getopt_long(argc, argv, "hS:C:", lopts, NULL)) != -1) {
+		switch(ch) {
+		case '?':
+			usage(argv[0], stderr);
+			return 1;
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+		case 'S':
+			serve_path = optarg;
+			break;
+		case 'C':
+			client_path = optarg;
+			break;
+		}
+	}
+
+	if (client_path)
+		return client(client_path, argc - optind, argv + optind);
+
+	if (!serve_path) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+
+	for (; optind < argc; optind++) {
+		ret = get_resident(argv[optind], &res);
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", argv[optind],
+				strerror(-ret));
+			return 3;
+		}
+		put_resident(res);
+	}
+
+	return serve(serve_path);
+}
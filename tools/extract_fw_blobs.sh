@@ -4,6 +4,7 @@ if [ "$#" -lt 1 ]
 then
 	echo "usage: $0 <device/image file>"
 	echo "  This will extract boot0.bin and firmware.img"
+	echo "  .xz images are read with b0xz, set B0XZ to point to it"
 	exit 1
 fi
 
@@ -12,8 +13,25 @@ IMAGE="$1"
 UBOOT=19096
 PARTTAB=20480
 
-dd if="$IMAGE" bs=8k skip=1 count=4 of=boot0.bin
-dd if="$IMAGE" bs=1k skip=$UBOOT count=$((PARTTAB-UBOOT)) of=firmware.img
+case "$IMAGE" in
+*.xz)
+	# only decompress the blocks covering boot0 and the firmware
+	B0XZ="${B0XZ:-$(dirname "$0")/b0xz}"
+	# images starting at 8K (like in images/) begin with the boot0 header
+	BASE=0
+	if "$B0XZ" cat -s 4 -l 8 "$IMAGE" | grep -qa eGON.BT0
+	then
+		BASE=8
+	fi
+	"$B0XZ" cat -s $(((8 - BASE) * 1024)) -l 32768 "$IMAGE" > boot0.bin
+	"$B0XZ" cat -s $(((UBOOT - BASE) * 1024)) \
+		-l $(((PARTTAB - UBOOT) * 1024)) "$IMAGE" > firmware.img
+	;;
+*)
+	dd if="$IMAGE" bs=8k skip=1 count=4 of=boot0.bin
+	dd if="$IMAGE" bs=1k skip=$UBOOT count=$((PARTTAB-UBOOT)) of=firmware.img
+	;;
+esac
 
 # We don't need the original partition table, but if people wonder ...
 #dd if="$IMAGE" bs=1k skip=$PARTTAB count=64 of=parttab.bin
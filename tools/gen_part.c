@@ -25,54 +25,10 @@
 #include <fcntl.h>
 #include <string.h>
 #include "nand-part-a20.h"
+#include "nand_mbr.h"
 
 #define MAX_NAME 16
 
-struct CRC32_DATA {
-	uint32_t CRC;
-	uint32_t CRC_32_Tbl[256];
-};
-
-static uint32_t calc_crc32(uint8_t * buffer, uint32_t length)
-{
-	uint32_t i, j;
-	struct CRC32_DATA crc32;
-	uint32_t CRC32 = 0xffffffff;
-	crc32.CRC = 0;
-
-	for (i = 0; i < 256; ++i) {
-		crc32.CRC = i;
-		for (j = 0; j < 8 ; ++j) {
-			if(crc32.CRC & 1)
-				crc32.CRC = (crc32.CRC >> 1) ^ 0xEDB88320;
-			else
-				crc32.CRC >>= 1;
-		}
-		crc32.CRC_32_Tbl[i] = crc32.CRC;
-	}
-
-	CRC32 = 0xffffffff;
-	for (i = 0; i < length; ++i)
-		CRC32 = crc32.CRC_32_Tbl[(CRC32^buffer[i]) & 0xff] ^ (CRC32>>8);
-
-	return CRC32^0xffffffff;
-}
-
-static int write_mbr_copy(FILE *stream, MBR *mbr, int copy)
-{
-	int old_index;
-
-	old_index = mbr->index;
-	mbr->index = copy;
-	mbr->crc32 = calc_crc32((uint8_t *)mbr + 4, sizeof(MBR) - 4);
-
-	fwrite(mbr, sizeof(MBR), 1, stream);
-
-	mbr->index = old_index;
-
-	return 0;
-}
-
 static off_t parse_num(const char* numstr)
 {
 	char *endptr;
@@ -0,0 +1,984 @@
+/*
+ * libboot0img: assemble Allwinner boot0 firmware images in memory
+ *
+ * Copyright 2016 Andre Przywara <osp@andrep.de>
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "libboot0img.h"
+#include "b0stats.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+uint32_t b0_calc_checksum(const void *buffer, size_t length)
+{
+	const uint32_t *buf = buffer;
+	uint32_t sum = 0;
+	size_t i;
+
+	for (i = 0; i < length / 4; i++)
+		sum += buf[i];
+
+	return sum;
+}
+
+/*
+ * Calculate the boot0 checksum of an image starting with a header, ignoring
+ * the checksum stored in there, which is returned in *old_checksum.
+ */
+uint32_t b0_image_checksum(const void *buffer, size_t length,
+			   uint32_t *old_checksum)
+{
+	const char *buf = buffer;
+	uint32_t checksum;
+
+	checksum = b0_calc_checksum(buf, 12);
+	if (old_checksum)
+		*old_checksum = b0_calc_checksum(buf + 12, 4);
+	checksum += b0_calc_checksum(buf + 16, length - 16);
+
+	return checksum + CHECKSUM_SEED;
+}
+
+#define CHUNK_SIZE 262144
+
+ssize_t b0_read_file(const char *filename, char **buffer_addr)
+{
+	FILE *fp;
+	char* buffer;
+	size_t len, ret;
+
+	fp = fopen(filename, "rb");
+	if (fp == NULL)
+		return -errno;
+
+	buffer = malloc(CHUNK_SIZE);
+	for (len = 0; !feof(fp); len += ret) {
+		ret = fread(buffer + len, 1, CHUNK_SIZE, fp);
+		if (ferror(fp)) {
+			fclose(fp);
+			free(buffer);
+			return -errno;
+		}
+
+		if (!feof(fp))
+			buffer = realloc(buffer, len + 2 * CHUNK_SIZE);
+	}
+
+	*buffer_addr = realloc(buffer, len);
+
+	fclose(fp);
+	return len;
+}
+
+#define ZBUFSIZE 1024
+int b0_fill_zeroes(FILE *stream, off_t size)
+{
+	static const char zeroes[ZBUFSIZE] = {};
+	int chunk, ret;
+
+	while (size) {
+		chunk = (size > ZBUFSIZE ? ZBUFSIZE : size);
+
+		ret = fwrite(zeroes, 1, chunk, stream);
+		if (!ret)
+			return -errno;
+
+		size -= ret;
+	}
+
+	return 0;
+}
+
+int b0_pseek(FILE *stream, long offset)
+{
+	int ret;
+
+	ret = fseek(stream, offset, SEEK_CUR);
+	if (!ret)
+		return ret;
+
+	if (ret < 0 && errno != ESPIPE)
+		return -errno;
+
+	return b0_fill_zeroes(stream, offset);
+}
+
+#define SEC_PER_TRACK	63
+#define TRACKS_PER_CYL	255
+static void chs_encode(int lba, uint8_t *chs)
+{
+	int c, h, s;
+
+	s = (lba % SEC_PER_TRACK) + 1;
+	h = ((lba / SEC_PER_TRACK) % TRACKS_PER_CYL) & 0xff;
+	c = lba / (SEC_PER_TRACK * TRACKS_PER_CYL) & 0x3ff;
+
+	chs[0] = h;
+	chs[1] = s | (c >> 8);
+	chs[2] = c & 0xff;
+}
+
+/* Fill a 512 byte MBR with a FAT (or EFI) and a firmware partition. */
+void b0_create_part_table(uint8_t *mbr, off_t fat_size, bool efi, bool patch)
+{
+	union {
+		uint8_t b[16];
+		uint32_t l[4];
+	} fatp = {}, fwp = {};
+	uint8_t *part = mbr + 446;
+
+	memset(mbr, 0, 512);
+
+	fat_size /= 512;
+	fatp.b[0] = 0x80;
+	fatp.l[2] = htole32((patch ? 1 : 20) * 2048);
+	fatp.l[3] = htole32(fat_size);
+	chs_encode(fatp.l[2], &fatp.b[1]);
+	fatp.b[4] = efi ? 0xef : 0x06;
+	chs_encode(fatp.l[2] + fatp.l[3] - 1, &fatp.b[5]);
+	memcpy(part, fatp.b, 16);
+
+	if (!patch) {
+		fwp.b[0] = 0;
+		fwp.l[2] = htole32(1);
+		fwp.l[3] = htole32(20 * 2048 - 1);
+		chs_encode(fwp.l[2], &fwp.b[1]);
+		fwp.b[4] = 0xda;
+		chs_encode(fwp.l[2] + fwp.l[3] - 1, &fwp.b[5]);
+		memcpy(part + 16, fwp.b, 16);
+	}
+
+	mbr[510] = 0x55;
+	mbr[511] = 0xaa;
+}
+
+/*
+ * Scan the boot0 binary for a Thumb2 instruction which loads a wide
+ * immediate into a register (MOVW <Rd>, #<imm16>), which is encoded as:
+ * "1111.0i10.0100.imm4|0imm3.Rd.imm8", where the imm16 is constructed as:
+ * "imm4:i:imm3:imm8". Match for an instruction which loads the "orig" value
+ * into any register and replace it with a load with the "new" value.
+ * Returns the number of patched instructions.
+ */
+int b0_patch_boot0(uint16_t *boot0, uint16_t orig, uint16_t new)
+{
+	int i;
+	uint16_t first = 0, imm;
+	int patched = 0;
+
+	for (i = 0; i < 16384; i++) {
+		if ((boot0[i] & 0xfbf0) == 0xf240) {
+			first = boot0[i];
+			continue;
+		}
+		if (!first)
+			continue;
+		if (boot0[i] & 0x8000) {
+			first = 0;
+			continue;
+		}
+		imm = (first & 0xf) << 12;
+		imm |= (first & 0x0400) << 1;
+		imm |= (boot0[i] & 0x7000) >> 4;
+		imm |= boot0[i] & 0x00ff;
+
+		if (imm == orig) {
+			first &= 0xfbf0;
+			first |= (new & 0xf000) >> 12;
+			first |= (new & 0x0800) >> 1;
+			boot0[i - 1] = first;
+			boot0[i] &= 0x8f00;
+			boot0[i] |= (new & 0x0700) << 4;
+			boot0[i] |= new & 0x00ff;
+
+			patched++;
+		}
+
+		first = 0;
+	}
+
+	return patched;
+}
+
+static void *alloc_buffer(size_t size)
+{
+	void *buf;
+
+	if (posix_memalign(&buf, B0_BUF_ALIGN, ALIGN(size, B0_BUF_ALIGN)))
+		return NULL;
+	memset(buf, 0, ALIGN(size, B0_BUF_ALIGN));
+
+	return buf;
+}
+
+/*
+ * Copy boot0 into a BOOT0_SIZE buffer, patching (or unpatching) the
+ * U-Boot load offset as requested. Returns whether the resulting boot0
+ * loads from BOOT0_END_KB, which might differ from the request, when
+ * patching is not possible.
+ */
+static int copy_boot0(uint8_t *buffer, const struct b0_component *boot0,
+		      bool patch)
+{
+	int nr_patches;
+	uint32_t checksum = 0;
+
+	if (boot0->size > BOOT0_SIZE)
+		return -EFBIG;
+
+	while (true) {			/* loop to potentially undo patching */
+		memset(buffer, 0, BOOT0_SIZE);
+		memcpy(buffer, boot0->data, boot0->size);
+
+		if (patch) {
+			nr_patches = b0_patch_boot0((void *)buffer,
+						    BOOT0_END_KB * 2,
+						    BOOT0_END_KB * 2);
+			if (nr_patches == 2)		/* already patched */
+				break;
+
+			nr_patches = b0_patch_boot0((void *)buffer,
+						    UBOOT_OFFSET_KB * 2,
+						    BOOT0_END_KB * 2);
+			if (nr_patches != 2) {		/* something's wrong */
+				patch = false;
+				continue;		/* reload file */
+			}
+			checksum = 1;
+		} else {
+			nr_patches = b0_patch_boot0((void *)buffer,
+						    UBOOT_OFFSET_KB * 2,
+						    UBOOT_OFFSET_KB * 2);
+			if (nr_patches == 2)		/* all fine */
+				break;
+
+			nr_patches = b0_patch_boot0((void *)buffer,
+						    BOOT0_END_KB * 2,
+						    BOOT0_END_KB * 2);
+			if (nr_patches != 2)		/* unknown boot0 */
+				break;			/* proceed unaltered */
+
+			/* patched boot0, revert to old U-Boot position */
+			nr_patches = b0_patch_boot0((void *)buffer,
+						    BOOT0_END_KB * 2,
+						    UBOOT_OFFSET_KB * 2);
+			checksum = 1;
+			patch = false;
+		}
+		break;
+	}
+	if (checksum) {
+		checksum = b0_image_checksum(buffer, boot0->size, NULL);
+		((uint32_t *)buffer)[3] = htole32(checksum);
+	}
+
+	return (int)patch;
+}
+
+/*
+ * The instrumented trampolines read the physical counter (CNTVOFF is not
+ * set up yet at this point) and the counter frequency, reset the stamp
+ * table and store the counter value as the first stamp. The arguments from
+ * boot0 in x0-x3/r0-r3 are passed on untouched. The AArch64 variant only
+ * uses scratch registers, the AArch32 one clobbers the callee-saved r4-r7
+ * as well, which is fine as long as nothing expects them to survive the
+ * branch: boot0 never gets control back.
+ */
+static const uint32_t stamp64[] = {
+	0xd5033fdf,		/* isb */
+	0xd53be029,		/* mrs	x9, cntpct_el0 */
+	0xd53be00a,		/* mrs	x10, cntfrq_el0 */
+	0x1800014b,		/* ldr	w11, table */
+	0x1800014c,		/* ldr	w12, magic */
+	0x5280002d,		/* mov	w13, #1 */
+	0xb900016c,		/* str	w12, [x11] */
+	0xb900056d,		/* str	w13, [x11, #4] */
+	0xb900096a,		/* str	w10, [x11, #8] */
+	0xb9000d7f,		/* str	wzr, [x11, #12] */
+	0xf9000969,		/* str	x9, [x11, #16] */
+	0x18000090,		/* ldr	w16, target */
+	0xd61f0200,		/* br	x16 */
+};
+
+static const uint32_t stamp32[] = {
+	0xf57ff06f,		/* isb */
+	0xec554f0e,		/* mrrc	p15, 0, r4, r5, c14 (CNTPCT) */
+	0xee1e6f10,		/* mrc	p15, 0, r6, c14, c0, 0 (CNTFRQ) */
+	0xe59fc02c,		/* ldr	r12, table */
+	0xe59f702c,		/* ldr	r7, magic */
+	0xe58c7000,		/* str	r7, [r12] */
+	0xe3a07001,		/* mov	r7, #1 */
+	0xe58c7004,		/* str	r7, [r12, #4] */
+	0xe58c6008,		/* str	r6, [r12, #8] */
+	0xe3a07000,		/* mov	r7, #0 */
+	0xe58c700c,		/* str	r7, [r12, #12] */
+	0xe58c4010,		/* str	r4, [r12, #16] */
+	0xe58c5014,		/* str	r5, [r12, #20] */
+	0xe51fc000,		/* ldr	r12, target */
+	0xe12fff1c,		/* bx	r12 */
+};
+
+/*
+ * Write the DRAM trampoline code jumping to target, recording a timestamp
+ * if stamp_addr is not 0. Returns the number of words written, at most
+ * B0_TRAMPOLINE_WORDS.
+ */
+int b0_write_trampoline(uint32_t *buf, enum b0_dram_type type,
+			uint32_t target, uint32_t stamp_addr)
+{
+	const uint32_t *code = type == B0_DRAM_TRAMPOLINE64 ? stamp64 :
+								stamp32;
+	int i, n = type == B0_DRAM_TRAMPOLINE64 ? ARRAY_SIZE(stamp64) :
+						   ARRAY_SIZE(stamp32);
+
+	if (!stamp_addr) {
+		if (type == B0_DRAM_TRAMPOLINE64) {
+				/* ldr	x16, 0x8 */
+			buf[0] = htole32(0x58000050);
+				/* br	x16 */
+			buf[1] = htole32(0xd61f0200);
+			buf[2] = htole32(target);
+				/* high word is always 0 */
+			buf[3] = 0;
+			return 4;
+		}
+			/* ldr	r12, [pc, #-0] */
+		buf[0] = htole32(0xe51fc000);
+			/* bx	r12 */
+		buf[1] = htole32(0xe12fff1c);
+		buf[2] = htole32(target);
+		return 3;
+	}
+
+	for (i = 0; i < n; i++)
+		buf[i] = htole32(code[i]);
+	/* the literal pool: the AArch32 one starts with the target */
+	if (type == B0_DRAM_TRAMPOLINE64) {
+		buf[n++] = htole32(stamp_addr);
+		buf[n++] = htole32(B0_STAMP_MAGIC);
+		buf[n++] = htole32(target);
+	} else {
+		buf[n++] = htole32(target);
+		buf[n++] = htole32(stamp_addr);
+		buf[n++] = htole32(B0_STAMP_MAGIC);
+	}
+
+	return n;
+}
+
+/*
+ * Decode a stamp table as found in a memory dump. Returns the number of
+ * stamps, -ENOENT without a valid table.
+ */
+int b0_decode_stamps(const void *buf, size_t len, struct b0_stamp_table *tbl)
+{
+	const uint32_t *words = buf;
+	unsigned int i;
+
+	if (len < 16 || le32toh(words[0]) != B0_STAMP_MAGIC)
+		return -ENOENT;
+
+	tbl->magic = B0_STAMP_MAGIC;
+	tbl->count = le32toh(words[1]);
+	tbl->freq = le32toh(words[2]);
+	tbl->reserved = le32toh(words[3]);
+	if (tbl->count > B0_MAX_STAMPS ||
+	    len < 16 + tbl->count * sizeof(uint64_t))
+		return -ENOENT;
+
+	for (i = 0; i < tbl->count; i++)
+		tbl->stamp[i] = le32toh(words[4 + i * 2]) |
+				(uint64_t)le32toh(words[5 + i * 2]) << 32;
+
+	return tbl->count;
+}
+
+static void add_segment(struct b0_image *img, off_t offset, size_t size,
+			void *data)
+{
+	struct b0_segment *seg = &img->seg[img->nr_segs++];
+
+	seg->offset = offset;
+	seg->size = size;
+	seg->data = data;
+	img->size = offset + size;
+}
+
+void b0_init_options(struct b0_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->part_size_mb = -1;
+}
+
+/*
+ * Lay out the parts of the firmware blob behind the header, returning the
+ * size of the blob. An embedded header is the start of the U-Boot image.
+ */
+static size_t layout_regions(const struct b0_options *opts,
+			     struct b0_region *region)
+{
+	size_t uboot_size = 0, dram_size = 0, sram_size;
+
+	if (opts->uboot.data)
+		uboot_size = ALIGN(opts->uboot.size, 512);
+	if (opts->embedded_header)
+		uboot_size -= HEADER_SIZE;
+	if (opts->dram_type != B0_DRAM_BINARY)
+		dram_size = 512;
+	else if (opts->dram.data)
+		dram_size = ALIGN(opts->dram.size, 512);
+	sram_size = opts->sram.size;
+	if (opts->arisc_entry)
+		sram_size += 0x4000;
+	sram_size = ALIGN(sram_size, 512);
+
+	region[B0_REGION_UBOOT].offset = HEADER_SIZE;
+	region[B0_REGION_UBOOT].size = uboot_size;
+	region[B0_REGION_DRAM].offset = HEADER_SIZE + uboot_size;
+	region[B0_REGION_DRAM].size = dram_size;
+	region[B0_REGION_SRAM].offset = HEADER_SIZE + uboot_size + dram_size;
+	region[B0_REGION_SRAM].size = sram_size;
+
+	return HEADER_SIZE + uboot_size + dram_size + sram_size;
+}
+
+/* Copy one part into the firmware blob, padding it with zeroes. */
+static void fill_region(uint8_t *fw, const struct b0_options *opts,
+			const struct b0_region *region, int id)
+{
+	uint32_t *buf = (uint32_t *)(fw + region[id].offset);
+	size_t skip;
+
+	memset(buf, 0, region[id].size);
+
+	switch (id) {
+	case B0_REGION_UBOOT:
+		if (!opts->uboot.data)
+			break;
+		skip = opts->embedded_header ? HEADER_SIZE : 0;
+		memcpy(buf, (const uint8_t *)opts->uboot.data + skip,
+		       opts->uboot.size - skip);
+		break;
+	case B0_REGION_DRAM:
+		if (opts->dram_type != B0_DRAM_BINARY)
+			b0_write_trampoline(buf, opts->dram_type,
+					    opts->trampoline_addr,
+					    opts->stamp_addr);
+		else if (opts->dram.data)
+			memcpy(buf, opts->dram.data, opts->dram.size);
+		break;
+	case B0_REGION_SRAM:
+		/*
+		 * Move the loaded code to the SRAM part behind the OpenRISC
+		 * exception vector part, which is in fact only sparsely
+		 * implemented on the Allwinner SoCs.
+		 * Add an OpenRISC jump instruction into the arisc entry point.
+		 */
+		if (opts->arisc_entry) {
+			memcpy(buf + 0x1000, opts->sram.data, opts->sram.size);
+				/* OpenRISC: l.j <offset> */
+			buf[64] = htole32((opts->arisc_addr - 0x40100) / 4);
+				/* OpenRISC: l.nop (delay slot) */
+			buf[65] = htole32(0x15000000);
+		} else {
+			memcpy(buf, opts->sram.data, opts->sram.size);
+		}
+		break;
+	}
+}
+
+/*
+ * Fill in the header for the given layout, with the checksum field holding
+ * the seed. Returns the sum of the header words.
+ */
+static uint32_t fill_header(uint32_t *header, const struct b0_options *opts,
+			    const struct b0_region *region, size_t fw_size)
+{
+	const struct b0_region *dram = &region[B0_REGION_DRAM];
+	const struct b0_region *sram = &region[B0_REGION_SRAM];
+
+	/* Assuming an embedded header already has a branch instruction. */
+	if (opts->embedded_header) {
+		memcpy(header, opts->uboot.data, HEADER_SIZE);
+	} else {
+		uint32_t br_ins;
+		bool jump32 = false;
+
+		memset(header, 0, HEADER_SIZE);
+		br_ins = jump32 ? 0xea000000 : 0x14000000;
+		br_ins |= (jump32 ? HEADER_SIZE - 8 : HEADER_SIZE) / 4;
+		header[HEADER_JUMP_INS] = htole32(br_ins);
+	}
+
+	if (dram->size) {
+		header[HEADER_SECS + 0] = htole32(dram->offset);
+		header[HEADER_SECS + 1] = htole32(dram->size);
+	}
+	header[HEADER_SECS + 8] = htole32(sram->offset);
+	header[HEADER_SECS + 9] = htole32(sram->size);
+
+	/* fill the static part of the header */
+	strncpy((char*)&header[HEADER_MAGIC], FW_MAGIC, MAGIC_SIZE);
+	header[HEADER_CHECKSUM] = CHECKSUM_SEED;
+	header[HEADER_ALIGN] = htole32(BOOT0_ALIGN);
+	header[HEADER_LOADADDR] = htole32(UBOOT_LOAD_ADDR);
+	header[HEADER_PRIMSIZE] = htole32(fw_size);
+	header[HEADER_LENGTH] = htole32(ALIGN(fw_size, BOOT0_ALIGN));
+
+	return b0_calc_checksum(header, HEADER_SIZE);
+}
+
+/*
+ * Put together the firmware blob (header, U-Boot, DRAM and SRAM parts)
+ * and, if requested, boot0 and a partition table in front of it.
+ * On success the image owns its segment buffers, to be released with
+ * b0_free_image().
+ */
+int b0_assemble(const struct b0_options *opts, struct b0_image *img)
+{
+	bool absolute = opts->device || opts->part_size_mb != -1;
+	uint8_t *fw, *boot0 = NULL, *mbr = NULL;
+	struct b0_region *region = img->region;
+	struct b0_stats_mark mark;
+	uint32_t *header;
+	off_t pos;
+	uint32_t checksum;
+	int ret, i;
+
+	memset(img, 0, sizeof(*img));
+	img->boot0_offset = -1;
+	img->stats = opts->stats;
+
+	if (!opts->sram.data)
+		return -EINVAL;
+	if (opts->stamp_addr &&
+	    (opts->dram_type == B0_DRAM_BINARY || opts->stamp_addr % 8))
+		return -EINVAL;
+	if (opts->embedded_header &&
+	    (!opts->uboot.data || opts->uboot.size < HEADER_SIZE))
+		return -EINVAL;
+
+	img->fw_size = layout_regions(opts, region);
+	fw = alloc_buffer(img->fw_size);
+	if (!fw)
+		return -ENOMEM;
+
+	for (i = 0; i < B0_NR_REGIONS; i++)
+		fill_region(fw, opts, region, i);
+	header = (uint32_t *)fw;
+	checksum = fill_header(header, opts, region, img->fw_size);
+
+	b0_stats_begin(opts->stats, &mark);
+	for (i = 0; i < B0_NR_REGIONS; i++) {
+		region[i].sum = b0_calc_checksum(fw + region[i].offset,
+						 region[i].size);
+		checksum += region[i].sum;
+	}
+	header[HEADER_CHECKSUM] = htole32(checksum);
+	img->checksum = checksum;
+	b0_stats_end(opts->stats, B0_PHASE_CHECKSUM, &mark, img->fw_size);
+
+	img->patched_boot0 = opts->patch_boot0;
+	if (opts->part_size_mb != -1) {
+		mbr = alloc_buffer(512);
+		if (!mbr) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		b0_stats_begin(opts->stats, &mark);
+		b0_create_part_table(mbr, opts->part_size_mb * 1024 * 1024,
+				     opts->efi_part, opts->patch_boot0);
+		b0_stats_end(opts->stats, B0_PHASE_PARTITION, &mark, 512);
+		add_segment(img, 0, 512, mbr);
+	}
+
+	if (opts->boot0.data) {
+		boot0 = alloc_buffer(BOOT0_SIZE);
+		if (!boot0) {
+			ret = -ENOMEM;
+			goto out_free;
+		}
+		b0_stats_begin(opts->stats, &mark);
+		ret = copy_boot0(boot0, &opts->boot0, opts->patch_boot0);
+		b0_stats_end(opts->stats, B0_PHASE_PATCH, &mark,
+			     opts->boot0.size);
+		if (ret < 0)
+			goto out_free;
+		img->patched_boot0 = ret;
+
+		pos = absolute ? BOOT0_OFFSET : 0;
+		img->boot0_offset = pos;
+		add_segment(img, pos, opts->boot0.size, boot0);
+		pos += opts->boot0.size;
+		if (!img->patched_boot0)
+			pos += (UBOOT_OFFSET_KB - BOOT0_END_KB) * 1024;
+	} else {
+		pos = absolute ? UBOOT_OFFSET_KB * 1024 : 0;
+	}
+
+	img->fw_offset = pos;
+	add_segment(img, pos, img->fw_size, fw);
+	pos += img->fw_size;
+	add_segment(img, pos, ALIGN(img->fw_size, BOOT0_ALIGN) - img->fw_size,
+		    NULL);
+
+	return 0;
+
+out_free:
+	free(fw);
+	free(mbr);
+	free(boot0);
+	memset(img, 0, sizeof(*img));
+	return ret;
+}
+
+void b0_free_image(struct b0_image *img)
+{
+	int i;
+
+	for (i = 0; i < img->nr_segs; i++)
+		free(img->seg[i].data);
+
+	memset(img, 0, sizeof(*img));
+}
+
+/* Add [start, end) of the firmware blob to the dirty list, page aligned. */
+static void add_dirty(struct b0_image *dirty, const struct b0_image *img,
+		      uint8_t *fw, size_t start, size_t end)
+{
+	struct b0_segment *last;
+
+	start = start / B0_BUF_ALIGN * B0_BUF_ALIGN;
+	end = ALIGN(end, B0_BUF_ALIGN);
+	if (dirty->nr_segs) {
+		last = &dirty->seg[dirty->nr_segs - 1];
+		if (img->fw_offset + (off_t)start <=
+		    last->offset + (off_t)last->size) {
+			last->size = img->fw_offset + end - last->offset;
+			return;
+		}
+	}
+	add_segment(dirty, img->fw_offset + start, end - start, fw + start);
+}
+
+/*
+ * Replace the firmware parts flagged in changed (1 << B0_REGION_*) with
+ * the ones in opts, which must hold all components, as for b0_assemble().
+ * The checksum gets updated from the sums of the parts, the others are only
+ * moved when sizes change, and the header is adjusted to the new layout.
+ * The parts of the image which need to be written out are returned in
+ * dirty, whose segments point into the image and must not be freed.
+ */
+int b0_update_image(struct b0_image *img, const struct b0_options *opts,
+		    unsigned int changed, struct b0_image *dirty)
+{
+	struct b0_region region[B0_NR_REGIONS];
+	struct b0_segment *fw_seg = NULL, *pad;
+	uint8_t *fw, *old;
+	uint32_t *header, checksum;
+	size_t fw_size, start = SIZE_MAX;
+	bool moved = false;
+	int i;
+
+	for (i = 0; i < img->nr_segs - 1; i++)
+		if (img->seg[i].offset == img->fw_offset && img->seg[i].data)
+			fw_seg = &img->seg[i];
+	if (!fw_seg || !img->region[B0_REGION_SRAM].size || !opts->sram.data)
+		return -EINVAL;
+	if (opts->embedded_header &&
+	    (!opts->uboot.data || opts->uboot.size < HEADER_SIZE))
+		return -EINVAL;
+
+	fw_size = layout_regions(opts, region);
+	for (i = 0; i < B0_NR_REGIONS; i++) {
+		if (region[i].offset != img->region[i].offset ||
+		    region[i].size != img->region[i].size)
+			moved = true;
+		if ((moved || changed & (1U << i)) &&
+		    region[i].offset < start)
+			start = region[i].offset;
+	}
+
+	/* take out the old header, with the seed in place of the checksum */
+	old = fw_seg->data;
+	header = (uint32_t *)old;
+	checksum = img->checksum - b0_calc_checksum(header, HEADER_SIZE) +
+		   header[HEADER_CHECKSUM] - CHECKSUM_SEED;
+
+	fw = old;
+	if (moved) {
+		fw = alloc_buffer(fw_size);
+		if (!fw)
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < B0_NR_REGIONS; i++) {
+		if (changed & (1U << i)) {
+			checksum -= img->region[i].sum;
+			fill_region(fw, opts, region, i);
+			region[i].sum = b0_calc_checksum(fw + region[i].offset,
+							 region[i].size);
+			checksum += region[i].sum;
+			continue;
+		}
+		/* moving a part does not change its sum */
+		if (moved)
+			memcpy(fw + region[i].offset,
+			       old + img->region[i].offset, region[i].size);
+		region[i].sum = img->region[i].sum;
+	}
+
+	header = (uint32_t *)fw;
+	checksum += fill_header(header, opts, region, fw_size);
+	header[HEADER_CHECKSUM] = htole32(checksum);
+
+	memset(dirty, 0, sizeof(*dirty));
+	dirty->boot0_offset = img->boot0_offset;
+	dirty->fw_offset = img->fw_offset;
+	dirty->fw_size = fw_size;
+	dirty->patched_boot0 = img->patched_boot0;
+	dirty->checksum = checksum;
+
+	add_dirty(dirty, img, fw, 0, HEADER_SIZE);
+	if (moved) {
+		/* everything behind the first moved part, and the padding */
+		add_dirty(dirty, img, fw, start, fw_size);
+		if (ALIGN(fw_size, BOOT0_ALIGN) > ALIGN(fw_size, B0_BUF_ALIGN))
+			add_segment(dirty, img->fw_offset +
+				    ALIGN(fw_size, B0_BUF_ALIGN),
+				    ALIGN(fw_size, BOOT0_ALIGN) -
+				    ALIGN(fw_size, B0_BUF_ALIGN), NULL);
+
+		free(old);
+		fw_seg->data = fw;
+		fw_seg->size = fw_size;
+		pad = fw_seg + 1;
+		pad->offset = img->fw_offset + fw_size;
+		pad->size = ALIGN(fw_size, BOOT0_ALIGN) - fw_size;
+		img->size = pad->offset + pad->size;
+		img->fw_size = fw_size;
+	} else {
+		for (i = 0; i < B0_NR_REGIONS; i++)
+			if (changed & (1U << i) && region[i].size)
+				add_dirty(dirty, img, fw, region[i].offset,
+					  region[i].offset + region[i].size);
+	}
+	dirty->size = img->size;
+
+	memcpy(img->region, region, sizeof(region));
+	img->checksum = checksum;
+
+	return 0;
+}
+
+/* Copy the image into one contiguous buffer, with gaps filled by zeroes. */
+int b0_flatten_image(const struct b0_image *img, void **buffer)
+{
+	char *buf;
+	int i;
+
+	buf = calloc(1, img->size ? img->size : 1);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0; i < img->nr_segs; i++)
+		if (img->seg[i].data)
+			memcpy(buf + img->seg[i].offset, img->seg[i].data,
+			       img->seg[i].size);
+
+	*buffer = buf;
+	return 0;
+}
+
+/*
+ * Write the image to a stream, starting at its current position.
+ * On a device, gaps are skipped over and the padding gets written as
+ * zeroes, otherwise gaps and padding become holes (or zeroes in a pipe)
+ * and a regular file gets truncated to the image size.
+ */
+int b0_write_image(const struct b0_image *img, FILE *stream, bool device)
+{
+	const struct b0_segment *seg;
+	struct b0_stats_mark mark;
+	off_t pos = 0;
+	long fpos;
+	int i, ret;
+
+	for (i = 0; i < img->nr_segs; i++) {
+		seg = &img->seg[i];
+
+		if (seg->offset > pos) {
+			b0_stats_begin(img->stats, &mark);
+			ret = b0_pseek(stream, seg->offset - pos);
+			b0_stats_end(img->stats, B0_PHASE_ZEROFILL, &mark,
+				     seg->offset - pos);
+			if (ret)
+				return ret;
+		}
+
+		b0_stats_begin(img->stats, &mark);
+		if (seg->data) {
+			ret = seg->size &&
+			      fwrite(seg->data, seg->size, 1, stream) != 1 ?
+			      -errno : 0;
+			b0_stats_end(img->stats, B0_PHASE_WRITE, &mark,
+				     seg->size);
+		} else {
+			ret = device ? b0_fill_zeroes(stream, seg->size) :
+				       b0_pseek(stream, seg->size);
+			b0_stats_end(img->stats, B0_PHASE_ZEROFILL, &mark,
+				     seg->size);
+		}
+		if (ret)
+			return ret;
+
+		pos = seg->offset + seg->size;
+	}
+
+	if (!device) {
+		b0_stats_begin(img->stats, &mark);
+		fpos = ftell(stream);
+		ret = fpos >= 0 && ftruncate(fileno(stream), fpos) ? -errno : 0;
+		b0_stats_end(img->stats, B0_PHASE_TRUNCATE, &mark, 0);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+#define ZERO_IOVS	64
+static const uint8_t zero_page[B0_BUF_ALIGN]
+	__attribute__((aligned(B0_BUF_ALIGN)));
+
+/* Feed zeroes into a pipe, referencing the same zero page over and over. */
+int b0_splice_zeroes(int fd, off_t size)
+{
+	struct iovec iov[ZERO_IOVS];
+	ssize_t ret;
+	int i;
+
+	while (size) {
+		for (i = 0; i < ZERO_IOVS && size > (off_t)i * B0_BUF_ALIGN;
+		     i++) {
+			iov[i].iov_base = (void *)zero_page;
+			iov[i].iov_len = size - (off_t)i * B0_BUF_ALIGN;
+			if (iov[i].iov_len > B0_BUF_ALIGN)
+				iov[i].iov_len = B0_BUF_ALIGN;
+		}
+
+		ret = vmsplice(fd, iov, i, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		size -= ret;
+	}
+
+	return 0;
+}
+
+static int splice_buffer(int fd, const void *data, size_t size)
+{
+	struct iovec iov;
+	ssize_t ret;
+
+	while (size) {
+		iov.iov_base = (void *)data;
+		iov.iov_len = size;
+		ret = vmsplice(fd, &iov, 1, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		data = (const uint8_t *)data + ret;
+		size -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the image into a pipe without copying it, using vmsplice() from
+ * the page aligned segment buffers. Gaps and padding come from a shared
+ * zero page. Without vmsplice() support this fails with -ENOSYS right at
+ * the start, the caller can then still fall back to b0_write_image().
+ *
+ * The pipe references the image pages instead of holding a copy, so the
+ * caller must neither modify nor free the image until the reader has
+ * consumed everything. Exiting is fine, the pipe keeps the pages alive.
+ */
+int b0_splice_image(const struct b0_image *img, int fd)
+{
+	const struct b0_segment *seg;
+	struct b0_stats_mark mark;
+	struct stat st;
+	off_t pos = 0;
+	int i, ret;
+
+	if (fstat(fd, &st))
+		return -errno;
+	if (!S_ISFIFO(st.st_mode))
+		return -EINVAL;
+
+	/* fewer wake ups with a larger pipe, the default is 64K */
+	fcntl(fd, F_SETPIPE_SZ, B0_PIPE_SIZE);
+
+	for (i = 0; i < img->nr_segs; i++) {
+		seg = &img->seg[i];
+
+		if (seg->offset > pos) {
+			b0_stats_begin(img->stats, &mark);
+			ret = b0_splice_zeroes(fd, seg->offset - pos);
+			b0_stats_end(img->stats, B0_PHASE_ZEROFILL, &mark,
+				     seg->offset - pos);
+			if (ret)
+				return ret;
+		}
+
+		b0_stats_begin(img->stats, &mark);
+		if (seg->data) {
+			ret = splice_buffer(fd, seg->data, seg->size);
+			b0_stats_end(img->stats, B0_PHASE_WRITE, &mark,
+				     seg->size);
+		} else {
+			ret = b0_splice_zeroes(fd, seg->size);
+			b0_stats_end(img->stats, B0_PHASE_ZEROFILL, &mark,
+				     seg->size);
+		}
+		if (ret)
+			return ret;
+
+		pos = seg->offset + seg->size;
+	}
+
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * libboot0img: assemble Allwinner boot0 firmware images in memory
+ *
+ * Copyright 2016 Andre Przywara <osp@andrep.de>
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __LIBBOOT0IMG_H__
+#define __LIBBOOT0IMG_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+
+struct b0_stats;
+
+enum header_offsets {				/* in words of 4 bytes */
+	HEADER_JUMP_INS	= 0,
+	HEADER_MAGIC	= 1,
+	HEADER_CHECKSUM	= 3,
+	HEADER_ALIGN	= 4,
+	HEADER_LENGTH	= 5,
+	HEADER_PRIMSIZE	= 6,
+	HEADER_LOADADDR = 11,
+	HEADER_SECS	= 0x500 / 4,
+};
+
+#define MAGIC_SIZE	((HEADER_CHECKSUM - HEADER_MAGIC) * 4)
+#define HEADER_SIZE	0x600
+#define FW_MAGIC	"uboot"
+
+#define CHECKSUM_SEED	0x5F0A6C39
+
+#define BOOT0_MAGIC	"eGON.BT0"
+#define BOOT0_LENGTH	4		/* in the eGON header, in words */
+#define BOOT0_OFFSET	8192
+#define BOOT0_SIZE	32768
+#define BOOT0_END_KB	((BOOT0_OFFSET + BOOT0_SIZE) / 1024)
+#define BOOT0_ALIGN	0x4000
+#define UBOOT_LOAD_ADDR	0x4a000000
+#define UBOOT_OFFSET_KB	19096
+
+#define ALIGN(x, a)	((((x) + (a) - 1) / (a)) * (a))
+
+static inline uint64_t now_ns(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+
+	return tp.tv_sec * 1000000000ULL + tp.tv_nsec;
+}
+
+/*
+ * All functions in here are thread safe: they only work on the buffers
+ * passed in, never exit and report errors as negative errno values.
+ */
+
+/* A firmware component, as a memory buffer owned by the caller. */
+struct b0_component {
+	const void *data;
+	size_t size;
+};
+
+enum b0_dram_type {
+	B0_DRAM_BINARY,			/* use the dram component */
+	B0_DRAM_TRAMPOLINE64,		/* AArch64 jump to trampoline_addr */
+	B0_DRAM_TRAMPOLINE32,		/* AArch32 jump to trampoline_addr */
+};
+
+struct b0_options {
+	struct b0_component boot0;	/* optional */
+	struct b0_component uboot;	/* optional */
+	struct b0_component dram;	/* optional */
+	struct b0_component sram;	/* mandatory */
+	enum b0_dram_type dram_type;
+	uint32_t trampoline_addr;
+	uint32_t stamp_addr;		/* trampoline timestamp, 0 for none */
+	bool patch_boot0;		/* load firmware from below 1MB */
+	bool embedded_header;		/* U-Boot comes with the header */
+	bool arisc_entry;		/* put a jump into the arisc vector */
+	uint32_t arisc_addr;
+	long part_size_mb;		/* -1 for no partition table */
+	bool efi_part;
+	bool device;			/* lay out at absolute disk offsets */
+	struct b0_stats *stats;		/* optional, see b0stats.h */
+};
+
+/*
+ * The assembled image is described as a scatter list of segments with
+ * increasing offsets. A segment without data stands for zero padding which
+ * must be written out. Gaps between segments are left untouched on a
+ * device, and read as zeroes in files and streams.
+ */
+struct b0_segment {
+	off_t offset;
+	size_t size;
+	void *data;			/* NULL for zeroes */
+};
+
+/*
+ * The parts of the firmware blob behind its header. The checksum is a plain
+ * sum of words, so keeping the sum of each part allows updating it when
+ * just one of them changes.
+ */
+enum b0_region_id {
+	B0_REGION_UBOOT,
+	B0_REGION_DRAM,
+	B0_REGION_SRAM,
+	B0_NR_REGIONS
+};
+
+struct b0_region {
+	size_t offset;			/* within the firmware blob */
+	size_t size;			/* 0 if not present */
+	uint32_t sum;
+};
+
+#define B0_MAX_SEGMENTS	4		/* MBR, boot0, firmware, padding */
+#define B0_BUF_ALIGN	4096		/* segment data is page aligned */
+#define B0_PIPE_SIZE	(1024 * 1024)
+
+struct b0_image {
+	struct b0_segment seg[B0_MAX_SEGMENTS];
+	int nr_segs;
+	off_t size;			/* end of the last segment */
+	off_t boot0_offset;		/* -1 without boot0 */
+	off_t fw_offset;		/* position of the firmware header */
+	size_t fw_size;			/* HEADER_PRIMSIZE */
+	bool patched_boot0;		/* boot0 loads from BOOT0_END_KB */
+	uint32_t checksum;
+	struct b0_region region[B0_NR_REGIONS];	/* unset for cached images */
+	struct b0_stats *stats;		/* optional, for the writers */
+};
+
+/*
+ * Boot stage timestamps: an instrumented DRAM trampoline resets the table
+ * at stamp_addr and records the counter there, right when boot0 hands
+ * over. Later stages can append their own stamps, incrementing count.
+ * The table is little endian and must be 8 byte aligned.
+ */
+#define B0_STAMP_MAGIC		0x53543042	/* "B0TS" */
+#define B0_MAX_STAMPS		8
+#define B0_TRAMPOLINE_WORDS	18
+
+struct b0_stamp_table {
+	uint32_t magic;
+	uint32_t count;
+	uint32_t freq;			/* CNTFRQ, as seen by the trampoline */
+	uint32_t reserved;
+	uint64_t stamp[B0_MAX_STAMPS];	/* CNTPCT */
+};
+
+void b0_init_options(struct b0_options *opts);
+int b0_assemble(const struct b0_options *opts, struct b0_image *img);
+void b0_free_image(struct b0_image *img);
+int b0_update_image(struct b0_image *img, const struct b0_options *opts,
+		    unsigned int changed, struct b0_image *dirty);
+
+int b0_flatten_image(const struct b0_image *img, void **buffer);
+int b0_write_image(const struct b0_image *img, FILE *stream, bool device);
+int b0_splice_image(const struct b0_image *img, int fd);
+
+int b0_write_trampoline(uint32_t *buf, enum b0_dram_type type,
+			uint32_t target, uint32_t stamp_addr);
+int b0_decode_stamps(const void *buf, size_t len, struct b0_stamp_table *tbl);
+
+uint32_t b0_calc_checksum(const void *buffer, size_t length);
+uint32_t b0_image_checksum(const void *buffer, size_t length,
+			   uint32_t *old_checksum);
+int b0_patch_boot0(uint16_t *boot0, uint16_t orig, uint16_t new);
+void b0_create_part_table(uint8_t *mbr, off_t fat_size, bool efi,
+			  bool patch);
+
+ssize_t b0_read_file(const char *filename, char **buffer_addr);
+int b0_fill_zeroes(FILE *stream, off_t size);
+int b0_pseek(FILE *stream, long offset);
+int b0_splice_zeroes(int fd, off_t size);
+
+#endif
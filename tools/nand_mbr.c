@@ -0,0 +1,67 @@
+/*
+ * nand_mbr: CRC and output helpers for the Allwinner NAND MBR
+ *
+ * Copyright (C) 2016 Andre Przywara <osp@andrep.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include "nand-part-a20.h"
+#include "nand_mbr.h"
+
+struct CRC32_DATA {
+	uint32_t CRC;
+	uint32_t CRC_32_Tbl[256];
+};
+
+uint32_t calc_crc32(uint8_t * buffer, uint32_t length)
+{
+	uint32_t i, j;
+	struct CRC32_DATA crc32;
+	uint32_t CRC32 = 0xffffffff;
+	crc32.CRC = 0;
+
+	for (i = 0; i < 256; ++i) {
+		crc32.CRC = i;
+		for (j = 0; j < 8 ; ++j) {
+			if(crc32.CRC & 1)
+				crc32.CRC = (crc32.CRC >> 1) ^ 0xEDB88320;
+			else
+				crc32.CRC >>= 1;
+		}
+		crc32.CRC_32_Tbl[i] = crc32.CRC;
+	}
+
+	CRC32 = 0xffffffff;
+	for (i = 0; i < length; ++i)
+		CRC32 = crc32.CRC_32_Tbl[(CRC32^buffer[i]) & 0xff] ^ (CRC32>>8);
+
+	return CRC32^0xffffffff;
+}
+
+int write_mbr_copy(FILE *stream, MBR *mbr, int copy)
+{
+	int old_index;
+
+	old_index = mbr->index;
+	mbr->index = copy;
+	mbr->crc32 = calc_crc32((uint8_t *)mbr + 4, sizeof(MBR) - 4);
+
+	fwrite(mbr, sizeof(MBR), 1, stream);
+
+	mbr->index = old_index;
+
+	return 0;
+}
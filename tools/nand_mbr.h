@@ -0,0 +1,29 @@
+/*
+ * nand_mbr: CRC and output helpers for the Allwinner NAND MBR
+ *
+ * Copyright (C) 2016 Andre Przywara <osp@andrep.de>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NAND_MBR_H__
+#define __NAND_MBR_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include "nand-part-a20.h"
+
+uint32_t calc_crc32(uint8_t *buffer, uint32_t length);
+int write_mbr_copy(FILE *stream, MBR *mbr, int copy);
+
+#endif
@@ -25,6 +25,24 @@
 #include <unistd.h>
 #include <inttypes.h>
 #include <time.h>
+#include <math.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <malloc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/utsname.h>
+#include <linux/perf_event.h>
+
+#include "ttresult.h"
 
 #if defined __aarch64__
 static void delay_tick(unsigned long r)
@@ -63,6 +81,20 @@ static uint64_t read_counter_sync(void)
 	return reg;
 }
 
+static uint64_t read_counter_isb_after(void)
+{
+	uint64_t reg;
+
+	__asm__ volatile ("mrs %0, CNTVCT_EL0; isb\n" :"=r" (reg));
+
+	return reg;
+}
+
+static void isb(void)
+{
+	__asm__ volatile ("isb\n" : : : "memory");
+}
+
 #elif defined(__arm__)
 
 static void delay_tick(unsigned long r)
@@ -105,10 +137,67 @@ static uint64_t read_counter_sync(void)
 	return ((uint64_t)hi << 32) | lo;
 }
 
+static uint64_t read_counter_isb_after(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ volatile (
+		"mrrc p15, 1, %0, %1, c14\n\t"
+		"isb\n"
+		: "=r" (lo), "=r" (hi)
+	);
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static void isb(void)
+{
+	__asm__ volatile ("isb\n" : : : "memory");
+}
+
 #else
 #error unsupported architecture
 #endif
 
+/*
+ * Read strategies mirroring the Linux kernel's counter erratum workarounds.
+ * Like the kernel, they synchronise once, then retry the plain reads.
+ */
+#define STABLE_RETRIES	200		/* as in the kernel */
+#define LOWBITS_RETRIES	150
+
+/* Freescale A-008585: re-read until two consecutive values agree. */
+static uint64_t read_counter_stable(void)
+{
+	uint64_t old, new;
+	int retries = STABLE_RETRIES;
+
+	isb();
+	do {
+		old = read_counter();
+		new = read_counter();
+	} while (old != new && --retries);
+
+	return new;
+}
+
+/*
+ * Allwinner A64 UNKNOWN1: the lower 9 bits can be corrupted when they are
+ * rolling over, so re-read while they are all ones or all zeroes.
+ */
+static uint64_t read_counter_lowbits(void)
+{
+	uint64_t val;
+	int retries = LOWBITS_RETRIES;
+
+	isb();
+	do {
+		val = read_counter();
+	} while (((val + 1) & 0x1ff) <= 1 && --retries);
+
+	return val;
+}
+
 #define RESTORE_ONLY	-1
 #define ALL_CORES	-2
 
@@ -139,15 +228,427 @@ static int pin_thread(pid_t pid, int core, bool restore)
 	return sched_setaffinity(pid, sizeof(cpu_set_t), &mask);
 }
 
+/*
+ * The numbers behind the TAP output, collected for the results file (-o).
+ * Records are only added from the main thread.
+ */
+static struct {
+	bool enabled;
+	struct tt_record *rec;
+	unsigned int nr, max;
+	uint32_t flags;			/* TT_FLAG_* */
+} results;
+
+static const double tt_pct[TT_NR_PCT] = { 50, 90, 99, 99.9 };
+
+/* Returns NULL if there is no results file. */
+static struct tt_record *add_result(int type, int id, int core)
+{
+	struct tt_record *rec;
+
+	if (!results.enabled)
+		return NULL;
+
+	if (results.nr == results.max) {
+		rec = realloc(results.rec, (results.max + 64) * sizeof(*rec));
+		if (!rec)
+			return NULL;
+		results.rec = rec;
+		results.max += 64;
+	}
+
+	rec = &results.rec[results.nr++];
+	memset(rec, 0, sizeof(*rec));
+	rec->type = type;
+	rec->id = id;
+	rec->core = core;
+
+	return rec;
+}
+
+/*
+ * Low noise mode (-L): the tests run under SCHED_FIFO with all memory locked
+ * and the sample buffers prefaulted, so neither page faults nor ordinary
+ * tasks end up in the figures. What is left (interrupts, the odd preemption)
+ * gets accounted for: /proc/interrupts is read before and after each test,
+ * and each thread counts its context switches. Without the privileges for
+ * SCHED_FIFO or mlockall() the tests still run, prefaulted and accounted.
+ */
+#define NOISE_PRIO	90		/* below the kernel's migration threads */
+#define NOISE_STACK	(256 * 1024)	/* locked, so not the default 8MB */
+#define NOISE_PREFAULT	(64 * 1024)	/* of each thread's stack */
+#define IRQ_LABEL_SIZE	16
+#define IRQ_DESC_SIZE	32
+
+static struct {
+	bool enabled;
+	int nr_cores;
+} noise;
+
+/* /proc/interrupts, one count per line and core */
+struct irq_snapshot {
+	int nr_lines;
+	char (*label)[IRQ_LABEL_SIZE];
+	char (*desc)[IRQ_DESC_SIZE];
+	uint64_t *count;		/* nr_lines x nr_cores */
+};
+
+/* the interference seen by one test */
+struct noise_snap {
+	struct irq_snapshot before, after;
+	struct rusage ru;		/* of the calling thread */
+	long nvcsw, nivcsw;		/* its context switches, afterwards */
+	int cpu;			/* it ran on, -1 if it migrated */
+};
+
+static void prefault(void *buf, size_t len)
+{
+	volatile char *p = buf;
+	long page_size = sysconf(_SC_PAGESIZE);
+	size_t i;
+
+	if (!noise.enabled || !buf)
+		return;
+	for (i = 0; i < len; i += page_size)
+		p[i] = p[i];
+}
+
+static void prefault_stack(void)
+{
+	char buf[NOISE_PREFAULT];
+
+	prefault(buf, sizeof(buf));
+}
+
+static void irq_free(struct irq_snapshot *snap)
+{
+	free(snap->label);
+	free(snap->desc);
+	free(snap->count);
+	memset(snap, 0, sizeof(*snap));
+}
+
+static int irq_grow(struct irq_snapshot *snap, int max_lines)
+{
+	void *label, *desc, *count;
+
+	label = realloc(snap->label, max_lines * sizeof(*snap->label));
+	if (label)
+		snap->label = label;
+	desc = realloc(snap->desc, max_lines * sizeof(*snap->desc));
+	if (desc)
+		snap->desc = desc;
+	count = realloc(snap->count,
+			max_lines * noise.nr_cores * sizeof(*snap->count));
+	if (count)
+		snap->count = count;
+
+	return label && desc && count ? 0 : -ENOMEM;
+}
+
+/*
+ * The columns are the online CPUs, as named in the first line. Some lines
+ * (ERR, MIS) have a single count only.
+ */
+static int irq_snapshot(struct irq_snapshot *snap)
+{
+	int *col_cpu, nr_cols = 0, max_lines = 0, ret = 0, i;
+	char *line = NULL, *p, *end, *desc;
+	uint64_t *count;
+	size_t size = 0;
+	FILE *f;
+
+	memset(snap, 0, sizeof(*snap));
+	col_cpu = calloc(noise.nr_cores, sizeof(*col_cpu));
+	if (!col_cpu)
+		return -ENOMEM;
+	f = fopen("/proc/interrupts", "r");
+	if (!f) {
+		free(col_cpu);
+		return -errno;
+	}
+
+	if (getline(&line, &size, f) > 0)
+		for (p = line; nr_cols < noise.nr_cores &&
+		     (p = strstr(p, "CPU")); nr_cols++) {
+			col_cpu[nr_cols] = strtol(p + 3, &p, 10);
+			if (col_cpu[nr_cols] >= noise.nr_cores)
+				col_cpu[nr_cols] = -1;
+		}
+
+	while (getline(&line, &size, f) > 0) {
+		p = strchr(line, ':');
+		if (!p)
+			continue;
+		if (snap->nr_lines == max_lines) {
+			max_lines += 64;
+			ret = irq_grow(snap, max_lines);
+			if (ret)
+				break;
+		}
+
+		*p++ = 0;
+		snprintf(snap->label[snap->nr_lines], IRQ_LABEL_SIZE, "%s",
+			 line + strspn(line, " "));
+		count = &snap->count[snap->nr_lines * noise.nr_cores];
+		memset(count, 0, noise.nr_cores * sizeof(*count));
+		for (i = 0; i < nr_cols; i++) {
+			uint64_t val = strtoull(p, &end, 10);
+
+			if (end == p)
+				break;
+			p = end;
+			if (col_cpu[i] >= 0)
+				count[col_cpu[i]] = val;
+		}
+
+		/* the device for numbered interrupts, the text for the others */
+		p[strcspn(p, "\n")] = 0;
+		desc = p + strspn(p, " ");
+		if (isdigit((unsigned char)*snap->label[snap->nr_lines]) &&
+		    strrchr(desc, ' '))
+			desc = strrchr(desc, ' ') + 1;
+		snprintf(snap->desc[snap->nr_lines], IRQ_DESC_SIZE, "%s", desc);
+		snap->nr_lines++;
+	}
+	free(line);
+	free(col_cpu);
+	fclose(f);
+
+	if (ret)
+		irq_free(snap);
+
+	return ret;
+}
+
+/*
+ * Interrupts on a core (or all of them) between the two snapshots, and the
+ * line contributing most of them. Lines are matched up by their label, as
+ * interrupts may have been requested or freed in the meantime.
+ */
+static uint64_t irq_delta(const struct noise_snap *ns, int core, int *top,
+			  uint64_t *top_count)
+{
+	const struct irq_snapshot *a = &ns->after, *b = &ns->before;
+	int i, j, c, first = core < 0 ? 0 : core;
+	int last = core < 0 ? noise.nr_cores : core + 1;
+	uint64_t total = 0, sum, now, then;
+
+	*top = -1;
+	*top_count = 0;
+	for (i = 0; i < a->nr_lines; i++) {
+		j = i < b->nr_lines && !strcmp(a->label[i], b->label[i]) ?
+			i : -1;
+		for (c = 0; j < 0 && c < b->nr_lines; c++)
+			if (!strcmp(a->label[i], b->label[c]))
+				j = c;
+
+		for (sum = 0, c = first; c < last; c++) {
+			now = a->count[i * noise.nr_cores + c];
+			then = j < 0 ? 0 : b->count[j * noise.nr_cores + c];
+			sum += now > then ? now - then : 0;
+		}
+		total += sum;
+		if (sum > *top_count) {
+			*top_count = sum;
+			*top = i;
+		}
+	}
+
+	return total;
+}
+
+static void noise_begin(struct noise_snap *ns)
+{
+	memset(ns, 0, sizeof(*ns));
+	if (!noise.enabled)
+		return;
+
+	irq_snapshot(&ns->before);
+	getrusage(RUSAGE_THREAD, &ns->ru);
+	ns->cpu = sched_getcpu();
+}
+
+static void noise_end(struct noise_snap *ns)
+{
+	struct rusage ru;
+
+	if (!noise.enabled)
+		return;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	ns->nvcsw = ru.ru_nvcsw - ns->ru.ru_nvcsw;
+	ns->nivcsw = ru.ru_nivcsw - ns->ru.ru_nivcsw;
+	if (sched_getcpu() != ns->cpu)
+		ns->cpu = -1;
+	irq_snapshot(&ns->after);
+}
+
+static void noise_free(struct noise_snap *ns)
+{
+	irq_free(&ns->before);
+	irq_free(&ns->after);
+}
+
+/*
+ * One line on the interference seen by a per core thread, or with core -1
+ * by the calling thread (on the CPU it stayed on). It goes into the results
+ * as well, behind the records of the test.
+ */
+static void noise_report(FILE *stream, const struct noise_snap *ns, int type,
+			 int core, long nvcsw, long nivcsw)
+{
+	struct tt_record *rec;
+	uint64_t irqs, top_count;
+	int top;
+
+	if (!noise.enabled)
+		return;
+
+	if (core >= 0) {
+		fprintf(stream, "# core %d: noise: ", core);
+	} else {
+		core = ns->cpu;
+		nvcsw = ns->nvcsw;
+		nivcsw = ns->nivcsw;
+		if (core >= 0)
+			fprintf(stream, "# noise on core %d: ", core);
+		else
+			fprintf(stream, "# noise on all cores (migrated): ");
+	}
+
+	irqs = irq_delta(ns, core, &top, &top_count);
+	fprintf(stream, "%"PRIu64" interrupts", irqs);
+	if (top >= 0)
+		fprintf(stream, " (%"PRIu64" from %s: %s)", top_count,
+			ns->after.label[top], ns->after.desc[top]);
+	fprintf(stream, ", context switches: %ld involuntary, %ld voluntary\n",
+		nivcsw, nvcsw);
+
+	rec = add_result(TT_REC_NOISE, type, core >= 0 ? core : TT_ALL_CORES);
+	if (rec) {
+		rec->count = irqs;
+		rec->errors = nivcsw;
+		rec->max = top_count;
+		rec->extra = nvcsw;
+	}
+}
+
+/*
+ * Threads started afterwards inherit the scheduling policy. An unprivileged
+ * user may still get a lower RT priority (RLIMIT_RTPRIO), or a lower nice
+ * value.
+ */
+static void noise_setup(FILE *stream, int nr_cores)
+{
+	struct sched_param sp = { .sched_priority = NOISE_PRIO };
+	struct rlimit rl;
+
+	noise.enabled = true;
+	noise.nr_cores = nr_cores;
+
+	/* no mmap()ed chunks and no trimming, so freed memory stays locked */
+	mallopt(M_MMAP_MAX, 0);
+	mallopt(M_TRIM_THRESHOLD, -1);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		fprintf(stream, "# low noise: cannot lock memory: %s, prefaulting only\n",
+			strerror(errno));
+	} else {
+		results.flags |= TT_FLAG_LOCKED;
+	}
+	prefault_stack();
+
+	if (!getrlimit(RLIMIT_RTPRIO, &rl) && rl.rlim_cur > 0 &&
+	    rl.rlim_cur < NOISE_PRIO && geteuid())
+		sp.sched_priority = rl.rlim_cur;
+	if (!sched_setscheduler(0, SCHED_FIFO, &sp)) {
+		results.flags |= TT_FLAG_RT;
+		fprintf(stream, "# low noise: SCHED_FIFO, priority %d%s\n",
+			sp.sched_priority, results.flags & TT_FLAG_LOCKED ?
+			", memory locked" : "");
+		return;
+	}
+
+	fprintf(stream, "# low noise: no SCHED_FIFO: %s", strerror(errno));
+	if (!setpriority(PRIO_PROCESS, 0, -20))
+		fprintf(stream, ", nice -20 instead\n");
+	else
+		fprintf(stream, ", staying at SCHED_OTHER\n");
+}
+
+/* The bucket below which q percent of the samples fall. */
+static double hist_percentile(const uint64_t *hist, int hist_size,
+			      uint64_t total, double q)
+{
+	uint64_t sum = 0, limit = total * q / 100;
+	int i;
+
+	for (i = 0; i < hist_size; i++) {
+		sum += hist[i];
+		if (sum > limit)
+			return i;
+	}
+
+	return hist_size;		/* the overflow bucket */
+}
+
+/* back-to-back read differences, in ticks or LINUX_BUCKET_NS */
+#define READ_HIST_BUCKETS	1024
+#define LINUX_BUCKET_NS		10
+
+static uint64_t *read_hist_alloc(void)
+{
+	uint64_t *hist;
+
+	if (!results.enabled)
+		return NULL;
+	hist = calloc(READ_HIST_BUCKETS + 1, sizeof(uint64_t));
+	prefault(hist, (READ_HIST_BUCKETS + 1) * sizeof(uint64_t));
+
+	return hist;
+}
+
+static void read_hist_add(uint64_t *hist, int64_t val)
+{
+	if (val < 0)
+		val = 0;
+	hist[val < READ_HIST_BUCKETS ? val : READ_HIST_BUCKETS]++;
+}
+
+static void record_reads(int id, int loops, int errcnt, int64_t min,
+			 int64_t sum, int64_t max, uint64_t *hist,
+			 double unit_ns, double bucket_ns, double cost_ns)
+{
+	struct tt_record *rec = add_result(TT_REC_READS, id, TT_ALL_CORES);
+	int i;
+
+	if (rec) {
+		rec->count = loops;
+		rec->errors = errcnt;
+		rec->min = min * unit_ns;
+		rec->avg = (double)sum / loops * unit_ns;
+		rec->max = max * unit_ns;
+		for (i = 0; i < TT_NR_PCT && hist; i++)
+			rec->pct[i] = hist_percentile(hist, READ_HIST_BUCKETS,
+						      loops, tt_pct[i]) *
+				      bucket_ns;
+		rec->extra = cost_ns;
+	}
+	free(hist);
+}
+
 static long nr_procs(void)
 {
 	long online = sysconf(_SC_NPROCESSORS_ONLN);
 	long cpus = sysconf(_SC_NPROCESSORS_CONF);
 
-	if (cpus != online)
+	if (cpus != online) {
 		fprintf(stdout, "# %ld CPU%s offline\n",
 			cpus - online,
 			cpus - online > 1 ? "s" : "");
+		results.flags |= TT_FLAG_OFFLINE;
+	}
 
 	return cpus;
 }
@@ -172,6 +673,8 @@ static int test_frequency(FILE *stream, int testnr, int nr_cores)
 	}
 	fprintf(stream, "%sok %d same timer frequency on all cores\n",
 		equal ? "" : "not ", testnr);
+	if (!equal)
+		results.flags |= TT_FLAG_FREQ_MISMATCH;
 	fprintf(stream, "# timer frequency is %"PRId64" Hz (%"PRId64" MHz)\n",
 		freq, freq / 1000000);
 
@@ -207,17 +710,189 @@ static void offset_info(FILE *stream, int core)
 #define NSECS 1000000000U
 #define MAX_ERRORS 16
 
-static void test_monotonic(FILE *stream, int loops, int testnr)
+enum perf_event_idx {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_CTX_SWITCHES,
+	NR_PERF_EVENTS
+};
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+	const char *name;
+} perf_events[NR_PERF_EVENTS] = {
+	[PERF_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+			  "cycles" },
+	[PERF_INSTRUCTIONS] = { PERF_TYPE_HARDWARE,
+				PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+	[PERF_CACHE_MISSES] = { PERF_TYPE_HARDWARE,
+				PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+	[PERF_CTX_SWITCHES] = { PERF_TYPE_SOFTWARE,
+				PERF_COUNT_SW_CONTEXT_SWITCHES, "ctx-switches" },
+};
+
+/*
+ * Per-thread perf event counters. Each event is opened on its own, so a
+ * PMU lacking one of them (or a paranoid kernel refusing the hardware
+ * events) still leaves the others usable. An unavailable event has fd -1.
+ */
+struct perf_counters {
+	int fd[NR_PERF_EVENTS];
+	uint64_t val[NR_PERF_EVENTS];
+	bool user_only;
+};
+
+static int perf_open(struct perf_counters *pc)
+{
+	struct perf_event_attr attr;
+	int i, nr_open = 0, err = 0;
+
+	memset(pc, 0, sizeof(*pc));
+	for (i = 0; i < NR_PERF_EVENTS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = perf_events[i].type;
+		attr.config = perf_events[i].config;
+		attr.disabled = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+				   PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		/* this thread only, on whatever CPU it runs */
+		pc->fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (pc->fd[i] < 0 && (errno == EACCES || errno == EPERM)) {
+			/* perf_event_paranoid may still allow user space */
+			attr.exclude_kernel = 1;
+			pc->fd[i] = syscall(__NR_perf_event_open, &attr,
+					    0, -1, -1, 0);
+			if (pc->fd[i] >= 0)
+				pc->user_only = true;
+		}
+		if (pc->fd[i] < 0)
+			err = errno;
+		else
+			nr_open++;
+	}
+
+	return nr_open ? 0 : -err;
+}
+
+static void perf_close(struct perf_counters *pc)
+{
+	int i;
+
+	for (i = 0; i < NR_PERF_EVENTS; i++)
+		if (pc->fd[i] >= 0)
+			close(pc->fd[i]);
+}
+
+static void perf_start(struct perf_counters *pc)
+{
+	int i;
+
+	if (!pc)
+		return;
+
+	for (i = 0; i < NR_PERF_EVENTS; i++) {
+		if (pc->fd[i] < 0)
+			continue;
+		ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+}
+
+static void perf_stop(struct perf_counters *pc)
+{
+	uint64_t data[3];	/* value, time enabled, time running */
+	int i;
+
+	if (!pc)
+		return;
+
+	for (i = 0; i < NR_PERF_EVENTS; i++) {
+		if (pc->fd[i] < 0)
+			continue;
+		ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		if (read(pc->fd[i], data, sizeof(data)) != sizeof(data)) {
+			pc->val[i] = 0;
+			continue;
+		}
+		/* scale up if the event was multiplexed with others */
+		if (data[2] && data[2] < data[1])
+			data[0] = (double)data[0] * data[1] / data[2];
+		pc->val[i] = data[0];
+	}
+}
+
+/* Report the counters of the last phase, also divided by nr_ops. */
+static void perf_report(FILE *stream, const struct perf_counters *pc,
+			const char *phase, uint64_t nr_ops)
+{
+	int i;
+
+	if (!pc)
+		return;
+
+	fprintf(stream, "# perf: %s%s:", phase,
+		pc->user_only ? " (user only)" : "");
+	for (i = 0; i < NR_PERF_EVENTS; i++) {
+		if (pc->fd[i] < 0) {
+			fprintf(stream, " %s: n/a,", perf_events[i].name);
+			continue;
+		}
+		fprintf(stream, " %s: %"PRIu64, perf_events[i].name,
+			pc->val[i]);
+		if (nr_ops && i != PERF_CTX_SWITCHES)
+			fprintf(stream, " (%.2f/op)",
+				(double)pc->val[i] / nr_ops);
+		fprintf(stream, ",");
+	}
+	fprintf(stream, " ops: %"PRIu64"\n", nr_ops);
+}
+
+/*
+ * Measure the cost of obtaining a counter value, with and without the
+ * ISB in front of the MRS. Only meaningful with perf counters enabled.
+ */
+static void perf_read_cost(FILE *stream, struct perf_counters *pc, int loops)
+{
+	int i;
+
+	if (!pc)
+		return;
+
+	perf_start(pc);
+	for (i = 0; i < loops; i++)
+		read_counter();
+	perf_stop(pc);
+	perf_report(stream, pc, "read_counter()", loops);
+
+	perf_start(pc);
+	for (i = 0; i < loops; i++)
+		read_counter_sync();
+	perf_stop(pc);
+	perf_report(stream, pc, "read_counter_sync()", loops);
+}
+
+static void test_monotonic(FILE *stream, int loops, int testnr,
+			   struct perf_counters *pc, uint64_t freq)
 {
-	uint64_t time1, time2;
+	uint64_t time1, time2, *hist = read_hist_alloc();
 	int64_t diff, min = INT64_MAX, max = 0, sum = 0;
+	struct noise_snap ns;
 	int errcnt = 0;
 	int i;
 
+	noise_begin(&ns);
+	perf_start(pc);
 	for (i = 0; i < loops; i++) {
 		time1 = read_counter_sync();
 		time2 = read_counter();
 		diff = time2 - time1;
+		if (hist)
+			read_hist_add(hist, diff);
 
 		if (diff < 0) {
 			errcnt++;
@@ -234,24 +909,38 @@ static void test_monotonic(FILE *stream, int loops, int testnr)
 			max = diff;
 		sum += diff;
 	}
+	perf_stop(pc);
+	noise_end(&ns);
 	fprintf(stream, "%sok %d native counter reads are monotonic # %d errors\n",
 		min >= 0 ? "" : "not ", testnr, errcnt);
 	fprintf(stream, "# min: %"PRId64", avg: %"PRId64", max: %"PRId64"\n",
 		min, sum / loops, max);
+	record_reads(TT_READ_NATIVE, loops, errcnt, min, sum, max, hist,
+		     1e9 / freq, 1e9 / freq, 0);
+	noise_report(stream, &ns, TT_REC_READS, -1, 0, 0);
+	noise_free(&ns);
+	perf_report(stream, pc, "native counter reads", 2ULL * loops);
 }
 
-static void test_monotonic_linux(FILE *stream, int loops, int testnr)
+static void test_monotonic_linux(FILE *stream, int loops, int testnr,
+				 struct perf_counters *pc)
 {
 	struct timespec tp1, tp2;
 	int64_t diff, min = INT64_MAX, max = 0, sum = 0;
+	uint64_t *hist = read_hist_alloc();
+	struct noise_snap ns;
 	int errcnt = 0;
 	int i;
 
+	noise_begin(&ns);
+	perf_start(pc);
 	for (i = 0; i < loops; i++) {
 		clock_gettime(CLOCK_MONOTONIC_RAW, &tp1);
 		clock_gettime(CLOCK_MONOTONIC_RAW, &tp2);
 		diff = (tp2.tv_sec * NSECS + tp2.tv_nsec) -
 			(tp1.tv_sec * NSECS + tp1.tv_nsec);
+		if (hist)
+			read_hist_add(hist, diff / LINUX_BUCKET_NS);
 
 		if (diff < 0) {
 			if (errcnt == 0)
@@ -270,32 +959,1520 @@ static void test_monotonic_linux(FILE *stream, int loops, int testnr)
 			max = diff;
 		sum += diff;
 	}
+	perf_stop(pc);
+	noise_end(&ns);
 	if (errcnt)
 		fprintf(stream, "\n");
 	fprintf(stream, "%sok %d Linux counter reads are monotonic # %d errors\n",
 		min >= 0 ? "" : "not ", testnr, errcnt);
 	fprintf(stream, "# min: %"PRId64", avg: %"PRId64", max: %"PRId64"\n",
 		min, sum / loops, max);
+	record_reads(TT_READ_LINUX, loops, errcnt, min, sum, max, hist,
+		     1, LINUX_BUCKET_NS, 0);
+	noise_report(stream, &ns, TT_REC_READS, -1, 0, 0);
+	noise_free(&ns);
+	perf_report(stream, pc, "clock_gettime() reads", 2ULL * loops);
 }
 
-int main(int argc, char** argv)
+static const struct read_strategy {
+	const char *name;
+	uint64_t (*fn)(void);
+	const char *desc;
+} read_strategies[] = {
+	{ "plain",	read_counter,		"MRS only" },
+	{ "isb",	read_counter_sync,	"ISB, then MRS" },
+	{ "isb-after",	read_counter_isb_after,	"MRS, then ISB" },
+	{ "stable",	read_counter_stable,	"re-read until two reads agree" },
+	{ "lowbits",	read_counter_lowbits,	"re-read while low bits roll over" },
+	{ NULL }
+};
+
+/*
+ * Run the monotonicity test with both reads using the same strategy, and
+ * measure what a single read costs, in counter ticks and (with perf
+ * counters) in cycles. The error rate against the cost tells which
+ * workaround is worth it on a given board.
+ */
+static void test_strategy(FILE *stream, int loops, int testnr,
+			  const struct read_strategy *strat,
+			  struct perf_counters *pc, uint64_t freq)
 {
-	int nr_cpus;
+	uint64_t time1, time2, start, elapsed, *hist = read_hist_alloc();
+	int64_t diff, min = INT64_MAX, max = 0, sum = 0;
+	struct noise_snap ns;
+	int errcnt = 0;
 	int i;
 
-	fprintf(stdout, "TAP version 13\n");
-	nr_cpus = nr_procs();
-	fprintf(stdout, "# number of cores: %d\n", nr_cpus);
+	noise_begin(&ns);
+	perf_start(pc);
+	start = read_counter_sync();
+	for (i = 0; i < loops; i++) {
+		time1 = strat->fn();
+		time2 = strat->fn();
+		diff = time2 - time1;
+		if (hist)
+			read_hist_add(hist, diff);
 
+		if (diff < 0) {
+			errcnt++;
+			if (errcnt <= MAX_ERRORS)
+				fprintf(stream, "# time1: %"PRIx64", time2: %"PRIx64", diff: %"PRId64"\n",
+					time1, time2, diff);
+			if (errcnt == MAX_ERRORS + 1)
+				fprintf(stream, "# too many errors, stopping reports\n");
+		}
 
-	test_frequency(stdout, 1, nr_cpus);
+		if (diff < min)
+			min = diff;
+		if (diff > max)
+			max = diff;
+		sum += diff;
+	}
+	elapsed = read_counter_sync() - start;
+	perf_stop(pc);
+	noise_end(&ns);
 
-	test_monotonic(stdout, 10000000, 2);
-	test_monotonic_linux(stdout, 10000000, 3);
+	fprintf(stream, "%sok %d %s counter reads are monotonic # %d errors\n",
+		min >= 0 ? "" : "not ", testnr, strat->name, errcnt);
+	fprintf(stream, "# %s (%s): min: %"PRId64", avg: %"PRId64", max: %"PRId64"\n",
+		strat->name, strat->desc, min, sum / loops, max);
+	fprintf(stream, "# %s: error rate: %.3f ppm, cost: %.2f ticks (%.1f ns) per read\n",
+		strat->name, 1e6 * errcnt / loops,
+		(double)elapsed / (2.0 * loops),
+		(double)elapsed * NSECS / freq / (2.0 * loops));
+	perf_report(stream, pc, strat->name, 2ULL * loops);
+	record_reads(TT_READ_STRATEGY + (strat - read_strategies), loops,
+		     errcnt, min, sum, max, hist, 1e9 / freq, 1e9 / freq,
+		     (double)elapsed * NSECS / freq / (2.0 * loops));
+	noise_report(stream, &ns, TT_REC_READS, -1, 0, 0);
+	noise_free(&ns);
+}
 
-	for (i = 0; i < nr_cpus; i++)
-		offset_info(stdout, i);
+/*
+ * Convert between nanoseconds and counter ticks without overflowing 64 bits
+ * for runs of a few hours (and without requiring 128-bit arithmetic on arm).
+ */
+static uint64_t ns_to_ticks(uint64_t ns, uint64_t freq)
+{
+	return (ns / NSECS) * freq + (ns % NSECS) * freq / NSECS;
+}
+
+static int64_t ticks_to_ns(int64_t ticks, uint64_t freq)
+{
+	int64_t sign = ticks < 0 ? -1 : 1;
+	uint64_t t = ticks * sign;
+
+	return sign * (int64_t)((t / freq) * NSECS + (t % freq) * NSECS / freq);
+}
+
+static uint64_t ts_to_ns(const struct timespec *tp)
+{
+	return tp->tv_sec * (uint64_t)NSECS + tp->tv_nsec;
+}
+
+static void ns_to_ts(uint64_t ns, struct timespec *tp)
+{
+	tp->tv_sec = ns / NSECS;
+	tp->tv_nsec = ns % NSECS;
+}
+
+/* Pin the calling thread only, without touching the saved mask. */
+static int pin_self(int core)
+{
+	cpu_set_t mask;
+
+	CPU_ZERO(&mask);
+	CPU_SET(core, &mask);
+
+	return sched_setaffinity(0, sizeof(cpu_set_t), &mask);
+}
+
+/*
+ * Every per-core job structure starts with this, so that run_per_core()
+ * can pass the core number in and report failures to pin the thread. With
+ * -L it also counts the thread's context switches.
+ */
+struct core_job {
+	int core;
+	int err;
+	void *(*fn)(void *);
+	long nvcsw, nivcsw;
+};
+
+static void *core_thread(void *arg)
+{
+	struct core_job *job = arg;
+	struct rusage ru0, ru1;
+	void *ret;
+
+	if (!noise.enabled)
+		return job->fn(job);
+
+	prefault_stack();
+	getrusage(RUSAGE_THREAD, &ru0);
+	ret = job->fn(job);
+	getrusage(RUSAGE_THREAD, &ru1);
+	job->nvcsw = ru1.ru_nvcsw - ru0.ru_nvcsw;
+	job->nivcsw = ru1.ru_nivcsw - ru0.ru_nivcsw;
+
+	return ret;
+}
+
+/*
+ * Start one thread per core, each running fn() on its own element of the
+ * jobs array (of "size" bytes each), and wait for all of them to finish.
+ */
+static int run_per_core(int nr_cores, void *(*fn)(void *), void *jobs,
+			size_t size)
+{
+	pthread_attr_t attr;
+	pthread_t *threads;
+	int i, ret = 0;
+
+	threads = calloc(nr_cores, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+
+	pthread_attr_init(&attr);
+	if (noise.enabled)
+		pthread_attr_setstacksize(&attr, NOISE_STACK);
+	for (i = 0; i < nr_cores; i++) {
+		struct core_job *job = (void *)((char *)jobs + i * size);
+
+		job->core = i;
+		job->fn = fn;
+		job->err = pthread_create(&threads[i], &attr, core_thread, job);
+		if (job->err)
+			ret = -job->err;
+	}
+	pthread_attr_destroy(&attr);
+	for (i = 0; i < nr_cores; i++) {
+		struct core_job *job = (void *)((char *)jobs + i * size);
+
+		if (!job->err)
+			pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	return ret;
+}
+
+/*
+ * Sample CLOCK_MONOTONIC and the counter as close together as possible,
+ * returning the counter value matching *mono_ns (at the midpoint of the two
+ * clock reads). *uncert receives the width of that window in ticks.
+ */
+static uint64_t correlate_read(uint64_t (*read_fn)(void), clockid_t clock,
+			       uint64_t *mono_ns, uint64_t freq,
+			       uint64_t *uncert)
+{
+	struct timespec tp1, tp2;
+	uint64_t cnt;
+
+	clock_gettime(clock, &tp1);
+	cnt = read_fn();
+	clock_gettime(clock, &tp2);
+
+	*mono_ns = (ts_to_ns(&tp1) + ts_to_ns(&tp2)) / 2;
+	if (uncert)
+		*uncert = ns_to_ticks(ts_to_ns(&tp2) - ts_to_ns(&tp1), freq);
+
+	return cnt;
+}
+
+static uint64_t correlate_monotonic(clockid_t clock, uint64_t *mono_ns,
+				    uint64_t freq, uint64_t *uncert)
+{
+	return correlate_read(read_counter_sync, clock, mono_ns, freq, uncert);
+}
+
+struct offset_ref {
+	bool valid;
+	int core;
+	uint64_t cnt, raw_ns;
+};
+
+/*
+ * The counter offset of a core against the first one measured, with both
+ * correlated to CLOCK_MONOTONIC_RAW, which is the same on all cores.
+ */
+static void core_offset(FILE *stream, int core, uint64_t freq,
+			struct offset_ref *ref)
+{
+	uint64_t cnt, raw_ns, uncert;
+	struct tt_record *rec;
+	int64_t offset;
+
+	if (pin_thread(0, core, false))
+		return;
+	cnt = correlate_monotonic(CLOCK_MONOTONIC_RAW, &raw_ns, freq, &uncert);
+	pin_thread(0, RESTORE_ONLY, true);
+
+	if (!ref->valid) {
+		ref->valid = true;
+		ref->core = core;
+		ref->cnt = cnt;
+		ref->raw_ns = raw_ns;
+	}
+	offset = ticks_to_ns(cnt - ref->cnt, freq) -
+		 (int64_t)(raw_ns - ref->raw_ns);
+
+	fprintf(stream, "# core %d: counter offset to core %d: %"PRId64" ns (+/- %"PRId64" ns)\n",
+		core, ref->core, offset, ticks_to_ns(uncert, freq) / 2);
+
+	rec = add_result(TT_REC_OFFSET, 0, core);
+	if (rec) {
+		rec->count = 1;
+		rec->avg = offset;
+		rec->max = ticks_to_ns(uncert, freq) / 2;
+	}
+}
+
+#define HIST_BUCKETS	1000		/* one bucket per microsecond */
+
+struct latency_params {
+	unsigned long interval_us;
+	int loops;
+	bool use_timerfd;
+	int hist_size;
+	uint64_t freq;
+	bool perf;
+	const struct read_strategy *strat;	/* NULL: ISB, then MRS */
+};
+
+struct latency_job {
+	struct core_job job;
+	const struct latency_params *params;
+	uint64_t *hist;			/* hist_size + 1 overflow bucket */
+	int64_t min, max, sum;		/* in nanoseconds */
+	int count, early, overruns;
+	struct perf_counters pc;
+	bool have_perf;
+};
+
+static void *latency_thread(void *arg)
+{
+	struct latency_job *lj = arg;
+	const struct latency_params *p = lj->params;
+	uint64_t (*read_fn)(void) = p->strat ? p->strat->fn : read_counter_sync;
+	uint64_t interval_ns = p->interval_us * 1000ULL;
+	uint64_t next_ns, mono_ns, cnt_ref, uncert, now;
+	struct timespec next;
+	int tfd = -1;
+	int i;
+
+	if (pin_self(lj->job.core)) {
+		lj->job.err = errno;
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	next_ns = ts_to_ns(&next) + interval_ns;
+
+	if (p->use_timerfd) {
+		struct itimerspec its;
+
+		tfd = timerfd_create(CLOCK_MONOTONIC, 0);
+		if (tfd < 0) {
+			lj->job.err = errno;
+			return NULL;
+		}
+		ns_to_ts(next_ns, &its.it_value);
+		ns_to_ts(interval_ns, &its.it_interval);
+		if (timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL)) {
+			lj->job.err = errno;
+			close(tfd);
+			return NULL;
+		}
+	}
+
+	if (p->perf && !perf_open(&lj->pc))
+		lj->have_perf = true;
+
+	lj->min = INT64_MAX;
+	lj->max = INT64_MIN;
+	perf_start(lj->have_perf ? &lj->pc : NULL);
+	for (i = 0; i < p->loops; i++) {
+		int64_t lat_ticks, lat;
+
+		/*
+		 * Re-correlate the two clocks on every iteration, so that
+		 * NTP slewing of CLOCK_MONOTONIC does not add up over time.
+		 */
+		cnt_ref = correlate_read(read_fn, CLOCK_MONOTONIC, &mono_ns,
+					 p->freq, &uncert);
+
+		if (p->use_timerfd) {
+			uint64_t expirations;
 
-	fprintf(stdout, "1..3\n");
+			if (read(tfd, &expirations, sizeof(expirations)) !=
+			    sizeof(expirations)) {
+				lj->job.err = errno;
+				break;
+			}
+			now = read_fn();
+			if (expirations > 1) {
+				lj->overruns++;
+				next_ns += (expirations - 1) * interval_ns;
+			}
+		} else {
+			ns_to_ts(next_ns, &next);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &next, NULL) == EINTR)
+				;
+			now = read_fn();
+		}
+
+		/* The deadline may already have passed when we correlated. */
+		lat_ticks = now - cnt_ref;
+		if (next_ns >= mono_ns)
+			lat_ticks -= ns_to_ticks(next_ns - mono_ns, p->freq);
+		else
+			lat_ticks += ns_to_ticks(mono_ns - next_ns, p->freq);
+		if (lat_ticks < -(int64_t)(uncert + 1))
+			lj->early++;
+		lat = ticks_to_ns(lat_ticks, p->freq);
+
+		if (lat < lj->min)
+			lj->min = lat;
+		if (lat > lj->max)
+			lj->max = lat;
+		lj->sum += lat;
+		lj->count++;
+
+		if (lat < 0)
+			lj->hist[0]++;
+		else if (lat / 1000 >= p->hist_size)
+			lj->hist[p->hist_size]++;
+		else
+			lj->hist[lat / 1000]++;
+
+		next_ns += interval_ns;
+	}
+	perf_stop(lj->have_perf ? &lj->pc : NULL);
+
+	if (tfd >= 0)
+		close(tfd);
+
+	return NULL;
+}
+
+static void record_wakeup(const struct latency_job *lj, int hist_size)
+{
+	const struct read_strategy *strat = lj->params->strat;
+	struct tt_record *rec;
+	int i;
+
+	rec = add_result(TT_REC_WAKEUP, strat ? TT_READ_STRATEGY +
+			 (strat - read_strategies) : TT_READ_NATIVE,
+			 lj->job.core);
+	if (!rec)
+		return;
+
+	rec->count = lj->count;
+	rec->errors = lj->early;
+	rec->min = lj->min;
+	rec->avg = (double)lj->sum / lj->count;
+	rec->max = lj->max;
+	for (i = 0; i < TT_NR_PCT; i++)
+		rec->pct[i] = hist_percentile(lj->hist, hist_size, lj->count,
+					      tt_pct[i]) * 1000.0;
+	rec->extra = lj->overruns;
+}
+
+static void print_histogram(FILE *stream, struct latency_job *lj,
+			    int nr_cores, int hist_size)
+{
+	int i, c;
+
+	fprintf(stream, "# histogram (us)");
+	for (c = 0; c < nr_cores; c++)
+		fprintf(stream, "\tcore %d", c);
+	fprintf(stream, "\n");
+
+	for (i = 0; i <= hist_size; i++) {
+		bool used = false;
+
+		for (c = 0; c < nr_cores; c++)
+			used = used || (!lj[c].job.err && lj[c].hist[i]);
+		if (!used)
+			continue;
+
+		if (i == hist_size)
+			fprintf(stream, "# >=%d", i);
+		else
+			fprintf(stream, "# %d", i);
+		for (c = 0; c < nr_cores; c++)
+			fprintf(stream, "\t%"PRIu64,
+				lj[c].job.err ? 0 : lj[c].hist[i]);
+		fprintf(stream, "\n");
+	}
+}
+
+/*
+ * cyclictest style wakeup latency test: one thread pinned to each core
+ * sleeps until an absolute deadline, then timestamps the wakeup with the
+ * counter. Waking up before the deadline is a failure, as is exceeding
+ * max_lat_us (if given).
+ */
+static int test_latency(FILE *stream, int testnr, int nr_cores,
+			const struct latency_params *params, long max_lat_us)
+{
+	struct latency_job *lj;
+	struct noise_snap ns;
+	int64_t worst = 0;
+	int early = 0;
+	bool ok = true;
+	int c;
+
+	lj = calloc(nr_cores, sizeof(*lj));
+	if (!lj)
+		return 0;
+	for (c = 0; c < nr_cores; c++) {
+		lj[c].params = params;
+		lj[c].hist = calloc(params->hist_size + 1, sizeof(uint64_t));
+		if (!lj[c].hist) {
+			while (c--)
+				free(lj[c].hist);
+			free(lj);
+			return 0;
+		}
+		prefault(lj[c].hist, (params->hist_size + 1) * sizeof(uint64_t));
+	}
+
+	fprintf(stream, "# wakeup latency: %d loops, %lu us interval, using %s, %s reads\n",
+		params->loops, params->interval_us,
+		params->use_timerfd ? "timerfd" : "clock_nanosleep",
+		params->strat ? params->strat->name : "isb");
+	noise_begin(&ns);
+	run_per_core(nr_cores, latency_thread, lj, sizeof(*lj));
+	noise_end(&ns);
+
+	for (c = 0; c < nr_cores; c++) {
+		if (lj[c].job.err) {
+			fprintf(stream, "# core %d: skipped: %s\n", c,
+				strerror(lj[c].job.err));
+			continue;
+		}
+		if (!lj[c].count)
+			continue;
+
+		fprintf(stream, "# core %d: min: %"PRId64" ns, avg: %"PRId64" ns, max overshoot: %"PRId64" ns, early: %d, overruns: %d\n",
+			c, lj[c].min, lj[c].sum / lj[c].count, lj[c].max,
+			lj[c].early, lj[c].overruns);
+		if (lj[c].have_perf) {
+			char phase[32];
+
+			snprintf(phase, sizeof(phase), "core %d wakeups", c);
+			perf_report(stream, &lj[c].pc, phase, lj[c].count);
+		}
+		if (lj[c].max > worst)
+			worst = lj[c].max;
+		early += lj[c].early;
+		record_wakeup(&lj[c], params->hist_size);
+		noise_report(stream, &ns, TT_REC_WAKEUP, c, lj[c].job.nvcsw,
+			     lj[c].job.nivcsw);
+	}
+	noise_free(&ns);
+	print_histogram(stream, lj, nr_cores, params->hist_size);
+
+	ok = !early && (max_lat_us < 0 || worst <= max_lat_us * 1000);
+	fprintf(stream, "%sok %d wakeup latency%s%s # max %"PRId64" ns, %d early wakeups\n",
+		ok ? "" : "not ", testnr, params->strat ? " with " : "",
+		params->strat ? params->strat->name : "", worst, early);
+
+	/* also for the cores which failed or got no samples */
+	for (c = 0; c < nr_cores; c++) {
+		if (lj[c].have_perf)
+			perf_close(&lj[c].pc);
+		free(lj[c].hist);
+	}
+	free(lj);
+
+	return 1;
+}
+
+struct drift_params {
+	unsigned int duration_s;
+	unsigned int interval_ms;
+	uint64_t step_ns;
+	double max_ppm;			/* negative: don't check */
+	uint64_t freq;
+};
+
+/* paired readings of the counter and both Linux clocks, for one core */
+struct drift_job {
+	struct core_job job;
+	const struct drift_params *params;
+	uint64_t *cnt, *raw, *mono;
+	int count;
+};
+
+static void *drift_thread(void *arg)
+{
+	struct drift_job *dj = arg;
+	const struct drift_params *p = dj->params;
+	int nr_samples = p->duration_s * 1000ULL / p->interval_ms + 1;
+	struct timespec next, tp1, tp2, tpm;
+	uint64_t next_ns;
+	int i;
+
+	dj->cnt = calloc(nr_samples, sizeof(uint64_t));
+	dj->raw = calloc(nr_samples, sizeof(uint64_t));
+	dj->mono = calloc(nr_samples, sizeof(uint64_t));
+	if (!dj->cnt || !dj->raw || !dj->mono) {
+		dj->job.err = ENOMEM;
+		return NULL;
+	}
+	prefault(dj->cnt, nr_samples * sizeof(uint64_t));
+	prefault(dj->raw, nr_samples * sizeof(uint64_t));
+	prefault(dj->mono, nr_samples * sizeof(uint64_t));
+
+	if (pin_self(dj->job.core)) {
+		dj->job.err = errno;
+		return NULL;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	next_ns = ts_to_ns(&next);
+	for (i = 0; i < nr_samples; i++) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &tp1);
+		dj->cnt[i] = read_counter_sync();
+		clock_gettime(CLOCK_MONOTONIC_RAW, &tp2);
+		clock_gettime(CLOCK_MONOTONIC, &tpm);
+
+		dj->raw[i] = (ts_to_ns(&tp1) + ts_to_ns(&tp2)) / 2;
+		dj->mono[i] = ts_to_ns(&tpm);
+		dj->count++;
+
+		next_ns += p->interval_ms * 1000000ULL;
+		ns_to_ts(next_ns, &next);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+				       &next, NULL) == EINTR)
+			;
+	}
+
+	return NULL;
+}
+
+/*
+ * Least squares fit of the clock readings (in ns since the first sample)
+ * over the counter readings (converted to ns), then look at the residuals.
+ * A slope of 1.0 means no drift. Values are centred on their means before
+ * summing up, to keep the precision of the doubles over long runs.
+ */
+static bool analyse_drift(FILE *stream, int core, int id,
+			  const char *clockname, const uint64_t *cnt,
+			  const uint64_t *clk, int n,
+			  const struct drift_params *p)
+{
+	struct tt_record *rec;
+	double mx = 0, my = 0, sxx = 0, sxy = 0, slope, icept, ppm;
+	double res, prev_res = 0, sq = 0, maxres = 0, maxstep = 0;
+	int i, steps = 0, step_at = -1;
+
+	for (i = 0; i < n; i++) {
+		mx += ticks_to_ns(cnt[i] - cnt[0], p->freq);
+		my += clk[i] - clk[0];
+	}
+	mx /= n;
+	my /= n;
+	for (i = 0; i < n; i++) {
+		double dx = ticks_to_ns(cnt[i] - cnt[0], p->freq) - mx;
+		double dy = (double)(clk[i] - clk[0]) - my;
+
+		sxx += dx * dx;
+		sxy += dx * dy;
+	}
+	slope = sxx > 0 ? sxy / sxx : 1.0;
+	icept = my - slope * mx;
+	/* positive: the counter runs fast compared to this clock */
+	ppm = (1.0 / slope - 1.0) * 1e6;
+
+	for (i = 0; i < n; i++) {
+		double x = ticks_to_ns(cnt[i] - cnt[0], p->freq);
+
+		res = (double)(clk[i] - clk[0]) - (icept + slope * x);
+		sq += res * res;
+		if (fabs(res) > maxres)
+			maxres = fabs(res);
+		if (i && fabs(res - prev_res) > p->step_ns) {
+			steps++;
+			if (fabs(res - prev_res) > fabs(maxstep)) {
+				maxstep = res - prev_res;
+				step_at = i;
+			}
+		}
+		prev_res = res;
+	}
+
+	fprintf(stream, "# core %d: counter vs %s: drift: %+.3f ppm, residual rms: %.1f ns, max: %.1f ns, steps: %d\n",
+		core, clockname, ppm, sqrt(sq / n), maxres, steps);
+	if (steps)
+		fprintf(stream, "# core %d: biggest %s step: %+.0f ns after %.1f s\n",
+			core, clockname, maxstep,
+			ticks_to_ns(cnt[step_at] - cnt[0], p->freq) / 1e9);
+
+	rec = add_result(TT_REC_DRIFT, id, core);
+	if (rec) {
+		rec->count = n;
+		rec->errors = steps;
+		rec->min = sqrt(sq / n);
+		rec->avg = ppm;
+		rec->max = maxres;
+		rec->extra = maxstep;
+	}
+
+	return !steps && (p->max_ppm < 0 || fabs(ppm) <= p->max_ppm);
+}
+
+/*
+ * Long term comparison of the counter against the Linux clocks: sample
+ * all three periodically on every core and fit a line through the
+ * readings. Fails on step discontinuities, or if the drift exceeds the
+ * given limit.
+ */
+static int test_drift(FILE *stream, int testnr, int nr_cores,
+		      const struct drift_params *params)
+{
+	struct drift_job *dj;
+	struct noise_snap ns;
+	bool ok = true;
+	int c;
+
+	dj = calloc(nr_cores, sizeof(*dj));
+	if (!dj)
+		return 0;
+	for (c = 0; c < nr_cores; c++)
+		dj[c].params = params;
+
+	fprintf(stream, "# drift: sampling for %u s, every %u ms\n",
+		params->duration_s, params->interval_ms);
+	fflush(stream);
+	noise_begin(&ns);
+	run_per_core(nr_cores, drift_thread, dj, sizeof(*dj));
+	noise_end(&ns);
+
+	for (c = 0; c < nr_cores; c++) {
+		if (dj[c].job.err) {
+			fprintf(stream, "# core %d: skipped: %s\n", c,
+				strerror(dj[c].job.err));
+		} else if (dj[c].count < 3) {
+			fprintf(stream, "# core %d: not enough samples\n", c);
+		} else {
+			ok &= analyse_drift(stream, c, 0,
+					    "CLOCK_MONOTONIC_RAW",
+					    dj[c].cnt, dj[c].raw,
+					    dj[c].count, params);
+			ok &= analyse_drift(stream, c, 1, "CLOCK_MONOTONIC",
+					    dj[c].cnt, dj[c].mono,
+					    dj[c].count, params);
+			noise_report(stream, &ns, TT_REC_DRIFT, c,
+				     dj[c].job.nvcsw, dj[c].job.nivcsw);
+		}
+		free(dj[c].cnt);
+		free(dj[c].raw);
+		free(dj[c].mono);
+	}
+	free(dj);
+	noise_free(&ns);
+
+	fprintf(stream, "%sok %d counter drift against Linux clocks\n",
+		ok ? "" : "not ", testnr);
+
+	return 1;
+}
+
+static void read_id_file(const char *path, char *buf, size_t size)
+{
+	size_t len;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return;
+	len = fread(buf, 1, size - 1, f);
+	fclose(f);
+
+	/* device tree strings end in a NUL, other files in a newline */
+	buf[len] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+}
+
+/*
+ * Idle exit: sleep for periods long enough to reach each cpuidle state, and
+ * check the counter against CLOCK_MONOTONIC_RAW across them. A counter
+ * which stops or loses its value in a power down state shows up as a gap
+ * between the two, or as waking up early if the kernel's clocksource is
+ * that very counter. The wakeup latency is the cost of leaving the state.
+ */
+#define MAX_IDLE_STATES	10
+#define IDLE_MIN_US	50
+#define CPUIDLE_PATH	"/sys/devices/system/cpu/cpu%d/cpuidle/state%d/%s"
+
+struct idle_params {
+	int loops;			/* idle periods per state */
+	uint64_t step_ns;		/* a bigger gap is a discontinuity */
+	uint64_t freq;
+};
+
+struct idle_state {
+	char name[16];
+	unsigned int latency_us, residency_us;
+	bool disabled;
+	int usage_fd;			/* -1 without cpuidle */
+	uint64_t sleep_ns;
+	int hits;			/* targeted periods ending up here */
+	/* for all periods which ended up in this state */
+	uint64_t hist[HIST_BUCKETS + 1];
+	int64_t min, max, sum;		/* wakeup latency, in ns */
+	int64_t max_gap;		/* counter minus CLOCK_MONOTONIC_RAW */
+	int count, gaps, early;
+};
+
+struct idle_job {
+	struct core_job job;
+	const struct idle_params *params;
+	struct idle_state state[MAX_IDLE_STATES];
+	int nr_states;
+	bool cpuidle;
+	int unattributed;		/* no state entered at all */
+};
+
+static int read_idle_attr(int core, int state, const char *attr, char *buf,
+			  size_t size)
+{
+	char path[96];
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), CPUIDLE_PATH, core, state, attr);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	len = read(fd, buf, size - 1);
+	close(fd);
+	if (len < 0)
+		return -errno;
+	buf[len] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+
+	return 0;
+}
+
+static uint64_t read_usage(int fd)
+{
+	char buf[32];
+	ssize_t len;
+
+	len = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (len <= 0)
+		return 0;
+	buf[len] = 0;
+
+	return strtoull(buf, NULL, 10);
+}
+
+/*
+ * The governor picks the deepest state whose target residency fits the
+ * expected idle time, so sleeping halfway between two residencies should
+ * end up in the shallower one. Without cpuidle: 50us, 500us, 5ms and 50ms.
+ */
+static void idle_states(struct idle_job *ij)
+{
+	struct idle_state *st;
+	int i, core = ij->job.core;
+	char buf[64];
+
+	for (i = 0; i < MAX_IDLE_STATES; i++) {
+		st = &ij->state[i];
+		if (read_idle_attr(core, i, "name", st->name, sizeof(st->name)))
+			break;
+		if (!read_idle_attr(core, i, "latency", buf, sizeof(buf)))
+			st->latency_us = strtoul(buf, NULL, 10);
+		if (!read_idle_attr(core, i, "residency", buf, sizeof(buf)))
+			st->residency_us = strtoul(buf, NULL, 10);
+		if (!read_idle_attr(core, i, "disable", buf, sizeof(buf)))
+			st->disabled = atoi(buf);
+		snprintf(buf, sizeof(buf), CPUIDLE_PATH, core, i, "usage");
+		st->usage_fd = open(buf, O_RDONLY);
+	}
+	ij->nr_states = i;
+	ij->cpuidle = i > 0;
+
+	for (i = 0; i < ij->nr_states; i++) {
+		st = &ij->state[i];
+		if (i + 1 < ij->nr_states)
+			st->sleep_ns = (st->residency_us +
+					ij->state[i + 1].residency_us) * 500ULL;
+		else
+			st->sleep_ns = st->residency_us * 2000ULL;
+		if (st->sleep_ns < IDLE_MIN_US * 1000ULL)
+			st->sleep_ns = IDLE_MIN_US * 1000ULL;
+	}
+
+	for (i = 0; !ij->cpuidle && i < 4; i++) {
+		st = &ij->state[i];
+		st->usage_fd = -1;
+		st->sleep_ns = i ? ij->state[i - 1].sleep_ns * 10 :
+				   IDLE_MIN_US * 1000ULL;
+		ij->nr_states++;
+	}
+}
+
+static void idle_sample(struct idle_job *ij, struct idle_state *st,
+			int64_t lat, int64_t gap, int64_t tolerance)
+{
+	if (!st->count || lat < st->min)
+		st->min = lat;
+	if (!st->count || lat > st->max)
+		st->max = lat;
+	st->sum += lat;
+	st->count++;
+
+	if (lat < 0)
+		st->hist[0]++;
+	else if (lat / 1000 >= HIST_BUCKETS)
+		st->hist[HIST_BUCKETS]++;
+	else
+		st->hist[lat / 1000]++;
+
+	if (llabs(gap) > llabs(st->max_gap))
+		st->max_gap = gap;
+	if (llabs(gap) > (int64_t)ij->params->step_ns + tolerance)
+		st->gaps++;
+}
+
+static void *idle_thread(void *arg)
+{
+	struct idle_job *ij = arg;
+	const struct idle_params *p = ij->params;
+	uint64_t usage[MAX_IDLE_STATES];
+	uint64_t cnt0, cnt1, raw0, raw1, u0, u1;
+	struct idle_state *st, *target;
+	int64_t lat, gap, unc;
+	struct timespec req;
+	int i, s, entered;
+
+	if (pin_self(ij->job.core)) {
+		ij->job.err = errno;
+		return NULL;
+	}
+	/* the default 50us of timer slack would count as latency */
+	prctl(PR_SET_TIMERSLACK, 1UL);
+	idle_states(ij);
+
+	for (target = ij->state; target < ij->state + ij->nr_states;
+	     target++) {
+		for (i = 0; i < p->loops && !target->disabled; i++) {
+			for (s = 0; ij->cpuidle && s < ij->nr_states; s++)
+				usage[s] = read_usage(ij->state[s].usage_fd);
+
+			ns_to_ts(target->sleep_ns, &req);
+			cnt0 = correlate_monotonic(CLOCK_MONOTONIC_RAW, &raw0,
+						   p->freq, &u0);
+			while (clock_nanosleep(CLOCK_MONOTONIC, 0, &req,
+					       &req) == EINTR)
+				;
+			cnt1 = correlate_monotonic(CLOCK_MONOTONIC_RAW, &raw1,
+						   p->freq, &u1);
+
+			/* the deepest state entered, if more than one */
+			entered = ij->cpuidle ? -1 : target - ij->state;
+			for (s = 0; ij->cpuidle && s < ij->nr_states; s++)
+				if (read_usage(ij->state[s].usage_fd) !=
+				    usage[s])
+					entered = s;
+			if (entered < 0) {
+				ij->unattributed++;
+				continue;
+			}
+			st = &ij->state[entered];
+			if (st == target)
+				target->hits++;
+
+			lat = (int64_t)(raw1 - raw0) - target->sleep_ns;
+			gap = ticks_to_ns(cnt1 - cnt0, p->freq) -
+			      (int64_t)(raw1 - raw0);
+			unc = ticks_to_ns(u0 + u1, p->freq) / 2;
+			/*
+			 * CLOCK_MONOTONIC may run up to 500 ppm faster than
+			 * the raw clock, when NTP slews it.
+			 */
+			if (lat < -(unc + (int64_t)target->sleep_ns / 2000) ||
+			    cnt1 < cnt0)
+				st->early++;
+			idle_sample(ij, st, lat, gap, unc);
+		}
+	}
+
+	for (s = 0; s < ij->nr_states; s++)
+		if (ij->state[s].usage_fd >= 0)
+			close(ij->state[s].usage_fd);
+
+	return NULL;
+}
+
+static void record_idle(const struct idle_job *ij, int id)
+{
+	const struct idle_state *st = &ij->state[id];
+	struct tt_record *rec = add_result(TT_REC_IDLE, id, ij->job.core);
+	int i;
+
+	if (!rec)
+		return;
+
+	rec->count = st->count;
+	rec->errors = st->gaps + st->early;
+	rec->min = st->min;
+	rec->avg = (double)st->sum / st->count;
+	rec->max = st->max;
+	for (i = 0; i < TT_NR_PCT; i++)
+		rec->pct[i] = hist_percentile(st->hist, HIST_BUCKETS,
+					      st->count, tt_pct[i]) * 1000.0;
+	rec->extra = st->max_gap;
+}
+
+static int test_idle(FILE *stream, int testnr, int nr_cores,
+		     const struct idle_params *params)
+{
+	const struct idle_state *st;
+	struct noise_snap ns;
+	struct idle_job *ij;
+	char clocksource[32];
+	int c, s, errors = 0;
+
+	ij = calloc(nr_cores, sizeof(*ij));
+	if (!ij)
+		return 0;
+	for (c = 0; c < nr_cores; c++)
+		ij[c].params = params;
+	prefault(ij, nr_cores * sizeof(*ij));
+
+	strcpy(clocksource, "unknown");
+	read_id_file("/sys/devices/system/clocksource/clocksource0/current_clocksource",
+		     clocksource, sizeof(clocksource));
+	fprintf(stream, "# idle exit: %d periods per state, clocksource: %s\n",
+		params->loops, clocksource);
+	fflush(stream);
+	noise_begin(&ns);
+	run_per_core(nr_cores, idle_thread, ij, sizeof(*ij));
+	noise_end(&ns);
+
+	for (c = 0; c < nr_cores; c++) {
+		if (ij[c].job.err) {
+			fprintf(stream, "# core %d: skipped: %s\n", c,
+				strerror(ij[c].job.err));
+			continue;
+		}
+		if (!ij[c].cpuidle)
+			fprintf(stream, "# core %d: no cpuidle states, sleeping for fixed times\n",
+				c);
+
+		for (s = 0; s < ij[c].nr_states; s++) {
+			st = &ij[c].state[s];
+			if (ij[c].cpuidle)
+				fprintf(stream, "# core %d: state %d: %s, exit latency: %u us, residency: %u us%s\n",
+					c, s, st->name, st->latency_us,
+					st->residency_us,
+					st->disabled ? ", disabled" : "");
+			if (st->disabled)
+				continue;
+			if (ij[c].cpuidle)
+				fprintf(stream, "# core %d: state %d: sleeping %"PRIu64" us, %d of %d periods ended up there\n",
+					c, s, st->sleep_ns / 1000, st->hits,
+					params->loops);
+			else
+				fprintf(stream, "# core %d: sleeping %"PRIu64" us\n",
+					c, st->sleep_ns / 1000);
+			if (!st->count)
+				continue;
+			fprintf(stream, "# core %d: state %d: %d wakeups, latency min: %"PRId64" ns, avg: %"PRId64" ns, max: %"PRId64" ns, p99: %.0f us\n",
+				c, s, st->count, st->min, st->sum / st->count,
+				st->max,
+				hist_percentile(st->hist, HIST_BUCKETS,
+						st->count, 99));
+			fprintf(stream, "# core %d: state %d: counter vs CLOCK_MONOTONIC_RAW: biggest gap: %+"PRId64" ns, discontinuities: %d, early: %d\n",
+				c, s, st->max_gap, st->gaps, st->early);
+			errors += st->gaps + st->early;
+			record_idle(&ij[c], s);
+		}
+		if (ij[c].unattributed)
+			fprintf(stream, "# core %d: %d periods without entering any idle state\n",
+				c, ij[c].unattributed);
+		noise_report(stream, &ns, TT_REC_IDLE, c, ij[c].job.nvcsw,
+			     ij[c].job.nivcsw);
+	}
+	free(ij);
+	noise_free(&ns);
+
+	fprintf(stream, "%sok %d counter continuity across idle states # %d discontinuities\n",
+		errors ? "not " : "", testnr, errors);
+
+	return 1;
+}
+
+static uint64_t read_clock(clockid_t clock)
+{
+	struct timespec tp;
+
+	clock_gettime(clock, &tp);
+
+	return ts_to_ns(&tp);
+}
+
+/* The counter sources the scalability benchmark can hammer on. */
+static const struct read_source {
+	const char *name;
+	clockid_t clock;		/* if fn is NULL */
+	uint64_t (*fn)(void);
+} read_sources[] = {
+	{ "native",		0, read_counter },
+	{ "native-sync",	0, read_counter_sync },
+	{ "native-isb-after",	0, read_counter_isb_after },
+	{ "native-stable",	0, read_counter_stable },
+	{ "native-lowbits",	0, read_counter_lowbits },
+	{ "monotonic",		CLOCK_MONOTONIC, NULL },
+	{ "monotonic-raw",	CLOCK_MONOTONIC_RAW, NULL },
+	{ "monotonic-coarse",	CLOCK_MONOTONIC_COARSE, NULL },
+	{ "realtime",		CLOCK_REALTIME, NULL },
+	{ "boottime",		CLOCK_BOOTTIME, NULL },
+	{ NULL }
+};
+
+static const struct read_source *find_read_source(const char *name)
+{
+	const struct read_source *src;
+
+	for (src = read_sources; src->name; src++)
+		if (!strcmp(src->name, name))
+			return src;
+
+	return NULL;
+}
+
+struct scale_job {
+	struct core_job job;
+	const struct read_source *src;
+	uint64_t start_ns, end_ns;	/* CLOCK_MONOTONIC */
+	uint64_t reads;
+	double rate;			/* reads per second */
+};
+
+#define SCALE_BATCH	4096		/* reads between checking the time */
+
+static void *scale_thread(void *arg)
+{
+	struct scale_job *sj = arg;
+	uint64_t now, reads = 0;
+	int i;
+
+	if (pin_self(sj->job.core)) {
+		sj->job.err = errno;
+		return NULL;
+	}
+
+	/* all threads start hammering at the same time */
+	while ((now = read_clock(CLOCK_MONOTONIC)) < sj->start_ns)
+		;
+
+	do {
+		if (sj->src->fn) {
+			for (i = 0; i < SCALE_BATCH; i++)
+				sj->src->fn();
+		} else {
+			for (i = 0; i < SCALE_BATCH; i++)
+				read_clock(sj->src->clock);
+		}
+		reads += SCALE_BATCH;
+	} while ((now = read_clock(CLOCK_MONOTONIC)) < sj->end_ns);
+
+	sj->reads = reads;
+	sj->rate = reads * 1e9 / (now - sj->start_ns);
+
+	return NULL;
+}
+
+/*
+ * Measure the read throughput of a counter source with 1..N threads, each
+ * pinned to its own core and reading in a tight loop for duration_ms.
+ * The efficiency compares the aggregate rate against N times the single
+ * thread rate, so contention (seqcount retries, erratum workarounds trapping
+ * into the kernel) shows up as a dropping curve.
+ */
+static int test_scaling(FILE *stream, int testnr, int nr_cores,
+			const struct read_source *src, unsigned int duration_ms)
+{
+	struct tt_record *rec;
+	struct scale_job *sj;
+	struct noise_snap ns;
+	double single = 0;
+	bool ok = true;
+	int t, c;
+
+	sj = calloc(nr_cores, sizeof(*sj));
+	if (!sj)
+		return 0;
+
+	fprintf(stream, "# read scalability of %s, %u ms per step\n",
+		src->name, duration_ms);
+	for (t = 1; t <= nr_cores; t++) {
+		uint64_t start = read_clock(CLOCK_MONOTONIC) + 10000000;
+		double aggregate = 0;
+		int active = 0;
+
+		memset(sj, 0, nr_cores * sizeof(*sj));
+		for (c = 0; c < t; c++) {
+			sj[c].src = src;
+			sj[c].start_ns = start;
+			sj[c].end_ns = start + duration_ms * 1000000ULL;
+		}
+		noise_begin(&ns);
+		run_per_core(t, scale_thread, sj, sizeof(*sj));
+		noise_end(&ns);
+
+		fprintf(stream, "# threads: %d, per thread (Mreads/s):", t);
+		for (c = 0; c < t; c++) {
+			if (sj[c].job.err) {
+				fprintf(stream, " -");
+				continue;
+			}
+			fprintf(stream, " %.2f", sj[c].rate / 1e6);
+			aggregate += sj[c].rate;
+			active++;
+			ok &= sj[c].reads > 0;
+		}
+		fprintf(stream, "\n");
+
+		if (t == 1)
+			single = aggregate;
+		fprintf(stream, "# threads: %d, aggregate: %.2f Mreads/s, efficiency: %.1f%%\n",
+			t, aggregate / 1e6,
+			active && single ? 100.0 * aggregate / (active * single) : 0);
+
+		rec = add_result(TT_REC_SCALE, src - read_sources, t - 1);
+		if (rec) {
+			for (c = 0; c < t; c++)
+				rec->count += sj[c].reads;
+			rec->errors = t - active;
+			rec->avg = aggregate;
+			rec->extra = active && single ?
+				100.0 * aggregate / (active * single) : 0;
+		}
+		for (c = 0; c < t; c++)
+			if (!sj[c].job.err)
+				noise_report(stream, &ns, TT_REC_SCALE, c,
+					     sj[c].job.nvcsw, sj[c].job.nivcsw);
+		noise_free(&ns);
+	}
+	free(sj);
+
+	fprintf(stream, "%sok %d %s read scalability\n",
+		ok ? "" : "not ", testnr, src->name);
+
+	return 1;
+}
+
+static int write_results(const char *fname, int nr_cores, uint64_t freq,
+			 time_t start)
+{
+	struct tt_header hdr;
+	struct utsname uts;
+	int ret = 0;
+	FILE *f;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TT_MAGIC, sizeof(hdr.magic));
+	hdr.version = TT_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.record_size = sizeof(struct tt_record);
+	hdr.nr_records = results.nr;
+	hdr.nr_cores = nr_cores;
+	hdr.flags = results.flags;
+	hdr.timestamp = start;
+	hdr.freq = freq;
+
+	read_id_file("/proc/device-tree/model", hdr.model, sizeof(hdr.model));
+	if (!hdr.model[0])
+		read_id_file("/sys/class/dmi/id/product_name", hdr.model,
+			     sizeof(hdr.model));
+	read_id_file("/proc/device-tree/serial-number", hdr.serial,
+		     sizeof(hdr.serial));
+	if (!hdr.serial[0])
+		read_id_file("/etc/machine-id", hdr.serial,
+			     sizeof(hdr.serial));
+	gethostname(hdr.hostname, sizeof(hdr.hostname) - 1);
+	if (!uname(&uts)) {
+		snprintf(hdr.kernel, sizeof(hdr.kernel), "%.63s", uts.release);
+		snprintf(hdr.kernel_build, sizeof(hdr.kernel_build), "%.63s",
+			 uts.version);
+	}
+
+	f = fopen(fname, "wb");
+	if (!f)
+		return -errno;
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    fwrite(results.rec, sizeof(*results.rec), results.nr, f) !=
+	    results.nr)
+		ret = -EIO;
+	if (fclose(f) && !ret)
+		ret = -errno;
+
+	return ret;
+}
+
+static void usage(const char *progname, FILE *stream)
+{
+	const struct read_strategy *strat;
+	const struct read_source *src;
+
+	fprintf(stream, "test_timer: test Linux and ARM generic timer\n"
+		"usage: %s [-h] [-p] [-L] [-o results] [-l [-t] [-i interval] [-n loops] [-m max] [-H buckets]]\n"
+		"       %s [-d seconds [-s interval] [-S step] [-M ppm]]\n"
+		"       %s [-x source [-T ms]]\n"
+		"       %s [-r strategy|all]\n"
+		"       %s [-I periods [-S step]]\n",
+		progname, progname, progname, progname, progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-p|--perf: report perf event counts for each test phase\n"
+		"\t-L|--low-noise: SCHED_FIFO and locked memory, report interrupts and\n"
+		"\t\tcontext switches during each test\n"
+		"\t-o|--output: also write the results into this file, for ttfleet\n"
+		"\t-l|--latency: measure wakeup latency on every core\n"
+		"\t-t|--timerfd: use a timerfd instead of clock_nanosleep()\n"
+		"\t-i|--interval: wakeup interval in microseconds (default: 1000)\n"
+		"\t-n|--loops: number of wakeups per core (default: 10000)\n"
+		"\t-m|--max-latency: fail if a wakeup is later than this (in us)\n"
+		"\t-H|--histogram: number of 1us histogram buckets (default: %d)\n"
+		"\t-d|--drift: compare counter and Linux clocks for <n> seconds\n"
+		"\t-s|--sample: drift sampling interval in ms (default: 1000)\n"
+		"\t-S|--step: report residual jumps or idle gaps bigger than this (in ns, default: 1000)\n"
+		"\t-M|--max-drift: fail if the drift exceeds this (in ppm)\n"
+		"\t-x|--scale: measure read throughput with 1..N threads\n"
+		"\t-T|--time: duration of each scaling step in ms (default: 1000)\n"
+		"\t-r|--strategy: also test this counter read strategy (or all),\n"
+		"\t\twith -l also measure the wakeup latency using it\n"
+		"\t-I|--idle: sleep into each cpuidle state <n> times per core\n",
+		HIST_BUCKETS);
+	fprintf(stream, "\nsources for --scale:");
+	for (src = read_sources; src->name; src++)
+		fprintf(stream, " %s", src->name);
+	fprintf(stream, "\n");
+	fprintf(stream, "strategies for --strategy:\n");
+	for (strat = read_strategies; strat->name; strat++)
+		fprintf(stream, "\t%s: %s\n", strat->name, strat->desc);
+}
+
+int main(int argc, char** argv)
+{
+	static const struct option lopts[] = {
+		{ "help",	0, 0, 'h' },
+		{ "perf",	0, 0, 'p' },
+		{ "latency",	0, 0, 'l' },
+		{ "timerfd",	0, 0, 't' },
+		{ "interval",	1, 0, 'i' },
+		{ "loops",	1, 0, 'n' },
+		{ "max-latency",	1, 0, 'm' },
+		{ "histogram",	1, 0, 'H' },
+		{ "drift",	1, 0, 'd' },
+		{ "sample",	1, 0, 's' },
+		{ "step",	1, 0, 'S' },
+		{ "max-drift",	1, 0, 'M' },
+		{ "scale",	1, 0, 'x' },
+		{ "time",	1, 0, 'T' },
+		{ "strategy",	1, 0, 'r' },
+		{ "output",	1, 0, 'o' },
+		{ "idle",	1, 0, 'I' },
+		{ "low-noise",	0, 0, 'L' },
+		{ NULL, 0, 0, 0 },
+	};
+	struct latency_params lat_params = {
+		.interval_us = 1000,
+		.loops = 10000,
+		.hist_size = HIST_BUCKETS,
+	};
+	struct drift_params drift_params = {
+		.interval_ms = 1000,
+		.step_ns = 1000,
+		.max_ppm = -1,
+	};
+	struct idle_params idle_params = { };
+	struct perf_counters perf, *pc = NULL;
+	const struct read_source *scale_src = NULL;
+	unsigned int scale_ms = 1000;
+	const struct read_strategy *strat;
+	const char *strategy = NULL, *results_fname = NULL;
+	struct offset_ref offset_ref = { };
+	time_t start = time(NULL);
+	long max_lat_us = -1;
+	bool latency = false, low_noise = false;
+	int nr_cpus;
+	int testnr = 0;
+	int i, ch;
+
+	while ((ch = getopt_long(argc, argv, "hplti:n:m:H:d:s:S:M:x:T:r:o:I:L",
+				 lopts, NULL)) != -1) {
+		switch(ch) {
+		case '?':
+			usage(argv[0], stderr);
+			return 1;
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+		case 'p':
+			lat_params.perf = true;
+			break;
+		case 'L':
+			low_noise = true;
+			break;
+		case 'o':
+			results_fname = optarg;
+			results.enabled = true;
+			break;
+		case 'l':
+			latency = true;
+			break;
+		case 't':
+			lat_params.use_timerfd = true;
+			break;
+		case 'i':
+			lat_params.interval_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			lat_params.loops = atoi(optarg);
+			break;
+		case 'm':
+			max_lat_us = atol(optarg);
+			break;
+		case 'H':
+			lat_params.hist_size = atoi(optarg);
+			break;
+		case 'd':
+			drift_params.duration_s = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			drift_params.interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			drift_params.step_ns = strtoull(optarg, NULL, 0);
+			break;
+		case 'M':
+			drift_params.max_ppm = atof(optarg);
+			break;
+		case 'x':
+			scale_src = find_read_source(optarg);
+			if (!scale_src) {
+				fprintf(stderr, "unknown read source \"%s\"\n",
+					optarg);
+				usage(argv[0], stderr);
+				return 1;
+			}
+			break;
+		case 'I':
+			idle_params.loops = atoi(optarg);
+			break;
+		case 'T':
+			scale_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			strategy = optarg;
+			for (strat = read_strategies; strat->name; strat++)
+				if (!strcmp(strat->name, strategy))
+					break;
+			if (!strat->name && strcmp(strategy, "all")) {
+				fprintf(stderr, "unknown read strategy \"%s\"\n",
+					strategy);
+				usage(argv[0], stderr);
+				return 1;
+			}
+			break;
+		}
+	}
+
+	if (!lat_params.interval_us || lat_params.loops <= 0 ||
+	    lat_params.hist_size <= 0 || !drift_params.interval_ms ||
+	    !scale_ms) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+
+	fprintf(stdout, "TAP version 13\n");
+	nr_cpus = nr_procs();
+	fprintf(stdout, "# number of cores: %d\n", nr_cpus);
+	if (low_noise)
+		noise_setup(stdout, nr_cpus);
+
+	testnr += test_frequency(stdout, testnr + 1, nr_cpus);
+
+	if (lat_params.perf) {
+		int ret = perf_open(&perf);
+
+		if (ret)
+			fprintf(stdout, "# perf events unavailable: %s\n",
+				strerror(-ret));
+		else
+			pc = &perf;
+		lat_params.perf = pc != NULL;
+	}
+
+	if (latency || drift_params.duration_s || scale_src ||
+	    idle_params.loops > 0) {
+		lat_params.freq = read_cntfrq();
+		drift_params.freq = lat_params.freq;
+		idle_params.freq = lat_params.freq;
+		idle_params.step_ns = drift_params.step_ns;
+		if (latency)
+			testnr += test_latency(stdout, testnr + 1, nr_cpus,
+					       &lat_params, max_lat_us);
+		for (strat = read_strategies;
+		     latency && strategy && strat->name; strat++) {
+			if (strcmp(strategy, "all") &&
+			    strcmp(strategy, strat->name))
+				continue;
+			lat_params.strat = strat;
+			testnr += test_latency(stdout, testnr + 1, nr_cpus,
+					       &lat_params, max_lat_us);
+		}
+		if (drift_params.duration_s)
+			testnr += test_drift(stdout, testnr + 1, nr_cpus,
+					     &drift_params);
+		if (scale_src)
+			testnr += test_scaling(stdout, testnr + 1, nr_cpus,
+					       scale_src, scale_ms);
+		if (idle_params.loops > 0)
+			testnr += test_idle(stdout, testnr + 1, nr_cpus,
+					    &idle_params);
+	} else {
+		perf_read_cost(stdout, pc, 1000000);
+		test_monotonic(stdout, 10000000, ++testnr, pc, read_cntfrq());
+		test_monotonic_linux(stdout, 10000000, ++testnr, pc);
+
+		for (strat = read_strategies; strategy && strat->name; strat++)
+			if (!strcmp(strategy, "all") ||
+			    !strcmp(strategy, strat->name))
+				test_strategy(stdout, 10000000, ++testnr, strat,
+					      pc, read_cntfrq());
+
+		for (i = 0; i < nr_cpus; i++) {
+			offset_info(stdout, i);
+			core_offset(stdout, i, read_cntfrq(), &offset_ref);
+		}
+	}
+
+	if (pc)
+		perf_close(pc);
+
+	fprintf(stdout, "1..%d\n", testnr);
+
+	if (results_fname) {
+		int ret = write_results(results_fname, nr_cpus, read_cntfrq(),
+					start);
+
+		if (ret) {
+			fprintf(stderr, "%s: %s\n", results_fname,
+				strerror(-ret));
+			return 1;
+		}
+	}
 	return 0;
 }
@@ -0,0 +1,601 @@
+/*
+ * ttfleet: fleet wide statistics from test_timer results files
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE			/* nftw's FTW_PHYS */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ttresult.h"
+
+#define MAX_READ_IDS	8
+#define MAX_THREADS	64
+#define MAD_SCALE	1.4826		/* MAD to standard deviation */
+
+/* in the order of test_timer's read strategies */
+static const char *read_names[MAX_READ_IDS] = {
+	"native", "linux", "plain", "isb", "isb-after", "stable", "lowbits",
+};
+
+enum read_metric {
+	RM_ERRORS,
+	RM_P50,
+	RM_P99,
+	RM_P999,
+	RM_MAX,
+	NR_READ_METRICS
+};
+
+enum metric_idx {
+	M_OFFSET = MAX_READ_IDS * NR_READ_METRICS,
+	M_WAKEUP_P99,
+	M_WAKEUP_MAX,
+	M_WAKEUP_EARLY,
+	M_DRIFT_RAW,
+	M_DRIFT_MONO,
+	M_DRIFT_STEPS,
+	M_SCALE_EFF,
+	M_IDLE_P99,
+	M_IDLE_ERRORS,
+	NR_METRICS
+};
+
+struct metric {
+	char name[40];
+	const char *unit;
+	bool lower_is_worse;
+	bool per_core;			/* worst core gets reported */
+};
+
+static struct metric metrics[NR_METRICS] = {
+	[M_OFFSET] = { "core offset", "ns", false, true },
+	[M_WAKEUP_P99] = { "wakeup p99", "ns", false, true },
+	[M_WAKEUP_MAX] = { "wakeup max", "ns", false, true },
+	[M_WAKEUP_EARLY] = { "early wakeups", "", false, false },
+	[M_DRIFT_RAW] = { "drift vs raw", "ppm", false, true },
+	[M_DRIFT_MONO] = { "drift vs monotonic", "ppm", false, true },
+	[M_DRIFT_STEPS] = { "drift steps", "", false, false },
+	[M_SCALE_EFF] = { "read scaling", "%", true, false },
+	[M_IDLE_P99] = { "idle exit p99", "ns", false, true },
+	[M_IDLE_ERRORS] = { "idle discontinuities", "", false, false },
+};
+
+struct board {
+	const char *path;
+	struct tt_header hdr;
+	double m[NR_METRICS];		/* NAN if not measured */
+	int16_t core[NR_METRICS];
+	int err;
+};
+
+enum group_by {
+	GROUP_NONE,
+	GROUP_MODEL,
+	GROUP_KERNEL,
+};
+
+static struct {
+	char **paths;
+	size_t nr, max;
+} files;
+
+static void init_metrics(void)
+{
+	static const char *suffix[NR_READ_METRICS] = {
+		[RM_ERRORS] = "error rate", [RM_P50] = "p50",
+		[RM_P99] = "p99", [RM_P999] = "p99.9", [RM_MAX] = "max",
+	};
+	struct metric *m;
+	int i, j;
+
+	for (i = 0; i < MAX_READ_IDS; i++) {
+		for (j = 0; j < NR_READ_METRICS; j++) {
+			m = &metrics[i * NR_READ_METRICS + j];
+			snprintf(m->name, sizeof(m->name), "%s reads %s",
+				 read_names[i] ? read_names[i] : "?",
+				 suffix[j]);
+			m->unit = j == RM_ERRORS ? "ppm" : "ns";
+		}
+	}
+}
+
+static int add_file(const char *path, const struct stat *st, int type,
+		    struct FTW *ftw)
+{
+	char **p;
+
+	if (type != FTW_F || !S_ISREG(st->st_mode))
+		return 0;
+
+	if (files.nr == files.max) {
+		p = realloc(files.paths, (files.max + 1024) * sizeof(*p));
+		if (!p)
+			return -ENOMEM;
+		files.paths = p;
+		files.max += 1024;
+	}
+	files.paths[files.nr] = strdup(path);
+	if (!files.paths[files.nr])
+		return -ENOMEM;
+	files.nr++;
+
+	return 0;
+}
+
+/* Keep the worst value of a metric, remembering the core it came from. */
+static void update(struct board *b, int idx, double val, int core)
+{
+	bool worse;
+
+	if (isnan(b->m[idx]))
+		worse = true;
+	else if (metrics[idx].lower_is_worse)
+		worse = val < b->m[idx];
+	else
+		worse = val > b->m[idx];
+	if (worse) {
+		b->m[idx] = val;
+		b->core[idx] = core;
+	}
+}
+
+static void add_up(struct board *b, int idx, double val)
+{
+	b->m[idx] = isnan(b->m[idx]) ? val : b->m[idx] + val;
+}
+
+static void parse_record(struct board *b, const struct tt_record *rec)
+{
+	int base;
+
+	switch (rec->type) {
+	case TT_REC_READS:
+		if (rec->id >= MAX_READ_IDS || !rec->count)
+			break;
+		base = rec->id * NR_READ_METRICS;
+		update(b, base + RM_ERRORS, 1e6 * rec->errors / rec->count,
+		       rec->core);
+		update(b, base + RM_P50, rec->pct[0], rec->core);
+		update(b, base + RM_P99, rec->pct[2], rec->core);
+		update(b, base + RM_P999, rec->pct[3], rec->core);
+		update(b, base + RM_MAX, rec->max, rec->core);
+		break;
+	case TT_REC_OFFSET:
+		update(b, M_OFFSET, fabs(rec->avg), rec->core);
+		break;
+	case TT_REC_WAKEUP:
+		/* the read strategy runs are for comparison only */
+		if (rec->id != TT_READ_NATIVE)
+			break;
+		update(b, M_WAKEUP_P99, rec->pct[2], rec->core);
+		update(b, M_WAKEUP_MAX, rec->max, rec->core);
+		add_up(b, M_WAKEUP_EARLY, rec->errors);
+		break;
+	case TT_REC_DRIFT:
+		update(b, rec->id ? M_DRIFT_MONO : M_DRIFT_RAW,
+		       fabs(rec->avg), rec->core);
+		add_up(b, M_DRIFT_STEPS, rec->errors);
+		break;
+	case TT_REC_SCALE:
+		/* all cores busy is what counts */
+		if (rec->core + 1 == (int)b->hdr.nr_cores)
+			update(b, M_SCALE_EFF, rec->extra, TT_ALL_CORES);
+		break;
+	case TT_REC_IDLE:
+		update(b, M_IDLE_P99, rec->pct[2], rec->core);
+		add_up(b, M_IDLE_ERRORS, rec->errors);
+		break;
+	}
+}
+
+/*
+ * Validate a results file and boil it down to the per board metrics. The
+ * record size comes from the file, so newer files with longer records
+ * still get parsed.
+ */
+static int load_board(struct board *b)
+{
+	const struct tt_header *hdr;
+	struct tt_record rec;
+	const char *data;
+	struct stat st;
+	size_t rec_size;
+	uint32_t i;
+	int fd, ret = 0;
+
+	for (i = 0; i < NR_METRICS; i++)
+		b->m[i] = NAN;
+
+	fd = open(b->path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -errno;
+	}
+	if ((size_t)st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return -errno;
+
+	hdr = (const struct tt_header *)data;
+	rec_size = hdr->record_size < sizeof(rec) ? hdr->record_size :
+						    sizeof(rec);
+	if (memcmp(hdr->magic, TT_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version != TT_VERSION || hdr->header_size < sizeof(*hdr) ||
+	    !hdr->record_size ||
+	    hdr->header_size + (uint64_t)hdr->nr_records * hdr->record_size >
+	    (uint64_t)st.st_size) {
+		ret = -EINVAL;
+		goto out_unmap;
+	}
+
+	b->hdr = *hdr;
+	b->hdr.model[sizeof(hdr->model) - 1] = 0;
+	b->hdr.serial[sizeof(hdr->serial) - 1] = 0;
+	b->hdr.hostname[sizeof(hdr->hostname) - 1] = 0;
+	b->hdr.kernel[sizeof(hdr->kernel) - 1] = 0;
+	b->hdr.kernel_build[sizeof(hdr->kernel_build) - 1] = 0;
+
+	for (i = 0; i < hdr->nr_records; i++) {
+		memset(&rec, 0, sizeof(rec));
+		memcpy(&rec, data + hdr->header_size +
+		       (size_t)i * hdr->record_size, rec_size);
+		parse_record(b, &rec);
+	}
+
+out_unmap:
+	munmap((void *)data, st.st_size);
+	return ret;
+}
+
+struct load_job {
+	struct board *boards;
+	size_t nr;
+	size_t *next;			/* shared among all threads */
+};
+
+static void *load_thread(void *arg)
+{
+	struct load_job *job = arg;
+	size_t i;
+
+	while ((i = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED)) <
+	       job->nr)
+		job->boards[i].err = load_board(&job->boards[i]);
+
+	return NULL;
+}
+
+static int load_boards(struct board *boards, size_t nr, int nr_threads)
+{
+	pthread_t threads[MAX_THREADS];
+	struct load_job job = { boards, nr, &(size_t){ 0 } };
+	int i, started = 0;
+
+	for (i = 0; i < nr_threads; i++)
+		if (!pthread_create(&threads[i], NULL, load_thread, &job))
+			started++;
+		else
+			break;
+	/* without any thread, do it all here */
+	if (!started)
+		load_thread(&job);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	return 0;
+}
+
+static const char *group_key(const struct board *b, enum group_by group)
+{
+	const char *key;
+
+	switch (group) {
+	case GROUP_MODEL:
+		key = b->hdr.model;
+		break;
+	case GROUP_KERNEL:
+		key = b->hdr.kernel;
+		break;
+	default:
+		return "all";
+	}
+
+	return key[0] ? key : "unknown";
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *sorted, size_t n, double q)
+{
+	size_t i = q / 100 * (n - 1) + 0.5;
+
+	return sorted[i < n ? i : n - 1];
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/* The distinct group keys, sorted. */
+static size_t find_groups(const struct board *boards, size_t nr,
+			  enum group_by group, const char **keys)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < nr; i++)
+		if (!boards[i].err)
+			keys[n++] = group_key(&boards[i], group);
+	qsort(keys, n, sizeof(*keys), cmp_str);
+
+	for (i = 0; i + 1 < n; i++)
+		if (!strcmp(keys[i], keys[i + 1]))
+			keys[i] = NULL;
+	for (i = 0, nr = 0; i < n; i++)
+		if (keys[i])
+			keys[nr++] = keys[i];
+
+	return nr;
+}
+
+static void print_distributions(const struct board *boards, size_t nr,
+				enum group_by group, double *vals,
+				const char **keys)
+{
+	size_t i, g, n, nr_groups, nonzero;
+	char name[64];
+	int m;
+
+	nr_groups = find_groups(boards, nr, group, keys);
+
+	printf("%-32s %-24s %6s %6s %10s %10s %10s %10s %10s\n", "metric",
+	       "group", "boards", "!= 0", "min", "p50", "p90", "p99", "max");
+	for (m = 0; m < NR_METRICS; m++) {
+		for (g = 0; g < nr_groups; g++) {
+			n = nonzero = 0;
+			for (i = 0; i < nr; i++) {
+				if (boards[i].err || isnan(boards[i].m[m]) ||
+				    strcmp(group_key(&boards[i], group),
+					   keys[g]))
+					continue;
+				vals[n++] = boards[i].m[m];
+				nonzero += boards[i].m[m] != 0;
+			}
+			if (!n)
+				continue;
+			qsort(vals, n, sizeof(*vals), cmp_double);
+
+			snprintf(name, sizeof(name), "%.40s%s%.8s%s",
+				 metrics[m].name, metrics[m].unit[0] ? " [" : "",
+				 metrics[m].unit, metrics[m].unit[0] ? "]" : "");
+			printf("%-32s %-24.24s %6zu %6zu %10.4g %10.4g %10.4g "
+			       "%10.4g %10.4g\n", g ? "" : name, keys[g], n,
+			       nonzero, vals[0], percentile(vals, n, 50),
+			       percentile(vals, n, 90), percentile(vals, n, 99),
+			       vals[n - 1]);
+		}
+	}
+}
+
+/*
+ * Boards further than k scaled median absolute deviations from the fleet
+ * median, in the bad direction. With most boards at the same value (no
+ * errors at all, say) the MAD is 0, and every board deviating is reported.
+ */
+static void print_outliers(const struct board *boards, size_t nr, double k,
+			   int max_listed, double *vals)
+{
+	const struct board *b;
+	double med, mad, limit, dev;
+	size_t i, n;
+	int m, listed, found;
+
+	printf("\noutliers, more than %g MADs from the fleet median:\n", k);
+	for (m = 0; m < NR_METRICS; m++) {
+		for (i = 0, n = 0; i < nr; i++)
+			if (!boards[i].err && !isnan(boards[i].m[m]))
+				vals[n++] = boards[i].m[m];
+		if (n < 3)
+			continue;
+		qsort(vals, n, sizeof(*vals), cmp_double);
+		med = percentile(vals, n, 50);
+		for (i = 0; i < n; i++)
+			vals[i] = fabs(vals[i] - med);
+		qsort(vals, n, sizeof(*vals), cmp_double);
+		mad = percentile(vals, n, 50) * MAD_SCALE;
+		limit = k * mad;
+
+		listed = found = 0;
+		for (i = 0; i < nr; i++) {
+			b = &boards[i];
+			if (b->err || isnan(b->m[m]))
+				continue;
+			dev = metrics[m].lower_is_worse ? med - b->m[m] :
+							  b->m[m] - med;
+			if (dev <= limit || dev <= 0)
+				continue;
+			if (!found++)
+				printf("%s [%s], median %.4g, MAD %.4g:\n",
+				       metrics[m].name, metrics[m].unit, med,
+				       mad);
+			if (listed++ >= max_listed)
+				continue;
+			printf("  %10.4g  %s (%s), %s, %s", b->m[m],
+			       b->hdr.hostname[0] ? b->hdr.hostname : "-",
+			       b->hdr.serial[0] ? b->hdr.serial : "-",
+			       b->hdr.model[0] ? b->hdr.model : "-",
+			       b->hdr.kernel[0] ? b->hdr.kernel : "-");
+			if (metrics[m].per_core && b->core[m] != TT_ALL_CORES)
+				printf(", core %d", b->core[m]);
+			printf(", %s\n", b->path);
+		}
+		if (found > max_listed)
+			printf("  ... and %d more\n", found - max_listed);
+	}
+}
+
+static void usage(const char *progname, FILE *stream)
+{
+	fprintf(stream, "ttfleet: fleet wide statistics from test_timer "
+		"results files\n"
+		"usage: %s [-h] [-v] [-j threads] [-g model|kernel] [-k mads] "
+		"[-n max] <file|dir>...\n", progname);
+	fprintf(stream, "\t-h|--help: this help output\n"
+		"\t-v|--verbose: list the files which could not be loaded\n"
+		"\t-j|--jobs: number of threads parsing files "
+		"(default: one per CPU)\n"
+		"\t-g|--group: distributions per board model or kernel "
+		"version\n"
+		"\t-k|--mads: outlier threshold in median absolute deviations "
+		"(default: 5)\n"
+		"\t-n|--max-outliers: boards listed per metric (default: 10)\n\n");
+	fprintf(stream, "Directories are searched recursively, the results "
+		"files come from\ntest_timer -o.\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option lopts[] = {
+		{ "help",	0, 0, 'h' },
+		{ "verbose",	0, 0, 'v' },
+		{ "jobs",	1, 0, 'j' },
+		{ "group",	1, 0, 'g' },
+		{ "mads",	1, 0, 'k' },
+		{ "max-outliers",	1, 0, 'n' },
+		{ NULL, 0, 0, 0 },
+	};
+	enum group_by group = GROUP_NONE;
+	int nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int ch, i, max_listed = 10;
+	size_t nr_bad = 0, n;
+	struct board *boards;
+	bool verbose = false;
+	struct timespec t0, t1;
+	const char **keys;
+	double k = 5, secs, *vals;
+
+	while ((ch = getopt_long(argc, argv, "hvj:g:k:n:", lopts, NULL)) != -1) {
+		switch(ch) {
+		case '?':
+			usage(argv[0], stderr);
+			return 1;
+		case 'h':
+			usage(argv[0], stdout);
+			return 0;
+		case 'v':
+			verbose = true;
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			break;
+		case 'g':
+			if (!strcmp(optarg, "model")) {
+				group = GROUP_MODEL;
+			} else if (!strcmp(optarg, "kernel")) {
+				group = GROUP_KERNEL;
+			} else {
+				fprintf(stderr, "cannot group by %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'k':
+			k = atof(optarg);
+			break;
+		case 'n':
+			max_listed = atoi(optarg);
+			break;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0], stderr);
+		return 1;
+	}
+	if (nr_threads < 1)
+		nr_threads = 1;
+	if (nr_threads > MAX_THREADS)
+		nr_threads = MAX_THREADS;
+	init_metrics();
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = optind; i < argc; i++) {
+		if (nftw(argv[i], add_file, 64, FTW_PHYS)) {
+			perror(argv[i]);
+			return 2;
+		}
+	}
+	if (!files.nr) {
+		fprintf(stderr, "no results files found\n");
+		return 2;
+	}
+
+	boards = calloc(files.nr, sizeof(*boards));
+	vals = calloc(files.nr, sizeof(*vals));
+	keys = calloc(files.nr, sizeof(*keys));
+	if (!boards || !vals || !keys) {
+		fprintf(stderr, "out of memory\n");
+		return 2;
+	}
+	for (n = 0; n < files.nr; n++)
+		boards[n].path = files.paths[n];
+
+	load_boards(boards, files.nr, nr_threads);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	for (n = 0; n < files.nr; n++) {
+		if (!boards[n].err)
+			continue;
+		nr_bad++;
+		if (verbose)
+			fprintf(stderr, "%s: %s\n", boards[n].path,
+				boards[n].err == -EINVAL ?
+				"not a test_timer results file" :
+				strerror(-boards[n].err));
+	}
+	printf("%zu results files loaded, %zu invalid, in %.3f s with %d "
+	       "threads\n\n", files.nr - nr_bad, nr_bad, secs, nr_threads);
+	if (nr_bad == files.nr)
+		return 3;
+
+	print_distributions(boards, files.nr, group, vals, keys);
+	print_outliers(boards, files.nr, k, max_listed, vals);
+
+	return 0;
+}
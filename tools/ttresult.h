@@ -0,0 +1,116 @@
+/*
+ * ttresult: the binary results file written by test_timer -o
+ *
+ * This programme is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+ *
+ * This programme is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this programme.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TTRESULT_H__
+#define __TTRESULT_H__
+
+#include <stdint.h>
+
+/*
+ * A header followed by nr_records fixed size records. Everything is little
+ * endian (both the boards and the hosts aggregating the files are), the
+ * values in the records are doubles, times are in nanoseconds.
+ */
+#define TT_MAGIC		"TTRESULT"
+#define TT_VERSION		1
+#define TT_NR_PCT		4		/* 50, 90, 99, 99.9% */
+
+#define TT_FLAG_FREQ_MISMATCH	(1U << 0)	/* CNTFRQ differs per core */
+#define TT_FLAG_OFFLINE		(1U << 1)	/* some cores were offline */
+#define TT_FLAG_RT		(1U << 2)	/* -L: ran under SCHED_FIFO */
+#define TT_FLAG_LOCKED		(1U << 3)	/* -L: memory was locked */
+
+struct tt_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;		/* offset of the first record */
+	uint32_t record_size;
+	uint32_t nr_records;
+	uint32_t nr_cores;
+	uint32_t flags;
+	uint64_t timestamp;		/* start of the run, seconds */
+	uint64_t freq;			/* CNTFRQ in Hz */
+	char model[64];			/* the device tree model */
+	char serial[64];		/* board serial or machine-id */
+	char hostname[64];
+	char kernel[64];		/* uname release */
+	char kernel_build[64];		/* uname version */
+};
+
+enum tt_record_type {
+	/*
+	 * Back-to-back reads, id is the read strategy (TT_READ_*): errors
+	 * are going backwards, min/avg/max/pct the difference between the
+	 * two reads, extra the cost of one read.
+	 */
+	TT_REC_READS = 1,
+	/* per core: avg is the counter offset to core 0, max its uncertainty */
+	TT_REC_OFFSET,
+	/*
+	 * Wakeup latency per core, id is the read strategy (TT_READ_NATIVE or
+	 * TT_READ_STRATEGY + index): errors are early wakeups, extra the
+	 * number of timer overruns.
+	 */
+	TT_REC_WAKEUP,
+	/*
+	 * Drift per core, id 0 against CLOCK_MONOTONIC_RAW, 1 against
+	 * CLOCK_MONOTONIC: avg in ppm, min the residual rms, max the biggest
+	 * residual, errors the number of steps, extra the biggest step.
+	 */
+	TT_REC_DRIFT,
+	/*
+	 * Read throughput, id is the read source index, core the number of
+	 * threads minus 1: avg in reads per second, extra the efficiency.
+	 */
+	TT_REC_SCALE,
+	/*
+	 * Idle exit per core, id is the cpuidle state: min/avg/max/pct the
+	 * wakeup latency, errors the counter discontinuities (gaps against
+	 * CLOCK_MONOTONIC_RAW, or waking up early), extra the biggest gap.
+	 */
+	TT_REC_IDLE,
+	/*
+	 * With -L, the interference seen during a test, following its records:
+	 * id is their type, core the core (TT_ALL_CORES for a thread which
+	 * migrated), count the interrupts, max those from the busiest
+	 * interrupt line, errors the involuntary context switches, extra the
+	 * voluntary ones.
+	 */
+	TT_REC_NOISE,
+	TT_NR_RECORD_TYPES
+};
+
+enum tt_read_id {
+	TT_READ_NATIVE,			/* ISB, MRS / MRS */
+	TT_READ_LINUX,			/* CLOCK_MONOTONIC_RAW */
+	TT_READ_STRATEGY,		/* + index of the read strategy */
+};
+
+#define TT_ALL_CORES		-1
+
+struct tt_record {
+	uint16_t type;
+	uint16_t id;
+	int16_t core;			/* TT_ALL_CORES if not per core */
+	uint16_t reserved;
+	uint64_t count;			/* samples */
+	uint64_t errors;
+	double min, avg, max;
+	double pct[TT_NR_PCT];
+	double extra;
+};
+
+#endif